@@ -0,0 +1,527 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2019 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Microbenchmarks for some of the hot paths in ncdc. Built and run with `make
+// bench'. This links against all of ncdc's objects except main.c, so the
+// few symbols defined there are provided here instead.
+//
+// Each benchmark is run with an increasing number of iterations until it has
+// taken at least --time milliseconds. All input data is generated from a
+// fixed seed, so the numbers are comparable between runs and builds.
+
+#include "ncdc.h"
+#include "bench.h"
+
+
+const char *main_version = "bench";
+
+void ncdc_quit() {
+  exit(0);
+}
+
+char *ncdc_version() {
+  return "ncdc-bench";
+}
+
+
+
+
+// Allocation counting. With G_SLICE=always-malloc, all g_slice and g_malloc
+// allocations end up in malloc(), which is wrapped here on glibc.
+
+static int bench_allocs = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t size) {
+  g_atomic_int_inc(&bench_allocs);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  g_atomic_int_inc(&bench_allocs);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  g_atomic_int_inc(&bench_allocs);
+  return __libc_realloc(ptr, size);
+}
+#define BENCH_HAVE_ALLOCS 1
+#else
+#define BENCH_HAVE_ALLOCS 0
+#endif
+
+
+static gint64 bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (gint64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+
+
+// Input data
+
+static char *bench_buf;          // BENCH_BUFSIZE bytes of random data
+static char bench_tths[4096][24];
+static char bench_b32[4096][40];
+static char **bench_words;
+static int bench_nwords;
+static char *bench_tmpdir;
+
+#define BENCH_BUFSIZE (1024*1024)
+#define BENCH_LEAVES 4096
+
+static const char *bench_exts[] = { "mp3", "flac", "avi", "mkv", "jpg", "txt", "iso", "zip", "pdf", "nfo" };
+
+
+static void bench_data_init() {
+  GRand *rnd = g_rand_new_with_seed(42);
+  bench_buf = g_malloc(BENCH_BUFSIZE);
+  int i;
+  for(i=0; i<BENCH_BUFSIZE; i++)
+    bench_buf[i] = g_rand_int(rnd);
+  for(i=0; i<4096; i++) {
+    int j;
+    for(j=0; j<24; j++)
+      bench_tths[i][j] = g_rand_int(rnd);
+    base32_encode(bench_tths[i], bench_b32[i]);
+  }
+
+  // A vocabulary of pronounceable words, used for file names and queries
+  static const char *syl[] = { "ka", "lo", "mi", "ne", "ru", "sa", "to", "vi", "ze", "qua", "bel", "dor", "fin", "gar", "hul", "jen" };
+  bench_nwords = 2000;
+  bench_words = g_new(char *, bench_nwords);
+  for(i=0; i<bench_nwords; i++) {
+    GString *w = g_string_new("");
+    int j, n = g_rand_int_range(rnd, 2, 5);
+    for(j=0; j<n; j++)
+      g_string_append(w, syl[g_rand_int_range(rnd, 0, G_N_ELEMENTS(syl))]);
+    bench_words[i] = g_string_free(w, FALSE);
+  }
+  g_rand_free(rnd);
+
+  bench_tmpdir = g_build_filename(g_get_tmp_dir(), "ncdc-bench-XXXXXX", NULL);
+  if(!mkdtemp(bench_tmpdir))
+    g_error("Can't create temporary directory: %s", g_strerror(errno));
+}
+
+
+// Words are picked with a skewed distribution, so that some words are common
+// and most are rare, as in real file lists.
+static const char *bench_word(GRand *rnd) {
+  double r = g_rand_double(rnd);
+  return bench_words[(int)(r*r*r*bench_nwords)];
+}
+
+
+static char *bench_name(GRand *rnd, gboolean isfile) {
+  GString *s = g_string_new(bench_word(rnd));
+  int i, n = g_rand_int_range(rnd, 1, 4);
+  for(i=0; i<n; i++) {
+    g_string_append_c(s, ' ');
+    g_string_append(s, bench_word(rnd));
+  }
+  if(isfile)
+    g_string_append_printf(s, " %03d.%s", g_rand_int_range(rnd, 0, 1000), bench_exts[g_rand_int_range(rnd, 0, G_N_ELEMENTS(bench_exts))]);
+  return g_string_free(s, FALSE);
+}
+
+
+// Generates a file list with (about) the given number of files, in
+// directories of 10-50 files, nested at most three levels deep. Each list has
+// its own random stream, seeded with its size, so that the same list is
+// generated regardless of which other benchmarks have run before.
+static fl_list_t *bench_list(int files) {
+  GRand *rnd = g_rand_new_with_seed(files);
+  fl_list_t *root = fl_list_create_root();
+  fl_list_t *parents[4] = { root };
+  int n = 0, depth = 0;
+  while(n < files) {
+    if(depth < 3 && g_rand_int_range(rnd, 0, 3) == 0)
+      depth++;
+    else if(depth > 0 && g_rand_int_range(rnd, 0, 2) == 0)
+      depth--;
+    char *name = bench_name(rnd, FALSE);
+    fl_list_t *dir = fl_list_create_in(root, name, FALSE);
+    g_free(name);
+    dir->sub = g_ptr_array_new_with_free_func(fl_list_free);
+    fl_list_add(parents[depth], dir, -1);
+    parents[depth+1] = dir;
+
+    int i, num = g_rand_int_range(rnd, 10, 51);
+    for(i=0; i<num; i++, n++) {
+      name = bench_name(rnd, TRUE);
+      fl_list_t *f = fl_list_create_in(root, name, FALSE);
+      g_free(name);
+      f->isfile = TRUE;
+      f->hastth = TRUE;
+      f->size = g_rand_int_range(rnd, 1, G_MAXINT);
+      memcpy(f->tth, bench_tths[n & 4095], 24);
+      fl_list_add(dir, f, -1);
+    }
+    fl_list_sort(dir);
+    // Directory names may be duplicated, which is fine for our purposes.
+  }
+  fl_list_sort(root);
+  g_rand_free(rnd);
+  return root;
+}
+
+
+
+
+// Benchmarks. Each function performs n operations and returns the number of
+// bytes processed, or 0 if a throughput doesn't make sense.
+
+static guint64 b_tiger(int n) {
+  tiger_ctx_t t;
+  char res[24];
+  tiger_init(&t);
+  int i;
+  for(i=0; i<n; i++)
+    tiger_update(&t, bench_buf, BENCH_BUFSIZE);
+  tiger_final(&t, res);
+  return (guint64)n*BENCH_BUFSIZE;
+}
+
+
+static guint64 b_tth_update(int n) {
+  tth_ctx_t t;
+  char res[24];
+  tth_init(&t);
+  int i;
+  for(i=0; i<n; i++)
+    tth_update(&t, bench_buf, BENCH_BUFSIZE);
+  tth_final(&t, res);
+  return (guint64)n*BENCH_BUFSIZE;
+}
+
+
+static guint64 b_tth_root(int n) {
+  char res[24];
+  int i;
+  for(i=0; i<n; i++)
+    tth_root(bench_buf, BENCH_LEAVES, res);
+  return (guint64)n*BENCH_LEAVES*24;
+}
+
+
+static guint64 b_base32_encode(int n) {
+  char res[40];
+  int i;
+  for(i=0; i<n; i++)
+    base32_encode(bench_tths[i & 4095], res);
+  return (guint64)n*24;
+}
+
+
+static guint64 b_base32_decode(int n) {
+  char res[24];
+  int i;
+  for(i=0; i<n; i++)
+    base32_decode(bench_b32[i & 4095], res);
+  return (guint64)n*39;
+}
+
+
+static guint64 b_bloom_add(int n) {
+  bloom_t b;
+  bloom_init(&b, 1<<20, 8, 24);
+  int i;
+  for(i=0; i<n; i++)
+    bloom_add(&b, bench_tths[i & 4095]);
+  bloom_free(&b);
+  return 0;
+}
+
+
+static char *bench_adcmsg[4];
+
+static guint64 b_adc_parse(int n) {
+  if(!bench_adcmsg[0]) {
+    bench_adcmsg[0] = g_strdup_printf("BINF AAAB ID%s PD%s NIsome_user SS123456789012 SF54321 VEncdc\\s1.23 SL5 FS5 HN3 HR1 HO0"
+      " DEsome\\sdescription\\swith\\sspaces SUTCP4,UDP4,ADC0,SEGA I4192.168.1.2 U412345", bench_b32[0], bench_b32[1]);
+    bench_adcmsg[1] = g_strdup_printf("BSCH AAAC ANsome ANwords NOexcluded EXmkv EXavi GE1048576 TOauto%d", 42);
+    bench_adcmsg[2] = g_strdup_printf("DRES AAAB AAAC FN/Share/Some\\sdirectory/Some\\sfile\\s001.mkv SI734003200 SL3 TR%s TOauto42", bench_b32[2]);
+    bench_adcmsg[3] = g_strdup("BMSG AAAB Hello\\severyone,\\sthis\\sis\\sa\\stypical\\schat\\smessage\\swith\\sa\\sfew\\swords.");
+  }
+  guint64 bytes = 0;
+  int i;
+  for(i=0; i<n; i++) {
+    adc_cmd_t cmd;
+    const char *msg = bench_adcmsg[i&3];
+    if(adc_parse(msg, &cmd, NULL, NULL))
+      g_strfreev(cmd.argv);
+    bytes += strlen(msg);
+  }
+  return bytes;
+}
+
+
+// File list benchmarks. These operate on bench_fl, generated with
+// bench_fl_setup() for each list size.
+
+static fl_list_t *bench_fl;
+static int bench_fl_size;
+static char *bench_fl_file[2]; // FU and FB files, written by bench_fl_setup() and b_fl_save_fu/fb
+static GString *bench_fl_buf;
+
+static guint64 bench_fl_save(int n, gboolean zlib, GString *buf, const char *file) {
+  guint64 bytes = 0;
+  int i;
+  for(i=0; i<n; i++) {
+    GError *err = NULL;
+    if(buf)
+      g_string_truncate(buf, 0);
+    int r = fl_save(bench_fl, bench_b32[0], 0, zlib, buf, file, &err);
+    if(!r)
+      g_error("fl_save(): %s", err->message);
+    bytes += r;
+  }
+  return bytes;
+}
+
+
+static void bench_fl_setup(int size) {
+  if(bench_fl && bench_fl_size == size)
+    return;
+  if(bench_fl)
+    fl_list_free(bench_fl);
+  bench_fl = bench_list(size);
+  bench_fl_size = size;
+  int i;
+  for(i=0; i<2; i++)
+    if(bench_fl_file[i]) {
+      unlink(bench_fl_file[i]);
+      g_free(bench_fl_file[i]);
+    }
+  char *tmp = g_strdup_printf("files-%d.xml", size);
+  bench_fl_file[0] = g_build_filename(bench_tmpdir, tmp, NULL);
+  bench_fl_file[1] = g_strconcat(bench_fl_file[0], ".bz2", NULL);
+  g_free(tmp);
+  // Write the files for the fl_load benchmarks, in case the fl_save ones
+  // aren't run
+  for(i=0; i<2; i++)
+    if(!g_file_test(bench_fl_file[i], G_FILE_TEST_EXISTS))
+      bench_fl_save(1, FALSE, NULL, bench_fl_file[i]);
+}
+
+
+static guint64 bench_fl_load(int n, const char *file) {
+  int i;
+  struct stat st;
+  if(stat(file, &st) < 0)
+    g_error("Can't stat %s: %s", file, g_strerror(errno));
+  for(i=0; i<n; i++) {
+    GError *err = NULL;
+    fl_list_t *fl = fl_load(file, &err, FALSE);
+    if(!fl)
+      g_error("fl_load(): %s", err->message);
+    fl_list_free(fl);
+  }
+  return (guint64)n*st.st_size;
+}
+
+
+#define FL_BENCH(size) \
+  static guint64 b_fl_save_fu_##size(int n) { bench_fl_setup(size); return bench_fl_save(n, FALSE, NULL, bench_fl_file[0]); }\
+  static guint64 b_fl_save_fb_##size(int n) { bench_fl_setup(size); return bench_fl_save(n, FALSE, NULL, bench_fl_file[1]); }\
+  static guint64 b_fl_save_mu_##size(int n) { bench_fl_setup(size); return bench_fl_save(n, FALSE, bench_fl_buf, NULL); }\
+  static guint64 b_fl_save_mz_##size(int n) { bench_fl_setup(size); return bench_fl_save(n, TRUE, bench_fl_buf, NULL); }\
+  static guint64 b_fl_load_fu_##size(int n) { bench_fl_setup(size); return bench_fl_load(n, bench_fl_file[0]); }\
+  static guint64 b_fl_load_fb_##size(int n) { bench_fl_setup(size); return bench_fl_load(n, bench_fl_file[1]); }\
+  static guint64 b_fl_search_##size(int n) { bench_fl_setup(size); return bench_fl_search(n); }
+
+
+// A mix of queries: common words, rare words, multiple keywords, exclusions
+// and a query that doesn't match anything. Results are limited to 10, as with
+// hub searches.
+static guint64 bench_fl_search(int n) {
+  static fl_search_t s[6];
+  static gboolean init = FALSE;
+  if(!init) {
+    char *q[6][4] = {
+      { bench_words[0], NULL },
+      { bench_words[1], bench_words[5], NULL },
+      { bench_words[bench_nwords/2], NULL },
+      { bench_words[2], bench_words[3], bench_words[4], NULL },
+      { bench_words[0], NULL },
+      { "nosuchwordinthelist", NULL },
+    };
+    char *not[] = { bench_words[1], NULL };
+    int i;
+    for(i=0; i<6; i++) {
+      s[i].sizem = i == 3 ? 1 : -2;
+      s[i].size = 100*1024*1024;
+      s[i].filedir = 3;
+      s[i].ext = NULL;
+      fl_search_keywords(&s[i], q[i], i == 4 ? not : NULL);
+    }
+    init = TRUE;
+  }
+  fl_list_t *res[10];
+  int i;
+  for(i=0; i<n; i++)
+    fl_search_rec(bench_fl, &s[i%6], res, 10);
+  return 0;
+}
+
+
+FL_BENCH(100000)
+FL_BENCH(1000000)
+
+
+typedef struct bench_t {
+  const char *name;
+  guint64 (*run)(int);
+} bench_t;
+
+#define FL_BENCHES(size) \
+  { "fl_save/FU/" #size, b_fl_save_fu_##size },\
+  { "fl_save/FB/" #size, b_fl_save_fb_##size },\
+  { "fl_save/MU/" #size, b_fl_save_mu_##size },\
+  { "fl_save/MZ/" #size, b_fl_save_mz_##size },\
+  { "fl_load/FU/" #size, b_fl_load_fu_##size },\
+  { "fl_load/FB/" #size, b_fl_load_fb_##size },\
+  { "fl_search_rec/" #size, b_fl_search_##size }
+
+static const bench_t benches[] = {
+  { "tiger_update",  b_tiger         },
+  { "tth_update",    b_tth_update    },
+  { "tth_root",      b_tth_root      },
+  { "base32_encode", b_base32_encode },
+  { "base32_decode", b_base32_decode },
+  { "bloom_add",     b_bloom_add     },
+  { "adc_parse",     b_adc_parse     },
+  FL_BENCHES(100000),
+  FL_BENCHES(1000000),
+  { NULL }
+};
+
+
+
+
+static int bench_time = 1000;
+static gboolean bench_json = FALSE;
+static char *bench_filter = NULL;
+
+static GOptionEntry bench_options[] = {
+  { "time",   't', 0, G_OPTION_ARG_INT,    &bench_time,   "Minimum run time of each benchmark, in milliseconds (default: 1000).", "MS" },
+  { "json",   'j', 0, G_OPTION_ARG_NONE,   &bench_json,   "Output the results as JSON.", NULL },
+  { "filter", 'f', 0, G_OPTION_ARG_STRING, &bench_filter, "Only run the benchmarks whose name starts with this string.", "NAME" },
+  { NULL }
+};
+
+
+// Runs a benchmark with an increasing number of iterations until it takes at
+// least bench_time milliseconds. The first run is a warm-up, and may also
+// generate the input data.
+static void bench_run(const bench_t *b, gboolean first) {
+  b->run(1);
+
+  int n = 1;
+  gint64 t;
+  guint64 bytes;
+  int allocs;
+  while(1) {
+    g_atomic_int_set(&bench_allocs, 0);
+    t = bench_now();
+    bytes = b->run(n);
+    t = bench_now() - t;
+    allocs = g_atomic_int_get(&bench_allocs);
+    if(t >= (gint64)bench_time*1000000 || n >= G_MAXINT/2)
+      break;
+    // Aim for 1.2 times the requested time, and at most grow by 100x per round
+    gint64 next = t > 0 ? (gint64)n * bench_time*1200000 / t : (gint64)n*100;
+    n = MIN(MAX(next, n+1), MIN((gint64)n*100, G_MAXINT/2));
+  }
+
+  double nsop = (double)t / n;
+  double mbs = bytes ? ((double)bytes/(1024*1024)) / ((double)t/1e9) : 0;
+  double aop = (double)allocs / n;
+
+  if(bench_json) {
+    printf("%s\n  {\"name\": \"%s\", \"iterations\": %d, \"ns_per_op\": %.1f", first ? "" : ",", b->name, n, nsop);
+    if(bytes)
+      printf(", \"mb_per_s\": %.2f", mbs);
+    if(BENCH_HAVE_ALLOCS)
+      printf(", \"allocs_per_op\": %.2f", aop);
+    printf("}");
+  } else {
+    printf("%-24s %10d %14.1f ns/op", b->name, n, nsop);
+    if(bytes)
+      printf(" %10.2f MB/s", mbs);
+    else
+      printf("       %*s", 9, "");
+    if(BENCH_HAVE_ALLOCS)
+      printf(" %10.2f allocs/op", aop);
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+
+int main(int argc, char **argv) {
+  // Must be set before the first g_slice allocation
+  setenv("G_SLICE", "always-malloc", 1);
+
+  GError *err = NULL;
+  GOptionContext *optx = g_option_context_new("- ncdc microbenchmarks");
+  g_option_context_add_main_entries(optx, bench_options, NULL);
+  if(!g_option_context_parse(optx, &argc, &argv, &err)) {
+    puts(err->message);
+    exit(1);
+  }
+  g_option_context_free(optx);
+
+  g_thread_init(NULL);
+  bench_data_init();
+  bench_fl_buf = g_string_sized_new(1024*1024);
+
+  const bench_t *b;
+  gboolean first = TRUE;
+  if(bench_json)
+    printf("[");
+  for(b=benches; b->name; b++) {
+    if(bench_filter && strncmp(b->name, bench_filter, strlen(bench_filter)) != 0)
+      continue;
+    bench_run(b, first);
+    first = FALSE;
+  }
+  if(bench_json)
+    printf("\n]\n");
+
+  int i;
+  for(i=0; i<2 && bench_fl_file[i]; i++)
+    unlink(bench_fl_file[i]);
+  rmdir(bench_tmpdir);
+  return 0;
+}
@@ -54,17 +54,27 @@ int bloom_init(bloom_t *b, int m, int k, int h) {
 }
 
 
+/* The sub-hashes are taken from the hash as a little-endian bit stream. Rather
+ * than extracting one bit at a time, read the 64 bits starting at the byte
+ * that contains the first bit of the sub-hash and shift them into place. The
+ * hash is copied into a zero-padded buffer so that these reads never go past
+ * the end. */
 void bloom_add(bloom_t *b, const char *hash) {
-  int i, j, pos = 0;
-  guint64 tmp;
+  unsigned char buf[24+8+1] = {};
+  memcpy(buf, hash, 24);
+  guint64 mask = b->h == 64 ? G_MAXUINT64 : (((guint64)1)<<b->h) - 1;
+  guint64 bits = ((guint64)b->m)<<3;
+  int i, pos = 0;
   for(i=0; i<b->k; i++) {
-    tmp = 0;
-    for(j=0; j<b->h; j++) {
-      tmp |= ((guint64)((((const unsigned char *)hash)[pos>>3] >> (pos&7)) & 1)) << j;
-      pos++;
-    }
-    j = tmp % (b->m<<3);
-    b->d[j>>3] |= 1<<(j&7);
+    guint64 tmp;
+    int shift = pos&7;
+    memcpy(&tmp, buf+(pos>>3), 8);
+    tmp = GUINT64_FROM_LE(tmp) >> shift;
+    if(shift && shift + b->h > 64)
+      tmp |= ((guint64)buf[(pos>>3)+8]) << (64-shift);
+    tmp = (tmp & mask) % bits;
+    b->d[tmp>>3] |= 1<<(tmp&7);
+    pos += b->h;
   }
 }
 
@@ -95,6 +95,14 @@ void cc_expect_add(hub_t *hub, hub_user_t *u, guint16 port, char *t, gboolean dl
 }
 
 
+// Sets cc->hub and makes the file transfers of this connection count towards
+// the rate limits of that hub.
+static void cc_sethub(cc_t *cc, hub_t *hub) {
+  cc->hub = hub;
+  net_setbuckets(cc->net, hub ? hub->rate_down : NULL, hub ? hub->rate_up : NULL);
+}
+
+
 // Checks the expects list for the current connection, sets cc->dl, cc->uid,
 // cc->hub and cc->kp_user and removes it from the expects list. cc->token must
 // be known, and either cc->cid must be set or a uid must be given.
@@ -107,7 +115,7 @@ static gboolean cc_expect_adc_rm(cc_t *cc, guint64 uid) {
     cc_expect_t *e = n->data;
     if(e->adc && e->port == cc->port && strcmp(cc->token, e->token) == 0 && e->uid == (cc->cid ? hub_user_adc_id(e->hub->id, cc->cid) : uid)) {
       cc->uid = e->uid;
-      cc->hub = e->hub;
+      cc_sethub(cc, e->hub);
       cc->kp_user = e->kp;
       e->kp = NULL;
       cc_expect_rm(n, cc);
@@ -127,7 +135,7 @@ static gboolean cc_expect_nmdc_rm(cc_t *cc) {
     if(cc->hub && cc->hub != e->hub)
       continue;
     if(!e->adc && e->port == cc->port && strcmp(e->nick, cc->nick_raw) == 0) {
-      cc->hub = e->hub;
+      cc_sethub(cc, e->hub);
       cc->uid = e->uid;
       cc_expect_rm(n, cc);
       return TRUE;
@@ -243,7 +251,7 @@ struct cc_t {
   gboolean slot_mini : 1;
   gboolean slot_granted : 1;
   gboolean dl : 1;
-  gboolean zlig : 1; // Only used for partial file lists, and only used on ADC because I don't know how NMDC clients handle that
+  gboolean zlig : 1; // Used for partial file lists and ZL1 file transfers, and only on ADC because I don't know how NMDC clients handle that
   guint16 port;
   guint16 state;
   int dir;        // (NMDC) our direction. -1 = Upload, otherwise: Download $dir
@@ -389,7 +397,7 @@ void cc_remove_hub(hub_t *hub) {
     cc_t *c = g_sequence_get(i);
     if(c->hub == hub) {
       c->hub_name = g_strdup(hub->tab->name);
-      c->hub = NULL;
+      cc_sethub(c, NULL);
     }
   }
 
@@ -541,7 +549,7 @@ void cc_download(cc_t *cc, dl_t *dl) {
 
   // otherwise, send GET request
   } else {
-    /* TODO: A more long-term rate calculation algorithm might be more suitable here */
+    /* dlfile combines this with a longer-term average of previous segments */
     cc->dlthread = dlfile_getchunk(dl, cc->uid, ratecalc_rate(net_rate_in(cc->net)));
     if(!cc->dlthread) {
       g_set_error_literal(&cc->err, 1, 0, "Download interrupted.");
@@ -552,8 +560,10 @@ void cc_download(cc_t *cc, dl_t *dl) {
     gint64 len = dl->islist ? -1 :
       MIN(((gint64)cc->dlthread->allocated * DLFILE_CHUNKSIZE) - cc->dlthread->len, (gint64)(dl->size - cc->last_offset));
 
+    // files.xml.bz2 is already compressed, no point in asking for ZL1
     if(cc->adc)
-      net_writef(cc->net, "CGET file %s %"G_GUINT64_FORMAT" %"G_GINT64_FORMAT"\n", fn, cc->last_offset, len);
+      net_writef(cc->net, "CGET file %s %"G_GUINT64_FORMAT" %"G_GINT64_FORMAT"%s\n", fn, cc->last_offset, len,
+        !dl->islist && cc->zlig && var_get_bool(0, VAR_transfer_zlib) ? " ZL1" : "");
     else
       net_writef(cc->net, "$ADCGET file %s %"G_GUINT64_FORMAT" %"G_GINT64_FORMAT"|", fn, cc->last_offset, len);
   }
@@ -595,7 +605,7 @@ static void handle_recvtth(net_t *n, char *buf, int read) {
 }
 
 
-static void handle_adcsnd(cc_t *cc, gboolean tthl, guint64 start, gint64 bytes) {
+static void handle_adcsnd(cc_t *cc, gboolean tthl, guint64 start, gint64 bytes, gboolean zlib) {
   dl_t *dl = g_hash_table_lookup(dl_queue, cc->last_hash);
   if(!dl || (!tthl && !cc->dlthread)) {
     g_set_error_literal(&cc->err, 1, 0, "Download interrupted.");
@@ -610,7 +620,7 @@ static void handle_adcsnd(cc_t *cc, gboolean tthl, guint64 start, gint64 bytes)
       cc->last_size = dl->size = bytes;
       dl->hassize = TRUE;
     }
-    net_recvfile(cc->net, bytes, dlfile_recv, handle_recvdone, cc->dlthread);
+    net_recvfile(cc->net, bytes, zlib, dlfile_recv, handle_recvdone, cc->dlthread);
     cc->dlthread = NULL;
   } else {
     g_return_if_fail(start == 0 && bytes > 0 && (bytes%24) == 0 && bytes < 48*1024);
@@ -627,16 +637,6 @@ static void handle_sendcomplete(net_t *net) {
 }
 
 
-static void send_file(cc_t *cc, const char *path, guint64 start, guint64 len, gboolean flush, GError **err) {
-  int fd = 0;
-  if((fd = open(path, O_RDONLY)) < 0 || lseek(fd, start, SEEK_SET) == (off_t)-1) {
-    // Don't give a detailed error message, the remote shouldn't know too much about us.
-    g_set_error_literal(err, 1, 50, "Error opening file");
-    g_message("Error opening/seeking '%s' for sending: %s", path, g_strerror(errno));
-    return;
-  }
-  net_sendfile(cc->net, fd, len, flush, handle_sendcomplete);
-}
 
 
 // err->code:
@@ -655,7 +655,7 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
     char root[24];
     base32_decode(id+4, root);
     int len = 0;
-    char *dat = db_fl_gettthl(root, &len);
+    char *dat = fl_local_tthl(root, &len);
     if(!dat)
       g_set_error_literal(err, 1, 51, "File Not Available");
     else if(!cc->slot_granted && throttle_check(cc, root, G_MAXUINT64)) {
@@ -665,7 +665,6 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
       // no need to adc_escape(id) here, since it cannot contain any special characters
       net_writef(cc->net, cc->adc ? "CSND tthl %s 0 %d\n" : "$ADCSND tthl %s 0 %d|", id, len);
       net_write(cc->net, dat, len);
-      g_free(dat);
     }
     return;
   }
@@ -681,24 +680,18 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
       g_set_error_literal(err, 1, 51, "File Not Available");
       return;
     }
-    // Use a targetsize of 16k for non-recursive lists and 256k for recursive
-    // ones. This should give useful results in most cases. The only exception
-    // here is Jucy, which does not handle "Incomplete" entries in a recursive
-    // list, but... yeah, that's Jucy's problem. :-)
-    GString *buf = g_string_new("");
     GError *e = NULL;
-    int len = fl_save(f, var_get(0, VAR_cid), re1 ? 256*1024 : 16*1024, zlib, buf, NULL, &e);
-    if(!len) {
+    int len;
+    GString *buf = fl_local_partial(f, re1, zlib, &len, &e);
+    if(!buf) {
       g_set_error(err, 1, 50, "Creating partial XML list: %s", e->message);
       g_error_free(e);
-      g_string_free(buf, TRUE);
       return;
     }
     char *eid = adc_escape(id, !cc->adc);
     net_writef(cc->net, cc->adc ? "CSND list %s 0 %d%s\n" : "$ADCSND list %s 0 %d%s|", eid, len, zlib ? " ZL1" : "");
     net_write(cc->net, buf->str, buf->len);
     g_free(eid);
-    g_string_free(buf, TRUE);
     return;
   }
 
@@ -708,86 +701,90 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
     return;
   }
 
-  // get path (for file uploads)
+  // open file (for file uploads)
   // TODO: files.xml? (Required by ADC, but I doubt it's used)
-  char *path = NULL;
+  int fd = -1;
   char *vpath = NULL;
-  fl_list_t *f = NULL;
+  char tth[24] = {};
+  gboolean hastth = FALSE;
+  guint64 size = 0;
   gboolean needslot = TRUE;
 
   // files.xml.bz2
   if(strcmp(id, "files.xml.bz2") == 0) {
-    path = g_strdup(fl_local_list_file);
+    fl_flush_request();
+    struct stat st;
+    if((fd = open(fl_local_list_file, O_RDONLY)) >= 0 && fstat(fd, &st) < 0) {
+      close(fd);
+      fd = -1;
+    }
+    size = fd >= 0 ? st.st_size : 0;
     vpath = g_strdup("files.xml.bz2");
     needslot = FALSE;
-  // / (path in the nameless root)
-  } else if(id[0] == '/' && fl_local_list) {
-    f = fl_list_from_path(fl_local_list, id);
-  // TTH/
-  } else if(strncmp(id, "TTH/", 4) == 0 && istth(id+4)) {
-    char root[24];
-    base32_decode(id+4, root);
-    GSList *l = fl_local_from_tth(root);
-    f = l ? l->data : NULL;
-  }
-
-  if(f) {
-    char *enc_path = fl_local_path(f);
-    path = g_filename_from_utf8(enc_path, -1, NULL, NULL, NULL);
-    g_free(enc_path);
-    vpath = fl_list_path(f);
-  }
+  // / (path in the nameless root) or TTH/
+  } else if((fd = fl_local_open(id, &vpath, tth, &size)) >= 0)
+    hastth = TRUE;
 
   // validate
-  struct stat st = {};
-  if(!path || stat(path, &st) < 0 || !S_ISREG(st.st_mode) || start > st.st_size) {
-    if(st.st_size && start > st.st_size)
-      g_set_error_literal(err, 1, 52, "File Part Not Available");
-    else
-      g_set_error_literal(err, 1, 51, "File Not Available");
-    g_free(path);
+  if(fd < 0) {
+    g_set_error_literal(err, 1, 51, "File Not Available");
     g_free(vpath);
     return;
   }
-  if(bytes < 0 || bytes > st.st_size-start)
-    bytes = st.st_size-start;
-  if(needslot && st.st_size < var_get_int(0, VAR_minislot_size))
+  if(start > size) {
+    g_set_error_literal(err, 1, 52, "File Part Not Available");
+    close(fd);
+    g_free(vpath);
+    return;
+  }
+  if(bytes < 0 || (guint64)bytes > size-start)
+    bytes = size-start;
+  if(needslot && size < (guint64)var_get_int(0, VAR_minislot_size))
     needslot = FALSE;
 
-  if(f && !cc->slot_granted && throttle_check(cc, f->tth, start)) {
+  if(hastth && !cc->slot_granted && throttle_check(cc, tth, start)) {
     g_message("CC:%s: File upload throttled: %s offset %"G_GUINT64_FORMAT, net_remoteaddr(cc->net), vpath, start);
     g_set_error_literal(err, 1, 50, "Action throttled");
-    g_free(path);
+    close(fd);
     g_free(vpath);
     return;
   }
 
   // send
   if(request_slot(cc, needslot)) {
+    // Only compress file data if the remote asked for it and it's not
+    // compressed already. The latter is checked by net_sendfile(), which then
+    // picks the header to reply with.
+    if(zlib)
+      zlib = hastth && var_get_bool(0, VAR_transfer_zlib);
     g_free(cc->last_file);
     cc->last_file = vpath;
     cc->last_length = bytes;
     cc->last_offset = start;
-    cc->last_size = st.st_size;
-    if(f)
-      memcpy(cc->last_hash, f->tth, 24);
+    cc->last_size = size;
+    if(hastth)
+      memcpy(cc->last_hash, tth, 24);
     char *tmp = adc_escape(id, !cc->adc);
     // Note: For >=2GB chunks, we tell the other client that we're sending them
     // more than 2GB, but in actuality we stop transfering stuff at 2GB. Other
     // DC clients (DC++, notabily) don't like it when you reply with a
     // different byte count than they requested. :-(
-    net_writef(cc->net,
-      cc->adc ? "CSND file %s %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"\n" : "$ADCSND file %s %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"|",
-      tmp, start, bytes);
+    const char *fmt = cc->adc
+      ? "CSND file %s %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"%s\n"
+      : "$ADCSND file %s %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT"%s|";
+    char *hdr = g_strdup_printf(fmt, tmp, start, bytes, "");
+    char *hdr_zlib = zlib ? g_strdup_printf(fmt, tmp, start, bytes, " ZL1") : NULL;
     cc->state = CCS_TRANSFER;
     time(&cc->last_start);
-    send_file(cc, path, start, cc->last_length, strcmp(vpath, "files.xml.bz2") == 0 ? FALSE : TRUE, err);
+    net_sendfile(cc->net, fd, start, cc->last_length, hastth, hdr, hdr_zlib, handle_sendcomplete);
+    g_free(hdr);
+    g_free(hdr_zlib);
     g_free(tmp);
   } else {
     g_set_error_literal(err, 1, 53, "No Slots Available");
+    close(fd);
     g_free(vpath);
   }
-  g_free(path);
 }
 
 
@@ -964,16 +961,15 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
       g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), msg);
       cc_disconnect(cc, TRUE);
-    } else if(adc_getparam(cmd.argv, "ZL", NULL)) {
-      // Even though we indicate support for ZLIG, we don't actually support
-      // *receiving* zlib compressed transfers. So this is an error.
-      // TODO: This is in violation with the ADC spec, to probably want to fix
-      // this at some point.
+    } else if(strcmp(cmd.argv[0], "tthl") == 0 && adc_getparam(cmd.argv, "ZL", NULL)) {
+      // TTHL data is read with net_readbytes(), which doesn't do zlib. We
+      // never ask for it to be compressed, either.
       g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
       g_message("CC:%s: Received zlib-compressed data when we didn't request it: %s", net_remoteaddr(cc->net), msg);
       cc_disconnect(cc, TRUE);
     } else
-      handle_adcsnd(cc, strcmp(cmd.argv[0], "tthl") == 0, g_ascii_strtoull(cmd.argv[2], NULL, 0), g_ascii_strtoll(cmd.argv[3], NULL, 0));
+      handle_adcsnd(cc, strcmp(cmd.argv[0], "tthl") == 0, g_ascii_strtoull(cmd.argv[2], NULL, 0), g_ascii_strtoll(cmd.argv[3], NULL, 0),
+        adc_getparam(cmd.argv, "ZL", NULL) ? TRUE : FALSE);
     break;
 
   case ADCC_GFI:
@@ -991,8 +987,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       } else if(strncmp(cmd.argv[1], "TTH/", 4) == 0 && istth(cmd.argv[1]+4)) {
         char root[24];
         base32_decode(cmd.argv[1]+4, root);
-        GSList *l = fl_local_from_tth(root);
-        f = l ? l->data : NULL;
+        f = fl_local_from_tth(root);
       }
       // Generate response
       GString *r;
@@ -1282,7 +1277,7 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
       char *type = g_match_info_fetch(nfo, 1);
       char *start = g_match_info_fetch(nfo, 2);
       char *bytes = g_match_info_fetch(nfo, 3);
-      handle_adcsnd(cc, strcmp(type, "tthl") == 0, g_ascii_strtoull(start, NULL, 10), g_ascii_strtoll(bytes, NULL, 10));
+      handle_adcsnd(cc, strcmp(type, "tthl") == 0, g_ascii_strtoull(start, NULL, 10), g_ascii_strtoll(bytes, NULL, 10), FALSE);
       g_free(type);
       g_free(start);
       g_free(bytes);
@@ -1345,7 +1340,7 @@ static void handle_error(net_t *n, int action, const char *err) {
 cc_t *cc_create(hub_t *hub) {
   cc_t *cc = g_new0(cc_t, 1);
   cc->net = net_new(cc, handle_error);
-  cc->hub = hub;
+  cc_sethub(cc, hub);
   cc->iter = g_sequence_append(cc_list, cc);
   cc->state = CCS_CONN;
   uit_conn_listchange(cc->iter, UITCONN_ADD);
@@ -1508,6 +1503,7 @@ void cc_free(cc_t *cc) {
   uit_conn_listchange(cc->iter, UITCONN_DEL);
   g_sequence_remove(cc->iter);
   net_disconnect(cc->net);
+  cc_sethub(cc, NULL);
   net_unref(cc->net);
   if(cc->err)
     g_error_free(cc->err);
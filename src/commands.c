@@ -700,16 +700,22 @@ static void c_gc(char *args) {
   if(args[0])
     ui_m(NULL, 0, "This command does not accept any arguments.");
   else {
-    ui_m(NULL, UIM_NOLOG, "Collecting garbage...");
-    ui_draw();
     if(!fl_gc())
-      ui_m(NULL, 0, "Not checking for unused hash data: File list refresh in progress or not performed yet.");
-    db_fl_purgedata();
+      ui_m(NULL, 0, "Not checking for unused hash data: File list refresh not performed yet.");
     dl_fl_clean(NULL);
     dl_inc_clean();
-    db_vacuum();
-    ui_m(NULL, UIM_NOLOG, NULL);
-    ui_m(NULL, 0, "Garbage-collection done.");
+    ui_m(NULL, 0, "Garbage-collection started in the background.");
+  }
+}
+
+
+static void c_stats(char *args) {
+  if(args[0])
+    ui_m(NULL, 0, "This command does not accept any arguments.");
+  else {
+    char *r = stats_report();
+    ui_m(NULL, 0, r);
+    g_free(r);
   }
 }
 
@@ -1281,6 +1287,7 @@ static cmd_t cmds[] = {
   { "search",      c_search,      NULL             },
   { "set",         c_set,         c_set_sug        },
   { "share",       c_share,       c_share_sug      },
+  { "stats",       c_stats,       NULL             },
   { "ungrant",     c_ungrant,     c_ungrant_sug    },
   { "unset",       c_unset,       c_unset_sug      },
   { "unshare",     c_unshare,     c_unshare_sug    },
@@ -65,6 +65,12 @@ static GHashTable *db_stmt_cache = NULL;
 //            until DBQ_END. (Only INT, INT64, TEXT and BLOB can be used)
 //   if(type != END)
 //     goto arguments
+//
+// A queue item with the DBF_BATCH flag executes the same query for multiple
+// rows. Instead of a single list of arguments, the query is followed by:
+//   int32 = number of rows
+// and then, for each row, a list of arguments as above terminated by DBQ_END.
+// DBQ_RES can't be used in a batch.
 
 // A "result item" is a darray to represent a result row, with the following
 // structure:
@@ -80,6 +86,7 @@ static GHashTable *db_stmt_cache = NULL;
 #define DBF_LAST    2 // Current query must be the last in a transaction (forces a flush)
 #define DBF_SINGLE  4 // Query must not be executed in a transaction (e.g. VACUUM)
 #define DBF_NOCACHE 8 // Don't cache this query in the prepared statement cache
+#define DBF_BATCH  16 // Query is executed for each row of arguments, see above
 #define DBF_END   128 // Signal the database thread to close
 
 // Column types
@@ -96,6 +103,26 @@ static GHashTable *db_stmt_cache = NULL;
 // How long to keep a transaction active before flushing. In microseconds.
 #define DB_FLUSH_TIMEOUT (5000000)
 
+// Maximum number of rows in a single batch item. Larger batches are split.
+#define DB_BATCH_MAX 1000
+
+
+#if INTERFACE
+
+struct db_stats_t {
+  int queued;            // Number of items waiting in the queue
+  guint64 transactions;  // Number of committed transactions
+  guint64 queries;       // Number of statements executed in those (each row of a batch counts)
+  int lastsize;          // Number of statements in the last committed transaction
+  guint64 commit_time;   // Total time spent committing, in microseconds
+  guint64 commit_max;    // Slowest commit, in microseconds
+};
+
+#endif
+
+static db_stats_t db_stats_data = {};
+static GStaticMutex db_stats_lock = G_STATIC_MUTEX_INIT;
+
 
 // Give back a final response and unref the queue.
 static void db_queue_item_final(GAsyncQueue *res, int code, gint64 lastid) {
@@ -143,6 +170,46 @@ static int db_queue_process_prepare(sqlite3 *db, const char *query, sqlite3_stmt
 }
 
 
+// Binds the arguments of a queue item to a statement (if not NULL), up to
+// the DBQ_END or DBQ_RES. Returns the type that ended the argument list.
+static int db_queue_process_bind(sqlite3_stmt *s, char *q) {
+  int t, n;
+  int i = 1;
+  char *a;
+  while((t = darray_get_int32(q)) != DBQ_END && t != DBQ_RES) {
+    switch(t) {
+    case DBQ_NULL:
+      if(s)
+        sqlite3_bind_null(s, i);
+      break;
+    case DBQ_INT:
+      n = darray_get_int32(q);
+      if(s)
+        sqlite3_bind_int(s, i, n);
+      break;
+    case DBQ_INT64: {
+      gint64 v = darray_get_int64(q);
+      if(s)
+        sqlite3_bind_int64(s, i, v);
+      break;
+    }
+    case DBQ_TEXT:
+      a = darray_get_string(q);
+      if(s)
+        sqlite3_bind_text(s, i, a, -1, SQLITE_STATIC);
+      break;
+    case DBQ_BLOB:
+      a = darray_get_dat(q, &n);
+      if(s)
+        sqlite3_bind_blob(s, i, a, n, SQLITE_STATIC);
+      break;
+    }
+    i++;
+  }
+  return t;
+}
+
+
 // Executes a single query.
 // If transaction = TRUE, the query is assumed to be executed in a transaction
 //   (which has already been initiated)
@@ -169,32 +236,8 @@ static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean
   }
 
   // Bind parameters
-  int t, n;
-  int i = 1;
-  char *a;
-  while((t = darray_get_int32(q)) != DBQ_END && t != DBQ_RES) {
-    if(r == SQLITE_ERROR)
-      continue;
-    switch(t) {
-    case DBQ_NULL:
-      sqlite3_bind_null(s, i);
-      break;
-    case DBQ_INT:
-      sqlite3_bind_int(s, i, darray_get_int32(q));
-      break;
-    case DBQ_INT64:
-      sqlite3_bind_int64(s, i, darray_get_int64(q));
-      break;
-    case DBQ_TEXT:
-      sqlite3_bind_text(s, i, darray_get_string(q), -1, SQLITE_STATIC);
-      break;
-    case DBQ_BLOB:
-      a = darray_get_dat(q, &n);
-      sqlite3_bind_blob(s, i, a, n, SQLITE_STATIC);
-      break;
-    }
-    i++;
-  }
+  int t = db_queue_process_bind(r == SQLITE_ERROR ? NULL : s, q);
+  int i, n;
 
   // Fetch information about what results we need to send back
   gboolean wantlastid = FALSE;
@@ -250,8 +293,45 @@ static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean
 }
 
 
-static int db_queue_process_commit(sqlite3 *db) {
-  g_debug("db: COMMIT");
+// Executes a DBF_BATCH item within a transaction. The number of executed rows
+// is stored in *rows. Returns SQLITE_DONE on success, in which case all rows
+// have been executed.
+static int db_queue_process_batch(sqlite3 *db, char *q, gboolean nocache, int *rows) {
+  char *query = darray_get_ptr(q);
+  *rows = 0;
+
+  int r = SQLITE_DONE;
+  sqlite3_stmt *s;
+  if(nocache ? sqlite3_prepare_v2(db, query, -1, &s, NULL) : db_queue_process_prepare(db, query, &s)) {
+    g_critical("SQLite3 error preparing `%s': %s", query, sqlite3_errmsg(db));
+    return SQLITE_ERROR;
+  }
+
+  int num = darray_get_int32(q);
+  while(r == SQLITE_DONE && *rows < num) {
+    g_return_val_if_fail(db_queue_process_bind(s, q) == DBQ_END, SQLITE_ERROR);
+    while((r = sqlite3_step(s)) == SQLITE_ROW)
+      ;
+    if(r != SQLITE_DONE)
+      g_critical("SQLite3 error on step() of `%s': %s", query, sqlite3_errmsg(db));
+    sqlite3_reset(s);
+    sqlite3_clear_bindings(s);
+    (*rows)++;
+  }
+  g_debug("db: Executed \"%s\" for %d rows", query, *rows);
+
+  if(nocache)
+    sqlite3_finalize(s);
+  return r;
+}
+
+
+// size is the number of statements executed in the transaction, for the
+// statistics.
+static int db_queue_process_commit(sqlite3 *db, int size) {
+  g_debug("db: COMMIT (%d statements)", size);
+  GTimeVal start, end;
+  g_get_current_time(&start);
   int r;
   sqlite3_stmt *s;
   if(db_queue_process_prepare(db, "COMMIT", &s))
@@ -262,6 +342,19 @@ static int db_queue_process_commit(sqlite3 *db) {
   if(r != SQLITE_DONE)
     g_critical("SQLite3 error committing transaction: %s", sqlite3_errmsg(db));
   sqlite3_reset(s);
+
+  g_get_current_time(&end);
+  gint64 t = MAX(0, (end.tv_sec - start.tv_sec)*G_GINT64_CONSTANT(1000000) + (end.tv_usec - start.tv_usec));
+  if(r == SQLITE_DONE) {
+    g_static_mutex_lock(&db_stats_lock);
+    db_stats_data.transactions++;
+    db_stats_data.queries += size;
+    db_stats_data.lastsize = size;
+    db_stats_data.commit_time += t;
+    db_stats_data.commit_max = MAX(db_stats_data.commit_max, (guint64)t);
+    g_static_mutex_unlock(&db_stats_lock);
+    stats_record(STATH_DB_COMMIT, t);
+  }
   return r;
 }
 
@@ -293,12 +386,13 @@ static int db_queue_process_begin(sqlite3 *db) {
 
 static void db_queue_process(sqlite3 *db) {
   GTimeVal trans_end = {}; // tv_sec = 0 if no transaction is active
+  int trans_size = 0;      // number of statements in the active transaction
   gboolean donext = FALSE;
   gboolean errtrans = FALSE;
 
   GAsyncQueue *res;
   gint64 lastid;
-  int r;
+  int r, rows;
 
   while(1) {
     char *q =   donext ? g_async_queue_try_pop(db_queue) :
@@ -312,7 +406,7 @@ static void db_queue_process(sqlite3 *db) {
     if(!q || flags & DBF_SINGLE || flags & DBF_END) {
       g_warn_if_fail(!donext);
       if(trans_end.tv_sec)
-        db_queue_process_commit(db);
+        db_queue_process_commit(db, trans_size);
       trans_end.tv_sec = 0;
       donext = errtrans = FALSE;
     }
@@ -339,7 +433,8 @@ static void db_queue_process(sqlite3 *db) {
     // report error to NEXT-chained queries if the transaction has been aborted.
     if(errtrans) {
       g_warn_if_fail(donext);
-      db_queue_item_error(q);
+      if(!(flags & DBF_BATCH))
+        db_queue_item_error(q);
       donext = flags & DBF_NEXT ? TRUE : FALSE;
       if(!donext) {
         errtrans = FALSE;
@@ -355,7 +450,7 @@ static void db_queue_process(sqlite3 *db) {
       // Commit first, then send back the final result
       if(trans_end.tv_sec) {
         if(r == SQLITE_DONE)
-          r = db_queue_process_commit(db);
+          r = db_queue_process_commit(db, trans_size+1);
         if(r != SQLITE_DONE)
           db_queue_process_rollback(db);
       }
@@ -370,21 +465,29 @@ static void db_queue_process(sqlite3 *db) {
     if(!trans_end.tv_sec) {
       g_get_current_time(&trans_end);
       g_time_val_add(&trans_end, DB_FLUSH_TIMEOUT);
+      trans_size = 0;
       r = db_queue_process_begin(db);
       if(r != SQLITE_DONE) {
         if(flags & DBF_NEXT)
           donext = errtrans = TRUE;
         else
           trans_end.tv_sec = 0;
-        db_queue_item_error(q);
+        if(!(flags & DBF_BATCH))
+          db_queue_item_error(q);
         g_free(q);
         continue;
       }
     }
 
     // handle normal/NEXT queries
-    r = db_queue_process_one(db, q, nocache, TRUE, &res, &lastid);
-    db_queue_item_final(res, r, lastid);
+    if(flags & DBF_BATCH) {
+      r = db_queue_process_batch(db, q, nocache, &rows);
+      trans_size += rows;
+    } else {
+      r = db_queue_process_one(db, q, nocache, TRUE, &res, &lastid);
+      db_queue_item_final(res, r, lastid);
+      trans_size++;
+    }
     g_free(q);
 
     // Rollback and update state on error
@@ -438,32 +541,26 @@ void db_close() {
 }
 
 
-// The query is assumed to be a static string that is not freed or modified.
-static void *db_queue_item_create(int flags, const char *q, ...) {
-  GByteArray *a = g_byte_array_new();
-  darray_init(a);
-  darray_add_int32(a, flags);
-  darray_add_ptr(a, q);
-
+// Adds the arguments from a DBQ_END or DBQ_RES-terminated argument list to a
+// queue item. Returns the type that ended the list, or -1 on error.
+static int db_queue_item_args(GByteArray *a, va_list *va) {
   int t;
   char *p;
-  va_list va;
-  va_start(va, q);
-  while((t = va_arg(va, int)) != DBQ_END && t != DBQ_RES) {
+  while((t = va_arg(*va, int)) != DBQ_END && t != DBQ_RES) {
     switch(t) {
     case DBQ_NULL:
       darray_add_int32(a, DBQ_NULL);
       break;
     case DBQ_INT:
       darray_add_int32(a, DBQ_INT);
-      darray_add_int32(a, va_arg(va, int));
+      darray_add_int32(a, va_arg(*va, int));
       break;
     case DBQ_INT64:
       darray_add_int32(a, DBQ_INT64);
-      darray_add_int64(a, va_arg(va, gint64));
+      darray_add_int64(a, va_arg(*va, gint64));
       break;
     case DBQ_TEXT:
-      p = va_arg(va, char *);
+      p = va_arg(*va, char *);
       if(p) {
         darray_add_int32(a, DBQ_TEXT);
         darray_add_string(a, p);
@@ -471,8 +568,8 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
         darray_add_int32(a, DBQ_NULL);
       break;
     case DBQ_BLOB:
-      t = va_arg(va, int);
-      p = va_arg(va, char *);
+      t = va_arg(*va, int);
+      p = va_arg(*va, char *);
       if(p) {
         darray_add_int32(a, DBQ_BLOB);
         darray_add_dat(a, p, t);
@@ -480,9 +577,25 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
         darray_add_int32(a, DBQ_NULL);
       break;
     default:
-      g_return_val_if_reached(NULL);
+      g_return_val_if_reached(-1);
     }
   }
+  return t;
+}
+
+
+// The query is assumed to be a static string that is not freed or modified.
+static void *db_queue_item_create(int flags, const char *q, ...) {
+  GByteArray *a = g_byte_array_new();
+  darray_init(a);
+  darray_add_int32(a, flags);
+  darray_add_ptr(a, q);
+
+  int t;
+  va_list va;
+  va_start(va, q);
+  t = db_queue_item_args(a, &va);
+  g_return_val_if_fail(t >= 0, NULL);
 
   if(t == DBQ_RES) {
     darray_add_int32(a, DBQ_RES);
@@ -506,6 +619,50 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
 #define db_queue_push_unlocked(...) g_async_queue_push_unlocked(db_queue, db_queue_item_create(__VA_ARGS__))
 
 
+// Batches. Rows are collected with db_batch_add() and queued as a single
+// DBF_BATCH item with db_batch_flush(). Large batches are flushed
+// automatically every DB_BATCH_MAX rows.
+
+typedef struct db_batch_t {
+  const char *query; // Static string, as with db_queue_item_create()
+  GByteArray *a;     // NULL if no rows have been added yet
+  guint numoff;      // Offset of the number of rows in a
+  int rows;
+} db_batch_t;
+
+
+static void db_batch_flush(db_batch_t *b) {
+  if(!b->a)
+    return;
+  *((gint32 *)(b->a->data + b->numoff)) = b->rows;
+  g_async_queue_push(db_queue, g_byte_array_free(b->a, FALSE));
+  b->a = NULL;
+  b->rows = 0;
+}
+
+
+// Arguments are the same as for db_queue_push(), without DBQ_RES.
+static void db_batch_add(db_batch_t *b, ...) {
+  if(!b->a) {
+    b->a = g_byte_array_new();
+    darray_init(b->a);
+    darray_add_int32(b->a, DBF_BATCH);
+    darray_add_ptr(b->a, b->query);
+    darray_add_int32(b->a, 0);
+    b->numoff = b->a->len - 4;
+  }
+
+  va_list va;
+  va_start(va, b);
+  g_warn_if_fail(db_queue_item_args(b->a, &va) == DBQ_END);
+  va_end(va);
+  darray_add_int32(b->a, DBQ_END);
+
+  if(++b->rows >= DB_BATCH_MAX)
+    db_batch_flush(b);
+}
+
+
 
 
 
@@ -601,6 +758,30 @@ gint64 db_fl_getfile(const char *path, time_t *lastmod, guint64 *size, char *tth
 }
 
 
+// Calls func() with the filename, TTH root and size of every row in
+// hashfiles. This scans the table sequentially and looks up the size by the
+// primary key of hashdata, so it doesn't need any index. Used to build an
+// interim TTH index while the file list is being loaded.
+void db_fl_getall(void (*func)(const char *, const char *, guint64, void *), void *dat) {
+  GAsyncQueue *a = g_async_queue_new_full(g_free);
+  db_queue_push(0,
+    "SELECT f.filename, f.tth, d.size FROM hashfiles f JOIN hashdata d ON d.root = f.tth",
+    DBQ_RES, a, DBQ_TEXT, DBQ_TEXT, DBQ_INT64,
+    DBQ_END
+  );
+
+  char *r;
+  while((r = g_async_queue_pop(a)) && darray_get_int32(r) == SQLITE_ROW) {
+    const char *path = darray_get_string(r);
+    const char *tth = darray_get_string(r);
+    func(path, tth, darray_get_int64(r), dat);
+    g_free(r);
+  }
+  g_free(r);
+  g_async_queue_unref(a);
+}
+
+
 // Batch-remove rows from hashfiles.
 // TODO: how/when to remove rows from hashdata for which no entry in hashfiles
 // exist? A /gc will do this by calling db_fl_purgedata(), but ideally this
@@ -612,20 +793,46 @@ void db_fl_rmfiles(gint64 *ids, int num) {
 }
 
 
-// Gets the full list of all ids in the hashfiles table, in ascending order.
-// *callback is called for every row.
-void db_fl_getids(void (*callback)(gint64)) {
+// Runs a query that returns a single integer, 0 if it doesn't return a row
+// (or returns NULL). The query must not have any arguments other than the
+// optional (from, num) pair used by the /gc queries.
+static gint64 db_get_int64(int flags, const char *q, gint64 from, int num) {
+  GAsyncQueue *a = g_async_queue_new_full(g_free);
+  if(num)
+    db_queue_push(flags, q, DBQ_INT64, from, DBQ_INT, num, DBQ_RES, a, DBQ_INT64, DBQ_END);
+  else
+    db_queue_push(flags, q, DBQ_RES, a, DBQ_INT64, DBQ_END);
+
+  char *r = g_async_queue_pop(a);
+  gint64 v = darray_get_int32(r) == SQLITE_ROW ? darray_get_int64(r) : 0;
+  g_free(r);
+  g_async_queue_unref(a);
+  return v;
+}
+
+
+// Returns the largest id in the hashfiles table.
+gint64 db_fl_maxid() {
+  return db_get_int64(0, "SELECT MAX(id) FROM hashfiles", 0, 0);
+}
+
+
+// Appends at most num ids from the hashfiles table in the range (from, to] to
+// *ids, in ascending order.
+void db_fl_getids(gint64 from, gint64 to, int num, GArray *ids) {
   // This query is fast: `id' is the SQLite rowid, and has an index that is
   // already ordered.
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(0, "SELECT id FROM hashfiles ORDER BY id ASC",
+  db_queue_push(0, "SELECT id FROM hashfiles WHERE id > ? AND id <= ? ORDER BY id ASC LIMIT ?",
+    DBQ_INT64, from, DBQ_INT64, to, DBQ_INT, num,
     DBQ_RES, a, DBQ_INT64,
     DBQ_END
   );
 
   char *r;
   while((r = g_async_queue_pop(a)) && darray_get_int32(r) == SQLITE_ROW) {
-    callback(darray_get_int64(r));
+    gint64 id = darray_get_int64(r);
+    g_array_append_val(ids, id);
     g_free(r);
   }
   g_free(r);
@@ -633,20 +840,82 @@ void db_fl_getids(void (*callback)(gint64)) {
 }
 
 
+// Creates or drops the temporary index used by db_fl_purgedata().
+// For small databases, sqlite is clever enough to create a temporary
+// in-memory index on hashfiles(tth). But sometimes it doesn't, and then the
+// purge query takes an hour or longer to run. To be on the safe side,
+// explicitely create an index. This requires some extra disk space while a
+// /gc is running.
+void db_fl_gcindex(gboolean create) {
+  db_queue_push(DBF_NOCACHE, create
+    ? "CREATE INDEX IF NOT EXISTS hashfiles_tth_gc ON hashfiles (tth)"
+    : "DROP INDEX IF EXISTS hashfiles_tth_gc", DBQ_END);
+}
+
+
 // Remove rows from the hashdata table that are not referenced from the
-// hashfiles table.
-void db_fl_purgedata() {
-  // For small databases, sqlite is clever enough to create a temporary
-  // in-memory index on hashfiles(tth). But sometimes it doesn't, and then this
-  // query takes an hour or longer to run. To be on the safe side, explicitely
-  // create an index. This requires some extra disk space and makes a /gc run
-  // longer on average, but it should guarantee that a /gc actually finishes
-  // within a matter of minutes rather than hours.
-  db_queue_lock();
-  db_queue_push_unlocked(DBF_NEXT, "CREATE INDEX hashfiles_tth_gc ON hashfiles (tth)", DBQ_END);
-  db_queue_push_unlocked(DBF_NEXT, "DELETE FROM hashdata WHERE NOT EXISTS(SELECT 1 FROM hashfiles WHERE tth = root)", DBQ_END);
-  db_queue_push_unlocked(0, "DROP INDEX hashfiles_tth_gc", DBQ_END);
-  db_queue_unlock();
+// hashfiles table, checking at most num rows after the given rowid. Returns
+// the last checked rowid, or 0 when the end of the table has been reached.
+gint64 db_fl_purgedata(gint64 from, int num) {
+  gint64 to = db_get_int64(0, "SELECT MAX(rowid) FROM (SELECT rowid FROM hashdata WHERE rowid > ? ORDER BY rowid LIMIT ?)", from, num);
+  if(to)
+    db_queue_push(0, "DELETE FROM hashdata WHERE rowid > ? AND rowid <= ? AND NOT EXISTS(SELECT 1 FROM hashfiles WHERE tth = root)",
+      DBQ_INT64, from, DBQ_INT64, to, DBQ_END);
+  return to;
+}
+
+
+
+
+
+// hashresume
+
+// Saves a hashing checkpoint for a (large) file. tthl contains the hashes of
+// the blocks that have been fully hashed so far.
+void db_fl_setresume(const char *path, guint64 size, time_t lastmod, guint64 blocksize, const char *tthl, int tthl_len) {
+  db_queue_push(0, "INSERT OR REPLACE INTO hashresume (filename, size, lastmod, blocksize, tthl) VALUES(?, ?, ?, ?, ?)",
+    DBQ_TEXT, path,
+    DBQ_INT64, (gint64)size,
+    DBQ_INT64, (gint64)lastmod,
+    DBQ_INT64, (gint64)blocksize,
+    DBQ_BLOB, tthl_len, tthl,
+    DBQ_END
+  );
+}
+
+
+// Fetch the checkpoint data for a file. Returns NULL if there's no checkpoint,
+// or if the file has changed since the checkpoint was saved. Return value must
+// be g_free()'d.
+char *db_fl_getresume(const char *path, guint64 size, time_t lastmod, guint64 blocksize, int *len) {
+  GAsyncQueue *a = g_async_queue_new_full(g_free);
+  db_queue_push(0, "SELECT tthl FROM hashresume WHERE filename = ? AND size = ? AND lastmod = ? AND blocksize = ?",
+    DBQ_TEXT, path,
+    DBQ_INT64, (gint64)size,
+    DBQ_INT64, (gint64)lastmod,
+    DBQ_INT64, (gint64)blocksize,
+    DBQ_RES, a, DBQ_BLOB,
+    DBQ_END
+  );
+
+  char *r = g_async_queue_pop(a);
+  int n = 0;
+  char *res = darray_get_int32(r) == SQLITE_ROW ? darray_get_dat(r, &n) : NULL;
+  res = n ? g_memdup(res, n) : NULL;
+  *len = n;
+
+  g_free(r);
+  g_async_queue_unref(a);
+  return res;
+}
+
+
+// Remove the checkpoint for a file, or all checkpoints if path = NULL.
+void db_fl_rmresume(const char *path) {
+  if(path)
+    db_queue_push(0, "DELETE FROM hashresume WHERE filename = ?", DBQ_TEXT, path, DBQ_END);
+  else
+    db_queue_push(0, "DELETE FROM hashresume", DBQ_END);
 }
 
 
@@ -709,10 +978,38 @@ void db_dl_getdlus(void (*callback)(const char *tth, guint64 uid, char error, co
 }
 
 
+// While a batch is active, db_dl_insert() and db_dl_adduser() rows are
+// collected and queued in batches. Other db_dl_* modifications flush the
+// collected rows first, so that the order of the queries is preserved.
+// Batches can be nested, and must only be used from the main thread.
+static int db_dl_batch_level = 0;
+static db_batch_t db_dl_batch_dl = { "INSERT OR REPLACE INTO dl (tth, size, dest, priority, error, error_msg) VALUES (?, ?, ?, ?, ?, ?)" };
+static db_batch_t db_dl_batch_users = { "INSERT OR REPLACE INTO dl_users (tth, uid, error, error_msg) VALUES (?, ?, ?, ?)" };
+
+
+static void db_dl_batch_flush() {
+  db_batch_flush(&db_dl_batch_dl);
+  db_batch_flush(&db_dl_batch_users);
+}
+
+
+void db_dl_batch_begin() {
+  db_dl_batch_level++;
+}
+
+
+void db_dl_batch_end() {
+  g_return_if_fail(db_dl_batch_level > 0);
+  if(!--db_dl_batch_level)
+    db_dl_batch_flush();
+}
+
+
 // Delete a row from dl and any rows from dl_users that reference the row.
 void db_dl_rm(const char *tth) {
   char hash[40] = {};
   base32_encode(tth, hash);
+  db_dl_batch_flush();
 
   db_queue_lock();
   db_queue_push_unlocked(DBF_NEXT, "DELETE FROM dl_users WHERE tth = ?", DBQ_TEXT, hash, DBQ_END);
@@ -725,6 +1022,7 @@ void db_dl_rm(const char *tth) {
 void db_dl_setstatus(const char *tth, signed char priority, char error, const char *error_msg) {
   char hash[40] = {};
   base32_encode(tth, hash);
+  db_dl_batch_flush();
   db_queue_push(0, "UPDATE dl SET priority = ?, error = ?, error_msg = ? WHERE tth = ?",
     DBQ_INT, (int)priority, DBQ_INT, (int)error,
     DBQ_TEXT, error_msg,
@@ -738,6 +1036,7 @@ void db_dl_setstatus(const char *tth, signed char priority, char error, const ch
 // all rows for a single user if tth = NULL.
 // TODO: tth = NULL is currently not very fast - no index on dl_user(uid).
 void db_dl_setuerr(guint64 uid, const char *tth, char error, const char *error_msg) {
+  db_dl_batch_flush();
   // for a single dl item
   if(tth) {
     char hash[40] = {};
@@ -765,6 +1064,7 @@ void db_dl_setuerr(guint64 uid, const char *tth, char error, const char *error_m
 // rows from a single user if tth = NULL. (Same note as for db_dl_setuerr()
 // applies here).
 void db_dl_rmuser(guint64 uid, const char *tth) {
+  db_dl_batch_flush();
   // for a single dl item
   if(tth) {
     char hash[40] = {};
@@ -788,6 +1088,7 @@ void db_dl_rmuser(guint64 uid, const char *tth) {
 void db_dl_settthl(const char *tth, const char *tthl, int len) {
   char hash[40] = {};
   base32_encode(tth, hash);
+  db_dl_batch_flush();
   db_queue_push(0, "UPDATE dl SET tthl = ? WHERE tth = ?",
     DBQ_BLOB, len, tthl,
     DBQ_TEXT, hash,
@@ -800,6 +1101,18 @@ void db_dl_settthl(const char *tth, const char *tthl, int len) {
 void db_dl_insert(const char *tth, guint64 size, const char *dest, signed char priority, char error, const char *error_msg) {
   char hash[40] = {};
   base32_encode(tth, hash);
+  if(db_dl_batch_level) {
+    db_batch_add(&db_dl_batch_dl,
+      DBQ_TEXT, hash,
+      DBQ_INT64, (gint64)size,
+      DBQ_TEXT, dest,
+      DBQ_INT, (int)priority,
+      DBQ_INT, (int)error,
+      DBQ_TEXT, error_msg,
+      DBQ_END
+    );
+    return;
+  }
   db_queue_push(0, "INSERT OR REPLACE INTO dl (tth, size, dest, priority, error, error_msg) VALUES (?, ?, ?, ?, ?, ?)",
     DBQ_TEXT, hash,
     DBQ_INT64, (gint64)size,
@@ -816,6 +1129,16 @@ void db_dl_insert(const char *tth, guint64 size, const char *dest, signed char p
 void db_dl_adduser(const char *tth, guint64 uid, char error, const char *error_msg) {
   char hash[40] = {};
   base32_encode(tth, hash);
+  if(db_dl_batch_level) {
+    db_batch_add(&db_dl_batch_users,
+      DBQ_TEXT, hash,
+      DBQ_INT64, (gint64)uid,
+      DBQ_INT, (int)error,
+      DBQ_TEXT, error_msg,
+      DBQ_END
+    );
+    return;
+  }
   db_queue_push(0, "INSERT OR REPLACE INTO dl_users (tth, uid, error, error_msg) VALUES (?, ?, ?, ?)",
     DBQ_TEXT, hash,
     DBQ_INT64, (gint64)uid,
@@ -826,20 +1149,27 @@ void db_dl_adduser(const char *tth, guint64 uid, char error, const char *error_m
 }
 
 
-gboolean db_dl_checkhash(const char *root, int num, const char *hash) {
-  char rhash[40] = {};
-  base32_encode(root, rhash);
+// Fetch the tthl data of a dl row. Return value must be g_free()'d. Returns
+// NULL on error or when there is no TTHL data.
+// Called from the verification threads, so this doesn't flush the batch.
+char *db_dl_gettthl(const char *tth, int *len) {
+  char hash[40] = {};
+  base32_encode(tth, hash);
+
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(0, "SELECT 1 FROM dl WHERE tth = ? AND substr(tthl, 1+(24*?), 24) = ?",
-    DBQ_TEXT, rhash,
-    DBQ_INT, num,
-    DBQ_BLOB, 24, hash,
-    DBQ_RES, a, DBQ_INT,
+  db_queue_push(0, "SELECT COALESCE(tthl, '') FROM dl WHERE tth = ?",
+    DBQ_TEXT, hash,
+    DBQ_RES, a, DBQ_BLOB,
     DBQ_END
   );
 
   char *r = g_async_queue_pop(a);
-  gboolean res = darray_get_int32(r) == SQLITE_ROW ? TRUE : FALSE;
+  int n = 0;
+  char *res = darray_get_int32(r) == SQLITE_ROW ? darray_get_dat(r, &n) : NULL;
+  res = n ? g_memdup(res, n) : NULL;
+  if(len)
+    *len = n;
+
   g_free(r);
   g_async_queue_unref(a);
   return res;
@@ -1509,6 +1839,15 @@ static int db_dir_init() {
   "  flags INTEGER NOT NULL"\
   ")"
 
+#define DB_HASHRESUME_TABLE \
+  "CREATE TABLE hashresume ("\
+  "  filename TEXT NOT NULL PRIMARY KEY,"\
+  "  size INTEGER NOT NULL,"\
+  "  lastmod INTEGER NOT NULL,"\
+  "  blocksize INTEGER NOT NULL,"\
+  "  tthl BLOB NOT NULL"\
+  ")"
+
 
 static void db_init_schema() {
   // Get user_version
@@ -1526,8 +1865,10 @@ static void db_init_schema() {
 
   // New database? Initialize schema.
   if(ver == 0) {
+    // Has to be set before any table is created.
+    db_queue_push(DBF_SINGLE|DBF_NOCACHE, "PRAGMA auto_vacuum = INCREMENTAL", DBQ_END);
     db_queue_lock();
-    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 2", DBQ_END);
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 3", DBQ_END);
     db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE,
       "CREATE TABLE hashdata ("
       "  root TEXT NOT NULL PRIMARY KEY,"
@@ -1565,6 +1906,7 @@ static void db_init_schema() {
       "  path TEXT NOT NULL"
       ")", DBQ_END);
     db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, DB_USERS_TABLE, DBQ_END);
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, DB_HASHRESUME_TABLE, DBQ_END);
     // Get a result from the last one, to make sure the above queries were successful.
     GAsyncQueue *a = g_async_queue_new_full(g_free);
     db_queue_push_unlocked(DBF_LAST|DBF_NOCACHE,
@@ -1594,6 +1936,21 @@ static void db_init_schema() {
       g_error("Error updating database schema.");
     g_free(r);
     g_async_queue_unref(a);
+    ver = 2;
+  }
+
+  // Version 2 didn't have the hashresume table
+  if(ver == 2) {
+    db_queue_lock();
+    GAsyncQueue *a = g_async_queue_new_full(g_free);
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 3", DBQ_END);
+    db_queue_push_unlocked(DBF_LAST|DBF_NOCACHE, DB_HASHRESUME_TABLE, DBQ_RES, a, DBQ_END);
+    db_queue_unlock();
+    char *r = g_async_queue_pop(a);
+    if(darray_get_int32(r) != SQLITE_DONE)
+      g_error("Error updating database schema.");
+    g_free(r);
+    g_async_queue_unref(a);
   }
 }
 
@@ -1619,7 +1976,43 @@ void db_init() {
 
 
 
-// Executes a VACUUM
-void db_vacuum() {
-  db_queue_push(DBF_SINGLE|DBF_NOCACHE, "VACUUM", DBQ_END);
+// Reclaims some of the unused space in the database file. Returns the number
+// of unused pages left, 0 when done. Databases that were created without
+// auto_vacuum = INCREMENTAL are converted with a (one-time) full VACUUM.
+int db_vacuum() {
+  if(db_get_int64(DBF_SINGLE|DBF_NOCACHE, "PRAGMA auto_vacuum", 0, 0) != 2) {
+    db_queue_push(DBF_SINGLE|DBF_NOCACHE, "PRAGMA auto_vacuum = INCREMENTAL", DBQ_END);
+    db_queue_push(DBF_SINGLE|DBF_NOCACHE, "VACUUM", DBQ_END);
+    return 0;
+  }
+  db_queue_push(DBF_SINGLE, "PRAGMA incremental_vacuum(1024)", DBQ_END);
+  return db_get_int64(DBF_SINGLE, "PRAGMA freelist_count", 0, 0);
+}
+
+
+// Applies the db_synchronous and db_journal_mode settings. The PRAGMA
+// strings have to be static, see db_queue_process_prepare().
+void db_tune() {
+  int sync = var_get_int(0, VAR_db_synchronous);
+  db_queue_push(DBF_SINGLE,
+    sync == VAR_DBSYNC_OFF    ? "PRAGMA synchronous = OFF" :
+    sync == VAR_DBSYNC_NORMAL ? "PRAGMA synchronous = NORMAL" :
+                                "PRAGMA synchronous = FULL",
+    DBQ_END);
+
+  int journal = var_get_int(0, VAR_db_journal_mode);
+  db_queue_push(DBF_SINGLE,
+    journal == VAR_DBJOURNAL_TRUNCATE ? "PRAGMA journal_mode = TRUNCATE" :
+    journal == VAR_DBJOURNAL_WAL      ? "PRAGMA journal_mode = WAL" :
+                                        "PRAGMA journal_mode = DELETE",
+    DBQ_END);
+}
+
+
+// Fills out *st with the current statistics of the database thread.
+void db_stats(db_stats_t *st) {
+  g_static_mutex_lock(&db_stats_lock);
+  *st = db_stats_data;
+  g_static_mutex_unlock(&db_stats_lock);
+  st->queued = g_async_queue_length(db_queue);
 }
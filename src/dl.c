@@ -48,9 +48,15 @@ struct dl_user_t {
   int state;            // DLU_*
   int timeout;          // source id of the timeout function in DLU_WAI
   guint64 uid;
+  guint64 speed;        // smoothed download speed in bytes/s, 0 if unknown (maintained by dlfile.c)
   cc_t *cc;             // Always when state = IDL or ACT, may be set or NULL in EXP
   GSequence *queue;     // list of dl_user_dl_t, ordered by dl_user_dl_sort()
   dl_user_dl_t *active; // when state = DLU_ACT, the dud that is being downloaded (NULL if it had been removed from the queue while downloading)
+  GSequenceIter *ready; // position in queue_ready, NULL if not in it
+  // The key with which this user has been inserted into queue_ready
+  gboolean ready_idl : 1;
+  signed char ready_prio;
+  dl_t *ready_dl;
 };
 
 /* State machine for dl_user.state:
@@ -107,6 +113,7 @@ struct dl_t {
   signed char prio;      // DLP_*
   char error;            // DLE_*
   unsigned char active_threads; // number of active downloading threads (maintained by dlfile.c)
+  int verifying;         // number of blocks queued for verification (maintained by dlfile.c)
   int incfd;             // file descriptor for this file in <incoming_dir> (maintained by dlfile.c)
   char *error_msg;       // if error != DLE_NONE
   char *flsel;           // path to file/dir to select for filelists
@@ -119,11 +126,15 @@ struct dl_t {
   char *inc;             // path to the incomplete file (<incoming_dir>/<base32-hash>)
   char *dest;            // destination path
   GSequenceIter *iter;   // used by ui_dl
-  GSList *threads;       // maintained by dlfile.c
+  GSequence *threads;    // dlfile_thread_t structs, maintained by dlfile.c (NULL if empty)
   guint8 *bitmap;        // Only used if hastthl, maintained by dlfile.c
-  guint bitmap_src;      // timeout source for flushing the bitmap, maintained by dlfile.c
-  /* Maintained by dlfile.c, protects dl_t.{have,bitmap,bitmap_src} and
-   * dlfile_thread_t.{allocated,avail,chunk}.
+  char *tthl;            // In-memory copy of the TTHL data, loaded on demand by dlfile.c
+  int tthl_len;
+  guint8 *bitmap_dirty;  // Pages of the bitmap modified since the last flush, maintained by dlfile.c
+  gboolean bitmap_queued; // whether the bitmap is scheduled to be flushed, maintained by dlfile.c
+  int bitmap_flushing;   // number of bitmap flushes in progress (maintained by dlfile.c)
+  /* Maintained by dlfile.c, protects dl_t.{have,bitmap,bitmap_dirty,bitmap_queued,verifying,tthl} and
+   * dlfile_thread_t.{allocated,avail,chunk,busy} and the ordering of threads.
    * Some other fields are shared, too, but those are never modified while a
    * downloading thread is active and thus do not need synchronisation.  These
    * include dl_t.{size,islist,hash,hash_block,incfd} and possibly more.
@@ -149,6 +160,13 @@ GHashTable *dl_queue = NULL;
 // uid -> dl_user lookup table.
 static GHashTable *queue_users = NULL;
 
+// Users that may be a target for dl_queue_start_do(), ordered by
+// dl_queue_ready_cmp(). See dl_queue_ready_update() for the details.
+static GSequence *queue_ready = NULL;
+
+// Number of users in the DLU_ACT state
+static int queue_active = 0;
+
 
 
 // Utility function that returns an error string for DLE_* errors.
@@ -175,6 +193,7 @@ char *dl_strerror(char err, const char *sub) {
 // dl_user_t related functions
 
 static gboolean dl_user_waitdone(gpointer dat);
+static void dl_queue_ready_update(dl_user_t *du);
 
 
 // Determine whether a dl_user_dl struct can be considered as "enabled".
@@ -218,13 +237,17 @@ static void dl_user_dl_free(gpointer x) {
 // downloaded. This function can be assumed to be relatively fast, in most
 // cases the first iteration will be enough, in the worst case it at most
 // <download_slots> iterations.
+// A file of which all blocks are being downloaded is still returned for a
+// connected user when dlfile_getchunk() would let it take over a part from a
+// slower user (the "endgame").
 // Returns NULL if there is no dl item in the queue that is enabled and not
 // being downloaded.
 static dl_user_dl_t *dl_user_getdl(const dl_user_t *du) {
   GSequenceIter *i = g_sequence_get_begin_iter(du->queue);
   for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i)) {
     dl_user_dl_t *dud = g_sequence_get(i);
-    if(dl_user_dl_enabled(dud) && !dud->dl->allbusy)
+    if(dl_user_dl_enabled(dud) && (!dud->dl->allbusy
+        || (du->state == DLU_IDL && dud->dl->hastthl && dlfile_endgame(dud->dl, du->speed))))
       return dud;
   }
   return NULL;
@@ -246,13 +269,20 @@ static void dl_user_setstate(dl_user_t *du, int state) {
   if(state >= 0 && du->state == DLU_ACT && state != DLU_ACT && du->active)
     du->active = NULL;
 
+  if(state >= 0 && du->state != DLU_ACT && state == DLU_ACT)
+    queue_active++;
+  else if(state >= 0 && du->state == DLU_ACT && state != DLU_ACT)
+    queue_active--;
+
   // Set state
   //g_debug("dlu:%"G_GINT64_MODIFIER"x: %d -> %d (active = %s)", du->uid, du->state, state, du->active ? "true":"false");
   if(state >= 0)
     du->state = state;
+  dl_queue_ready_update(du);
 
   // Check whether there is any value in keeping this dl_user struct in memory
   if(du->state == DLU_NCO && !g_sequence_get_length(du->queue)) {
+    g_warn_if_fail(!du->ready);
     g_hash_table_remove(queue_users, &du->uid);
     g_sequence_free(du->queue);
     g_slice_free(dl_user_t, du);
@@ -288,12 +318,35 @@ void dl_user_cc(guint64 uid, cc_t *cc) {
 }
 
 
+// Smoothed download speed of a user, used by dlfile.c for scheduling.
+guint64 dl_user_getspeed(guint64 uid) {
+  dl_user_t *du = g_hash_table_lookup(queue_users, &uid);
+  return du ? du->speed : 0;
+}
+
+
+void dl_user_setspeed(guint64 uid, guint64 speed) {
+  dl_user_t *du = g_hash_table_lookup(queue_users, &uid);
+  if(du)
+    du->speed = speed;
+}
+
+
 // To be called when a user joins a hub. Checks whether we have something to
 // get from that user. May be called with uid=0 after joining a hub, in which
 // case all users in the queue will be checked.
 void dl_user_join(guint64 uid) {
-  if(!uid || g_hash_table_lookup(queue_users, &uid))
+  dl_user_t *du;
+  if(uid && (du = g_hash_table_lookup(queue_users, &uid))) {
+    dl_queue_ready_update(du);
+    dl_queue_start();
+  } else if(!uid) {
+    GHashTableIter iter;
+    g_hash_table_iter_init(&iter, queue_users);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du))
+      dl_queue_ready_update(du);
     dl_queue_start();
+  }
 }
 
 
@@ -323,6 +376,7 @@ static void dl_user_add(dl_t *dl, guint64 uid, char error, const char *error_msg
   // Add to du->queue and dl->u
   g_ptr_array_add(dl->u, g_sequence_insert_sorted(du->queue, dud, dl_user_dl_sort, NULL));
   uit_dl_dud_listchange(dud, UITDL_ADD);
+  dl_queue_ready_update(du);
 }
 
 
@@ -405,76 +459,125 @@ static gboolean dl_queue_start_user(dl_user_t *du) {
 
 
 // Compares two dl_user structs by a "priority" to determine from whom to
-// download first. Note that users in the IDL state always get priority over
+// download first, using the key with which they have been inserted into
+// queue_ready. Note that users in the IDL state always get priority over
 // users in the NCO state, in order to prevent the situation that the
 // lower-priority user in the IDL state is connected to anyway in a next
-// iteration. Returns -1 if a has a higher priority than b.
-// This function assumes dl_queue_start_istarget() for both arguments.
-static gint dl_queue_start_cmp(gconstpointer a, gconstpointer b) {
+// iteration. Otherwise the order is the same as dl_user_dl_sort() of the file
+// to be downloaded. Returns -1 if a has a higher priority than b.
+static gint dl_queue_ready_cmp(gconstpointer a, gconstpointer b, gpointer dat) {
   const dl_user_t *ua = a;
   const dl_user_t *ub = b;
-  return -1*(
-    ua->state == DLU_IDL && ub->state != DLU_IDL ?  1 :
-    ua->state != DLU_IDL && ub->state == DLU_IDL ? -1 :
-    dl_user_dl_sort(dl_user_getdl(ub), dl_user_getdl(ua), NULL)
-  );
+  int r;
+  return
+      ua->ready_idl && !ub->ready_idl ? -1 : !ua->ready_idl && ub->ready_idl ? 1
+    : ua->ready_dl->islist && !ub->ready_dl->islist ? -1 : !ua->ready_dl->islist && ub->ready_dl->islist ? 1
+    : ua->ready_prio > ub->ready_prio ? -1 : ua->ready_prio < ub->ready_prio ? 1
+    : (r = strcmp(ua->ready_dl->dest, ub->ready_dl->dest)) ? r
+    : ua->uid < ub->uid ? -1 : ua->uid > ub->uid ? 1 : 0;
+}
+
+
+static void dl_queue_ready_insert(dl_user_t *du, dl_user_dl_t *dud) {
+  g_return_if_fail(!du->ready);
+  du->ready_idl = du->state == DLU_IDL;
+  du->ready_prio = dud->dl->prio;
+  du->ready_dl = dud->dl;
+  du->ready = g_sequence_insert_sorted(queue_ready, du, dl_queue_ready_cmp, NULL);
+}
+
+
+static void dl_queue_ready_remove(dl_user_t *du) {
+  if(du->ready)
+    g_sequence_remove(du->ready);
+  du->ready = NULL;
+}
+
+
+// Whether the key of a user in queue_ready matches the given dud.
+#define dl_queue_ready_iskey(du, dud) (\
+    (du)->ready_dl == (dud)->dl && (du)->ready_prio == (dud)->dl->prio\
+    && !(du)->ready_idl == !((du)->state == DLU_IDL)\
+  )
+
+
+// Updates the position of a user in queue_ready. Should be called whenever
+// the state, the queue, or the priority of a file in the queue of the user
+// has changed, or when the user came online.
+// A user is in queue_ready when dl_queue_start_istarget() would be true if
+// dl->allbusy was ignored, keyed by its highest-priority enabled file. Since
+// all other files of the user have a lower priority, this key is an upper
+// bound on the actual priority of the user, which dl_queue_start_do() checks
+// when it gets to this user. Going offline is also only noticed at that
+// point. Users that dl_queue_start_do() finds to have only busy files are left
+// out until any of these changes, or until dl_queue_busy_clear() is called for
+// one of their files.
+static void dl_queue_ready_update(dl_user_t *du) {
+  dl_user_dl_t *dud = NULL;
+  if(du->state == DLU_NCO || du->state == DLU_IDL) {
+    GSequenceIter *i = g_sequence_get_begin_iter(du->queue);
+    dud = g_sequence_iter_is_end(i) ? NULL : g_sequence_get(i);
+    if(dud && !dl_user_dl_enabled(dud))
+      dud = NULL;
+  }
+  if(dud && du->state == DLU_NCO) {
+    hub_user_t *u = g_hash_table_lookup(hub_uids, &du->uid);
+    if(!u || !u->hub->nick_valid)
+      dud = NULL;
+  }
+
+  if(du->ready && dud && dl_queue_ready_iskey(du, dud))
+    return;
+  dl_queue_ready_remove(du);
+  if(dud)
+    dl_queue_ready_insert(du, dud);
 }
 
 
 // Initiates a new connection to a user or requests a file from an already
-// connected user, based on the current state of dl_user and dl structs.  This
-// function is relatively slow, so is executed from a timeout to bulk-check
-// everything after some state variables have changed. Should not be called
-// directly, use dl_queue_start() instead.
+// connected user, in the order of queue_ready. This is executed from a
+// timeout to bulk-check everything after some state variables have changed.
+// Should not be called directly, use dl_queue_start() instead.
 static gboolean dl_queue_start_do(gpointer dat) {
-  int freeslots = var_get_int(0, VAR_download_slots);
-
-  // Walk through all users in the queue and:
-  // - determine possible targets to connect to or to start a transfer from
-  // - determine the highest-priority target
-  // - calculate freeslots
-  GPtrArray *targets = g_ptr_array_new();
-  dl_user_t *du, *target = NULL;
-  int target_i = 0;
-  GHashTableIter iter;
-  g_hash_table_iter_init(&iter, queue_users);
-  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du)) {
-    if(du->state == DLU_ACT)
-      freeslots--;
-    if(dl_queue_start_istarget(du)) {
-      if(!target || dl_queue_start_cmp(target, du) > 0) {
-        target_i = targets->len;
-        target = du;
+  int freeslots = var_get_int(0, VAR_download_slots) - queue_active;
+  GSList *skipped = NULL;
+
+  while(freeslots > 0 && !g_sequence_iter_is_end(g_sequence_get_begin_iter(queue_ready))) {
+    dl_user_t *du = g_sequence_get(g_sequence_get_begin_iter(queue_ready));
+    dl_queue_ready_remove(du);
+
+    // Not a target at the moment. It will be added again when its state
+    // changes or, if that's only because all of its files are busy, when one
+    // of them becomes available. Connected users are an exception and are
+    // tried again next time, since the endgame may let them take over a busy
+    // file at any point.
+    if(!dl_queue_start_istarget(du)) {
+      if(du->state == DLU_IDL) {
+        dl_queue_ready_update(du);
+        if(du->ready) {
+          dl_queue_ready_remove(du);
+          skipped = g_slist_prepend(skipped, du);
+        }
       }
-      g_ptr_array_add(targets, du);
+      continue;
     }
-  }
 
-  // Try to connect to the previously found highest-priority target, then go
-  // through the list again to eliminate any users that may not be a target
-  // anymore and to fetch a new highest-priority target.
-  while(freeslots > 0 && target) {
-    if(dl_queue_start_user(target) && !--freeslots)
-      break;
-    g_ptr_array_remove_index_fast(targets, target_i);
-
-    int i = 0;
-    target = NULL;
-    while(i < targets->len) {
-      du = g_ptr_array_index(targets, i);
-      if(!dl_queue_start_istarget(du))
-        g_ptr_array_remove_index_fast(targets, i);
-      else {
-        if(!target || dl_queue_start_cmp(target, du) > 0) {
-          target_i = i;
-          target = du;
-        }
-        i++;
-      }
+    // The file that we'd actually download may have a lower priority than
+    // the key. In that case, put the user back at its real position.
+    dl_user_dl_t *dud = dl_user_getdl(du);
+    if(!dl_queue_ready_iskey(du, dud)) {
+      dl_queue_ready_insert(du, dud);
+      continue;
     }
+
+    if(dl_queue_start_user(du))
+      freeslots--;
   }
 
-  g_ptr_array_unref(targets);
+  GSList *l;
+  for(l=skipped; l; l=l->next)
+    dl_queue_ready_update(l->data);
+  g_slist_free(skipped);
 
   // Reset this value *after* performing all the checks and starts, to ignore
   // any dl_queue_start() calls while this function was working - this function
@@ -498,6 +601,17 @@ void dl_queue_start() {
 }
 
 
+// Called by dlfile.c when dl->allbusy has been cleared. Puts the users of this
+// file back in queue_ready, in case dl_queue_start_do() left them out because
+// all of their files were busy.
+void dl_queue_busy_clear(dl_t *dl) {
+  int i;
+  for(i=0; i<dl->u->len; i++)
+    dl_queue_ready_update(((dl_user_dl_t *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u);
+  dl_queue_start();
+}
+
+
 
 
 
@@ -593,41 +707,6 @@ static gboolean dl_queue_addfile(guint64 uid, char *hash, guint64 size, char *fn
 }
 
 
-// Recursively adds a file or directory to the queue. *excl will only be
-// checked for files in subdirectories, if *fl is a file it will always be
-// added.
-void dl_queue_add_fl(guint64 uid, fl_list_t *fl, char *base, GRegex *excl) {
-  // check excl
-  if(base && excl && g_regex_match(excl, fl->name, 0, NULL)) {
-    ui_mf(NULL, 0, "Ignoring `%s': excluded by regex.", fl->name);
-    return;
-  }
-  {
-    // don't download already shared files if download_shared is set to false.
-    GSList *localfl = fl_local_from_tth(fl->tth);
-    if(!var_get_bool(0, VAR_download_shared) && fl->hastth && localfl && localfl->data) {
-      fl_list_t *localf = localfl->data;
-      ui_mf(NULL, 0, "Ignoring `%s' : already shared as `%s'", fl->name, localf->name);
-      return;
-    }
-  }
-
-
-  char *name = base ? g_build_filename(base, fl->name, NULL) : g_strdup(fl->name);
-  if(fl->isfile) {
-    if(!dl_queue_addfile(uid, fl->tth, fl->size, name))
-      ui_mf(NULL, 0, "Ignoring `%s': already queued.", name);
-  } else {
-    int i;
-    for(i=0; i<fl->sub->len; i++)
-      dl_queue_add_fl(uid, g_ptr_array_index(fl->sub, i), name, excl);
-  }
-  if(!base)
-    ui_mf(NULL, 0, "%s added to queue.", name);
-  g_free(name);
-}
-
-
 // Add a search result to the queue. (Only for files)
 void dl_queue_add_res(search_r_t *r) {
   char *name = strrchr(r->file, '/');
@@ -662,23 +741,212 @@ int dl_queue_matchfile(guint64 uid, char *tth) {
 }
 
 
-// Recursively walks through the file list and adds the user to matching dl
-// items. Returns the number of items found, and the number of items for which
-// the user was added is stored in *added (should be initialized to zero).
-int dl_queue_match_fl(guint64 uid, fl_list_t *fl, int *added) {
-  if(fl->isfile && fl->hastth) {
-    int r = dl_queue_matchfile(uid, fl->tth);
-    if(r == 1)
-      (*added)++;
-    return r >= 0 ? 1 : 0;
+// Recursive queueing and matching of file lists. Walking through a large list
+// and adding every file to the queue can take a while, so this is done as a
+// background job: a worker thread walks through (a copy of) the list and
+// passes the files on to the main thread in batches, where they are merged
+// into the queue. Each batch is written to the database in a single
+// transaction. Jobs are processed one after another, in the order in which
+// they have been created.
 
-  } else {
-    int n = 0;
-    int i;
-    for(i=0; i<fl->sub->len; i++)
-      n += dl_queue_match_fl(uid, g_ptr_array_index(fl->sub, i), added);
-    return n;
+#define DL_FLJOB_BATCH 1000
+
+typedef struct dl_fljob_t {
+  guint64 uid;
+  fl_list_t *fl;  // owned by the job, freed by the worker thread
+  GRegex *excl;
+  char *user;     // for the final message of match jobs, may be NULL
+  gboolean match;
+  // The following are only accessed from the main thread
+  guint64 size;
+  guint64 donesize;
+  int files;
+  int found;
+  int added;
+} dl_fljob_t;
+
+typedef struct dl_fljob_file_t {
+  char tth[24];
+  gboolean hastth;
+  guint64 size;
+  char *name; // NULL for match jobs
+} dl_fljob_file_t;
+
+typedef struct dl_fljob_batch_t {
+  dl_fljob_t *job;
+  GArray *files;
+  guint64 skipped; // size of the items that have been skipped by the worker
+  gboolean last;
+} dl_fljob_batch_t;
+
+static GThreadPool *dl_fljob_pool = NULL;
+static GSList *dl_fljobs = NULL;
+
+
+static dl_fljob_batch_t *dl_fljob_batch_new(dl_fljob_t *j) {
+  dl_fljob_batch_t *b = g_slice_new0(dl_fljob_batch_t);
+  b->job = j;
+  b->files = g_array_sized_new(FALSE, FALSE, sizeof(dl_fljob_file_t), DL_FLJOB_BATCH);
+  return b;
+}
+
+
+static void dl_fljob_free(dl_fljob_t *j) {
+  dl_fljobs = g_slist_remove(dl_fljobs, j);
+  if(j->excl)
+    g_regex_unref(j->excl);
+  g_free(j->user);
+  g_slice_free(dl_fljob_t, j);
+}
+
+
+// Called from the main thread for every batch.
+static gboolean dl_fljob_merge(gpointer dat) {
+  dl_fljob_batch_t *b = dat;
+  dl_fljob_t *j = b->job;
+  gboolean shared = var_get_bool(0, VAR_download_shared);
+  fl_list_t *localf;
+  int i;
+
+  db_dl_batch_begin();
+  for(i=0; i<b->files->len; i++) {
+    dl_fljob_file_t *f = &g_array_index(b->files, dl_fljob_file_t, i);
+    j->files++;
+    j->donesize += f->size;
+    if(j->match) {
+      int r = dl_queue_matchfile(j->uid, f->tth);
+      if(r >= 0)
+        j->found++;
+      if(r == 1)
+        j->added++;
+      continue;
+    }
+    // don't download already shared files if download_shared is set to false.
+    if(!shared && f->hastth && (localf = fl_local_from_tth(f->tth)))
+      ui_mf(NULL, 0, "Ignoring `%s' : already shared as `%s'", f->name, localf->name);
+    else if(!dl_queue_addfile(j->uid, f->tth, f->size, f->name))
+      ui_mf(NULL, 0, "Ignoring `%s': already queued.", f->name);
+    g_free(f->name);
+  }
+  db_dl_batch_end();
+  j->donesize += b->skipped;
+
+  if(b->last) {
+    if(!j->match)
+      ui_mf(NULL, 0, "%s added to queue.", j->user);
+    else if(j->user)
+      ui_mf(NULL, 0, "Matched queue for %s: %d files, %d new.", j->user, j->found, j->added);
+    else
+      ui_mf(NULL, 0, "Matched %d files, %d new.", j->found, j->added);
+    dl_fljob_free(j);
   }
+  g_array_free(b->files, TRUE);
+  g_slice_free(dl_fljob_batch_t, b);
+  return FALSE;
+}
+
+
+static void dl_fljob_push(dl_fljob_batch_t *b) {
+  g_idle_add_full(G_PRIORITY_LOW, dl_fljob_merge, b, NULL);
+}
+
+
+// Recursively walks through the list and adds the files to the current batch.
+// *excl will only be checked for files in subdirectories, if *fl is a file it
+// will always be added.
+static void dl_fljob_walk(dl_fljob_t *j, dl_fljob_batch_t **b, fl_list_t *fl, const char *base) {
+  if(j->excl && base && g_regex_match(j->excl, fl->name, 0, NULL)) {
+    ui_mf(NULL, 0, "Ignoring `%s': excluded by regex.", fl->name);
+    (*b)->skipped += fl->size;
+    return;
+  }
+
+  if(fl->isfile) {
+    if(j->match && !fl->hastth) {
+      (*b)->skipped += fl->size;
+      return;
+    }
+    dl_fljob_file_t f;
+    memcpy(f.tth, fl->tth, 24);
+    f.hastth = fl->hastth;
+    f.size = fl->size;
+    f.name = j->match ? NULL : base ? g_build_filename(base, fl->name, NULL) : g_strdup(fl->name);
+    g_array_append_val((*b)->files, f);
+    if((*b)->files->len >= DL_FLJOB_BATCH) {
+      dl_fljob_push(*b);
+      *b = dl_fljob_batch_new(j);
+    }
+    return;
+  }
+
+  char *name = j->match ? NULL : base ? g_build_filename(base, fl->name, NULL) : g_strdup(fl->name);
+  int i;
+  for(i=0; i<fl->sub->len; i++)
+    dl_fljob_walk(j, b, g_ptr_array_index(fl->sub, i), name);
+  g_free(name);
+}
+
+
+static void dl_fljob_thread(gpointer dat, gpointer udat) {
+  dl_fljob_t *j = dat;
+  dl_fljob_batch_t *b = dl_fljob_batch_new(j);
+  dl_fljob_walk(j, &b, j->fl, NULL);
+  fl_list_free(j->fl);
+  j->fl = NULL;
+  b->last = TRUE;
+  dl_fljob_push(b);
+}
+
+
+static void dl_fljob_start(guint64 uid, fl_list_t *fl, GRegex *excl, char *user, gboolean match) {
+  dl_fljob_t *j = g_slice_new0(dl_fljob_t);
+  j->uid = uid;
+  j->fl = fl;
+  j->excl = excl ? g_regex_ref(excl) : NULL;
+  j->user = user;
+  j->match = match;
+  j->size = fl->size;
+  dl_fljobs = g_slist_append(dl_fljobs, j);
+  if(!dl_fljob_pool)
+    dl_fljob_pool = g_thread_pool_new(dl_fljob_thread, NULL, 1, FALSE, NULL);
+  g_thread_pool_push(dl_fljob_pool, j, NULL);
+}
+
+
+// Recursively adds a file or directory to the queue. *excl will only be
+// checked for files in subdirectories, if *fl is a file it will always be
+// added. The list is copied, so the caller can free it right away.
+void dl_queue_add_fl(guint64 uid, fl_list_t *fl, GRegex *excl) {
+  dl_fljob_start(uid, fl_list_copy(fl), excl, g_strdup(fl->name), FALSE);
+}
+
+
+// Adds the user to all dl items that are present in the file list. Ownership
+// of the list is passed to this function if own is set, otherwise it is
+// copied. The results are reported in a message, user is used to describe the
+// user in that message (if not NULL).
+void dl_queue_match_fl(guint64 uid, fl_list_t *fl, gboolean own, const char *user) {
+  dl_fljob_start(uid, own ? fl : fl_list_copy(fl), NULL, g_strdup(user), TRUE);
+}
+
+
+// Returns the number of file list jobs that are still in progress. The number
+// of files processed so far and the total progress (0-100) are stored in
+// *files and *pct.
+int dl_queue_fl_progress(int *files, int *pct) {
+  guint64 size = 0, done = 0;
+  int n = 0;
+  GSList *l;
+  *files = 0;
+  for(l=dl_fljobs; l; l=l->next) {
+    dl_fljob_t *j = l->data;
+    size += j->size;
+    done += j->donesize;
+    *files += j->files;
+    n++;
+  }
+  *pct = size ? MIN(100, done*100/size) : 0;
+  return n;
 }
 
 
@@ -699,10 +967,10 @@ void dl_queue_rm(dl_t *dl) {
     g_hash_table_remove(dl_queue, dl->hash);
   }
 
-  // Don't do anything else if there is still an active downloading thread.
-  // Wait until all threads stop this function is called again to actually free
-  // and remove the stuff.
-  if(dl->active_threads)
+  // Don't do anything else if there is still an active downloading thread, a
+  // block being verified or a bitmap flush in progress. Wait until all threads
+  // stop this function is called again to actually free and remove the stuff.
+  if(dl->active_threads || dl->verifying || dl->bitmap_flushing)
     return;
 
   // remove from the database
@@ -728,9 +996,11 @@ void dl_queue_setprio(dl_t *dl, signed char prio) {
   int i;
   for(i=0; i<dl->u->len; i++)
     g_sequence_sort_changed(g_ptr_array_index(dl->u, i), dl_user_dl_sort, NULL);
+  for(i=0; i<dl->u->len; i++)
+    dl_queue_ready_update(((dl_user_dl_t *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u);
   // Start downloading or re-attempt finalization if it is enabled
   if(enabled) {
-    if(!dl->active_threads && (dl->hassize || !dl->islist) && dl->have == dl->size)
+    if(!dl->active_threads && !dl->verifying && !dl->bitmap_flushing && (dl->hassize || !dl->islist) && dl->have == dl->size)
       dlfile_finished(dl);
     else
       dl_queue_start();
@@ -788,6 +1058,8 @@ void dl_queue_setuerr(guint64 uid, char *tth, char e, const char *emsg) {
     g_sequence_sort(du->queue, dl_user_dl_sort, NULL);
   }
 
+  dl_queue_ready_update(du);
+
   // update DB
   db_dl_setuerr(uid, tth, e, emsg);
 
@@ -910,6 +1182,9 @@ void dl_settthl(guint64 uid, char *tth, char *tthl, int len) {
   db_dl_settthl(tth, tthl, newlen);
   dl->hastthl = TRUE;
   dl->hash_block = bs;
+  // No downloading threads can be active yet, so no need for the lock.
+  dl->tthl = g_memdup(tthl, newlen);
+  dl->tthl_len = newlen;
 }
 
 
@@ -954,6 +1229,7 @@ void dl_load_dlu(const char *tth, guint64 uid, char error, const char *error_msg
 
 void dl_init_global() {
   queue_users = g_hash_table_new(g_int64_hash, g_int64_equal);
+  queue_ready = g_sequence_new(NULL);
   dl_queue = g_hash_table_new(g_int_hash, tiger_hash_equal);
   // load stuff from the database
   db_dl_getdls(dl_load_dl);
@@ -24,6 +24,9 @@
 */
 
 
+// For fallocate()
+#define _GNU_SOURCE
+
 #include "ncdc.h"
 #include "dlfile.h"
 
@@ -49,17 +52,36 @@
  * Must be a power of two and less than or equal to DL_MINBLOCKSIZE */
 #define DLFILE_CHUNKSIZE (128*1024)
 
+/* Size of the per-thread write buffer when download_prealloc is enabled.
+ * Buffers are flushed at offsets aligned to this size, at the end of each
+ * block and when the thread stops. A thread uses up to two of them, one being
+ * filled and one being written. Must be a multiple of DLFILE_CHUNKSIZE. */
+#define DLFILE_WBUFSIZE (4*1024*1024)
+
 
 /* For file lists (dl->islist), only len and chunk are used. The other fields
  * aren't used because no length of TTH info is known before downloading. */
 struct dlfile_thread_t {
   dl_t *dl;
-  tth_ctx_t hash_tth;
+  GSequenceIter *iter; /* Position in dl->threads */
   guint32 allocated; /* Number of remaining chunks allocated to this thread (including current) */
   guint32 avail;     /* Number of undownloaded chunks in and after this thread (including current & allocated) */
   guint32 chunk;     /* Current chunk number */
+  guint32 start;     /* Chunk number when the thread was added to dl->threads, never modified */
   guint32 len;       /* Number of bytes downloaded into this chunk */
   gboolean busy;     /* Whether this thread is being used */
+  /* Write buffer, only used while busy and with download_prealloc. Chunks are
+   * marked in the bitmap once they have been flushed to the file. */
+  char *wbuf;
+  guint32 wlen;
+  guint64 woff;
+  /* Set while a previous buffer is being written by the write worker, which
+   * leaves it in wspare when done. Protected by dlfile_wbuf_lock. */
+  gboolean wpend;
+  char *wspare;
+  /* Start of the current segment, to measure the speed of the source */
+  guint64 segoff;
+  double segtime;
   /* Fields for deferred error reporting */
   guint64 uid;
   char *err_msg, *uerr_msg;
@@ -69,6 +91,21 @@ struct dlfile_thread_t {
 #endif
 
 
+/* Time constant of the smoothed per-user download speed, in seconds. */
+#define DLFILE_SPEED_TIME 60.0
+
+/* Minimum duration of a segment before its own progress is used to estimate
+ * the speed of the source, in seconds. */
+#define DLFILE_SPEED_MINTIME 10
+
+/* Endgame: When all blocks have been allocated, the end of a busy segment is
+ * handed to an idle source if that source is at least DLFILE_ENDGAME_RATIO
+ * times faster and the segment is expected to take at least
+ * DLFILE_ENDGAME_MINTIME more seconds. */
+#define DLFILE_ENDGAME_RATIO 2
+#define DLFILE_ENDGAME_MINTIME 30
+
+
 static guint32 dlfile_chunks(guint64 size) {
   return (size+DLFILE_CHUNKSIZE-1)/DLFILE_CHUNKSIZE;
 }
@@ -81,12 +118,114 @@ static gboolean dlfile_hasfreeblock(dlfile_thread_t *t) {
 }
 
 
+static double dlfile_now() {
+  GTimeVal tv;
+  g_get_current_time(&tv);
+  return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+
+/* Ordering of dl->threads: Idle threads come first, largest first, followed by
+ * the busy threads with the most unallocated chunks. Ties are broken by the
+ * start chunk. Unlike t->chunk, which dlfile_recv() advances without
+ * re-sorting, this key never changes while the thread is in the sequence, so
+ * the ordering stays consistent. Note that the ordering of a busy thread
+ * doesn't change while it is downloading, since allocated and avail are
+ * decremented together. */
+static gint dlfile_thread_cmp(gconstpointer a, gconstpointer b, gpointer dat) {
+  const dlfile_thread_t *x = a;
+  const dlfile_thread_t *y = b;
+  guint32 fx = x->busy ? x->avail - x->allocated : x->avail;
+  guint32 fy = y->busy ? y->avail - y->allocated : y->avail;
+  return
+    !x->busy != !y->busy ? (x->busy ? 1 : -1) :
+    fx != fy ? (fx > fy ? -1 : 1) :
+    x->start < y->start ? -1 : x->start > y->start ? 1 : 0;
+}
+
+
+/* Must be called while the lock is held when dl->active_threads may be >0 */
+static void dlfile_thread_add(dl_t *dl, dlfile_thread_t *t) {
+  if(!dl->threads)
+    dl->threads = g_sequence_new(NULL);
+  t->start = t->chunk;
+  t->iter = g_sequence_insert_sorted(dl->threads, t, dlfile_thread_cmp, NULL);
+}
+
+
+/* To be called after modifying the busy, allocated or avail fields. Same
+ * locking requirements as above. */
+static void dlfile_thread_changed(dlfile_thread_t *t) {
+  g_sequence_sort_changed(t->iter, dlfile_thread_cmp, NULL);
+}
+
+
+/* Same locking requirements as above. Does not free the thread. */
+static void dlfile_thread_remove(dlfile_thread_t *t) {
+  dl_t *dl = t->dl;
+  g_sequence_remove(t->iter);
+  t->iter = NULL;
+  if(g_sequence_iter_is_end(g_sequence_get_begin_iter(dl->threads))) {
+    g_sequence_free(dl->threads);
+    dl->threads = NULL;
+  }
+}
+
+
+/* Returns the idle thread with the most available chunks or, if all threads
+ * are busy, the busy thread with the most unallocated chunks that still has a
+ * free block to split off. Returns NULL if all blocks have been allocated.
+ * Thanks to the ordering this usually only looks at the first thread, only
+ * the last block in the file may require looking further.
+ * Must be called while the lock is held. */
+static dlfile_thread_t *dlfile_thread_free(dl_t *dl) {
+  if(!dl->threads)
+    return NULL;
+  GSequenceIter *i = g_sequence_get_begin_iter(dl->threads);
+  for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i)) {
+    dlfile_thread_t *t = g_sequence_get(i);
+    if(!t->busy)
+      return t;
+    if(t->avail == t->allocated)
+      break;
+    if(dlfile_hasfreeblock(t))
+      return t;
+  }
+  return NULL;
+}
+
+
+/* Estimated speed of the source of a busy thread, in bytes/s. Uses the
+ * progress of the current segment once it has been running for a while, and
+ * the smoothed speed of the user before that.
+ * Must be called while the lock is held. */
+static guint64 dlfile_thread_speed(dlfile_thread_t *t, double now) {
+  double elapsed = now - t->segtime;
+  if(elapsed < DLFILE_SPEED_MINTIME)
+    return dl_user_getspeed(t->uid);
+  return (((guint64)t->chunk * DLFILE_CHUNKSIZE + t->len) - t->segoff) / elapsed;
+}
+
+
+/* Update the smoothed speed of the user with the speed of the segment that has
+ * just finished. */
+static void dlfile_thread_speedupdate(dlfile_thread_t *t) {
+  double elapsed = dlfile_now() - t->segtime;
+  if(elapsed < 1)
+    return;
+  double rate = (((guint64)t->chunk * DLFILE_CHUNKSIZE + t->len) - t->segoff) / elapsed;
+  double old = dl_user_getspeed(t->uid);
+  double a = 1.0 - exp(-elapsed / DLFILE_SPEED_TIME);
+  dl_user_setspeed(t->uid, old ? old + (rate-old)*a : rate);
+}
+
+
 /* Highly verbose debugging function. Prints out a list of threads for a particular dl item. */
 static void dlfile_threaddump(dl_t *dl, int n) {
 #if 0
-  GSList *l;
-  for(l=dl->threads; l; l=l->next) {
-    dlfile_thread_t *ti = l->data;
+  GSequenceIter *i = g_sequence_get_begin_iter(dl->threads);
+  for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i)) {
+    dlfile_thread_t *ti = g_sequence_get(i);
     g_debug("THREAD DUMP#%p.%d: busy = %d, chunk = %u, allocated = %u, avail = %u", dl, n, ti->busy, ti->chunk, ti->allocated, ti->avail);
   }
 #endif
@@ -100,7 +239,9 @@ static void dlfile_fatal_load_error(dl_t *dl, const char *op, const char *err) {
 }
 
 
-/* Must be called while the lock is held when dl->active_threads may be >0 */
+/* Writes out the full bitmap. Used when creating or loading the file, later
+ * modifications are written with dlfile_bitmap_flush_timeout().
+ * Must be called while the lock is held when dl->active_threads may be >0 */
 static gboolean dlfile_save_bitmap(dl_t *dl, int fd) {
   guint8 *buf = dl->bitmap;
   off_t off = dl->size;
@@ -113,31 +254,187 @@ static gboolean dlfile_save_bitmap(dl_t *dl, int fd) {
     off += r;
     buf += r;
   }
+  g_free(dl->bitmap_dirty);
+  dl->bitmap_dirty = NULL;
   return TRUE;
 }
 
 
-static gboolean dlfile_save_bitmap_timeout(gpointer dat) {
-  dl_t *dl = dat;
+/* Bitmap persistence
+ *
+ * Modifications to the bitmap are tracked in pages of DLFILE_BITMAP_PAGE
+ * bytes (dl->bitmap_dirty), and all dl items with modifications are flushed
+ * together in a single timed pass. Only the modified pages are written.
+ * To make sure that a bit never ends up on disk before the data it refers
+ * to, a bit is only set after its data has been written, and the incoming
+ * file is synced before writing the bitmap pages that were modified before
+ * the sync.
+ * The timed pass only copies the modified pages in the main thread; syncing
+ * and writing is done by a single worker thread, so that flushes of the same
+ * file are never reordered. While a flush is in progress
+ * (dl->bitmap_flushing > 0), the dl item and its incfd are kept around as if
+ * a downloading thread was still active. */
+
+#define DLFILE_BITMAP_PAGE 512
+
+static GStaticMutex dlfile_flush_lock = G_STATIC_MUTEX_INIT;
+static GSList *dlfile_flush_list = NULL; /* dl_t items with bitmap_queued set */
+static guint dlfile_flush_src = 0;
+
+typedef struct dlfile_flush_t {
+  dl_t *dl;
+  GPtrArray *pages;  /* GByteArray copies of the modified pages */
+  GArray *offs;      /* guint32 offset of each page within the bitmap */
+  int err;           /* errno of a failed sync or write, 0 on success */
+} dlfile_flush_t;
+
+static GThreadPool *dlfile_flush_pool = NULL;
+
+static void dlfile_idle(dl_t *dl);
+
+
+/* Copies the modified pages of the bitmap. Returns NULL if there are none.
+ * Must be called from the main thread without the lock held. */
+static dlfile_flush_t *dlfile_bitmap_copy(dl_t *dl) {
+  guint32 size = bita_size(dlfile_chunks(dl->size));
+  guint32 npages = (size+DLFILE_BITMAP_PAGE-1)/DLFILE_BITMAP_PAGE;
+  guint32 i;
+  dlfile_flush_t *f = g_slice_new0(dlfile_flush_t);
+  f->dl = dl;
+  f->pages = g_ptr_array_new();
+  f->offs = g_array_new(FALSE, FALSE, sizeof(guint32));
+
   g_static_mutex_lock(&dl->lock);
-  dl->bitmap_src = 0;
-  if(dl->incfd > 0 && !dlfile_save_bitmap(dl, dl->incfd)) {
-    g_warning("Error writing bitmap for `%s': %s.", dl->dest, g_strerror(errno));
-    dl_queue_seterr(dl, DLE_IO_INC, g_strerror(errno));
-  }
-  if(dl->incfd > 0 && !dl->active_threads) {
-    close(dl->incfd);
-    dl->incfd = 0;
+  for(i=0; dl->bitmap_dirty && i<npages; i++) {
+    if(!bita_get(dl->bitmap_dirty, i))
+      continue;
+    /* Coalesce adjacent pages into a single write */
+    guint32 end = i+1;
+    while(end < npages && bita_get(dl->bitmap_dirty, end))
+      end++;
+    guint32 off = i*DLFILE_BITMAP_PAGE;
+    guint32 len = MIN(end*DLFILE_BITMAP_PAGE, size) - off;
+    i = end-1;
+    GByteArray *page = g_byte_array_sized_new(len);
+    g_byte_array_append(page, dl->bitmap+off, len);
+    g_ptr_array_add(f->pages, page);
+    g_array_append_val(f->offs, off);
   }
+  g_free(dl->bitmap_dirty);
+  dl->bitmap_dirty = NULL;
   g_static_mutex_unlock(&dl->lock);
+
+  if(!f->pages->len) {
+    g_ptr_array_free(f->pages, TRUE);
+    g_array_free(f->offs, TRUE);
+    g_slice_free(dlfile_flush_t, f);
+    return NULL;
+  }
+  return f;
+}
+
+
+static gboolean dlfile_bitmap_flush_done(gpointer dat) {
+  dlfile_flush_t *f = dat;
+  dl_t *dl = f->dl;
+  dl->bitmap_flushing--;
+
+  if(f->err && g_hash_table_lookup(dl_queue, dl->hash)) {
+    g_warning("Error writing bitmap for `%s': %s.", dl->dest, g_strerror(f->err));
+    dl_queue_seterr(dl, DLE_IO_INC, g_strerror(f->err));
+  }
+
+  guint32 i;
+  for(i=0; i<f->pages->len; i++)
+    g_byte_array_free(g_ptr_array_index(f->pages, i), TRUE);
+  g_ptr_array_free(f->pages, TRUE);
+  g_array_free(f->offs, TRUE);
+  g_slice_free(dlfile_flush_t, f);
+  dlfile_idle(dl);
   return FALSE;
 }
 
 
-/* Must be called while dl->lock is held. */
-static void dlfile_save_bitmap_defer(dl_t *dl) {
-  if(!dl->bitmap_src)
-    dl->bitmap_src = g_timeout_add_seconds(5, dlfile_save_bitmap_timeout, dl);
+/* Syncs the incoming file and writes the copied pages, in the flush thread. */
+static void dlfile_bitmap_flush_thread(gpointer dat, gpointer udat) {
+  dlfile_flush_t *f = dat;
+  dl_t *dl = f->dl;
+
+#ifdef HAVE_FDATASYNC
+  if(fdatasync(dl->incfd) < 0)
+#else
+  if(fsync(dl->incfd) < 0)
+#endif
+    f->err = errno;
+
+  guint32 i;
+  for(i=0; !f->err && i<f->pages->len; i++) {
+    GByteArray *page = g_ptr_array_index(f->pages, i);
+    guint8 *buf = page->data;
+    off_t off = dl->size + g_array_index(f->offs, guint32, i);
+    size_t left = page->len;
+    while(!f->err && left > 0) {
+      int w = pwrite(dl->incfd, buf, left, off);
+      if(w < 0)
+        f->err = errno;
+      else {
+        left -= w;
+        off += w;
+        buf += w;
+      }
+    }
+  }
+
+  g_idle_add(dlfile_bitmap_flush_done, f);
+}
+
+
+static gboolean dlfile_bitmap_flush_timeout(gpointer dat) {
+  g_static_mutex_lock(&dlfile_flush_lock);
+  GSList *l, *list = dlfile_flush_list;
+  dlfile_flush_list = NULL;
+  dlfile_flush_src = 0;
+  /* bitmap_queued is cleared while the flush lock is held, so that new
+   * modifications will queue the dl item again. */
+  for(l=list; l; l=l->next)
+    ((dl_t *)l->data)->bitmap_queued = FALSE;
+  g_static_mutex_unlock(&dlfile_flush_lock);
+
+  if(!dlfile_flush_pool)
+    dlfile_flush_pool = g_thread_pool_new(dlfile_bitmap_flush_thread, NULL, 1, FALSE, NULL);
+
+  for(l=list; l; l=l->next) {
+    dl_t *dl = l->data;
+    dlfile_flush_t *f = dl->incfd > 0 ? dlfile_bitmap_copy(dl) : NULL;
+    if(f) {
+      dl->bitmap_flushing++;
+      g_thread_pool_push(dlfile_flush_pool, f, NULL);
+    } else if(dl->incfd > 0 && !dl->active_threads && !dl->verifying && !dl->bitmap_flushing && !dl->bitmap_queued) {
+      close(dl->incfd);
+      dl->incfd = 0;
+    }
+  }
+  g_slist_free(list);
+  return FALSE;
+}
+
+
+/* Sets or resets a bit in the bitmap and schedules it to be written.
+ * Must be called while dl->lock is held. */
+static void dlfile_bitmap_set(dl_t *dl, guint32 chunk, gboolean val) {
+  bita_val(dl->bitmap, chunk, val);
+  if(!dl->bitmap_dirty)
+    dl->bitmap_dirty = bita_new((bita_size(dlfile_chunks(dl->size))+DLFILE_BITMAP_PAGE-1)/DLFILE_BITMAP_PAGE);
+  bita_set(dl->bitmap_dirty, (chunk/8)/DLFILE_BITMAP_PAGE);
+
+  if(dl->bitmap_queued)
+    return;
+  g_static_mutex_lock(&dlfile_flush_lock);
+  dl->bitmap_queued = TRUE;
+  dlfile_flush_list = g_slist_prepend(dlfile_flush_list, dl);
+  if(!dlfile_flush_src)
+    dlfile_flush_src = g_timeout_add_seconds(5, dlfile_bitmap_flush_timeout, NULL);
+  g_static_mutex_unlock(&dlfile_flush_lock);
 }
 
 
@@ -215,37 +512,23 @@ static gboolean dlfile_load_bitmap(dl_t *dl, int fd) {
 }
 
 
-static dlfile_thread_t *dlfile_load_block(dl_t *dl, int fd, guint32 chunk, guint32 chunksinblock, guint32 *reset) {
+/* Chunks that have already been downloaded are skipped. The block will be
+ * hashed in full (from the file) once the remaining chunks have arrived. */
+static dlfile_thread_t *dlfile_load_block(dl_t *dl, guint32 chunk, guint32 chunksinblock, guint32 *reset) {
   dlfile_thread_t *t = g_slice_new0(dlfile_thread_t);
   t->dl = dl;
   t->chunk = chunk;
   t->avail = chunksinblock;
-  tth_init(&t->hash_tth);
-
-  char *bufp = malloc(DLFILE_CHUNKSIZE);
 
   *reset = chunksinblock;
   while(bita_get(dl->bitmap, t->chunk)) {
-    char *buf = bufp;
-    off_t off = (guint64)t->chunk * DLFILE_CHUNKSIZE;
-    size_t left = DLFILE_CHUNKSIZE;
-    while(left > 0) {
-      int r = pread(fd, buf, left, off);
-      if(r <= 0)
-        dlfile_fatal_load_error(dl, "read from", NULL);
-      off -= r;
-      left -= r;
-      buf += r;
-    }
-    tth_update(&t->hash_tth, bufp, DLFILE_CHUNKSIZE);
     t->chunk++;
     t->avail--;
     dl->have += DLFILE_CHUNKSIZE;
     (*reset)--;
   }
 
-  free(bufp);
-  dl->threads = g_slist_prepend(dl->threads, t);
+  dlfile_thread_add(dl, t);
   return t;
 }
 
@@ -254,7 +537,7 @@ static dlfile_thread_t *dlfile_load_block(dl_t *dl, int fd, guint32 chunk, guint
  * chunks. Threads are created in a TTHL-block-aligned fashion to ensure that
  * the downloading progress can continue from the threads while keeping the
  * integrity checks. */
-static gboolean dlfile_load_threads(dl_t *dl, int fd) {
+static gboolean dlfile_load_threads(dl_t *dl) {
   guint32 chunknum = dlfile_chunks(dl->size);
   guint32 chunksperblock = dl->hash_block / DLFILE_CHUNKSIZE;
   gboolean needsave = FALSE;
@@ -272,12 +555,13 @@ static gboolean dlfile_load_threads(dl_t *dl, int fd) {
 
     if(t && !bita_get(dl->bitmap, i)) {
       t->avail += chunksinblock;
+      dlfile_thread_changed(t);
       reset = chunksinblock;
     } else if(hasfullblock) {
       t = NULL;
       dl->have += dl->hash_block;
     } else
-      t = dlfile_load_block(dl, fd, i, chunksinblock, &reset);
+      t = dlfile_load_block(dl, i, chunksinblock, &reset);
 
     for(j=i+(chunksinblock-reset); j<i+chunksinblock; j++)
       if(bita_get(dl->bitmap, j)) {
@@ -320,7 +604,7 @@ void dlfile_load(dl_t *dl) {
   }
 
   gboolean needsave = dlfile_load_bitmap(dl, fd);
-  if(dlfile_load_threads(dl, fd))
+  if(dlfile_load_threads(dl))
     needsave = TRUE;
 
   if(needsave && !dlfile_save_bitmap(dl, fd))
@@ -334,10 +618,13 @@ void dlfile_load(dl_t *dl) {
 /* Called from dl.c when a dl item is being deleted, either from
  * dlfile_finished() or when the item is removed from the UI. */
 void dlfile_rm(dl_t *dl) {
-  g_return_if_fail(!dl->active_threads);
+  g_return_if_fail(!dl->active_threads && !dl->verifying && !dl->bitmap_flushing);
 
-  if(dl->bitmap_src)
-    g_source_remove(dl->bitmap_src);
+  if(dl->bitmap_queued) {
+    g_static_mutex_lock(&dlfile_flush_lock);
+    dlfile_flush_list = g_slist_remove(dlfile_flush_list, dl);
+    g_static_mutex_unlock(&dlfile_flush_lock);
+  }
 
   if(dl->incfd > 0)
     g_warn_if_fail(close(dl->incfd) == 0);
@@ -345,29 +632,234 @@ void dlfile_rm(dl_t *dl) {
   if(dl->inc)
     unlink(dl->inc);
 
-  GSList *l;
-  for(l=dl->threads; l; l=l->next)
-    g_slice_free(dlfile_thread_t, l->data);
-  g_slist_free(dl->threads);
+  if(dl->threads) {
+    GSequenceIter *i = g_sequence_get_begin_iter(dl->threads);
+    for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i))
+      g_slice_free(dlfile_thread_t, g_sequence_get(i));
+    g_sequence_free(dl->threads);
+  }
   g_free(dl->bitmap);
+  g_free(dl->bitmap_dirty);
+  g_free(dl->tthl);
 }
 
 
+/* Block verification
+ *
+ * Completed blocks are hashed and checked against the TTHL data by a pool of
+ * worker threads, so that the downloading threads only have to write the
+ * received data to the file. The block is read back from the incoming file,
+ * where it should still be in the page cache. While any block of a dl item is
+ * being verified (dl->verifying > 0), the dl item and its incfd are kept
+ * around as if a downloading thread was still active. The result is handled
+ * in the main thread; a block that fails verification is removed from the
+ * bitmap and gets a new thread, so that it will be downloaded again. */
+
+typedef struct dlfile_verify_t {
+  dl_t *dl;
+  guint64 uid;   /* User from whom the block was downloaded */
+  guint32 block;
+  gboolean ok;
+  char *err;     /* I/O error while reading the block */
+} dlfile_verify_t;
+
+static GThreadPool *dlfile_verify_pool = NULL;
+
+static gboolean dlfile_verify_done(gpointer dat);
+
+
+static void dlfile_verify_thread(gpointer dat, gpointer udat) {
+  dlfile_verify_t *v = dat;
+  dl_t *dl = v->dl;
+  guint64 off = (guint64)v->block * dl->hash_block;
+  guint64 len = MIN(dl->hash_block, dl->size - off);
+
+  tth_ctx_t tth;
+  tth_init(&tth);
+  char *buf = g_malloc(DLFILE_CHUNKSIZE);
+  guint64 o = off, left = len;
+  while(left > 0) {
+    int r = pread(dl->incfd, buf, MIN(left, DLFILE_CHUNKSIZE), o);
+    if(r <= 0) {
+      v->err = g_strdup(r < 0 ? g_strerror(errno) : "Unexpected end of file");
+      break;
+    }
+    tth_update(&tth, buf, r);
+    o += r;
+    left -= r;
+  }
+  g_free(buf);
+  fadv_oneshot(dl->incfd, off, len, VAR_FFC_DOWNLOAD);
+
+  if(!v->err) {
+    char leaf[24];
+    tth_final(&tth, leaf);
+    if(dl->size < dl->hash_block)
+      v->ok = memcmp(leaf, dl->hash, 24) == 0;
+    else {
+      /* Load the TTHL data on first use. It is not modified or freed while
+       * any verification is in progress, so doesn't need the lock after this. */
+      g_static_mutex_lock(&dl->lock);
+      char *tthl = dl->tthl;
+      int tthl_len = dl->tthl_len;
+      g_static_mutex_unlock(&dl->lock);
+      if(!tthl) {
+        tthl = db_dl_gettthl(dl->hash, &tthl_len);
+        g_static_mutex_lock(&dl->lock);
+        if(dl->tthl)
+          g_free(tthl);
+        else {
+          dl->tthl = tthl;
+          dl->tthl_len = tthl_len;
+        }
+        tthl = dl->tthl;
+        tthl_len = dl->tthl_len;
+        g_static_mutex_unlock(&dl->lock);
+      }
+      v->ok = tthl && (v->block+1)*24 <= tthl_len && memcmp(leaf, tthl+(v->block*24), 24) == 0;
+    }
+  }
+
+  g_idle_add(dlfile_verify_done, v);
+}
+
+
+/* Must be called while dl->lock is held. */
+static void dlfile_verify_queue(dlfile_thread_t *t, guint32 block) {
+  dlfile_verify_t *v = g_slice_new0(dlfile_verify_t);
+  v->dl = t->dl;
+  v->uid = t->uid;
+  v->block = block;
+  t->dl->verifying++;
+  g_thread_pool_push(dlfile_verify_pool, v, NULL);
+}
+
+
+/* Hash failure, remove the failed block from the bitmap and dl->have, and
+ * create a new thread so that the block can be re-downloaded. Must be called
+ * while dl->lock is held. */
+static void dlfile_verify_reset(dl_t *dl, guint32 block) {
+  guint32 chunksperblock = dl->hash_block / DLFILE_CHUNKSIZE;
+  guint32 startchunk = block * chunksperblock;
+  guint32 chunksinblock = MIN(chunksperblock, dlfile_chunks(dl->size) - startchunk);
+  dl->have -= MIN(dl->hash_block, dl->size - (guint64)startchunk * DLFILE_CHUNKSIZE);
+
+  guint32 i;
+  for(i=startchunk; i<startchunk+chunksinblock; i++)
+    dlfile_bitmap_set(dl, i, FALSE);
+
+  dlfile_thread_t *t = g_slice_new0(dlfile_thread_t);
+  t->dl = dl;
+  t->chunk = startchunk;
+  t->avail = chunksinblock;
+  dlfile_thread_add(dl, t);
+  dl->allbusy = FALSE;
+  dlfile_threaddump(dl, 4);
+}
+
+
+static gboolean dlfile_verify_done(gpointer dat) {
+  dlfile_verify_t *v = dat;
+  dl_t *dl = v->dl;
+  gboolean inqueue = !!g_hash_table_lookup(dl_queue, dl->hash);
+
+  g_static_mutex_lock(&dl->lock);
+  dl->verifying--;
+  if(!v->ok)
+    dlfile_verify_reset(dl, v->block);
+  g_static_mutex_unlock(&dl->lock);
+  if(!v->ok && inqueue)
+    dl_queue_busy_clear(dl);
+
+  if(!v->err) {
+    stats_inc(STATC_DL_VERIFIED);
+    if(!v->ok)
+      stats_inc(STATC_DL_HASHFAIL);
+  }
+
+  if(inqueue && v->err) {
+    g_warning("Error reading back block %u of `%s': %s.", v->block, dl->inc, v->err);
+    dl_queue_seterr(dl, DLE_IO_INC, v->err);
+  } else if(inqueue && !v->ok) {
+    guint32 chunksperblock = dl->hash_block / DLFILE_CHUNKSIZE;
+    char *msg = g_strdup_printf("Hash for block %u (chunk %u-%u) does not match.", v->block,
+      v->block*chunksperblock, MIN((v->block+1)*chunksperblock, dlfile_chunks(dl->size)));
+    dl_queue_setuerr(v->uid, dl->hash, DLE_HASH, msg);
+    g_free(msg);
+  }
+
+  g_free(v->err);
+  g_slice_free(dlfile_verify_t, v);
+  dlfile_idle(dl);
+  return FALSE;
+}
+
+
+/* Write buffers
+ *
+ * Full write buffers are written by a single worker thread, so that the
+ * network thread of a download only has to copy the data into the buffer. The
+ * worker marks the written chunks in the bitmap and, at the end of a block,
+ * queues the block for verification. The thread fills a second buffer in the
+ * meantime, and only waits for the worker when that one is full before the
+ * first has been written. When the transfer stops, the worker also writes
+ * what is left in the buffer and then hands the thread back to the main
+ * thread with dlfile_recv_finish(). */
+
+typedef struct dlfile_wbuf_t {
+  dlfile_thread_t *t;
+  char *buf;
+  guint32 len;
+  guint64 off;
+  gboolean verify; /* Whether to verify the block after writing */
+  guint32 block;
+  gboolean done;   /* Last buffer of the transfer, finish the thread after writing */
+} dlfile_wbuf_t;
+
+static GThreadPool *dlfile_wbuf_pool = NULL;
+static GStaticMutex dlfile_wbuf_lock = G_STATIC_MUTEX_INIT;
+static GCond *dlfile_wbuf_cond = NULL; /* Signalled when a buffer has been written */
+
+static void dlfile_wbuf_thread(gpointer dat, gpointer udat);
+static gboolean dlfile_recv_finish(gpointer dat);
+
+
 /* Create the inc file and initialize the necessary structs to prepare for
  * handling downloaded data. */
 static gboolean dlfile_open(dl_t *dl) {
+  // Opened for reading as well, to allow verification of the written blocks.
   if(dl->incfd <= 0)
-    dl->incfd = open(dl->inc, O_WRONLY|O_CREAT, 0666);
+    dl->incfd = open(dl->inc, O_RDWR|O_CREAT, 0666);
   if(dl->incfd < 0) {
     g_warning("Error opening %s: %s", dl->inc, g_strerror(errno));
     dl_queue_seterr(dl, DLE_IO_INC, g_strerror(errno));
     return FALSE;
   }
 
+  if(!dlfile_verify_pool) {
+    int n = sysconf(_SC_NPROCESSORS_ONLN);
+    dlfile_verify_pool = g_thread_pool_new(dlfile_verify_thread, NULL, MAX(n, 1), FALSE, NULL);
+    dlfile_wbuf_pool = g_thread_pool_new(dlfile_wbuf_thread, NULL, 1, FALSE, NULL);
+    dlfile_wbuf_cond = g_cond_new();
+  }
+
   /* Everything else has already been initialized if we have a thread or bitmap */
   if(dl->threads || dl->bitmap)
     return TRUE;
 
+  /* Allocate the full file in one go, so that parallel segments don't end up
+   * scattered over the disk. Not all filesystems support this, which is fine. */
+#ifdef HAVE_FALLOCATE
+  if(!dl->islist && var_get_bool(0, VAR_download_prealloc) && fallocate(dl->incfd, 0, 0, dl->size) < 0) {
+    if(errno == ENOSPC) {
+      g_warning("Error allocating space for `%s': %s.", dl->dest, g_strerror(errno));
+      dl_queue_seterr(dl, DLE_IO_INC, g_strerror(errno));
+      return FALSE;
+    }
+    g_debug("Can't preallocate `%s': %s.", dl->inc, g_strerror(errno));
+  }
+#endif
+
   if(!dl->islist) {
     dl->bitmap = bita_new(dlfile_chunks(dl->size));
     if(!dlfile_save_bitmap(dl, dl->incfd)) {
@@ -385,8 +877,7 @@ static gboolean dlfile_open(dl_t *dl) {
   t->allocated = 0;
   if(!dl->islist)
     t->avail = dlfile_chunks(dl->size);
-  tth_init(&t->hash_tth);
-  dl->threads = g_slist_prepend(dl->threads, t);
+  dlfile_thread_add(dl, t);
   return TRUE;
 }
 
@@ -396,6 +887,18 @@ void dlfile_finished(dl_t *dl) {
   if(dl->incfd <= 0 && !dlfile_open(dl))
     return;
 
+  if(var_get_bool(0, VAR_download_prealloc) &&
+#ifdef HAVE_FDATASYNC
+      fdatasync(dl->incfd) < 0
+#else
+      fsync(dl->incfd) < 0
+#endif
+      ) {
+    g_warning("Error syncing the incoming file for `%s': %s.", dl->dest, g_strerror(errno));
+    dl_queue_seterr(dl, DLE_IO_INC, g_strerror(errno));
+    return;
+  }
+
   /* Regular files: Remove bitmap from the file
    * File lists: Ensure that the file size is correct after we've downloaded a
    *   longer file list before that got interrupted. */
@@ -453,9 +956,64 @@ void dlfile_finished(dl_t *dl) {
 }
 
 
+/* Endgame: Looks for the busy thread that is expected to finish last, and
+ * that a source with the given speed could help out by downloading the end of
+ * its segment. The split point is chosen on a block boundary such that both
+ * sources would finish at about the same time. Returns NULL if there's no
+ * thread worth splitting. Must be called while the lock is held. */
+static dlfile_thread_t *dlfile_endgame_find(dl_t *dl, guint64 speed, guint32 *split) {
+  if(dl->islist || !dl->threads || !speed)
+    return NULL;
+
+  guint32 chunksinblock = dl->hash_block / DLFILE_CHUNKSIZE;
+  double now = dlfile_now();
+  double worst = DLFILE_ENDGAME_MINTIME;
+  dlfile_thread_t *victim = NULL;
+
+  GSequenceIter *i = g_sequence_get_begin_iter(dl->threads);
+  for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i)) {
+    dlfile_thread_t *t = g_sequence_get(i);
+    if(!t->busy || now - t->segtime < DLFILE_SPEED_MINTIME)
+      continue;
+    guint64 tspeed = dlfile_thread_speed(t, now);
+    if(speed < tspeed * DLFILE_ENDGAME_RATIO)
+      continue;
+
+    guint64 left = (guint64)t->avail * DLFILE_CHUNKSIZE - t->len;
+    double eta = tspeed ? (double)left / tspeed : G_MAXDOUBLE;
+    if(eta <= worst)
+      continue;
+
+    guint32 keep = ((double)t->avail * tspeed) / (tspeed + speed);
+    guint32 chunk = ((t->chunk + keep + chunksinblock - 1) / chunksinblock) * chunksinblock;
+    if(chunk <= t->chunk)
+      chunk += chunksinblock;
+    if(chunk >= t->chunk + t->avail)
+      continue;
+
+    worst = eta;
+    victim = t;
+    *split = chunk;
+  }
+  return victim;
+}
+
+
+/* Whether an idle source with the given speed would be given a part of a busy
+ * segment by dlfile_getchunk(), for when dl->allbusy is set. */
+gboolean dlfile_endgame(dl_t *dl, guint64 speed) {
+  guint32 split;
+  g_static_mutex_lock(&dl->lock);
+  gboolean r = !!dlfile_endgame_find(dl, speed, &split);
+  g_static_mutex_unlock(&dl->lock);
+  return r;
+}
+
+
 /* The 'speed' argument should be a pessimistic estimate of the peers' speed,
- * in bytes/s. I think this is best obtained from a 30 second average.
- * Returns the thread pointer. */
+ * in bytes/s. I think this is best obtained from a 30 second average. It is
+ * combined with the smoothed speed of previous segments from the same user.
+ * Returns the thread pointer, or NULL if there is nothing to download. */
 dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
   dlfile_thread_t *t = NULL;
   if(!dlfile_open(dl))
@@ -464,11 +1022,15 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
   /* File lists should always be downloaded in a single GET request because
    * their contents may be modified between subsequent requests. */
   if(dl->islist) {
-    t = dl->threads->data;
+    t = g_sequence_get(g_sequence_get_begin_iter(dl->threads));
     t->chunk = 0;
     t->len = 0;
     t->uid = uid;
     t->busy = TRUE;
+    t->segoff = 0;
+    t->segtime = dlfile_now();
+    if(var_get_bool(0, VAR_download_prealloc))
+      t->wbuf = g_malloc(DLFILE_WBUFSIZE);
     dl->hassize = FALSE;
     dl->have = 0;
     dl->allbusy = TRUE;
@@ -476,37 +1038,50 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
     return t;
   }
 
-  /* Walk through the threads and look for:
-   *      t = Thread with largest avail and with allocated = 0
-   *   tsec = Thread with an unallocated block and largest avail-allocated
-   */
-  dlfile_thread_t *tsec = NULL;
-  GSList *l;
+  speed = MAX(speed, dl_user_getspeed(uid));
+  guint32 chunksinblock = dl->hash_block/DLFILE_CHUNKSIZE;
 
   g_static_mutex_lock(&dl->lock);
   dlfile_threaddump(dl, 1);
-  for(l=dl->threads; l; l=l->next) {
-    dlfile_thread_t *ti = l->data;
-    if(ti->avail && (!tsec || ti->avail-ti->allocated > tsec->avail-tsec->allocated) && dlfile_hasfreeblock(ti))
-      tsec = ti;
-    if(!ti->busy && (!t || ti->avail > t->avail))
-      t = ti;
+
+  /* Use the largest idle thread, or split off a new thread from the busy
+   * thread with the largest unallocated range. The range is divided according
+   * to the speeds of both sources, so that they'd reach the split point at
+   * about the same time. Each source gets at least a quarter. */
+  guint32 chunk = 0, split = 0;
+  dlfile_thread_t *tsec = dlfile_thread_free(dl);
+  if(tsec && !tsec->busy)
+    t = tsec;
+  else if(tsec) {
+    guint64 tspeed = dlfile_thread_speed(tsec, dlfile_now());
+    double share = tspeed && speed ? CLAMP((double)tspeed / (tspeed + speed), 0.25, 0.75) : 0.5;
+    guint32 unalloc = tsec->avail - tsec->allocated;
+    chunk = ((tsec->chunk + tsec->allocated + (guint32)(unalloc*share)) / chunksinblock) * chunksinblock;
+    if(chunk < tsec->chunk + tsec->allocated) /* Only possible for the last block or a low share */
+      chunk += chunksinblock;
+  } else if((tsec = dlfile_endgame_find(dl, speed, &split))) {
+    /* Shorten the segment of the busy thread, dlfile_recv() will cancel its
+     * transfer when it reaches the split point. */
+    chunk = split;
+    g_debug("Endgame: taking over chunk %u-%u of `%s' from %016"G_GINT64_MODIFIER"x.",
+        chunk, tsec->chunk + tsec->avail, dl->dest, tsec->uid);
+    tsec->allocated = MIN(tsec->allocated, chunk - tsec->chunk);
+  } else {
+    dl->allbusy = TRUE;
+    g_static_mutex_unlock(&dl->lock);
+    return NULL;
   }
 
   if(!t) {
-    guint32 chunksinblock = dl->hash_block/DLFILE_CHUNKSIZE;
-    guint32 chunk = ((tsec->chunk + tsec->allocated + (tsec->avail - tsec->allocated)/2) / chunksinblock) * chunksinblock;
-    if(chunk < tsec->chunk + tsec->allocated) /* Only possible for the last block in the file */
-      chunk += chunksinblock;
     t = g_slice_new0(dlfile_thread_t);
     t->dl = dl;
     t->chunk = chunk;
     t->avail = tsec->avail - (chunk - tsec->chunk);
     g_return_val_if_fail(t->avail > 0, NULL);
-    tth_init(&t->hash_tth);
 
     tsec->avail -= t->avail;
-    dl->threads = g_slist_prepend(dl->threads, t);
+    dlfile_thread_changed(tsec);
+    dlfile_thread_add(dl, t);
   }
 
   /* Number of chunks to request as one segment. The size of a segment is
@@ -520,56 +1095,23 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
     t->allocated = t->avail;
   t->busy = TRUE;
   t->uid = uid;
+  t->segoff = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
+  t->segtime = dlfile_now();
+  dlfile_thread_changed(t);
+  if(var_get_bool(0, VAR_download_prealloc))
+    t->wbuf = g_malloc(DLFILE_WBUFSIZE);
   dl->active_threads++;
-
-  /* Go through the list again to update dl->allbusy */
-  for(l=dl->threads; l; l=l->next) {
-    dlfile_thread_t *ti = l->data;
-    if(ti->avail && (!ti->busy || dlfile_hasfreeblock(ti)))
-      break;
-  }
-  dl->allbusy = !l;
+  dl->allbusy = !dlfile_thread_free(dl);
 
   dlfile_threaddump(dl, 2);
   g_static_mutex_unlock(&dl->lock);
   g_debug("Allocating: allbusy = %d, chunk = %u, allocated = %u, avail = %u, chunksinblock = %u, chunksinfile = %u",
-      dl->allbusy, t->chunk, t->allocated, t->avail, (guint32)dl->hash_block/DLFILE_CHUNKSIZE, dlfile_chunks(dl->size));
+      dl->allbusy, t->chunk, t->allocated, t->avail, chunksinblock, dlfile_chunks(dl->size));
   return t;
 }
 
 
-static gboolean dlfile_recv_check(dlfile_thread_t *t, char *leaf) {
-  guint32 num = (t->chunk-1)/(t->dl->hash_block / DLFILE_CHUNKSIZE);
-  if(t->dl->size < t->dl->hash_block ? memcmp(leaf, t->dl->hash, 24) == 0 : db_dl_checkhash(t->dl->hash, num, leaf))
-    return TRUE;
-
-  g_static_mutex_lock(&t->dl->lock);
-
-  /* Hash failure, remove the failed block from the bitmap and dl->have, and
-   * reset this thread so that the block can be re-downloaded. */
-  guint32 startchunk = num * (t->dl->hash_block / DLFILE_CHUNKSIZE);
-  // Or: chunksinblock = MIN(t->dl->hash_block / DLFILE_CHUNKSIZE, dlfile_chunks(t->dl->size) - startchunk);
-  guint32 chunksinblock = t->chunk - startchunk;
-  t->chunk = startchunk;
-  t->avail += chunksinblock;
-  t->allocated += chunksinblock;
-  t->dl->have -= MIN(t->dl->hash_block, t->dl->size - (guint64)startchunk * DLFILE_CHUNKSIZE);
-
-  guint32 i;
-  for(i=startchunk; i<startchunk+chunksinblock; i++)
-    bita_set(t->dl->bitmap, i);
-  dlfile_save_bitmap_defer(t->dl);
-
-  g_static_mutex_unlock(&t->dl->lock);
-
-  t->uerr = DLE_HASH;
-  t->uerr_msg = g_strdup_printf("Hash for block %u (chunk %u-%u) does not match.", num, startchunk, startchunk+chunksinblock);
-  return FALSE;
-}
-
-
-static gboolean dlfile_recv_write(dlfile_thread_t *t, const char *buf, int len) {
-  off_t off = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
+static gboolean dlfile_recv_write(dlfile_thread_t *t, const char *buf, size_t len, off_t off) {
   off_t offi = off;
   size_t rem = len;
   const char *bufi = buf;
@@ -584,28 +1126,132 @@ static gboolean dlfile_recv_write(dlfile_thread_t *t, const char *buf, int len)
     rem -= r;
     bufi += r;
   }
-  fadv_oneshot(t->dl->incfd, off, len, VAR_FFC_DOWNLOAD);
+  /* Regular files are still needed for verification, the verification thread
+   * will call fadv_oneshot() instead. */
+  if(t->dl->islist)
+    fadv_oneshot(t->dl->incfd, off, len, VAR_FFC_DOWNLOAD);
+  return TRUE;
+}
+
+
+/* Writes out a write buffer and marks the completed chunks in the bitmap. */
+static gboolean dlfile_wbuf_write(dlfile_thread_t *t, const char *buf, guint32 len, guint64 off) {
+  if(!dlfile_recv_write(t, buf, len, off))
+    return FALSE;
+
+  if(!t->dl->islist) {
+    guint64 end = off + len;
+    guint32 i = off / DLFILE_CHUNKSIZE;
+    guint32 last = end == t->dl->size ? dlfile_chunks(t->dl->size) : end / DLFILE_CHUNKSIZE;
+    g_static_mutex_lock(&t->dl->lock);
+    for(; i<last; i++)
+      dlfile_bitmap_set(t->dl, i, TRUE);
+    g_static_mutex_unlock(&t->dl->lock);
+  }
+  return TRUE;
+}
+
+
+static void dlfile_wbuf_thread(gpointer dat, gpointer udat) {
+  dlfile_wbuf_t *w = dat;
+  dlfile_thread_t *t = w->t;
+
+  /* Buffers of the same thread are handled in order, so a failed write of a
+   * previous buffer is visible here. */
+  if(w->done) {
+    if(!t->err && w->len)
+      dlfile_wbuf_write(t, w->buf, w->len, w->off);
+    g_free(w->buf);
+    g_free(t->wspare);
+    t->wspare = NULL;
+    g_slice_free(dlfile_wbuf_t, w);
+    g_idle_add(dlfile_recv_finish, t);
+    return;
+  }
+
+  if(dlfile_wbuf_write(t, w->buf, w->len, w->off) && w->verify) {
+    g_static_mutex_lock(&t->dl->lock);
+    dlfile_verify_queue(t, w->block);
+    g_static_mutex_unlock(&t->dl->lock);
+  }
+
+  g_static_mutex_lock(&dlfile_wbuf_lock);
+  t->wspare = w->buf;
+  t->wpend = FALSE;
+  g_cond_broadcast(dlfile_wbuf_cond);
+  g_static_mutex_unlock(&dlfile_wbuf_lock);
+  g_slice_free(dlfile_wbuf_t, w);
+}
+
+
+/* Waits until the write worker has finished with the buffer of this thread.
+ * Errors of the write are in t->err afterwards. */
+static void dlfile_wbuf_wait(dlfile_thread_t *t) {
+  g_static_mutex_lock(&dlfile_wbuf_lock);
+  while(t->wpend)
+    g_cond_wait(dlfile_wbuf_cond, g_static_mutex_get_mutex(&dlfile_wbuf_lock));
+  g_static_mutex_unlock(&dlfile_wbuf_lock);
+}
+
+
+/* Hands t->wbuf to the write worker and continues with the spare buffer. If
+ * the previous buffer is still being written, the disk can't keep up and we
+ * wait for it first. If 'verify' is set, the worker queues the given block for
+ * verification once it is on disk.
+ * Returns FALSE if a write has failed. */
+static gboolean dlfile_recv_flush(dlfile_thread_t *t, gboolean verify, guint32 block) {
+  dlfile_wbuf_wait(t);
+  if(t->err)
+    return FALSE;
+
+  dlfile_wbuf_t *w = g_slice_new0(dlfile_wbuf_t);
+  w->t = t;
+  w->buf = t->wbuf;
+  w->len = t->wlen;
+  w->off = t->woff;
+  w->verify = verify;
+  w->block = block;
+  t->wbuf = t->wspare ? t->wspare : g_malloc(DLFILE_WBUFSIZE);
+  t->wspare = NULL;
+  t->wlen = 0;
+  t->wpend = TRUE;
+  g_thread_pool_push(dlfile_wbuf_pool, w, NULL);
   return TRUE;
 }
 
 
 /* Called when new data has been received from a downloading thread.  The data
- * is written to the file, the TTH calculation is updated and checked with the
- * DB, and the bitmap is updated.
+ * is written to the file and the bitmap is updated. Completed blocks are
+ * queued for verification.
  * This function may be called from another OS thread.
  * Returns TRUE to indicate success, FALSE on failure. */
 gboolean dlfile_recv(void *vt, const char *buf, int len) {
   dlfile_thread_t *t = vt;
-  if(!dlfile_recv_write(t, buf, len))
-    return FALSE;
 
   while(len > 0) {
+    /* The end of the segment may be handed to another thread in the endgame
+     * at any time, so this is checked for every chunk. dlfile_getchunk()
+     * never splits off the chunk we're currently working on, so once
+     * allocated is non-zero here the chunk is ours to finish. */
+    if(!t->dl->islist) {
+      g_static_mutex_lock(&t->dl->lock);
+      guint32 allocated = t->allocated;
+      g_static_mutex_unlock(&t->dl->lock);
+      if(!allocated)
+        return FALSE;
+    }
+
     guint32 inchunk = MIN((guint32)len, DLFILE_CHUNKSIZE - t->len);
+    if(t->wbuf) {
+      if(!t->wlen)
+        t->woff = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
+      memcpy(t->wbuf + t->wlen, buf, inchunk);
+      t->wlen += inchunk;
+    } else if(!dlfile_recv_write(t, buf, inchunk, ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len))
+      return FALSE;
     t->len += inchunk;
     gboolean islast = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len == t->dl->size;
 
-    if(!t->dl->islist)
-      tth_update(&t->hash_tth, buf, inchunk);
     buf += inchunk;
     len -= inchunk;
 
@@ -617,65 +1263,88 @@ gboolean dlfile_recv(void *vt, const char *buf, int len) {
       continue;
     }
 
-    if(!t->dl->islist) {
-      bita_set(t->dl->bitmap, t->chunk);
-      dlfile_save_bitmap_defer(t->dl);
-    }
+    if(!t->dl->islist && !t->wbuf)
+      dlfile_bitmap_set(t->dl, t->chunk, TRUE);
     t->chunk++;
-    t->allocated--;
+    if(t->allocated)
+      t->allocated--;
     t->avail--;
     t->len = 0;
+
+    guint32 chunksinblock = t->dl->hash_block / DLFILE_CHUNKSIZE;
+    gboolean blockend = !t->dl->islist && (islast || t->chunk % chunksinblock == 0);
+    gboolean flush = t->wbuf && (blockend || ((guint64)t->chunk * DLFILE_CHUNKSIZE) % DLFILE_WBUFSIZE == 0);
+    if(blockend && !flush)
+      dlfile_verify_queue(t, (t->chunk-1) / chunksinblock);
     g_static_mutex_unlock(&t->dl->lock);
 
-    if(!t->dl->islist && (islast || t->chunk % (t->dl->hash_block / DLFILE_CHUNKSIZE) == 0)) {
-      char leaf[24];
-      tth_final(&t->hash_tth, leaf);
-      tth_init(&t->hash_tth);
-      if(!dlfile_recv_check(t, leaf))
-        return FALSE;
-    }
+    /* The block has to be on disk before it can be verified, so the write
+     * worker queues it. Earlier parts of the block have been written before,
+     * as a thread has at most one buffer being written. */
+    if(flush && !dlfile_recv_flush(t, blockend, (t->chunk-1) / chunksinblock))
+      return FALSE;
   }
   return TRUE;
 }
 
 
+/* Called in the main thread when the transfer of a thread has stopped. If
+ * anything is left in the write buffer, or a previous buffer is still being
+ * written, the rest is done after the write worker has finished with it. The
+ * thread remains busy until then. */
 void dlfile_recv_done(dlfile_thread_t *t) {
+  dlfile_thread_speedupdate(t);
+  if(t->wbuf) {
+    g_static_mutex_lock(&dlfile_wbuf_lock);
+    gboolean pending = t->wpend;
+    g_static_mutex_unlock(&dlfile_wbuf_lock);
+    if(pending || t->wlen) {
+      dlfile_wbuf_t *w = g_slice_new0(dlfile_wbuf_t);
+      w->t = t;
+      w->buf = t->wbuf;
+      w->len = t->wlen;
+      w->off = t->woff;
+      w->done = TRUE;
+      t->wbuf = NULL;
+      t->wlen = 0;
+      g_thread_pool_push(dlfile_wbuf_pool, w, NULL);
+      return;
+    }
+    g_free(t->wbuf);
+    g_free(t->wspare);
+    t->wbuf = t->wspare = NULL;
+  }
+  dlfile_recv_finish(t);
+}
+
+
+static gboolean dlfile_recv_finish(gpointer dat) {
+  dlfile_thread_t *t = dat;
   dl_t *dl = t->dl;
+
+  gboolean freet = !t->err && (dl->islist ? dl->hassize && dl->have == dl->size : !t->avail);
+  g_return_val_if_fail(!freet || !t->uerr, FALSE); /* A failed thread can't be complete */
+
+  g_static_mutex_lock(&dl->lock);
   dl->active_threads--;
   t->busy = FALSE;
-
-  gboolean freet = FALSE;
-  if(dl->islist ? dl->hassize && dl->have == dl->size : !t->avail) {
-    g_return_if_fail(!(t->err || t->uerr)); /* A failed thread can't be complete */
-    dl->threads = g_slist_remove(dl->threads, t);
-    freet = TRUE;
-  } else {
+  if(freet)
+    dlfile_thread_remove(t);
+  else {
     t->allocated = 0;
+    dlfile_thread_changed(t);
     dl->allbusy = FALSE;
   }
+  g_static_mutex_unlock(&dl->lock);
   dlfile_threaddump(dl, 3);
 
-  /* File has been removed from the queue but the dl struct is still in memory
-   * because this thread hadn't finished yet. Free it now. Note that the actual
-   * call to dl_queue_rm() is deferred, because we can't access *t after
-   * calling it. */
-  gboolean doclose = !dl->bitmap_src && !dl->active_threads;
-  gboolean dorm = FALSE;
-  if(!dl->active_threads && !g_hash_table_lookup(dl_queue, dl->hash)) {
-    dorm = TRUE;
-    doclose = FALSE;
-  } else if(t->err)
-    dl_queue_seterr(t->dl, t->err, t->err_msg);
-  else if(t->uerr)
-    dl_queue_setuerr(t->uid, t->dl->hash, t->uerr, t->uerr_msg);
-  else if(!dl->threads) {
-    dlfile_finished(dl);
-    doclose = FALSE;
-  }
-
-  if(doclose) {
-    close(dl->incfd);
-    dl->incfd = 0;
+  if(g_hash_table_lookup(dl_queue, dl->hash)) {
+    if(!freet)
+      dl_queue_busy_clear(dl);
+    if(t->err)
+      dl_queue_seterr(t->dl, t->err, t->err_msg);
+    else if(t->uerr)
+      dl_queue_setuerr(t->uid, t->dl->hash, t->uerr, t->uerr_msg);
   }
 
   g_free(t->err_msg);
@@ -685,6 +1354,26 @@ void dlfile_recv_done(dlfile_thread_t *t) {
   if(freet)
     g_slice_free(dlfile_thread_t, t);
 
-  if(dorm)
+  dlfile_idle(dl);
+  return FALSE;
+}
+
+
+/* Called in the main thread after a downloading thread or a block
+ * verification has finished. Once neither is active anymore, the file is
+ * finalized, or closed until the next thread starts.
+ * If the file has been removed from the queue, the dl struct is still in
+ * memory because a thread or verification hadn't finished yet. Free it now. */
+static void dlfile_idle(dl_t *dl) {
+  if(dl->active_threads || dl->verifying || dl->bitmap_flushing)
+    return;
+
+  if(!g_hash_table_lookup(dl_queue, dl->hash))
     dl_queue_rm(dl);
+  else if(!dl->threads)
+    dlfile_finished(dl);
+  else if(!dl->bitmap_queued && dl->incfd > 0) {
+    close(dl->incfd);
+    dl->incfd = 0;
+  }
 }
@@ -79,14 +79,17 @@ static const doc_cmd_t doc_cmds[] = {
 },
 { "gc", NULL, "Perform some garbage collection.",
   "Cleans up unused data and reorganizes existing data to allow more efficient"
-  " storage and usage. Currently, this commands removes unused hash data, does"
-  " a VACUUM on db.sqlite3, removes unused files in inc/ and old files in"
-  " fl/.\n\n"
-  "This command may take some time to complete, and will fully block ncdc while"
-  " it is running. It is recommended to run this command every once in a while."
-  " Every month is a good interval. Note that when ncdc says that it has"
-  " completed this command, it's lying to you. Ncdc will still run a few large"
-  " queries on the background, which may take up to a minute to complete."
+  " storage and usage. Currently, this commands removes unused hash data,"
+  " reclaims unused space in db.sqlite3, removes unused files in inc/ and old"
+  " files in fl/.\n\n"
+  "The hash data is cleaned up in the background, in small steps, and a message"
+  " is displayed in the main tab when it is done. This may take a while on large"
+  " shares. If ncdc is closed before that, the garbage collection continues"
+  " where it left off the next time ncdc is started. The first time this"
+  " command is run on a database created by an older version of ncdc, a full"
+  " VACUUM is done to enable incremental vacuuming, which may take some time."
+  " It is recommended to run this command every once in a while. Every month is"
+  " a good interval."
 },
 { "grant", "[-list|<user>]", "Grant someone a slot.",
   "Grant someone a slot. This allows the user to download from you even if you"
@@ -223,6 +226,14 @@ static const doc_cmd_t doc_cmds[] = {
   " you give it will be public. An initial `/refresh' is done automatically on"
   " the added directory."
 },
+{ "stats", NULL, "Display runtime statistics.",
+  "Displays counters and timings of a few internal operations: the number of"
+  " incoming searches and the time spent handling them, database transactions,"
+  " file list serialization, hashing throughput, hash check failures of"
+  " downloaded data and the largest read buffer of network connections. These"
+  " are collected since ncdc was started and are mostly useful to diagnose"
+  " performance problems. See also the `log_stats' setting."
+},
 { "ungrant", "[<user>]", "Revoke a granted slot.",
   NULL
 },
@@ -370,6 +381,18 @@ static const doc_set_t doc_sets[] = {
   "This setting is ignored if `upload_rate' has been set. If it is, that value"
   " is broadcasted instead."
 },
+{ "db_journal_mode", 0, "<delete|truncate|wal>",
+  "Journal mode of the database (db.sqlite3). `delete' and `truncate' use a"
+  " rollback journal, `wal' uses a write-ahead log, which is usually faster for"
+  " the many small transactions made by ncdc. Note that a database in WAL mode"
+  " requires an SQLite version of at least 3.7.0 to be opened."
+},
+{ "db_synchronous", 0, "<off|normal|full>",
+  "How careful the database should be in syncing its changes to disk. With"
+  " `normal' the database may lose its most recent changes after a power"
+  " failure, and with `off' it may become corrupted in that case. `normal' is"
+  " safe in combination with `wal' for db_journal_mode."
+},
 { "description", 1, "<string>",
   "A short public description that will be displayed in the user list of a hub."
 },
@@ -393,12 +416,23 @@ static const doc_set_t doc_sets[] = {
   "This regex is not checked when adding individual files from either the file"
   " list browser or the search results."
 },
-{ "download_rate", 0, "<speed>",
+{ "download_prealloc", 0, "<boolean>",
+  "Allocate the full size of a file on disk when starting its download, and"
+  " write the received data in large aligned extents rather than in small"
+  " pieces. This reduces fragmentation when downloading many segments of the"
+  " same file in parallel, at the cost of 4 MiB of memory per active download."
+  " Completed downloads are also synced to disk before they are moved to their"
+  " destination. Preallocation only affects files that have not been started"
+  " yet."
+},
+{ "download_rate", 1, "<speed>",
   "Maximum combined transfer rate of all downloads. The total download speed"
   " will be limited to this value. The suffixes `G', 'M', and 'K' can be used"
   " for GiB/s, MiB/s and KiB/s, respectively. Note that, similar to upload_rate,"
   " TCP overhead are not counted towards this limit, so the actual bandwidth"
-  " usage might be a little higher."
+  " usage might be a little higher.\n\n"
+  "When set on a hub, the downloads from users on that hub are limited to this"
+  " value, in addition to the global limit."
 },
 { "download_segment", 0, "<size>",
   "Minimum segment size to use when requesting file data from another user."
@@ -454,6 +488,13 @@ static const doc_set_t doc_sets[] = {
   "Maximum file hashing speed. See the `download_rate' setting for allowed"
   " formats for this setting."
 },
+{ "hash_threads", 0, "<integer>",
+  "Maximum number of files to hash simultaneously. Files are spread over the"
+  " disks they reside on, so that each disk is busy with as few files as"
+  " possible. Increasing this is mostly useful when sharing directories from"
+  " multiple disks or from fast SSDs. The `hash_rate' limit is shared among"
+  " all files being hashed."
+},
 { "hubname", 1, "<string>",
   "The name of the currently opened hub tab. This is a user-assigned name, and"
   " is only used within ncdc itself. This is the same name as given to the"
@@ -490,6 +531,10 @@ static const doc_set_t doc_sets[] = {
   "Log the main hub chat. Note that changing this requires any affected hub"
   " tabs to be closed and reopened before the change is effective."
 },
+{ "log_stats", 0, "<interval>",
+  "Write the output of `/stats' to stderr.log in the session directory at the"
+  " given interval. Set to 0 to disable."
+},
 { "log_uploads", 0, "<boolean>",
   "Log file uploads to transfers.log."
 },
@@ -539,6 +584,12 @@ static const doc_set_t doc_sets[] = {
   "The time to wait before automatically reconnecting to a hub. Set to 0 to"
   " disable automatic reconnect."
 },
+{ "search_memory", 0, "<size>",
+  "Maximum amount of memory to use for the results of a single search tab."
+  " When this limit is reached, the results from users with the least free"
+  " slots are removed first. Changes to this setting only affect new search"
+  " tabs. Set to 0 to keep all results."
+},
 { "sendfile", 0, "<boolean>",
   "Whether or not to use the sendfile() system call to upload files, if"
   " supported. Using sendfile() allows less resource usage while uploading, but"
@@ -560,12 +611,27 @@ static const doc_set_t doc_sets[] = {
   " is one of which the file name starts with a dot. (e.g. `.bashrc'). A file"
   " list refresh is required for this setting to be effective."
 },
+{ "share_scan_threads", 0, "<integer>",
+  "Number of threads to use when scanning the shared directories. Directories"
+  " are scanned in parallel, which mostly helps when the filesystem has a high"
+  " latency for metadata operations, such as with network filesystems. Changes"
+  " to this setting take effect at the next refresh."
+},
 { "share_symlinks", 0, "<boolean>",
   "Whether to follow symlinks in shared directories. When disabled (default),"
   " ncdc will never share any files outside of the directory you specified. When"
   " enabled, any symlinks in your shared directories will be followed, even"
   " when they point to a directory outside your share."
 },
+{ "share_watch", 0, "<boolean>",
+  "Whether to watch the shared directories for changes. When enabled, changes"
+  " to files and directories are picked up within a few seconds, and only the"
+  " modified directories are rescanned. This is only supported on Linux, and"
+  " the number of directories that can be watched is limited by the"
+  " fs.inotify.max_user_watches sysctl. Directories that can't be watched, and"
+  " changes that are missed when the kernel event queue overflows, are still"
+  " picked up by a full refresh, see the `autorefresh' setting."
+},
 {
   "show_free_slots", 1, "<boolean>",
   "When set to true, [n sl] will be prepended to your description, where n is"
@@ -604,6 +670,14 @@ static const doc_set_t doc_sets[] = {
   " that, even if you set this to `prefer', TLS will only be used if the"
   " connecting party also supports it."
 },
+{ "tls_ktls", 0, "<boolean>",
+  "Allow GnuTLS to hand encryption of TLS connections over to the kernel"
+  " (kTLS). When the kernel accepts the session, TLS uploads can use the"
+  " sendfile() system call as well, see the `sendfile' setting. This requires"
+  " GnuTLS 3.7.3 or later with kTLS enabled in its system configuration, and"
+  " a kernel with the `tls' module loaded. Connections on which kTLS is not"
+  " available silently use the normal code path. Only affects new connections."
+},
 { "tls_priority", 0, "<string>",
   "Set the GnuTLS priority string used for all TLS-enabled connections. See the"
   " \"Priority strings\" section in the GnuTLS manual for details on what this"
@@ -611,6 +685,14 @@ static const doc_set_t doc_sets[] = {
   " priority string for different types of connections (e.g. hub or"
   " incoming/outgoing client connections)."
 },
+{ "transfer_zlib", 0, "<boolean>",
+  "Whether to use zlib compression (ZL1) for file transfers with ADC clients"
+  " that support it. Downloads are requested compressed, and uploads are"
+  " compressed when the remote client asks for it and a sample of the file"
+  " compresses well. Files that don't (most video, audio and archives) are"
+  " sent as-is, so that sendfile() can still be used. Compression stops being"
+  " used partway through a transfer when the data turns out not to compress after all."
+},
 { "ui_time_format", 0, "<string>",
   "The format of the time displayed in the lower-left of the screen. Set `-' to"
   " not display a time at all. The string is passed to the Glib"
@@ -620,10 +702,10 @@ static const doc_set_t doc_sets[] = {
   " date/time format used in other places, such as the chat window or log"
   " files."
 },
-{ "upload_rate", 0, "<speed>",
+{ "upload_rate", 1, "<speed>",
   "Maximum combined transfer rate of all uploads. See the `download_rate'"
-  " setting for more information on rate limiting. Note that this setting also"
-  " overrides any `connection' setting."
+  " setting for more information on rate limiting, including hub-local limits."
+  " Note that this setting also overrides any `connection' setting."
 },
 
 { NULL }
@@ -32,6 +32,11 @@
 #define STACKSIZE (8*1024)
 #define READBUFSIZE (32*1024)
 
+// Decompressed data is passed from the bzip2 thread to the parser in a ring of
+// PIPEBUFS buffers of PIPEBUFSIZE bytes.
+#define PIPEBUFS 4
+#define PIPEBUFSIZE (128*1024)
+
 // Only used for attributes that we care about, and those tend to be short,
 // file names being the longest possible values. I am unaware of a filesystem
 // that allows filenames longer than 256 bytes, so this should be a safe value.
@@ -72,6 +77,12 @@ typedef struct ctx_t {
     !(((x)[0] == '.' && (!(x)[1] || ((x)[1] == '.' && !(x)[2])))) && !strchr((x), '/'))
 
 
+// The local file list is modified for as long as ncdc runs, while the memory
+// of items removed from an arena is never reused. So only other lists are
+// allocated from an arena.
+#define fl_load_create(x, n, l) ((x)->local ? fl_list_create(n, l) : fl_list_create_in((x)->root, n, l))
+
+
 static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
   // Detect the end of the attributes for an open XML element.
   if(r != YXML_ATTRSTART && r != YXML_ATTRVAL && r != YXML_ATTREND) {
@@ -80,7 +91,7 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
         g_set_error_literal(err, 1, 0, "Missing Name attribute in Directory element");
         return;
       }
-      fl_list_t *new = fl_list_create(x->name, FALSE);
+      fl_list_t *new = fl_load_create(x, x->name, FALSE);
       new->isfile = FALSE;
       new->sub = g_ptr_array_new_with_free_func(fl_list_free);
       fl_list_add(x->cur, new, -1);
@@ -97,7 +108,7 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
         return;
       }
       // Create the file entry
-      fl_list_t *new = fl_list_create(x->name, x->local);
+      fl_list_t *new = fl_load_create(x, x->name, x->local);
       new->isfile = TRUE;
       new->size = x->filesize;
       new->hastth = TRUE;
@@ -205,8 +216,11 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
 }
 
 
+// Decompresses into bzs->next_out, returns the number of bytes written, or -1
+// on EOF or error.
 static int fl_load_readbz(bz_stream *bzs, int fd, char *bzbuf, GError **err) {
   int buflen;
+  unsigned int avail = bzs->avail_out;
 
   bzs->next_in = bzbuf;
   if(bzs->avail_in == 0) {
@@ -231,15 +245,105 @@ static int fl_load_readbz(bz_stream *bzs, int fd, char *bzbuf, GError **err) {
 
   memmove(bzbuf, bzs->next_in, bzs->avail_in);
   bzs->next_in = bzbuf;
-  return READBUFSIZE-bzs->avail_out;
+  return avail-bzs->avail_out;
+}
+
+
+// bzip2 decompression is slow enough to be worth running in parallel with
+// the XML parser. The decompression thread takes buffers from the 'empty'
+// queue, fills them and pushes them to the 'full' queue, the parser returns
+// them to 'empty' when it's done with them. The last buffer that is pushed to
+// 'full' has its 'last' flag set, after which the thread exits.
+
+typedef struct pipebuf_t {
+  int len;
+  gboolean last;
+  char data[PIPEBUFSIZE];
+} pipebuf_t;
+
+typedef struct pipe_t {
+  int fd;
+  bz_stream *bzs;
+  GAsyncQueue *empty, *full;
+  int abort; // set by the parser, accessed atomically
+  GError *err;
+  GThread *thread;
+} pipe_t;
+
+
+static gpointer fl_load_pipe_thread(gpointer dat) {
+  pipe_t *p = dat;
+  char *bzbuf = g_malloc(READBUFSIZE);
+  gboolean last = FALSE;
+
+  while(!last) {
+    pipebuf_t *b = g_async_queue_pop(p->empty);
+    b->len = 0;
+    last = g_atomic_int_get(&p->abort);
+    while(!last && b->len < PIPEBUFSIZE) {
+      p->bzs->next_out = b->data + b->len;
+      p->bzs->avail_out = PIPEBUFSIZE - b->len;
+      int r = fl_load_readbz(p->bzs, p->fd, bzbuf, &p->err);
+      if(r < 0)
+        last = TRUE;
+      else
+        b->len += r;
+    }
+    b->last = last;
+    g_async_queue_push(p->full, b);
+  }
+
+  g_free(bzbuf);
+  return NULL;
+}
+
+
+static pipe_t *fl_load_pipe_new(int fd, bz_stream *bzs) {
+  pipe_t *p = g_new0(pipe_t, 1);
+  p->fd = fd;
+  p->bzs = bzs;
+  p->empty = g_async_queue_new_full(g_free);
+  p->full = g_async_queue_new_full(g_free);
+  int i;
+  for(i=0; i<PIPEBUFS; i++)
+    g_async_queue_push(p->empty, g_new(pipebuf_t, 1));
+  p->thread = g_thread_create(fl_load_pipe_thread, p, TRUE, NULL);
+  return p;
+}
+
+
+// Stops the decompression thread and frees the pipe. 'done' indicates whether
+// the parser has already received the last buffer. Any decompression error is
+// propagated to err if that isn't already set.
+static void fl_load_pipe_free(pipe_t *p, gboolean done, GError **err) {
+  if(!done) {
+    g_atomic_int_set(&p->abort, 1);
+    pipebuf_t *b;
+    do {
+      b = g_async_queue_pop(p->full);
+      g_async_queue_push(p->empty, b);
+    } while(!b->last);
+  }
+  g_thread_join(p->thread);
+
+  if(p->err && !*err)
+    g_propagate_error(err, p->err);
+  else if(p->err)
+    g_error_free(p->err);
+  g_async_queue_unref(p->empty);
+  g_async_queue_unref(p->full);
+  g_free(p);
 }
 
 
 static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError **err) {
   ctx_t *x = g_new(ctx_t, 1);
   x->state = S_START;
-  x->root = fl_list_create("", FALSE);
-  x->root->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  if(local) {
+    x->root = fl_list_create("", FALSE);
+    x->root->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  } else
+    x->root = fl_list_create_root();
   x->cur = x->root;
   x->filesize = G_MAXUINT64;
   x->local = local;
@@ -249,18 +353,24 @@ static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError *
 
   yxml_init(&x->x, x->stack, STACKSIZE);
   int buflen = 0;
-  char *bzbuf = NULL;
+  char *buf = x->buf;
+  pipe_t *pipe = bzs ? fl_load_pipe_new(fd, bzs) : NULL;
+  pipebuf_t *pbuf_cur = NULL;
+  gboolean pipe_done = FALSE;
 
   while(1) {
     // Fill buffer
-    if(bzs) {
-      if(!bzbuf)
-        bzbuf = g_malloc(READBUFSIZE);
-      bzs->next_out = x->buf;
-      bzs->avail_out = READBUFSIZE;
-      buflen = fl_load_readbz(bzs, fd, bzbuf, err);
-      if(buflen < 0)
-        break;
+    if(pipe) {
+      if(pbuf_cur) {
+        pipe_done = pbuf_cur->last;
+        g_async_queue_push(pipe->empty, pbuf_cur);
+        pbuf_cur = NULL;
+        if(pipe_done)
+          break;
+      }
+      pbuf_cur = g_async_queue_pop(pipe->full);
+      buf = pbuf_cur->data;
+      buflen = pbuf_cur->len;
     } else {
       buflen = read(fd, x->buf, READBUFSIZE);
       if(buflen == 0)
@@ -272,7 +382,7 @@ static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError *
     }
 
     // And parse
-    char *pbuf = x->buf;
+    char *pbuf = buf;
     while(!*err && buflen > 0) {
       yxml_ret_t r = yxml_parse(&x->x, *pbuf);
       pbuf++;
@@ -291,17 +401,195 @@ static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError *
     }
   }
 
+  if(pipe) {
+    if(pbuf_cur) {
+      pipe_done = pbuf_cur->last;
+      g_async_queue_push(pipe->empty, pbuf_cur);
+    }
+    fl_load_pipe_free(pipe, pipe_done, err);
+  }
+
   if(!*err && yxml_eof(&x->x) < 0)
     g_set_error_literal(err, 1, 0, "XML document did not end correctly");
 
   fl_list_t *root = x->root;
-  g_free(bzbuf);
   g_free(x->name);
   g_free(x);
   return root;
 }
 
 
+// Binary cache of remote file lists. Parsing a large bzip2-compressed XML
+// list takes a while, so after a list has been loaded for the first time, the
+// tree is written to a binary file next to it ("<uid>.xml.bz2" ->
+// "<uid>.bin"). Later loads of the same list mmap() that file and build the
+// tree directly from it. The cache has the same modification time as the XML
+// file, so that dl_fl_clean() removes both at the same time.
+//
+// Format, in native byte order:
+//   header:  char magic[8], guint32 byteorder (BIN_BOM), guint32 zero,
+//            guint64 xml_size, gint64 xml_mtime, then the root's item list.
+//   list:    guint32 count, followed by count items.
+//   item:    guint8 flags (BIN_FILE|BIN_TTH), guint16 namelen, name,
+//            guint64 size, char tth[24] if BIN_TTH, list if !BIN_FILE.
+
+#define BIN_MAGIC "ncdcflb1"
+#define BIN_BOM 0x01020304
+#define BIN_FILE 1
+#define BIN_TTH  2
+#define BIN_HEADER 32
+
+
+static char *fl_load_binname(const char *file) {
+  int len = strlen(file);
+  if(len <= 8 || strcmp(file+len-8, ".xml.bz2") != 0)
+    return NULL;
+  return g_strdup_printf("%.*s.bin", len-8, file);
+}
+
+
+typedef struct bin_t {
+  const char *ptr, *end;
+  fl_list_t *root;
+  char name[G_MAXUINT16+1];
+} bin_t;
+
+#define bin_get(b, dest) (\
+    (b)->end - (b)->ptr < (int)sizeof(*(dest)) ? FALSE :\
+    (memcpy((dest), (b)->ptr, sizeof(*(dest))), (b)->ptr += sizeof(*(dest)), TRUE))
+
+
+static gboolean fl_load_binlist(bin_t *b, fl_list_t *dir) {
+  guint32 count;
+  if(!bin_get(b, &count))
+    return FALSE;
+  while(count-- > 0) {
+    guint8 flags;
+    guint16 len;
+    if(!bin_get(b, &flags) || !bin_get(b, &len) || b->end - b->ptr < len)
+      return FALSE;
+    memcpy(b->name, b->ptr, len);
+    b->name[len] = 0;
+    b->ptr += len;
+
+    fl_list_t *cur = fl_list_create_in(b->root, b->name, FALSE);
+    cur->parent = dir;
+    g_ptr_array_add(dir->sub, cur);
+    if(!bin_get(b, &cur->size))
+      return FALSE;
+    if(flags & BIN_TTH) {
+      if(b->end - b->ptr < 24)
+        return FALSE;
+      memcpy(cur->tth, b->ptr, 24);
+      b->ptr += 24;
+      cur->hastth = TRUE;
+    }
+    if(flags & BIN_FILE)
+      cur->isfile = TRUE;
+    else {
+      cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      if(!fl_load_binlist(b, cur))
+        return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+
+// Returns NULL if there is no valid cache for the given list.
+static fl_list_t *fl_load_bin(const char *file, struct stat *xst) {
+  char *fn = fl_load_binname(file);
+  if(!fn)
+    return NULL;
+  int fd = open(fn, O_RDONLY);
+  g_free(fn);
+  if(fd < 0)
+    return NULL;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && st.st_size >= BIN_HEADER)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return NULL;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  guint32 bom;
+  guint64 size;
+  gint64 mtime;
+  bin_t *b = g_new(bin_t, 1);
+  b->ptr = (char *)map+8;
+  b->end = (char *)map+st.st_size;
+  fl_list_t *root = NULL;
+  if(memcmp(map, BIN_MAGIC, 8) == 0 && bin_get(b, &bom) && bom == BIN_BOM
+      && bin_get(b, &bom) && bin_get(b, &size) && bin_get(b, &mtime)
+      && size == (guint64)xst->st_size && mtime == (gint64)xst->st_mtime) {
+    b->root = root = fl_list_create_root();
+    if(!fl_load_binlist(b, root) || b->ptr != b->end) {
+      fl_list_free(root);
+      root = NULL;
+    } else {
+      int i;
+      for(i=0; i<root->sub->len; i++)
+        root->size += ((fl_list_t *)g_ptr_array_index(root->sub, i))->size;
+    }
+  }
+  g_free(b);
+  munmap(map, st.st_size);
+  return root;
+}
+
+
+static gboolean fl_save_binlist(FILE *f, fl_list_t *dir) {
+  guint32 count = dir->sub->len;
+  if(fwrite(&count, 4, 1, f) != 1)
+    return FALSE;
+  int i;
+  for(i=0; i<dir->sub->len; i++) {
+    fl_list_t *cur = g_ptr_array_index(dir->sub, i);
+    guint8 flags = (cur->isfile ? BIN_FILE : 0) | (cur->hastth ? BIN_TTH : 0);
+    int namelen = strlen(cur->name);
+    guint16 len = MIN(namelen, G_MAXUINT16);
+    if(len != namelen || fwrite(&flags, 1, 1, f) != 1 || fwrite(&len, 2, 1, f) != 1
+        || fwrite(cur->name, 1, len, f) != len || fwrite(&cur->size, 8, 1, f) != 1
+        || (cur->hastth && fwrite(cur->tth, 24, 1, f) != 1)
+        || (!cur->isfile && !fl_save_binlist(f, cur)))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+
+// Writes the binary cache of a file list, errors are silently ignored.
+static void fl_save_bin(const char *file, struct stat *xst, fl_list_t *root) {
+  char *fn = fl_load_binname(file);
+  if(!fn)
+    return;
+  char *tmp = g_strdup_printf("%s.tmp-%d", fn, rand());
+  FILE *f = fopen(tmp, "w");
+  if(f) {
+    guint32 bom[2] = { BIN_BOM, 0 };
+    guint64 size = xst->st_size;
+    gint64 mtime = xst->st_mtime;
+    gboolean ok = fwrite(BIN_MAGIC, 8, 1, f) == 1 && fwrite(bom, 8, 1, f) == 1
+      && fwrite(&size, 8, 1, f) == 1 && fwrite(&mtime, 8, 1, f) == 1
+      && fl_save_binlist(f, root);
+    if(fclose(f))
+      ok = FALSE;
+    struct utimbuf ut = { xst->st_atime, xst->st_mtime };
+    if(!ok || utime(tmp, &ut) < 0 || rename(tmp, fn) < 0) {
+      g_debug("Unable to write file list cache %s: %s", fn, g_strerror(errno));
+      unlink(tmp);
+    }
+  }
+  g_free(tmp);
+  g_free(fn);
+}
+
+
 fl_list_t *fl_load(const char *file, GError **err, gboolean local) {
   g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
@@ -312,11 +600,16 @@ fl_list_t *fl_load(const char *file, GError **err, gboolean local) {
 
   // open file
   fd = open(file, O_RDONLY);
-  if(fd < 0) {
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) < 0) {
     g_set_error_literal(&ierr, 1, 0, g_strerror(errno));
     goto end;
   }
 
+  // Use the binary cache of remote lists if we have it
+  if(!local && (root = fl_load_bin(file, &st)))
+    goto end;
+
   // Create BZ2 stream object if this is a bzip2 file
   if(strlen(file) > 4 && strcmp(file+(strlen(file)-4), ".bz2") == 0) {
     bzs = g_new0(bz_stream, 1);
@@ -324,6 +617,8 @@ fl_list_t *fl_load(const char *file, GError **err, gboolean local) {
   }
 
   root = fl_load_parse(fd, bzs, local, &ierr);
+  if(!local && !ierr)
+    fl_save_bin(file, &st, root);
 
 end:
   if(bzs) {
@@ -345,8 +640,7 @@ end:
 
 
 
-// Async version of fl_load(). Performs the load in a background thread. Only
-// used for non-local filelists.
+// Async version of fl_load(). Performs the load in a background thread.
 
 typedef struct async_t {
   char *file;
@@ -354,6 +648,7 @@ typedef struct async_t {
   void *dat;
   GError *err;
   fl_list_t *fl;
+  gboolean local;
 } async_t;
 
 
@@ -368,21 +663,22 @@ static gboolean async_d(gpointer dat) {
 
 static void async_f(gpointer dat, gpointer udat) {
   async_t *arg = dat;
-  arg->fl = fl_load(arg->file, &arg->err, FALSE);
+  arg->fl = fl_load(arg->file, &arg->err, arg->local);
   g_idle_add(async_d, arg);
 }
 
 
 // Ownership of both the file list and the error is passed to the callback
 // function.
-void fl_load_async(const char *file, void (*cb)(fl_list_t *, GError *, void *), void *dat) {
+void fl_load_async(const char *file, gboolean local, void (*cb)(fl_list_t *, GError *, void *), void *dat) {
   static GThreadPool *pool = NULL;
   if(!pool)
-    pool = g_thread_pool_new(async_f, NULL, 2, FALSE, NULL);
+    pool = g_thread_pool_new(async_f, NULL, MAX(2, sysconf(_SC_NPROCESSORS_ONLN)), FALSE, NULL);
   async_t *arg = g_slice_new0(async_t);
   arg->file = g_strdup(file);
   arg->dat = dat;
   arg->cb = cb;
+  arg->local = local;
   g_thread_pool_push(pool, arg, NULL);
 }
 
@@ -32,21 +32,29 @@ char           *fl_local_list_file;
 fl_list_t      *fl_local_list  = NULL;
 GQueue         *fl_refresh_queue = NULL;
 time_t          fl_refresh_last = 0; // time when the last full file list refresh has been queued
-static gboolean fl_needflush = FALSE;
-// Index of the files in fl_local_list. Key = TTH root, value = GSList of files.
-static GHashTable *fl_hash_index;
+static int      fl_refresh_gen = 0;  // incremented after each refresh, see fl_gc_files()
+static gboolean fl_loading = FALSE;  // whether files.xml.bz2 is being loaded, see fl_init_loaded()
+static gboolean fl_needflush = FALSE; // whether the journal has unflushed records
+static char    *fl_journal_file;
+static FILE    *fl_journal = NULL;
+static gint64   fl_journal_size = 0; // size of the journal file, including unflushed records
+static gboolean fl_compacting = FALSE;
+static time_t   fl_lastcompact = 0;
+// Index of the files in fl_local_list, see "Hash index interface" below.
+static fl_hashindex_t fl_hash_index;
 guint64         fl_local_list_size;   // total share size, minus duplicate files
 int             fl_local_list_length; // total number of unique files in the share
 
 static GThreadPool *fl_scan_pool;
 static GThreadPool *fl_hash_pool;
 
-GHashTable       *fl_hash_queue = NULL; // set of files-to-hash
+GHashTable       *fl_hash_queue = NULL; // set of files-to-hash, value = fl_hash_dev_t
 guint64           fl_hash_queue_size = 0;
-static fl_list_t *fl_hash_cur = NULL;   // most recent file initiated for hashing
+static GHashTable *fl_hash_active;      // files currently being hashed, value = fl_hash_t
+static GHashTable *fl_hash_devs;        // key = device id, value = fl_hash_dev_t
+static GHashTable *fl_hash_rootdevs;    // key = share root name, value = device id
 ratecalc_t        fl_hash_rate;
-static guint64    fl_hash_reset = 0; // increased when fl_hash_cur is removed from the queue (to stop current hash operation)
-static GMutex    *fl_hash_resetlock;
+static GMutex    *fl_hash_resetlock;    // protects fl_hash_t.cancel
 static GCond     *fl_hash_resetcond;
 
 #define TTH_BUFSIZE (512*1024)
@@ -103,87 +111,1685 @@ void fl_local_suggest(char *path, char **sug) {
 }
 
 
-// get files with the (raw) TTH. Result does not have to be freed.
-GSList *fl_local_from_tth(const char *root) {
-  return g_hash_table_lookup(fl_hash_index, root);
+// Persistence of our file list
+//
+// files.xml.bz2 is a snapshot of the list. Every change made after that is
+// appended to files.journal as a line of text:
+//   F <path> <size> <tth>   hashed file, added or updated
+//   D <path>                directory
+//   R <path>                removal of a file or directory, recursive
+// Paths are virtual paths, ADC-escaped. As in files.xml.bz2, files that
+// haven't been hashed yet are not stored. Appending to the journal is cheap,
+// so records are written as soon as something changes. The journal is flushed
+// every FL_FLUSH_INTERVAL seconds.
+//
+// The journal is compacted in a background thread. The thread loads the
+// snapshot, replays the journal on top of it, writes the result as the new
+// snapshot, and then drops the replayed part of the journal. The result is
+// also the files.xml.bz2 that peers download, so compaction runs when a peer
+// asks for our list, when hashing or a refresh has finished, and when the
+// journal has grown large. Replaying a journal on a snapshot that already
+// includes it gives the same list, so a crash between writing the snapshot
+// and truncating the journal is harmless.
+//
+// At startup the snapshot and journal are loaded in the same way. The main
+// thread never writes to the journal while that is in progress.
+
+// Maximum number of seconds between two flushes of the journal, and minimum
+// number of seconds between two compactions requested by peers.
+#define FL_FLUSH_INTERVAL 60
+
+// Journal size at which it is compacted anyway.
+#define FL_JOURNAL_MAX (4*1024*1024)
+
+
+static void fl_journal_open() {
+  int fd = open(fl_journal_file, O_RDWR|O_APPEND|O_CREAT, 0666);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) < 0 || !(fl_journal = fdopen(fd, "a"))) {
+    ui_mf(uit_main_tab, UIP_MED, "Error opening %s: %s", fl_journal_file, g_strerror(errno));
+    if(fd >= 0)
+      close(fd);
+    return;
+  }
+  fl_journal_size = st.st_size;
+  // Terminate a record that was only partially written before a crash, so
+  // that it is ignored rather than merged with the next one.
+  char c;
+  if(st.st_size > 0 && pread(fd, &c, 1, st.st_size-1) == 1 && c != '\n') {
+    fputc('\n', fl_journal);
+    fl_journal_size++;
+  }
 }
 
 
-// Fill a bloom filter with all local hashes
-void fl_local_bloom(bloom_t *b) {
-  GHashTableIter iter;
-  const char *tth;
-  g_hash_table_iter_init(&iter, fl_hash_index);
-  while(g_hash_table_iter_next(&iter, (gpointer *)&tth, NULL))
-    bloom_add(b, tth);
+// Removes the first `end' bytes from the journal, keeping whatever has been
+// written after that.
+static void fl_journal_truncate(gint64 end) {
+  if(fl_journal) {
+    fclose(fl_journal);
+    fl_journal = NULL;
+  }
+
+  int fd = open(fl_journal_file, O_RDONLY);
+  struct stat st;
+  char *tail = NULL;
+  gsize len = 0;
+  gboolean ok = fd >= 0 && fstat(fd, &st) == 0;
+  if(ok && st.st_size > end) {
+    len = st.st_size - end;
+    tail = g_malloc(len);
+    ok = pread(fd, tail, len, end) == len;
+  }
+  if(fd >= 0)
+    close(fd);
+
+  // If the tail can't be read the journal is left alone. That only means
+  // that the next compaction replays some records again.
+  GError *err = NULL;
+  if(ok && !g_file_set_contents(fl_journal_file, tail ? tail : "", len, &err)) {
+    ui_mf(uit_main_tab, UIP_MED, "Error writing %s: %s", fl_journal_file, err->message);
+    g_error_free(err);
+  }
+  g_free(tail);
+  fl_journal_open();
+}
+
+
+static void fl_journal_write(char type, const char *path, fl_list_t *fl) {
+  if(!fl_journal)
+    return;
+  char *esc = adc_escape(path, FALSE);
+  int r;
+  if(type == 'F') {
+    char tth[40] = {};
+    base32_encode(fl->tth, tth);
+    r = fprintf(fl_journal, "F %s %"G_GUINT64_FORMAT" %s\n", esc, fl->size, tth);
+  } else
+    r = fprintf(fl_journal, "%c %s\n", type, esc);
+  g_free(esc);
+  if(r > 0)
+    fl_journal_size += r;
+  fl_needflush = TRUE;
+}
+
+
+static void fl_journal_tree(GString *path, fl_list_t *fl) {
+  if(fl->isfile) {
+    if(fl->hastth)
+      fl_journal_write('F', path->str, fl);
+    return;
+  }
+  fl_journal_write('D', path->str, NULL);
+  if(!fl->sub)
+    return;
+  int i, len = path->len;
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *c = g_ptr_array_index(fl->sub, i);
+    g_string_append_c(path, '/');
+    g_string_append(path, c->name);
+    fl_journal_tree(path, c);
+    g_string_truncate(path, len);
+  }
+}
+
+
+// Writes the current state of an item, including its contents in the case of
+// a directory, to the journal. An unhashed file is written as a removal, as
+// it may have replaced a hashed one.
+static void fl_journal_add(fl_list_t *fl) {
+  char *p = fl_list_path(fl);
+  if(fl->isfile && !fl->hastth)
+    fl_journal_write('R', p, NULL);
+  else {
+    GString *path = g_string_new(p);
+    fl_journal_tree(path, fl);
+    g_string_free(path, TRUE);
+  }
+  g_free(p);
+}
+
+
+static void fl_journal_del(fl_list_t *fl) {
+  char *p = fl_list_path(fl);
+  fl_journal_write('R', p, NULL);
+  g_free(p);
+}
+
+
+// The functions below are used from a background thread, on a list that is
+// not fl_local_list.
+
+// Adds fl to dir, replacing any item with the same name.
+static void fl_journal_put(fl_list_t *dir, fl_list_t *fl) {
+  fl_list_t *old = fl_list_file(dir, fl->name);
+  if(old)
+    fl_list_remove(old);
+  int lo = 0, hi = dir->sub->len;
+  while(lo < hi) {
+    int m = (lo+hi)/2;
+    if(fl_list_cmp(g_ptr_array_index(dir->sub, m), fl) < 0)
+      lo = m+1;
+    else
+      hi = m;
+  }
+  fl_list_add(dir, fl, lo);
+}
+
+
+// Returns the directory at the given path, creating it (and replacing any
+// files in the way) if necessary. Modifies path.
+static fl_list_t *fl_journal_dir(fl_list_t *root, char *path) {
+  fl_list_t *cur = root;
+  while(path && *path) {
+    char *name = path;
+    if((path = strchr(path, '/')))
+      *(path++) = 0;
+    if(!*name)
+      continue;
+    fl_list_t *n = fl_list_file(cur, name);
+    if(!n || n->isfile) {
+      n = fl_list_create(name, FALSE);
+      n->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      fl_journal_put(cur, n);
+    }
+    cur = n;
+  }
+  return cur;
+}
+
+
+static void fl_journal_apply(fl_list_t *root, char *line) {
+  char **arg = g_strsplit(line, " ", 0);
+  int argc = g_strv_length(arg);
+  char *path = argc >= 2 ? adc_unescape(arg[1], FALSE) : NULL;
+  char *name = path ? strrchr(path, '/') : NULL;
+  if(!name || strlen(arg[0]) != 1)
+    goto done;
+
+  if(*arg[0] == 'R' && argc == 2) {
+    fl_list_t *fl = fl_list_from_path(root, path);
+    if(fl == root) {
+      while(root->sub->len)
+        fl_list_remove(g_ptr_array_index(root->sub, root->sub->len-1));
+    } else if(fl)
+      fl_list_remove(fl);
+
+  } else if(*arg[0] == 'D' && argc == 2)
+    fl_journal_dir(root, path);
+
+  else if(*arg[0] == 'F' && argc == 4 && name[1] && istth(arg[3])) {
+    fl_list_t *fl = fl_list_create(name+1, TRUE);
+    fl->isfile = fl->hastth = TRUE;
+    fl->size = g_ascii_strtoull(arg[2], NULL, 10);
+    base32_decode(arg[3], fl->tth);
+    *name = 0;
+    fl_journal_put(fl_journal_dir(root, path), fl);
+  }
+
+done:
+  g_free(path);
+  g_strfreev(arg);
+}
+
+
+// Loads the snapshot and replays the first `end' bytes of the journal (the
+// entire journal if end < 0). Only complete records are replayed.
+static fl_list_t *fl_journal_load(gint64 end, GError **err) {
+  gboolean hasjournal = g_file_test(fl_journal_file, G_FILE_TEST_EXISTS);
+  fl_list_t *root;
+  // Without a snapshot the journal describes the entire list
+  if(hasjournal && !g_file_test(fl_local_list_file, G_FILE_TEST_EXISTS)) {
+    root = fl_list_create("", FALSE);
+    root->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  } else if(!(root = fl_load(fl_local_list_file, err, TRUE)))
+    return NULL;
+
+  char *dat;
+  gsize len;
+  if(!hasjournal || !g_file_get_contents(fl_journal_file, &dat, &len, NULL))
+    return root;
+  if(end >= 0 && end < len)
+    len = end;
+
+  char *line = dat, *eol;
+  while(line < dat+len && (eol = memchr(line, '\n', dat+len-line))) {
+    *eol = 0;
+    fl_journal_apply(root, line);
+    line = eol+1;
+  }
+  g_free(dat);
+  return root;
+}
+
+
+// Interim TTH index, used while the file list is being loaded at startup so
+// that TTH searches and TTH/ downloads don't have to wait for it. It is filled
+// from the hashfiles table, which may also have files that are not shared
+// anymore, so only files inside a shared directory are included. Their real
+// path is converted to a virtual path in the same way fl_local_path() does the
+// reverse. The files are only added to fl_interim_list, a sparse copy of the
+// virtual tree, when they are looked up. That way the results are regular
+// fl_list_t items that work with fl_list_path(), fl_local_path() and the
+// search functions, without building the entire tree twice.
+
+typedef struct fl_interim_t {
+  struct fl_interim_t *next; // next file with the same TTH
+  fl_list_t *fl;             // NULL if not in fl_interim_list (yet)
+  guint64 size;
+  char tth[24];
+  char vpath[];
+} fl_interim_t;
+
+typedef struct fl_interim_load_t {
+  GHashTable *idx;
+  char **shares;  // name, path, name, path, ...
+} fl_interim_load_t;
+
+static GHashTable *fl_interim_index = NULL; // tth -> fl_interim_t list
+static fl_list_t  *fl_interim_list = NULL;
+
+
+static void fl_interim_freelist(gpointer dat) {
+  fl_interim_t *n, *i = dat;
+  for(; i; i=n) {
+    n = i->next;
+    g_free(i);
+  }
+}
+
+
+// Called from db_fl_getall(), in the loading thread.
+static void fl_interim_addrow(const char *path, const char *tth, guint64 size, void *dat) {
+  fl_interim_load_t *l = dat;
+  if(!istth(tth))
+    return;
+  char **s = l->shares;
+  int plen = 0;
+  for(; *s; s+=2) {
+    plen = strlen(s[1]);
+    if(strncmp(path, s[1], plen) == 0 && plen && (path[plen] == '/' || s[1][plen-1] == '/'))
+      break;
+  }
+  if(!*s)
+    return;
+  const char *rel = path[plen] == '/' ? path+plen+1 : path+plen;
+  if(!*rel)
+    return;
+
+  int nlen = strlen(s[0]);
+  fl_interim_t *i = g_malloc(offsetof(fl_interim_t, vpath) + nlen + strlen(rel) + 3);
+  i->fl = NULL;
+  i->size = size;
+  base32_decode(tth, i->tth);
+  i->vpath[0] = '/';
+  strcpy(i->vpath+1, s[0]);
+  i->vpath[nlen+1] = '/';
+  strcpy(i->vpath+nlen+2, rel);
+
+  fl_interim_t *head = g_hash_table_lookup(l->idx, i->tth);
+  if(head) {
+    i->next = head->next;
+    head->next = i;
+  } else {
+    i->next = NULL;
+    g_hash_table_insert(l->idx, i->tth, i);
+  }
+}
+
+
+// Runs in the loading thread, shares is freed.
+static GHashTable *fl_interim_load(char **shares) {
+  fl_interim_load_t l;
+  l.idx = g_hash_table_new_full(g_int_hash, tiger_hash_equal, NULL, fl_interim_freelist);
+  l.shares = shares;
+  db_fl_getall(fl_interim_addrow, &l);
+  g_strfreev(shares);
+  return l.idx;
+}
+
+
+static void fl_interim_free() {
+  if(fl_interim_index)
+    g_hash_table_unref(fl_interim_index);
+  if(fl_interim_list)
+    fl_list_free(fl_interim_list);
+  fl_interim_index = NULL;
+  fl_interim_list = NULL;
+}
+
+
+static gboolean fl_interim_loaded(gpointer dat) {
+  fl_interim_free();
+  if(fl_loading)
+    fl_interim_index = dat;
+  else
+    g_hash_table_unref(dat);
+  return FALSE;
+}
+
+
+// Adds a file to fl_interim_list. Returns NULL if the path conflicts with a
+// file that is already there, which only happens with outdated rows.
+static fl_list_t *fl_interim_add(fl_interim_t *i) {
+  char *path = g_strdup(i->vpath+1);
+  char *name = strrchr(path, '/');
+  *(name++) = 0;
+
+  fl_list_t *dir = fl_interim_list, *fl = NULL;
+  char *cur = path, *next;
+  for(; dir && cur; cur=next) {
+    if((next = strchr(cur, '/')))
+      *(next++) = 0;
+    fl_list_t *n = fl_list_file(dir, cur);
+    if(!n) {
+      n = fl_list_create(cur, FALSE);
+      n->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      fl_journal_put(dir, n);
+    }
+    dir = n->isfile ? NULL : n;
+  }
+
+  if(dir && *name && !fl_list_file(dir, name)) {
+    fl = fl_list_create(name, TRUE);
+    fl->isfile = fl->hastth = TRUE;
+    fl->size = i->size;
+    memcpy(fl->tth, i->tth, 24);
+    fl_journal_put(dir, fl);
+  }
+  g_free(path);
+  return fl;
+}
+
+
+// Like fl_local_from_tth(), but looks in the interim index. The files with
+// this TTH are linked with fl_local_tthnext() as usual.
+static fl_list_t *fl_interim_from_tth(const char *root) {
+  fl_interim_t *head = fl_interim_index ? g_hash_table_lookup(fl_interim_index, root) : NULL;
+  if(!head)
+    return NULL;
+  if(!head->fl) {
+    if(!fl_interim_list) {
+      fl_interim_list = fl_list_create("", FALSE);
+      fl_interim_list->sub = g_ptr_array_new_with_free_func(fl_list_free);
+    }
+    fl_list_t *last = NULL;
+    fl_interim_t *i;
+    for(i=head; i; i=i->next) {
+      if(!(i->fl = fl_interim_add(i)))
+        continue;
+      fl_local_tthnext(i->fl) = NULL;
+      if(last)
+        fl_local_tthnext(last) = i->fl;
+      else
+        head->fl = i->fl;
+      last = i->fl;
+    }
+    // Nothing usable, don't try again
+    if(!head->fl) {
+      g_hash_table_remove(fl_interim_index, root);
+      return NULL;
+    }
+  }
+  return head->fl;
+}
+
+
+typedef struct fl_compact_t {
+  gint64 end;     // journal offset up to which the journal is replayed, -1 for all
+  char *cid;      // for compaction, NULL when loading the list at startup
+  char **shares;  // shared directories for fl_interim_load(), when loading at startup
+  fl_list_t *fl;  // the loaded list, when loading at startup
+  GError *err;
+} fl_compact_t;
+
+static void fl_init_loaded(fl_list_t *fl, GError *err, void *dat);
+
+
+static gboolean fl_compact_done(gpointer dat) {
+  fl_compact_t *c = dat;
+  if(!c->cid)
+    fl_init_loaded(c->fl, c->err, NULL);
+  else {
+    fl_compacting = FALSE;
+    if(c->err) {
+      ui_mf(uit_main_tab, UIP_MED, "Error saving file list: %s", c->err->message);
+      g_error_free(c->err);
+    } else
+      fl_journal_truncate(c->end);
+    g_free(c->cid);
+  }
+  g_slice_free(fl_compact_t, c);
+  return FALSE;
+}
+
+
+static gpointer fl_compact_thread(gpointer dat) {
+  fl_compact_t *c = dat;
+  if(c->shares)
+    g_idle_add(fl_interim_loaded, fl_interim_load(c->shares));
+  c->fl = fl_journal_load(c->end, &c->err);
+  if(c->fl && c->cid) {
+    fl_save(c->fl, c->cid, 0, FALSE, NULL, fl_local_list_file, &c->err);
+    fl_list_free(c->fl);
+    c->fl = NULL;
+  }
+  g_idle_add(fl_compact_done, c);
+  return NULL;
+}
+
+
+// Starts a compaction if there's anything to compact, or if we don't have a
+// files.xml.bz2 at all.
+static void fl_compact() {
+  if(fl_compacting || fl_loading || !fl_journal)
+    return;
+  if(!fl_journal_size && g_file_test(fl_local_list_file, G_FILE_TEST_EXISTS))
+    return;
+  fflush(fl_journal);
+  fl_compact_t *c = g_slice_new0(fl_compact_t);
+  c->end = fl_journal_size;
+  c->cid = g_strdup(var_get(0, VAR_cid));
+  fl_compacting = TRUE;
+  time(&fl_lastcompact);
+  g_thread_create(fl_compact_thread, c, FALSE, NULL);
 }
 
 
-// should be run from a timer. periodically flushes all unsaved data to disk.
+// Flushes the journal. Also called from a timer.
 gboolean fl_flush(gpointer dat) {
+  // The journal is only opened when the list has been loaded
+  if(fl_loading)
+    return TRUE;
   if(fl_needflush) {
-    // save our file list
-    GError *err = NULL;
-    if(!fl_save(fl_local_list, var_get(0, VAR_cid), 0, FALSE, NULL, fl_local_list_file, &err)) {
-      // this is a pretty fatal error... oh well, better luck next time
-      ui_mf(uit_main_tab, UIP_MED, "Error saving file list: %s", err->message);
-      g_error_free(err);
+    if(fl_journal && fflush(fl_journal))
+      ui_mf(uit_main_tab, UIP_MED, "Error writing %s: %s", fl_journal_file, g_strerror(errno));
+    // Remembered for the next startup, see fl_init()
+    char *tmp = g_strdup_printf("%"G_GUINT64_FORMAT" %d", fl_local_list_size, fl_local_list_length);
+    char *old = var_get(0, VAR_fl_size);
+    if(!old || strcmp(old, tmp) != 0)
+      var_set(0, VAR_fl_size, tmp, NULL);
+    g_free(tmp);
+  }
+  fl_needflush = FALSE;
+  if(fl_journal_size >= FL_JOURNAL_MAX)
+    fl_compact();
+  return TRUE;
+}
+
+
+// Called when our files.xml.bz2 is about to be uploaded to a peer. Starts a
+// compaction in the background to bring it up to date, at most once every
+// FL_FLUSH_INTERVAL seconds. The peer that triggered this still gets the
+// current snapshot, as waiting for the compaction would stall the upload.
+void fl_flush_request() {
+  if(fl_lastcompact + FL_FLUSH_INTERVAL <= time(NULL))
+    fl_compact();
+}
+
+// are we currently refreshing the share?
+gboolean fl_is_refreshing(void) {
+  return fl_refresh_queue && fl_refresh_queue->head;
+}
+
+// Cache of partial file lists, as generated for ADCGET list requests. Entries
+// are identified by the virtual path of the directory and the parameters of
+// the request, and are invalidated when something in or above that directory
+// is modified. The most recently used entries are at the head of the queue.
+
+typedef struct fl_listcache_t {
+  char *path;
+  gboolean re1, zlib;
+  GString *buf;
+  int len; // uncompressed size, as returned by fl_save()
+} fl_listcache_t;
+
+static GQueue *fl_listcache = NULL;
+static gsize   fl_listcache_size = 0;
+
+// Maximum total size of the cached lists
+#define FL_LISTCACHE_MAX (8*1024*1024)
+
+
+static void fl_listcache_free(fl_listcache_t *c) {
+  fl_listcache_size -= c->buf->len;
+  g_free(c->path);
+  g_string_free(c->buf, TRUE);
+  g_slice_free(fl_listcache_t, c);
+}
+
+
+// Returns TRUE if path a is equal to or a parent of path b.
+static gboolean fl_listcache_contains(const char *a, const char *b) {
+  int len = strlen(a);
+  return strncmp(a, b, len) == 0 && (!b[len] || b[len] == '/' || (len == 1 && *a == '/'));
+}
+
+
+static gboolean fl_upcache_isempty();
+static void fl_upcache_invalidate(const char *path);
+
+// Removes all cache entries that may include information about the given item.
+// That is, listings of any of its parents, of the item itself, and of
+// anything inside the item. fl = NULL clears the entire cache. This also
+// invalidates the open files of the upload cache.
+static void fl_listcache_invalidate(fl_list_t *fl) {
+  gboolean empty = !fl_listcache || !fl_listcache->head;
+  if(empty && fl_upcache_isempty())
+    return;
+  char *path = fl ? fl_list_path(fl) : NULL;
+  fl_upcache_invalidate(path);
+  if(empty) {
+    g_free(path);
+    return;
+  }
+  GList *n, *next;
+  for(n=fl_listcache->head; n; n=next) {
+    next = n->next;
+    fl_listcache_t *c = n->data;
+    if(!path || fl_listcache_contains(c->path, path) || fl_listcache_contains(path, c->path)) {
+      fl_listcache_free(c);
+      g_queue_delete_link(fl_listcache, n);
+    }
+  }
+  g_free(path);
+}
+
+
+// Called when our CID has changed, since the cached lists include it.
+void fl_local_cidchange() {
+  fl_listcache_invalidate(NULL);
+}
+
+
+// Returns the serialized (and possibly zlib-compressed) partial file list of a
+// local directory, for the ADCGET list command. The uncompressed size is
+// written to *len. The returned buffer is owned by the cache and is only valid
+// until control is returned to the main loop. Returns NULL on error.
+GString *fl_local_partial(fl_list_t *dir, gboolean re1, gboolean zlib, int *len, GError **err) {
+  if(!fl_listcache)
+    fl_listcache = g_queue_new();
+  char *path = fl_list_path(dir);
+
+  // Cache lookup
+  GList *n;
+  for(n=fl_listcache->head; n; n=n->next) {
+    fl_listcache_t *c = n->data;
+    if(!c->re1 == !re1 && !c->zlib == !zlib && strcmp(c->path, path) == 0)
+      break;
+  }
+  if(n) {
+    g_queue_unlink(fl_listcache, n);
+    g_queue_push_head_link(fl_listcache, n);
+    g_free(path);
+    fl_listcache_t *c = n->data;
+    *len = c->len;
+    return c->buf;
+  }
+
+  // Use a targetsize of 16k for non-recursive lists and 256k for recursive
+  // ones. This should give useful results in most cases. The only exception
+  // here is Jucy, which does not handle "Incomplete" entries in a recursive
+  // list, but... yeah, that's Jucy's problem. :-)
+  GString *buf = g_string_new("");
+  *len = fl_save(dir, var_get(0, VAR_cid), re1 ? 256*1024 : 16*1024, zlib, buf, NULL, err);
+  if(!*len) {
+    g_string_free(buf, TRUE);
+    g_free(path);
+    return NULL;
+  }
+
+  // Add to the cache and throw out the least recently used entries
+  fl_listcache_t *c = g_slice_new(fl_listcache_t);
+  c->path = path;
+  c->re1 = re1;
+  c->zlib = zlib;
+  c->buf = buf;
+  c->len = *len;
+  fl_listcache_size += buf->len;
+  g_queue_push_head(fl_listcache, c);
+  while(fl_listcache_size > FL_LISTCACHE_MAX && fl_listcache->tail->data != c)
+    fl_listcache_free(g_queue_pop_tail(fl_listcache));
+  return buf;
+}
+
+
+// Cache of open files for uploads. Popular files tend to be requested by many
+// users in small segments, and resolving the requested path, building the
+// real path and opening the file each time adds up. Entries are identified
+// by the ID from the GET request (a virtual path or TTH/<root>) and hold an
+// open file descriptor, each upload gets its own dup() of it. Since uploads
+// only use explicit offsets, sharing the file description is fine. Entries
+// are invalidated together with the partial list cache, and are reopened
+// after FL_UPCACHE_TTL seconds in case the file has been replaced on disk.
+
+typedef struct fl_upcache_t {
+  char *id;
+  char *vpath;
+  char tth[24];
+  int fd;
+  time_t opened;
+} fl_upcache_t;
+
+static GQueue *fl_upcache = NULL; // most recently used first
+
+#define FL_UPCACHE_MAX 32
+#define FL_UPCACHE_TTL 300
+
+
+static void fl_upcache_free(fl_upcache_t *c) {
+  close(c->fd);
+  g_free(c->id);
+  g_free(c->vpath);
+  g_slice_free(fl_upcache_t, c);
+}
+
+
+static gboolean fl_upcache_isempty() {
+  return !fl_upcache || !fl_upcache->head;
+}
+
+
+// Removes the entries of the given file or anything inside the given
+// directory, path = NULL clears the entire cache.
+static void fl_upcache_invalidate(const char *path) {
+  if(!fl_upcache)
+    return;
+  GList *n, *next;
+  for(n=fl_upcache->head; n; n=next) {
+    next = n->next;
+    fl_upcache_t *c = n->data;
+    if(!path || fl_listcache_contains(path, c->vpath)) {
+      fl_upcache_free(c);
+      g_queue_delete_link(fl_upcache, n);
+    }
+  }
+}
+
+
+static fl_upcache_t *fl_upcache_open(const char *id) {
+  fl_list_t *f = NULL;
+  if(id[0] == '/' && fl_local_list)
+    f = fl_list_from_path(fl_local_list, id);
+  else if(strncmp(id, "TTH/", 4) == 0 && istth(id+4)) {
+    char root[24];
+    base32_decode(id+4, root);
+    f = fl_local_from_tth(root);
+  }
+  if(!f || !f->isfile)
+    return NULL;
+
+  char *tmp = fl_local_path(f);
+  char *path = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
+  g_free(tmp);
+  int fd = path ? open(path, O_RDONLY) : -1;
+  struct stat st;
+  if(fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+    close(fd);
+    fd = -1;
+    errno = EISDIR;
+  }
+  if(fd < 0) {
+    if(path)
+      g_message("Error opening '%s' for sending: %s", path, g_strerror(errno));
+    g_free(path);
+    return NULL;
+  }
+  g_free(path);
+
+  fl_upcache_t *c = g_slice_new(fl_upcache_t);
+  c->id = g_strdup(id);
+  c->vpath = fl_list_path(f);
+  memcpy(c->tth, f->tth, 24);
+  c->fd = fd;
+  c->opened = time(NULL);
+  return c;
+}
+
+
+// Opens a local file for uploading. id is either a virtual path or
+// TTH/<root>. Returns a file descriptor, which must be closed by the caller,
+// or -1 if the file is not available. The virtual path (to be freed by the
+// caller), TTH root and current file size are written to the respective
+// arguments. The file offset of the returned descriptor is shared, so it
+// should only be accessed with pread() or sendfile() with an explicit offset.
+int fl_local_open(const char *id, char **vpath, char *tth, guint64 *size) {
+  if(!fl_upcache)
+    fl_upcache = g_queue_new();
+  time_t now = time(NULL);
+
+  GList *n;
+  for(n=fl_upcache->head; n; n=n->next)
+    if(strcmp(((fl_upcache_t *)n->data)->id, id) == 0)
+      break;
+  fl_upcache_t *c = n ? n->data : NULL;
+  struct stat st;
+  if(c && (now - c->opened > FL_UPCACHE_TTL || now < c->opened || fstat(c->fd, &st) < 0)) {
+    fl_upcache_free(c);
+    g_queue_delete_link(fl_upcache, n);
+    c = NULL;
+  }
+
+  if(c) {
+    g_queue_unlink(fl_upcache, n);
+    g_queue_push_head_link(fl_upcache, n);
+  } else {
+    if(!(c = fl_upcache_open(id)) || fstat(c->fd, &st) < 0) {
+      if(c)
+        fl_upcache_free(c);
+      return -1;
+    }
+    g_queue_push_head(fl_upcache, c);
+    if(fl_upcache->length > FL_UPCACHE_MAX)
+      fl_upcache_free(g_queue_pop_tail(fl_upcache));
+  }
+
+  int fd = dup(c->fd);
+  if(fd < 0) {
+    g_message("Error duplicating file descriptor for '%s': %s", c->vpath, g_strerror(errno));
+    return -1;
+  }
+  *vpath = g_strdup(c->vpath);
+  memcpy(tth, c->tth, 24);
+  *size = st.st_size;
+  return fd;
+}
+
+
+// LRU cache of TTHL data, for uploads. Hash data of a root never changes, but
+// is removed by /gc once the file isn't shared anymore, so the cache is
+// cleared after each refresh.
+
+typedef struct fl_tthlcache_t {
+  char root[24];
+  int len;
+  char dat[];
+} fl_tthlcache_t;
+
+static GHashTable *fl_tthlcache = NULL; // root -> GList node in fl_tthlcache_lru
+static GQueue     *fl_tthlcache_lru;    // most recently used first
+static gsize       fl_tthlcache_size = 0;
+
+// Maximum total size of the cached TTHL data
+#define FL_TTHLCACHE_MAX (4*1024*1024)
+
+
+static void fl_tthlcache_clear() {
+  if(!fl_tthlcache)
+    return;
+  g_hash_table_remove_all(fl_tthlcache);
+  while(fl_tthlcache_lru->head)
+    g_free(g_queue_pop_head(fl_tthlcache_lru));
+  fl_tthlcache_size = 0;
+}
+
+
+// Returns the TTHL data of the given root, or NULL if it's not in the
+// database. The returned buffer is owned by the cache and is only valid until
+// control is returned to the main loop.
+char *fl_local_tthl(const char *root, int *len) {
+  if(!fl_tthlcache) {
+    fl_tthlcache = g_hash_table_new(g_int_hash, tiger_hash_equal);
+    fl_tthlcache_lru = g_queue_new();
+  }
+
+  GList *l = g_hash_table_lookup(fl_tthlcache, root);
+  if(l) {
+    g_queue_unlink(fl_tthlcache_lru, l);
+    g_queue_push_head_link(fl_tthlcache_lru, l);
+    fl_tthlcache_t *c = l->data;
+    *len = c->len;
+    return c->dat;
+  }
+
+  char *dat = db_fl_gettthl(root, len);
+  if(!dat)
+    return NULL;
+
+  fl_tthlcache_t *c = g_malloc(sizeof(fl_tthlcache_t) + *len);
+  memcpy(c->root, root, 24);
+  c->len = *len;
+  memcpy(c->dat, dat, *len);
+  g_free(dat);
+  g_queue_push_head(fl_tthlcache_lru, c);
+  g_hash_table_insert(fl_tthlcache, c->root, fl_tthlcache_lru->head);
+  fl_tthlcache_size += c->len;
+  while(fl_tthlcache_size > FL_TTHLCACHE_MAX && fl_tthlcache_lru->tail->data != c) {
+    fl_tthlcache_t *o = g_queue_pop_tail(fl_tthlcache_lru);
+    g_hash_table_remove(fl_tthlcache, o->root);
+    fl_tthlcache_size -= o->len;
+    g_free(o);
+  }
+  return c->dat;
+}
+
+
+// Search index. This is an inverted index on the (casefolded) tokens in the
+// names of the items in fl_local_list, used to quickly find candidates for
+// non-TTH searches. Tokens are the sequences of alphanumeric characters in a
+// name. Since keywords may match anywhere within a name, the tokens are in
+// turn indexed on their byte trigrams. There are similar indices on the file
+// extensions and on the file sizes (in power-of-two buckets).
+// Rather than pointing to the items themselves, each index entry holds the
+// set of directories in which at least one item has the token, extension or
+// size. This keeps the index small, the remaining checks are performed on the
+// items within those directories.
+//
+// Files are only indexed when they have a TTH, since files without one won't
+// be matched anyway. Directories are always indexed, except the root.
+
+typedef struct fl_searchset_t {
+  fl_list_t *dir;   // if there is only a single directory in this set
+  int refs;         // number of items in that directory
+  GHashTable *dirs; // otherwise: key = directory, value = number of items
+} fl_searchset_t;
+
+typedef struct fl_searchkey_t {
+  fl_searchset_t set;
+  char name[1];
+} fl_searchkey_t;
+
+static GHashTable *fl_search_tokens;   // key = token, value = fl_searchkey_t
+static GHashTable *fl_search_trigrams; // key = trigram, value = GPtrArray of fl_searchkey_t (from fl_search_tokens)
+static GHashTable *fl_search_exts;     // key = extension, value = fl_searchkey_t
+static fl_searchset_t fl_search_sizes[65]; // index = g_bit_storage(size)
+
+#define fl_searchindex_trigram(s) GUINT_TO_POINTER((((guint)(guchar)(s)[0])<<16) + (((guint)(guchar)(s)[1])<<8) + (guint)(guchar)(s)[2])
+
+
+static void fl_searchset_add(fl_searchset_t *set, fl_list_t *dir) {
+  if(!set->dirs && (!set->dir || set->dir == dir)) {
+    set->dir = dir;
+    set->refs++;
+    return;
+  }
+  if(!set->dirs) {
+    set->dirs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(set->dirs, set->dir, GINT_TO_POINTER(set->refs));
+    set->dir = NULL;
+  }
+  int n = GPOINTER_TO_INT(g_hash_table_lookup(set->dirs, dir));
+  g_hash_table_insert(set->dirs, dir, GINT_TO_POINTER(n+1));
+}
+
+
+// Returns TRUE if the set is empty after removing the directory.
+static gboolean fl_searchset_del(fl_searchset_t *set, fl_list_t *dir) {
+  if(!set->dirs) {
+    g_return_val_if_fail(set->dir == dir, !set->dir);
+    if(!--set->refs)
+      set->dir = NULL;
+    return !set->dir;
+  }
+  int n = GPOINTER_TO_INT(g_hash_table_lookup(set->dirs, dir));
+  g_return_val_if_fail(n > 0, FALSE);
+  if(n > 1)
+    g_hash_table_insert(set->dirs, dir, GINT_TO_POINTER(n-1));
+  else
+    g_hash_table_remove(set->dirs, dir);
+  if(g_hash_table_size(set->dirs))
+    return FALSE;
+  g_hash_table_unref(set->dirs);
+  set->dirs = NULL;
+  return TRUE;
+}
+
+
+static void fl_searchkey_add(GHashTable *tbl, const char *name, fl_list_t *dir, gboolean trigrams) {
+  fl_searchkey_t *k = g_hash_table_lookup(tbl, name);
+  if(!k) {
+    int len = strlen(name);
+    k = g_malloc0(offsetof(fl_searchkey_t, name) + len + 1);
+    strcpy(k->name, name);
+    g_hash_table_insert(tbl, k->name, k);
+    int i;
+    for(i=0; trigrams && i+3<=len; i++) {
+      GPtrArray *l = g_hash_table_lookup(fl_search_trigrams, fl_searchindex_trigram(name+i));
+      if(!l) {
+        l = g_ptr_array_new();
+        g_hash_table_insert(fl_search_trigrams, fl_searchindex_trigram(name+i), l);
+      }
+      g_ptr_array_add(l, k);
+    }
+  }
+  fl_searchset_add(&k->set, dir);
+}
+
+
+static void fl_searchkey_del(GHashTable *tbl, const char *name, fl_list_t *dir, gboolean trigrams) {
+  fl_searchkey_t *k = g_hash_table_lookup(tbl, name);
+  g_return_if_fail(k);
+  if(!fl_searchset_del(&k->set, dir))
+    return;
+  int i, len = strlen(name);
+  for(i=0; trigrams && i+3<=len; i++) {
+    GPtrArray *l = g_hash_table_lookup(fl_search_trigrams, fl_searchindex_trigram(name+i));
+    g_ptr_array_remove_fast(l, k);
+    if(!l->len) {
+      g_hash_table_remove(fl_search_trigrams, fl_searchindex_trigram(name+i));
+      g_ptr_array_unref(l);
+    }
+  }
+  g_hash_table_remove(tbl, name);
+  g_free(k);
+}
+
+
+// Casefolds a string and replaces all non-alphanumeric characters with zero
+// bytes, so that the result is a sequence of NUL-separated tokens. The length
+// of the result (including the zero bytes) is written to *len. The returned
+// string should be g_free()'d.
+static char *fl_searchindex_split(const char *name, int *len) {
+  char *str = g_utf8_casefold(name, -1);
+  char *t, *n;
+  for(t=str; *t; t=n) {
+    n = g_utf8_next_char(t);
+    if(!g_unichar_isalnum(g_utf8_get_char(t)))
+      memset(t, 0, n-t);
+  }
+  *len = t-str;
+  return str;
+}
+
+
+// Incremented on every change to the search index, see fl_local_search().
+static guint64 fl_search_generation = 0;
+
+
+// Adds (add=TRUE) or removes (add=FALSE) an item to/from the search index.
+static void fl_searchindex_update(fl_list_t *fl, gboolean add) {
+  fl_list_t *dir = fl->parent;
+  fl_search_generation++;
+  if(!dir)
+    return;
+
+  int len;
+  char *tokens = fl_searchindex_split(fl->name, &len);
+  char *t;
+  for(t=tokens; t<tokens+len; t+=strlen(t)+1)
+    if(*t)
+      (add ? fl_searchkey_add : fl_searchkey_del)(fl_search_tokens, t, dir, TRUE);
+  g_free(tokens);
+
+  char *ext = strrchr(fl->name, '.');
+  if(ext && ext[1]) {
+    ext = g_utf8_casefold(ext+1, -1);
+    (add ? fl_searchkey_add : fl_searchkey_del)(fl_search_exts, ext, dir, FALSE);
+    g_free(ext);
+  }
+
+  if(fl->isfile) {
+    fl_searchset_t *set = fl_search_sizes + g_bit_storage(fl->size);
+    if(add)
+      fl_searchset_add(set, dir);
+    else
+      fl_searchset_del(set, dir);
+  }
+}
+
+#define fl_searchindex_insert(fl) fl_searchindex_update(fl, TRUE)
+#define fl_searchindex_del(fl) fl_searchindex_update(fl, FALSE)
+
+
+// Returns whether fl is already in the results list
+static gboolean fl_local_search_hasres(fl_list_t **res, int n, fl_list_t *fl) {
+  int i;
+  for(i=0; i<n; i++)
+    if(res[i] == fl)
+      return TRUE;
+  return FALSE;
+}
+
+
+// Matches the items in the given directory. If key is set, only items matching
+// key are considered, and directories matching key will be searched
+// recursively. *walked is used to avoid recursing into the same directory
+// twice.
+static int fl_local_search_dir(fl_list_t *dir, fl_search_t *s, guint64 key, GPtrArray *walked, fl_list_t **res, int n, int max) {
+  int i, j;
+  for(i=0; n<max && i<dir->sub->len; i++) {
+    fl_list_t *c = g_ptr_array_index(dir->sub, i);
+    if(key && G_LIKELY(!(str_matcher_match(s->match, c->name) & key)))
+      continue;
+    if(!fl_local_search_hasres(res, n, c) && fl_search_match_full(c, s))
+      res[n++] = c;
+    if(!key || c->isfile || n >= max)
+      continue;
+
+    for(j=0; j<walked->len; j++)
+      if(c == g_ptr_array_index(walked, j) || fl_list_is_child(g_ptr_array_index(walked, j), c))
+        break;
+    if(j < walked->len)
+      continue;
+    g_ptr_array_add(walked, c);
+    fl_list_t *sub[max-n];
+    int m = fl_search_rec_full(c, s, sub, max-n);
+    for(j=0; j<m; j++)
+      if(!fl_local_search_hasres(res, n, sub[j]))
+        res[n++] = sub[j];
+  }
+  return n;
+}
+
+
+static int fl_local_search_set(fl_searchset_t *set, fl_search_t *s, guint64 key, GPtrArray *walked, fl_list_t **res, int n, int max) {
+  if(!set->dirs)
+    return set->dir ? fl_local_search_dir(set->dir, s, key, walked, res, n, max) : n;
+  GHashTableIter iter;
+  fl_list_t *dir;
+  g_hash_table_iter_init(&iter, set->dirs);
+  while(n < max && g_hash_table_iter_next(&iter, (gpointer *)&dir, NULL))
+    n = fl_local_search_dir(dir, s, key, walked, res, n, max);
+  return n;
+}
+
+
+// Search for items matching the (casefolded) token in fl_search_tokens. key
+// is the bit in s->match of the keyword the token has been taken from.
+static int fl_local_search_token(const char *token, fl_search_t *s, guint64 key, fl_list_t **res, int max) {
+  GPtrArray *walked = g_ptr_array_new();
+  GPtrArray *l = NULL;
+  int i, n = 0, len = strlen(token);
+
+  // Tokens of three bytes or longer: look for the rarest trigram
+  if(len >= 3) {
+    for(i=0; i+3<=len; i++) {
+      GPtrArray *c = g_hash_table_lookup(fl_search_trigrams, fl_searchindex_trigram(token+i));
+      if(!c || !l || c->len < l->len)
+        l = c;
+      if(!l)
+        break;
+    }
+    for(i=0; l && n<max && i<l->len; i++) {
+      fl_searchkey_t *k = g_ptr_array_index(l, i);
+      if(strstr(k->name, token))
+        n = fl_local_search_set(&k->set, s, key, walked, res, n, max);
+    }
+
+  // Shorter ones: go through all tokens
+  } else {
+    GHashTableIter iter;
+    fl_searchkey_t *k;
+    g_hash_table_iter_init(&iter, fl_search_tokens);
+    while(n < max && g_hash_table_iter_next(&iter, NULL, (gpointer *)&k))
+      if(strstr(k->name, token))
+        n = fl_local_search_set(&k->set, s, key, walked, res, n, max);
+  }
+
+  g_ptr_array_unref(walked);
+  return n;
+}
+
+
+static int fl_local_search_index(fl_search_t *s, char **and, fl_list_t **res, int max) {
+  // Use the longest token of any of the keywords, this is likely to be the
+  // most selective one.
+  int i, key = 0, len;
+  char *token = NULL;
+  for(i=0; and && and[i] && i<64; i++) {
+    char *tokens = fl_searchindex_split(and[i], &len);
+    char *t;
+    for(t=tokens; t<tokens+len; t+=strlen(t)+1)
+      if(!token || strlen(t) > strlen(token)) {
+        g_free(token);
+        token = g_strdup(t);
+        key = i;
+      }
+    g_free(tokens);
+  }
+  int n = 0;
+
+  // Keyword search
+  if(token && *token)
+    n = fl_local_search_token(token, s, ((guint64)1)<<key, res, max);
+
+  // Lookup by extension
+  else if(s->ext && *s->ext) {
+    char **ext;
+    for(ext=s->ext; n<max && *ext; ext++) {
+      char *e = g_utf8_casefold(*ext, -1);
+      fl_searchkey_t *k = g_hash_table_lookup(fl_search_exts, e);
+      if(k)
+        n = fl_local_search_set(&k->set, s, 0, NULL, res, n, max);
+      g_free(e);
+    }
+
+  // Lookup by file size
+  } else if(s->filedir == 1 && s->sizem != -2) {
+    int b = g_bit_storage(s->size);
+    int end = s->sizem > 0 ? 64 : b;
+    for(i = s->sizem < 0 ? 0 : b; n<max && i<=end; i++)
+      n = fl_local_search_set(fl_search_sizes+i, s, 0, NULL, res, n, max);
+
+  // Nothing to use the index for, do a full search
+  } else
+    n = fl_search_rec(fl_local_list, s, res, max);
+
+  g_free(token);
+  return n;
+}
+
+
+// Cache of recent search results. Hubs tend to relay the same popular
+// searches from many users in a short time, so the results are remembered for
+// each (normalized) query. Any change to the search index increments
+// fl_search_generation, which invalidates the entire cache; that also ensures
+// that the cached fl_list_t pointers are always valid.
+
+typedef struct fl_searchcache_t {
+  char *key;
+  int n;
+  fl_list_t *res[];
+} fl_searchcache_t;
+
+static GHashTable *fl_searchcache = NULL; // key -> GList node in fl_searchcache_lru
+static GQueue     *fl_searchcache_lru;    // most recently used first
+static guint64     fl_searchcache_gen;
+guint64            fl_search_cache_hits = 0;
+guint64            fl_search_cache_lookups = 0;
+
+#define FL_SEARCHCACHE_MAX 256
+
+
+static gint fl_searchcache_strcmp(gconstpointer a, gconstpointer b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+
+// Appends the lowercased and sorted list of strings to the key.
+static void fl_searchcache_keylist(GString *key, char **list) {
+  int i, n = list ? g_strv_length(list) : 0;
+  char *low[n+1];
+  for(i=0; i<n; i++)
+    low[i] = str_matcher_lowercase(list[i]);
+  qsort(low, n, sizeof(char *), fl_searchcache_strcmp);
+  for(i=0; i<n; i++) {
+    g_string_append(key, low[i]);
+    g_string_append_c(key, 1);
+    g_free(low[i]);
+  }
+  g_string_append_c(key, 2);
+}
+
+
+static char *fl_searchcache_key(fl_search_t *s, char **and, char **not, int max) {
+  GString *key = g_string_new("");
+  g_string_printf(key, "%d %d %"G_GUINT64_FORMAT" %d ", s->sizem, s->filedir, s->sizem == -2 ? 0 : s->size, max);
+  fl_searchcache_keylist(key, and);
+  fl_searchcache_keylist(key, not);
+  fl_searchcache_keylist(key, s->ext);
+  return g_string_free(key, FALSE);
+}
+
+
+static void fl_searchcache_free(gpointer dat) {
+  fl_searchcache_t *c = dat;
+  g_free(c->key);
+  g_free(c);
+}
+
+
+static void fl_searchcache_clear() {
+  g_hash_table_remove_all(fl_searchcache);
+  while(fl_searchcache_lru->head)
+    fl_searchcache_free(g_queue_pop_head(fl_searchcache_lru));
+}
+
+
+// Searches the local file list, used for replying to non-TTH $Search and SCH
+// requests. `and' and `not' should contain the keywords that have been passed
+// to fl_search_keywords(). Returns the number of items written to res.
+int fl_local_search(fl_search_t *s, char **and, char **not, fl_list_t **res, int max) {
+  if(!fl_local_list || !fl_local_list->sub)
+    return 0;
+
+  if(!fl_searchcache) {
+    fl_searchcache = g_hash_table_new(g_str_hash, g_str_equal);
+    fl_searchcache_lru = g_queue_new();
+  }
+  if(fl_searchcache_gen != fl_search_generation) {
+    fl_searchcache_clear();
+    fl_searchcache_gen = fl_search_generation;
+  }
+
+  fl_search_cache_lookups++;
+  char *key = fl_searchcache_key(s, and, not, max);
+  GList *l = g_hash_table_lookup(fl_searchcache, key);
+  if(l) {
+    fl_search_cache_hits++;
+    g_free(key);
+    g_queue_unlink(fl_searchcache_lru, l);
+    g_queue_push_head_link(fl_searchcache_lru, l);
+    fl_searchcache_t *c = l->data;
+    memcpy(res, c->res, c->n*sizeof(fl_list_t *));
+    return c->n;
+  }
+
+  int n = fl_local_search_index(s, and, res, max);
+
+  fl_searchcache_t *c = g_malloc(sizeof(fl_searchcache_t) + n*sizeof(fl_list_t *));
+  c->key = key;
+  c->n = n;
+  memcpy(c->res, res, n*sizeof(fl_list_t *));
+  g_queue_push_head(fl_searchcache_lru, c);
+  g_hash_table_insert(fl_searchcache, key, fl_searchcache_lru->head);
+  if(fl_searchcache_lru->length > FL_SEARCHCACHE_MAX) {
+    c = g_queue_pop_tail(fl_searchcache_lru);
+    g_hash_table_remove(fl_searchcache, c->key);
+    fl_searchcache_free(c);
+  }
+  return n;
+}
+
+
+
+
+
+// Hash index interface. These operate on fl_hash_index and make sure
+// fl_local_list_size and _length stay correct.
+//
+// The index is an open addressing hash table with linear probing. Each slot
+// holds a copy of the TTH root, so that a lookup only has to touch the table
+// itself, and a pointer to the first file with that TTH. Any other files with
+// the same TTH are linked through fl_list_local_t.hashnext. Slots are 32 bytes
+// (on 64-bit systems) and the table is aligned to a cache line, so a slot
+// never straddles two lines. The first 4 bytes of the TTH are random enough to
+// be used as the hash value. Deletion uses backward shifting, so there are no
+// tombstones and the load factor stays below FL_HASHINDEX_LOAD.
+
+#if INTERFACE
+
+struct fl_hashslot_t {
+  char tth[24];
+  fl_list_t *fl; // NULL if the slot is empty
+};
+
+struct fl_hashindex_t {
+  fl_hashslot_t *slots;
+  guint32 mask;  // number of slots - 1
+  guint32 count; // number of used slots
+};
+
+#define fl_local_tthnext(f) (fl_list_getlocal(f).hashnext)
+
+#endif
+
+#define FL_HASHINDEX_MIN 1024
+#define FL_HASHINDEX_LOAD 0.7
+
+// Bloom filters of the hash index, as requested by ADC hubs. Most hubs use the
+// same parameters every time, so the last few filters are kept around and
+// updated as files are added. Removing a TTH can't be done incrementally, so
+// that only marks the filters as dirty, to be rebuilt on the next request.
+typedef struct fl_bloomcache_t {
+  bloom_t b;
+  gboolean dirty;
+} fl_bloomcache_t;
+
+static GSList *fl_bloom_cache = NULL; // most recently used first
+#define FL_BLOOM_CACHE 4
+
+static guint32 fl_hashindex_hash(const char *tth) {
+  guint32 h;
+  memcpy(&h, tth, 4);
+  return h;
+}
+
+
+// Returns the slot for the given TTH, which is either the slot that holds it
+// or the empty slot where it should be inserted.
+static fl_hashslot_t *fl_hashindex_lookup(const char *tth) {
+  guint32 i = fl_hashindex_hash(tth) & fl_hash_index.mask;
+  fl_hashslot_t *s;
+  while((s = fl_hash_index.slots+i)->fl && memcmp(s->tth, tth, 24) != 0)
+    i = (i+1) & fl_hash_index.mask;
+  return s;
+}
+
+
+// Resizes the table to the smallest size that holds n items.
+static void fl_hashindex_resize(guint32 n) {
+  guint32 size = FL_HASHINDEX_MIN;
+  while(size*FL_HASHINDEX_LOAD < n)
+    size <<= 1;
+  if(fl_hash_index.slots && size == fl_hash_index.mask+1)
+    return;
+
+  fl_hashslot_t *old = fl_hash_index.slots;
+  guint32 i, oldsize = old ? fl_hash_index.mask+1 : 0;
+  void *mem;
+  if(posix_memalign(&mem, 64, size*sizeof(fl_hashslot_t)))
+    g_error("Unable to allocate memory for the hash index.");
+  memset(mem, 0, size*sizeof(fl_hashslot_t));
+  fl_hash_index.slots = mem;
+  fl_hash_index.mask = size-1;
+  for(i=0; i<oldsize; i++)
+    if(old[i].fl)
+      *fl_hashindex_lookup(old[i].tth) = old[i];
+  free(old);
+}
+
+
+// Add to the hash index
+static void fl_hashindex_insert(fl_list_t *fl) {
+  if((fl_hash_index.count+1) > (fl_hash_index.mask+1)*FL_HASHINDEX_LOAD)
+    fl_hashindex_resize(fl_hash_index.count+1);
+  fl_hashslot_t *s = fl_hashindex_lookup(fl->tth);
+  if(s->fl) {
+    // insert item without modifying the first item
+    fl_local_tthnext(fl) = fl_local_tthnext(s->fl);
+    fl_local_tthnext(s->fl) = fl;
+  } else {
+    memcpy(s->tth, fl->tth, 24);
+    s->fl = fl;
+    fl_local_tthnext(fl) = NULL;
+    fl_hash_index.count++;
+    GSList *l;
+    for(l=fl_bloom_cache; l; l=l->next) {
+      fl_bloomcache_t *c = l->data;
+      if(!c->dirty)
+        bloom_add(&c->b, fl->tth);
+    }
+    fl_local_list_size += fl->size;
+  }
+  fl_local_list_length = fl_hash_index.count;
+  fl_searchindex_insert(fl);
+}
+
+
+// Removes the given slot, shifting back any items that would otherwise become
+// unreachable.
+static void fl_hashindex_delslot(fl_hashslot_t *s) {
+  guint32 mask = fl_hash_index.mask;
+  guint32 i = s - fl_hash_index.slots, j = i;
+  while(1) {
+    j = (j+1) & mask;
+    fl_hashslot_t *n = fl_hash_index.slots+j;
+    if(!n->fl)
+      break;
+    // Only move n to i if its home slot isn't cyclically within (i, j]
+    guint32 k = fl_hashindex_hash(n->tth) & mask;
+    if(((j-k) & mask) >= ((j-i) & mask)) {
+      fl_hash_index.slots[i] = *n;
+      i = j;
+    }
+  }
+  fl_hash_index.slots[i].fl = NULL;
+  fl_hash_index.count--;
+
+  GSList *l;
+  for(l=fl_bloom_cache; l; l=l->next)
+    ((fl_bloomcache_t *)l->data)->dirty = TRUE;
+}
+
+
+// ...and remove a file. This is done when a file is actually removed from the
+// share, or when its TTH information has been invalidated.
+static void fl_hashindex_del(fl_list_t *fl) {
+  if(!fl->hastth)
+    return;
+  fl_searchindex_del(fl);
+  fl_hashslot_t *s = fl_hashindex_lookup(fl->tth);
+  fl->hastth = FALSE;
+  g_return_if_fail(s->fl);
+
+  if(s->fl == fl) {
+    s->fl = fl_local_tthnext(fl);
+    if(!s->fl) {
+      fl_hashindex_delslot(s);
+      fl_local_list_size -= fl->size;
+    }
+  // there's another file with the same TTH.
+  } else {
+    fl_list_t *c = s->fl;
+    while(fl_local_tthnext(c) && fl_local_tthnext(c) != fl)
+      c = fl_local_tthnext(c);
+    if(fl_local_tthnext(c) == fl)
+      fl_local_tthnext(c) = fl_local_tthnext(fl);
+  }
+  fl_local_tthnext(fl) = NULL;
+  fl_local_list_length = fl_hash_index.count;
+}
+
+
+// Get the first file with the (raw) TTH, or NULL if there is none. Other files
+// with the same TTH can be found with fl_local_tthnext().
+fl_list_t *fl_local_from_tth(const char *root) {
+  fl_hashslot_t *s = fl_hashindex_lookup(root);
+  return s->fl || !fl_loading ? s->fl : fl_interim_from_tth(root);
+}
+
+
+static void fl_local_bloom_fill(bloom_t *b) {
+  guint32 i;
+  memset(b->d, 0, b->m);
+  for(i=0; i<=fl_hash_index.mask; i++)
+    if(fl_hash_index.slots[i].fl)
+      bloom_add(b, fl_hash_index.slots[i].tth);
+}
+
+
+// Returns a bloom filter with all local hashes, or NULL if the parameters are
+// invalid. The filter is owned by the cache and remains valid until control
+// is returned to the main loop.
+bloom_t *fl_local_bloom(int m, int k, int h) {
+  GSList *l;
+  fl_bloomcache_t *c = NULL;
+  for(l=fl_bloom_cache; l; l=l->next) {
+    c = l->data;
+    if(c->b.m == m && c->b.k == k && c->b.h == h)
+      break;
+  }
+
+  if(l) {
+    fl_bloom_cache = g_slist_delete_link(fl_bloom_cache, l);
+    if(c->dirty)
+      fl_local_bloom_fill(&c->b);
+  } else {
+    c = g_slice_new(fl_bloomcache_t);
+    if(bloom_init(&c->b, m, k, h) < 0) {
+      g_slice_free(fl_bloomcache_t, c);
+      return NULL;
+    }
+    fl_local_bloom_fill(&c->b);
+    if(g_slist_length(fl_bloom_cache) >= FL_BLOOM_CACHE) {
+      l = g_slist_last(fl_bloom_cache);
+      bloom_free(&((fl_bloomcache_t *)l->data)->b);
+      g_slice_free(fl_bloomcache_t, l->data);
+      fl_bloom_cache = g_slist_delete_link(fl_bloom_cache, l);
+    }
+  }
+  c->dirty = FALSE;
+  fl_bloom_cache = g_slist_prepend(fl_bloom_cache, c);
+  return &c->b;
+}
+
+
+
+
+
+// Watching shared directories
+//
+// With share_watch enabled, every directory that is scanned gets an inotify
+// watch. Changed directories are collected in fl_watch_dirty and refreshed in
+// a single batch after FL_WATCH_DELAY seconds. This batch is queued as a NULL
+// entry in fl_refresh_queue and only rescans the directories themselves, see
+// fl_refresh_process(). If the kernel event queue overflows, a full refresh
+// is done instead.
+
+#define FL_WATCH_DELAY 5
+
+#ifdef HAVE_INOTIFY_INIT1
+
+#define FL_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+static int fl_watch_fd = -1;
+static guint fl_watch_source = 0;
+static guint fl_watch_timer = 0;
+static GStaticMutex fl_watch_lock = G_STATIC_MUTEX_INIT; // protects fl_watch_paths
+static GHashTable *fl_watch_paths = NULL; // key = watch descriptor, value = directory path (UTF-8)
+static gboolean fl_watch_full = FALSE;    // whether we've already warned about the watch limit
+
+#endif
+
+static GHashTable *fl_watch_dirty = NULL;  // set of directory paths (UTF-8) to refresh
+
+static void fl_refresh_process();
+
+
+// Called from the scan threads. *path is in filesystem encoding, *upath in UTF-8.
+static void fl_watch_add(const char *path, const char *upath) {
+#ifdef HAVE_INOTIFY_INIT1
+  int fd = g_atomic_int_get(&fl_watch_fd);
+  if(fd < 0)
+    return;
+  int wd = inotify_add_watch(fd, path, FL_WATCH_MASK);
+  if(wd < 0) {
+    if(errno == ENOSPC && !fl_watch_full) {
+      fl_watch_full = TRUE;
+      ui_m(uit_main_tab, UIP_MED, "Not all shared directories are being watched for changes: inotify watch limit reached."
+        " Consider increasing fs.inotify.max_user_watches, changes to the other directories are detected with autorefresh.");
+    } else if(errno != ENOSPC)
+      g_debug("fl: Can't watch `%s': %s", upath, g_strerror(errno));
+    return;
+  }
+  g_static_mutex_lock(&fl_watch_lock);
+  g_hash_table_replace(fl_watch_paths, GINT_TO_POINTER(wd), g_strdup(upath));
+  g_static_mutex_unlock(&fl_watch_lock);
+#endif
+}
+
+
+#ifdef HAVE_INOTIFY_INIT1
+
+static gboolean fl_watch_flush(gpointer dat) {
+  // Try again later if the previous batch hasn't been processed yet
+  if(g_hash_table_size(fl_watch_dirty) && g_queue_find(fl_refresh_queue, NULL))
+    return TRUE;
+  fl_watch_timer = 0;
+  if(!g_hash_table_size(fl_watch_dirty))
+    return FALSE;
+  g_queue_push_tail(fl_refresh_queue, NULL);
+  if(fl_refresh_queue->head == fl_refresh_queue->tail)
+    fl_refresh_process();
+  return FALSE;
+}
+
+
+static gboolean fl_watch_read(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  char buf[16*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int len = read(fl_watch_fd, buf, sizeof(buf));
+  if(len <= 0)
+    return TRUE;
+
+  char *ptr;
+  const struct inotify_event *ev;
+  for(ptr=buf; ptr<buf+len; ptr+=sizeof(struct inotify_event)+ev->len) {
+    ev = (const struct inotify_event *)ptr;
+    if(ev->mask & IN_Q_OVERFLOW) {
+      g_debug("fl: inotify queue overflow, doing a full refresh.");
+      fl_refresh(NULL);
+      continue;
+    }
+    g_static_mutex_lock(&fl_watch_lock);
+    if(ev->mask & IN_IGNORED)
+      g_hash_table_remove(fl_watch_paths, GINT_TO_POINTER(ev->wd));
+    else {
+      char *path = g_hash_table_lookup(fl_watch_paths, GINT_TO_POINTER(ev->wd));
+      if(path && !g_hash_table_lookup(fl_watch_dirty, path))
+        g_hash_table_insert(fl_watch_dirty, g_strdup(path), (gpointer)1);
     }
+    g_static_mutex_unlock(&fl_watch_lock);
   }
-  fl_needflush = FALSE;
+
+  if(!fl_watch_timer && g_hash_table_size(fl_watch_dirty))
+    fl_watch_timer = g_timeout_add_seconds_full(G_PRIORITY_LOW, FL_WATCH_DELAY, fl_watch_flush, NULL, NULL);
   return TRUE;
 }
 
-// are we currently refreshing the share?
-gboolean fl_is_refreshing(void) {
-  return fl_refresh_queue && fl_refresh_queue->head;
+#endif
+
+
+static gint fl_watch_depthcmp(gconstpointer pa, gconstpointer pb) {
+  const fl_list_t *a = *((fl_list_t **)pa);
+  const fl_list_t *b = *((fl_list_t **)pb);
+  int r = 0;
+  for(; a; a=a->parent)
+    r--;
+  for(; b; b=b->parent)
+    r++;
+  return r;
 }
 
-// Hash index interface. These operate on fl_hash_index and make sure
-// fl_local_list_size and _length stay correct.
 
-// Add to the hash index
-static void fl_hashindex_insert(fl_list_t *fl) {
-  GSList *cur = g_hash_table_lookup(fl_hash_index, fl->tth);
-  if(cur) {
-    g_return_if_fail(cur == g_slist_insert(cur, fl, 1)); // insert item without modifying the pointer
-  } else {
-    cur = g_slist_prepend(cur, fl);
-    g_hash_table_insert(fl_hash_index, fl->tth, cur);
-    fl_local_list_size += fl->size;
+// Returns the directories in fl_watch_dirty and empties the set. The deepest
+// directories come first: fl_refresh_compare() on a parent directory may
+// remove one of its subdirectories, so that one has to be compared before.
+static GPtrArray *fl_watch_dirs() {
+  GPtrArray *dirs = g_ptr_array_new();
+  GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GHashTableIter iter;
+  char *path;
+  g_hash_table_iter_init(&iter, fl_watch_dirty);
+  while(g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+    fl_list_t *d = fl_local_from_path(path);
+    if(d && !d->isfile && d != fl_local_list && !g_hash_table_lookup(seen, d)) {
+      g_hash_table_insert(seen, d, d);
+      g_ptr_array_add(dirs, d);
+    }
   }
-  fl_local_list_length = g_hash_table_size(fl_hash_index);
+  g_hash_table_destroy(seen);
+  g_hash_table_remove_all(fl_watch_dirty);
+  g_ptr_array_sort(dirs, fl_watch_depthcmp);
+  return dirs;
 }
 
 
-// ...and remove a file. This is done when a file is actually removed from the
-// share, or when its TTH information has been invalidated.
-static void fl_hashindex_del(fl_list_t *fl) {
-  if(!fl->hastth)
+// Called at startup and when the share_watch setting has changed. Enabling
+// the watches requires a full refresh, which is done when sharing != FALSE.
+void fl_watch_reset(gboolean sharing) {
+#ifdef HAVE_INOTIFY_INIT1
+  gboolean enable = var_get_bool(0, VAR_share_watch);
+  if(!enable == (fl_watch_fd < 0))
     return;
-  GSList *cur = g_hash_table_lookup(fl_hash_index, fl->tth);
-  fl->hastth = FALSE;
 
-  cur = g_slist_remove(cur, fl);
-  if(!cur) {
-    g_hash_table_remove(fl_hash_index, fl->tth);
-    fl_local_list_size -= fl->size;
-  // there's another file with the same TTH.
-  } else
-    g_hash_table_replace(fl_hash_index, ((fl_list_t *)cur->data)->tth, cur);
-  fl_local_list_length = g_hash_table_size(fl_hash_index);
+  if(enable) {
+    fl_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fl_watch_fd < 0) {
+      ui_mf(uit_main_tab, UIP_MED, "Can't watch shared directories: %s", g_strerror(errno));
+      return;
+    }
+    GIOChannel *ch = g_io_channel_unix_new(fl_watch_fd);
+    fl_watch_source = g_io_add_watch(ch, G_IO_IN, fl_watch_read, NULL);
+    g_io_channel_unref(ch);
+    fl_watch_full = FALSE;
+    if(sharing)
+      fl_refresh(NULL);
+    return;
+  }
+
+  // Closing the inotify fd removes all watches. Note that a scan in progress
+  // may still call fl_watch_add() with the old fd, that call will fail.
+  g_source_remove(fl_watch_source);
+  close(fl_watch_fd);
+  g_atomic_int_set(&fl_watch_fd, -1);
+  g_static_mutex_lock(&fl_watch_lock);
+  g_hash_table_remove_all(fl_watch_paths);
+  g_static_mutex_unlock(&fl_watch_lock);
+#endif
 }
 
 
 
 
 
+
 // Scanning directories
 
 // Note: The `file' structure points to a (sub-)item in fl_local_list, and will
-// be accessed from both the scan thread and the main thread. It is therefore
-// important that no changes are made to the local file list while the scan
-// thread is active.
+// be accessed from both the scan threads and the main thread. It is therefore
+// important that no changes are made to the local file list while a scan is
+// active.
 typedef struct fl_scan_t {
   fl_list_t **file, **res;
   char **path;
@@ -191,10 +1797,34 @@ typedef struct fl_scan_t {
   gboolean emptydirs;
   gboolean inc_hidden;
   gboolean symlink;
+  gboolean shallow; // only scan the given directories, not the existing subdirectories
   gboolean (*donefun)(gpointer);
+  GMutex *lock;     // protects allocation from the arenas in res
+  int pending;      // number of roots that are still being scanned
 } fl_scan_t;
 
 
+// A single directory to scan. Every directory is a separate job for
+// fl_scan_pool, so that independent subtrees are scanned in parallel. While a
+// directory is being filled, dir->parent is NULL, so that fl_list_add() and
+// fl_list_remove() do not touch the (shared) parent directories. The directory
+// is linked back to its parent and its size is accounted for when it and all
+// of its subdirectories have been scanned, see fl_scan_done().
+typedef struct fl_scan_dir_t {
+  fl_list_t *dir, *old, *root;
+  char *path;   // Filesystem path, in filename encoding
+  char *vpath;  // Virtual path, in UTF-8
+  struct fl_scan_dir_t *parent;
+  fl_scan_t *opts;
+  int pending;  // this directory + number of subdirectories still being scanned
+} fl_scan_dir_t;
+
+
+// Whether the filesystem encoding is UTF-8, in which case most file names
+// don't have to be converted.
+static gboolean fl_scan_utf8;
+
+
 // Removes duplicate files (that is, files with the same name in a
 // case-insensitive context) from a dirtectory.
 static void fl_scan_rmdupes(fl_list_t *fl, const char *vpath) {
@@ -217,9 +1847,11 @@ static void fl_scan_rmdupes(fl_list_t *fl, const char *vpath) {
 // of DELETE FROM queries in a single transaction. This is significantly faster
 // than using a separate transaction for each DELETE.
 static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
+  static GStaticMutex lock = G_STATIC_MUTEX_INIT;
   static gint64 rmids[50];
   static int i = 0;
 
+  g_static_mutex_lock(&lock);
   if(id)
     rmids[i++] = id;
 
@@ -227,16 +1859,20 @@ static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
     db_fl_rmfiles(rmids, i);
     i = 0;
   }
+  g_static_mutex_unlock(&lock);
 }
 
 
 // Fetches TTH information either from the database or from *oldpar, and
-// invalidates this data if the file has changed.
-static void fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *real) {
+// invalidates this data if the file has changed. The database is only
+// consulted when the file is not in *oldpar, as that requires the full path
+// of the file (path + ename) to be resolved. Returns FALSE if that failed.
+static gboolean fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *path, const char *ename, const char *vcpath) {
   time_t oldlastmod;
   guint64 oldsize;
   char oldhash[24];
   gint64 oldid = 0;
+  char *real = NULL;
 
   fl_list_t *old = oldpar && oldpar->sub ? fl_list_file_strict(oldpar, new) : NULL;
   // Get from the previous in-memory structure
@@ -246,12 +1882,26 @@ static void fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *real) {
     oldsize = old->size;
     memcpy(oldhash, old->tth, 24);
   // Otherwise, do a database lookup on the file path
-  } else
+  } else {
+    char *cpath = g_build_filename(path, ename, NULL);
+    char *tmp = path_expand(cpath);
+    g_free(cpath);
+    if(!tmp) {
+      ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, g_strerror(errno));
+      return FALSE;
+    }
+    real = g_filename_to_utf8(tmp, -1, NULL, NULL, NULL);
+    g_free(tmp);
+    if(!real) {
+      ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, "Encoding error.");
+      return FALSE;
+    }
     oldid = db_fl_getfile(real, &oldlastmod, &oldsize, oldhash);
+  }
 
   // Check for file change
   if(oldid && (oldlastmod < fl_list_getlocal(new).lastmod || oldsize != new->size)) {
-    g_debug("fl: Dropping hash information for `%s': file has changed.", real);
+    g_debug("fl: Dropping hash information for `%s': file has changed.", real ? real : vcpath);
     fl_scan_invalidate(oldid, FALSE);
   // Otherwise, update *new
   } else if(oldid) {
@@ -260,44 +1910,48 @@ static void fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *real) {
     fl_list_getlocal(new).lastmod = oldlastmod;
     fl_list_getlocal(new).id = oldid;
   }
+  g_free(real);
+  return TRUE;
 }
 
 
-// *name is in filesystem encoding. For *path and *vpath see fl_scan_dir().
-static fl_list_t *fl_scan_item(fl_list_t *old, const char *path, const char *vpath, const char *name, fl_scan_t *opts) {
+// *name is in filesystem encoding and relative to the directory fd.
+static fl_list_t *fl_scan_item(fl_scan_dir_t *d, int fd, const char *name) {
+  fl_scan_t *opts = d->opts;
   char *uname = NULL;  // name-to-UTF8
   char *vcpath = NULL; // vpath + uname
   char *ename = NULL;  // uname-to-filesystem
-  char *cpath = NULL;  // path + ename
-  char *real = NULL;   // path_expand(cpath)-to-UTF8
   fl_list_t *node = NULL;
 
   // Try to get a UTF-8 filename
-  uname = g_filename_to_utf8(name, -1, NULL, NULL, NULL);
-  if(!uname)
-    uname = g_filename_display_name(name);
+  if(fl_scan_utf8 && g_utf8_validate(name, -1, NULL))
+    uname = g_strdup(name);
+  else {
+    uname = g_filename_to_utf8(name, -1, NULL, NULL, NULL);
+    if(!uname)
+      uname = g_filename_display_name(name);
+  }
 
   // Check for share_exclude as soon as we have the confname
   if(opts->excl_regex && g_regex_match(opts->excl_regex, uname, 0, NULL))
     goto done;
 
   // Get the virtual path (for reporting purposes)
-  vcpath = g_build_filename(vpath, uname, NULL);
+  vcpath = g_build_filename(d->vpath, uname, NULL);
 
   // Check that the UTF-8 filename can be converted back to something we can
   // access on the filesystem. If it can't be converted back, we won't share
   // the file at all. Keeping track of a raw-to-UTF-8 filename lookup table
   // isn't worth the effort.
-  ename = g_filename_from_utf8(uname, -1, NULL, NULL, NULL);
+  ename = fl_scan_utf8 ? g_strdup(uname) : g_filename_from_utf8(uname, -1, NULL, NULL, NULL);
   if(!ename) {
     ui_mf(uit_main_tab, UIP_MED, "Error reading directory entry in \"%s\": Invalid encoding.", vcpath);
     goto done;
   }
 
-  // Get cpath and try to stat() the file
-  cpath = g_build_filename(path, ename, NULL);
+  // Try to stat() the file
   struct stat dat;
-  int r = opts->symlink ? stat(cpath, &dat) : lstat(cpath, &dat);
+  int r = fstatat(fd, ename, &dat, opts->symlink ? 0 : AT_SYMLINK_NOFOLLOW);
   if(r < 0 || S_ISLNK(dat.st_mode) || !(S_ISREG(dat.st_mode) || S_ISDIR(dat.st_mode))) {
     if(r < 0)
       ui_mf(uit_main_tab, UIP_MED, "Error stat'ing \"%s\": %s", vcpath, g_strerror(errno));
@@ -306,24 +1960,10 @@ static fl_list_t *fl_scan_item(fl_list_t *old, const char *path, const char *vpa
     goto done;
   }
 
-  // Get the path_expand() (for lookup in the database)
-  // TODO: this path is only used if fl_scan_check() can't find the item in the
-  // old fl_list structure. It may be more efficient to only try to execute
-  // this code when this is the case.
-  char *tmp = path_expand(cpath);
-  if(!tmp) {
-    ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, g_strerror(errno));
-    goto done;
-  }
-  real = g_filename_to_utf8(tmp, -1, NULL, NULL, NULL);
-  g_free(tmp);
-  if(!real) {
-    ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, "Encoding error.");
-    goto done;
-  }
-
   // create the node
-  node = fl_list_create(uname, S_ISREG(dat.st_mode) ? TRUE : FALSE);
+  g_mutex_lock(opts->lock);
+  node = fl_list_create_in(d->root, uname, S_ISREG(dat.st_mode) ? TRUE : FALSE);
+  g_mutex_unlock(opts->lock);
   if(S_ISREG(dat.st_mode)) {
     node->isfile = TRUE;
     node->size = dat.st_size;
@@ -331,88 +1971,146 @@ static fl_list_t *fl_scan_item(fl_list_t *old, const char *path, const char *vpa
   }
 
   // Fetch id, tth, and hashtth fields.
-  if(node->isfile)
-    fl_scan_check(old, node, real);
+  if(node->isfile && !fl_scan_check(d->old, node, d->path, ename, vcpath)) {
+    fl_list_free(node);
+    node = NULL;
+  }
 
 done:
   g_free(uname);
   g_free(vcpath);
-  g_free(cpath);
   g_free(ename);
-  g_free(real);
   return node;
 }
 
 
-// recursive
+static void fl_scan_push(fl_scan_dir_t *parent, fl_list_t *dir, fl_list_t *old, char *path, char *vpath, fl_scan_t *opts, fl_list_t *root) {
+  fl_scan_dir_t *d = g_slice_new0(fl_scan_dir_t);
+  d->dir = dir;
+  d->old = old;
+  d->root = root;
+  d->path = path;
+  d->vpath = vpath;
+  d->parent = parent;
+  d->opts = opts;
+  d->pending = 1;
+  dir->parent = NULL;
+  g_thread_pool_push(fl_scan_pool, d, NULL);
+}
+
+
+// Called when a directory has been read. Once the directory and all its
+// subdirectories are done, the empty subdirectories are removed (if
+// !opts->emptydirs), the directory is linked to its parent and the parent is
+// checked for completion in turn. Only one thread can observe the pending
+// counter dropping to zero, so the directory is not accessed concurrently.
+static void fl_scan_done(fl_scan_dir_t *d) {
+  while(d && g_atomic_int_dec_and_test(&d->pending)) {
+    fl_scan_dir_t *par = d->parent;
+    fl_scan_t *opts = d->opts;
+    int i;
+    for(i=0; i<d->dir->sub->len; i++) {
+      fl_list_t *cur = g_ptr_array_index(d->dir->sub, i);
+      if(cur->isfile)
+        continue;
+      cur->parent = d->dir;
+      if(!cur->sub) // not scanned, see fl_scan_dir()
+        continue;
+      if(!opts->emptydirs && !cur->sub->len) {
+        g_ptr_array_remove_index(d->dir->sub, i);
+        i--; // Make sure that the index doesn't change with the next iteration
+      } else
+        d->dir->size += cur->size;
+    }
+
+    if(!par && g_atomic_int_dec_and_test(&opts->pending)) {
+      fl_scan_invalidate(0, TRUE);
+      g_idle_add_full(G_PRIORITY_HIGH_IDLE, opts->donefun, opts, NULL);
+    }
+    g_free(d->path);
+    g_free(d->vpath);
+    g_slice_free(fl_scan_dir_t, d);
+    d = par;
+  }
+}
+
+
+// Reads a single directory and queues its subdirectories. Runs in
+// fl_scan_pool.
 // Doesn't handle paths longer than PATH_MAX, but I don't think it matters all that much.
-// *path is the filesystem path in filename encoding, vpath is the virtual path in UTF-8.
-static void fl_scan_dir(fl_list_t *parent, fl_list_t *old, const char *path, const char *vpath, fl_scan_t *opts) {
-  GError *err = NULL;
-  GDir *dir = g_dir_open(path, 0, &err);
+static void fl_scan_dir(gpointer data, gpointer udata) {
+  fl_scan_dir_t *d = data;
+  fl_scan_t *opts = d->opts;
+  fl_list_t *parent = d->dir;
+
+  int fd = open(d->path, O_RDONLY | O_DIRECTORY);
+  DIR *dir = fd < 0 ? NULL : fdopendir(fd);
   if(!dir) {
-    ui_mf(uit_main_tab, UIP_MED, "Error reading directory \"%s\": %s", vpath, g_strerror(errno));
-    g_error_free(err);
+    ui_mf(uit_main_tab, UIP_MED, "Error reading directory \"%s\": %s", d->vpath, g_strerror(errno));
+    if(fd >= 0)
+      close(fd);
+    fl_scan_done(d);
     return;
   }
-  const char *name;
-  while((name = g_dir_read_name(dir))) {
+  fl_watch_add(d->path, d->vpath);
+  // readdir() fetches the entries in large batches with getdents()
+  struct dirent *ent;
+  while((ent = readdir(dir))) {
+    const char *name = ent->d_name;
     if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
       continue;
     if(!opts->inc_hidden && name[0] == '.')
       continue;
     // check with *excl, stat and create
-    fl_list_t *item = fl_scan_item(old, path, vpath, name, opts);
+    fl_list_t *item = fl_scan_item(d, fd, name);
     // and add it
     if(item)
       fl_list_add(parent, item, -1);
   }
-  g_dir_close(dir);
+  closedir(dir);
 
   // Sort
   fl_list_sort(parent);
-  fl_scan_rmdupes(parent, vpath);
+  fl_scan_rmdupes(parent, d->vpath);
 
-  // check for directories (outside of the above loop, to avoid having too many
-  // directories opened at the same time. Costs some extra CPU cycles, though...)
+  // Queue the subdirectories. The pending counter is incremented before each
+  // job is pushed, our own reference keeps it from dropping to zero until
+  // we're done here. In a shallow scan, subdirectories that are already in the
+  // old list are not scanned and keep their sub = NULL, fl_refresh_compare()
+  // will leave them alone.
   int i;
   for(i=0; i<parent->sub->len; i++) {
     fl_list_t *cur = g_ptr_array_index(parent->sub, i);
-    if(!cur->isfile) {
-      char *enc = g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
-      char *cpath = g_build_filename(path, enc, NULL);
-      char *virtpath = g_build_filename(vpath, cur->name, NULL);
-      cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-      fl_scan_dir(cur, old && old->sub ? fl_list_file_strict(old, cur) : NULL, cpath, virtpath, opts);
-      g_free(virtpath);
-      g_free(cpath);
-      g_free(enc);
-    }
-    // Removes this item if it is an empty directory and if !opts->emptydirs.
-    if(!opts->emptydirs && !cur->isfile && !cur->sub->len) {
-      fl_list_remove(cur);
-      i--; // Make sure that the index doesn't change with the next iteration
-    }
+    if(cur->isfile)
+      continue;
+    fl_list_t *old = d->old && d->old->sub ? fl_list_file_strict(d->old, cur) : NULL;
+    if(opts->shallow && !d->parent && old && !old->isfile && strcmp(old->name, cur->name) == 0)
+      continue;
+    char *enc = fl_scan_utf8 ? g_strdup(cur->name) : g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
+    cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
+    g_atomic_int_inc(&d->pending);
+    fl_scan_push(d, cur, old, g_build_filename(d->path, enc, NULL), g_build_filename(d->vpath, cur->name, NULL), opts, d->root);
+    g_free(enc);
   }
-}
 
+  fl_scan_done(d);
+}
 
-// Must be called in a separate thread.
-static void fl_scan_thread(gpointer data, gpointer udata) {
-  fl_scan_t *args = data;
 
+// Scans the directories in args in fl_scan_pool, args->donefun is called in
+// the main thread when done.
+static void fl_scan(fl_scan_t *args) {
   int i, len = g_strv_length(args->path);
+  args->lock = g_mutex_new();
+  args->pending = len;
+  if(!len)
+    g_idle_add_full(G_PRIORITY_HIGH_IDLE, args->donefun, args, NULL);
+
+  g_thread_pool_set_max_threads(fl_scan_pool, var_get_int(0, VAR_share_scan_threads), NULL);
   for(i=0; i<len; i++) {
-    fl_list_t *cur = fl_list_create("", FALSE);
-    char *tmp = g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL);
-    cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-    fl_scan_dir(cur, args->file[i], tmp, args->path[i], args);
-    g_free(tmp);
-    args->res[i] = cur;
+    args->res[i] = fl_list_create_root();
+    fl_scan_push(NULL, args->res[i], args->file[i], g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL), g_strdup(args->path[i]), args, args->res[i]);
   }
-
-  fl_scan_invalidate(0, TRUE);
-  g_idle_add_full(G_PRIORITY_HIGH_IDLE, args->donefun, args, NULL);
 }
 
 
@@ -423,9 +2121,20 @@ static void fl_scan_thread(gpointer data, gpointer udata) {
 // Hashing files
 
 
+// Files to be hashed are grouped by the device they reside on, so that the
+// hash threads can be spread over multiple disks rather than having them all
+// seek over the same one.
+typedef struct fl_hash_dev_t {
+  guint64 dev;
+  GHashTable *files; // set of queued files that are not being hashed yet
+  int active;        // number of fl_hash_t objects referring to this device
+} fl_hash_dev_t;
+
+
 // This struct is passed from the main thread to the hasher and back with modifications.
 typedef struct fl_hash_t {
   fl_list_t *file; // only accessed from main thread
+  fl_hash_dev_t *dev; // only accessed from main thread
   char *path;        // owned by main thread, read from hash thread
   guint64 filesize;  // set by main thread
   char root[24];     // set by hash thread
@@ -433,7 +2142,7 @@ typedef struct fl_hash_t {
   time_t lastmod;    // set by hash thread
   gint64 id;         // set by hash thread
   gdouble time;      // set by hash thread
-  guint64 lastreset; // last value of fl_hash_reset when starting this thread
+  gboolean cancel;   // set by main thread when the file is removed from the queue, protected by fl_hash_resetlock
 } fl_hash_t;
 
 // Maximum number of levels, including root (level 0).  The ADC docs specify
@@ -456,34 +2165,88 @@ typedef struct fl_hash_t {
 // there's no need for better granularity than this
 #define fl_hash_max_granularity G_GUINT64_CONSTANT(64 * 1024)
 
+// Save a checkpoint after hashing at least this many bytes of a file, so that
+// hashing can be resumed after a restart. Checkpoints are only saved on block
+// boundaries, so the actual interval may be larger for very large files.
+#define fl_hash_resume_interval G_GUINT64_CONSTANT(4 * 1024 * 1024 * 1024)
+
+
+
+// Returns the device that a file in the local list resides on. This is
+// determined from the share root directory that the file is in, so that we
+// don't have to stat() every single file.
+static guint64 fl_hash_rootdev(fl_list_t *fl) {
+  while(fl->parent && fl->parent->parent)
+    fl = fl->parent;
+  guint64 *dev = g_hash_table_lookup(fl_hash_rootdevs, fl->name);
+  if(!dev) {
+    struct stat st;
+    const char *path = db_share_path(fl->name);
+    dev = g_new(guint64, 1);
+    *dev = path && stat(path, &st) == 0 ? (guint64)st.st_dev : 0;
+    g_hash_table_insert(fl_hash_rootdevs, g_strdup(fl->name), dev);
+  }
+  return *dev;
+}
+
+
+// Free a device struct when nothing refers to it anymore.
+static void fl_hash_dev_gc(fl_hash_dev_t *d) {
+  if(d->active || g_hash_table_size(d->files))
+    return;
+  g_hash_table_remove(fl_hash_devs, &d->dev);
+  g_hash_table_unref(d->files);
+  g_slice_free(fl_hash_dev_t, d);
+}
+
+
+static void fl_hash_process();
 
 
 // adding/removing items from the files-to-be-hashed queue
 // _append() assumes that fl->hastth is false.
-#define fl_hash_queue_append(fl) do {\
-    g_warn_if_fail(!fl->hastth);\
-    gboolean start = !g_hash_table_size(fl_hash_queue);\
-    if(start || !g_hash_table_lookup(fl_hash_queue, fl))\
-      fl_hash_queue_size += fl->size;\
-    g_hash_table_insert(fl_hash_queue, fl, (void *)1);\
-    if(start)\
-      fl_hash_process();\
-  } while(0)
-
-
-#define fl_hash_queue_del(fl) do {\
-    if((fl)->isfile && g_hash_table_lookup(fl_hash_queue, fl)) {\
-      fl_hash_queue_size -= fl->size;\
-      g_hash_table_remove(fl_hash_queue, fl);\
-      if((fl) == fl_hash_cur) {\
-        g_mutex_lock(fl_hash_resetlock);\
-        fl_hash_reset++;\
-        g_cond_signal(fl_hash_resetcond);\
-        g_mutex_unlock(fl_hash_resetlock);\
-      }\
-    }\
-  } while(0)
+static void fl_hash_queue_append(fl_list_t *fl) {
+  g_warn_if_fail(!fl->hastth);
+  if(g_hash_table_lookup(fl_hash_queue, fl))
+    return;
+
+  guint64 id = fl_hash_rootdev(fl);
+  fl_hash_dev_t *d = g_hash_table_lookup(fl_hash_devs, &id);
+  if(!d) {
+    d = g_slice_new0(fl_hash_dev_t);
+    d->dev = id;
+    d->files = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(fl_hash_devs, &d->dev, d);
+  }
+  g_hash_table_insert(d->files, fl, fl);
+  g_hash_table_insert(fl_hash_queue, fl, d);
+  fl_hash_queue_size += fl->size;
+
+  if(g_hash_table_size(fl_hash_active) < var_get_int(0, VAR_hash_threads))
+    fl_hash_process();
+}
+
 
+// Removes a file from the queue. If the file is currently being hashed, the
+// hash thread is notified to stop hashing it.
+static void fl_hash_queue_del(fl_list_t *fl) {
+  fl_hash_dev_t *d;
+  if(!fl->isfile || !(d = g_hash_table_lookup(fl_hash_queue, fl)))
+    return;
+  fl_hash_queue_size -= fl->size;
+  g_hash_table_remove(fl_hash_queue, fl);
+
+  fl_hash_t *h = g_hash_table_lookup(fl_hash_active, fl);
+  if(h) {
+    g_mutex_lock(fl_hash_resetlock);
+    h->cancel = TRUE;
+    g_cond_broadcast(fl_hash_resetcond);
+    g_mutex_unlock(fl_hash_resetlock);
+    g_hash_table_remove(fl_hash_active, fl);
+  } else
+    g_hash_table_remove(d->files, fl);
+  fl_hash_dev_gc(d);
+}
 
 
 // Recursively deletes a fl_list structure from the hash queue
@@ -500,11 +2263,12 @@ static void fl_hash_queue_delrec(fl_list_t *f) {
 
 // Checks whether this hashing operation has been cancelled and waits until the
 // hash ratecalc object has enough burst to allow us to continue hashing again.
-// Returns the allowed burst, or 0 on cancellation.
-static int fl_hash_burst(guint64 lastreset) {
+// Returns the allowed burst, or 0 on cancellation. The burst is shared among
+// all hash threads.
+static int fl_hash_burst(fl_hash_t *args) {
   int b = 0;
   g_mutex_lock(fl_hash_resetlock);
-  while(fl_hash_reset == lastreset && (b = ratecalc_burst(&fl_hash_rate)) <= 0) {
+  while(!args->cancel && (b = ratecalc_burst(&fl_hash_rate)) <= 0) {
     GTimeVal end;
     g_get_current_time(&end);
     g_time_val_add(&end, 100*1000); // Wake up every 100ms.
@@ -515,13 +2279,98 @@ static int fl_hash_burst(guint64 lastreset) {
 }
 
 
+// Read-ahead for the hash threads. Each hash thread starts a reader thread
+// that keeps reading the file into TTH_BUFNUM buffers, so that the disk
+// doesn't sit idle while we're busy hashing and the other way around. The
+// reader also takes care of the rate limiting and page cache purging.
+
+#define TTH_BUFNUM 3
+
+typedef struct fl_hash_buf_t {
+  char *data;
+  int len; // number of bytes read, 0 on EOF, -1 on error or cancellation
+  int err; // errno on error, 0 on cancellation
+} fl_hash_buf_t;
+
+typedef struct fl_hash_rd_t {
+  fl_hash_t *args;
+  int stop; // set by the hash thread, accessed atomically
+  GAsyncQueue *empty, *filled;
+  GThread *thread;
+  fadv_t adv;
+  int fd;
+  fl_hash_buf_t bufs[TTH_BUFNUM];
+} fl_hash_rd_t;
+
+
+static gpointer fl_hash_rd_thread(gpointer dat) {
+  fl_hash_rd_t *rd = dat;
+  while(1) {
+    fl_hash_buf_t *b = g_async_queue_pop(rd->empty);
+    if(g_atomic_int_get(&rd->stop))
+      break;
+    int nr = fl_hash_burst(rd->args);
+    if(nr <= 0) {
+      b->len = -1;
+      b->err = 0;
+    } else {
+      do
+        b->len = read(rd->fd, b->data, MIN(nr, TTH_BUFSIZE));
+      while(b->len < 0 && errno == EINTR);
+      b->err = b->len < 0 ? errno : 0;
+    }
+    if(b->len > 0) {
+      fadv_purge(&rd->adv, b->len);
+      ratecalc_add(&fl_hash_rate, b->len);
+    }
+    g_async_queue_push(rd->filled, b);
+    if(b->len <= 0)
+      break;
+  }
+  return NULL;
+}
+
+
+static fl_hash_rd_t *fl_hash_rd_open(fl_hash_t *args, int fd, guint64 offset) {
+  fl_hash_rd_t *rd = g_slice_new0(fl_hash_rd_t);
+  rd->args = args;
+  rd->fd = fd;
+  fadv_init(&rd->adv, fd, offset, VAR_FFC_HASH);
+  rd->empty = g_async_queue_new();
+  rd->filled = g_async_queue_new();
+  int i;
+  for(i=0; i<TTH_BUFNUM; i++) {
+    rd->bufs[i].data = g_malloc(TTH_BUFSIZE);
+    g_async_queue_push(rd->empty, rd->bufs+i);
+  }
+  rd->thread = g_thread_create(fl_hash_rd_thread, rd, TRUE, NULL);
+  return rd;
+}
+
+
+// Stops the reader thread (if it hasn't stopped already) and frees the
+// buffers. Does not close the file.
+static void fl_hash_rd_close(fl_hash_rd_t *rd) {
+  g_atomic_int_set(&rd->stop, 1);
+  // Wake up the reader in case it's waiting for an empty buffer
+  g_async_queue_push(rd->empty, rd->bufs);
+  g_thread_join(rd->thread);
+  fadv_close(&rd->adv);
+  int i;
+  for(i=0; i<TTH_BUFNUM; i++)
+    g_free(rd->bufs[i].data);
+  g_async_queue_unref(rd->empty);
+  g_async_queue_unref(rd->filled);
+  g_slice_free(fl_hash_rd_t, rd);
+}
+
+
 static gboolean fl_hash_done(gpointer dat);
 
 static void fl_hash_thread(gpointer data, gpointer udata) {
   fl_hash_t *args = data;
-  // static, since only one hash thread is allowed and this saves stack space
   tth_ctx_t tth;
-  char *buf = g_malloc(TTH_BUFSIZE);
+  fl_hash_rd_t *rdr = NULL;
   char *blocks = NULL;
   int f = -1;
   char *real = NULL;
@@ -551,27 +2400,42 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
   blocks = g_malloc(24*blocks_num);
   tth_init(&tth);
 
-  fadv_t adv;
-  fadv_init(&adv, f, 0, VAR_FFC_HASH);
-
-  int r, nr;
+  fl_hash_buf_t *buf;
+  int r;
   guint64 rd = 0;
   int block_cur = 0;
   guint64 block_len = 0;
 
-  if((nr = fl_hash_burst(args->lastreset)) <= 0)
-    goto finish;
-  while((r = read(f, buf, MIN(nr, TTH_BUFSIZE))) > 0) {
+  // Continue from a previous checkpoint, if there is one and the file hasn't
+  // changed since.
+  struct stat st;
+  time_t mtime = 0;
+  if(args->filesize > fl_hash_resume_interval && !fstat(f, &st) && (guint64)st.st_size == args->filesize)
+    mtime = st.st_mtime;
+  if(mtime) {
+    int len;
+    char *dat = db_fl_getresume(real, args->filesize, mtime, blocksize, &len);
+    if(dat && len % 24 == 0 && len/24 < blocks_num && lseek(f, (len/24)*blocksize, SEEK_SET) != (off_t)-1) {
+      block_cur = len/24;
+      rd = block_cur*blocksize;
+      memcpy(blocks, dat, len);
+      g_debug("Resuming hash of %s at %"G_GUINT64_FORMAT" bytes.", real, rd);
+    }
+    g_free(dat);
+  }
+  guint64 rd_check = rd;
+
+  rdr = fl_hash_rd_open(args, f, rd);
+  while((buf = g_async_queue_pop(rdr->filled))->len > 0) {
+    r = buf->len;
     rd += r;
-    fadv_purge(&adv, r);
     // file has been modified. time to back out
     if(rd > args->filesize) {
       g_set_error_literal(&args->err, 1, 0, "File has been modified.");
       goto finish;
     }
-    ratecalc_add(&fl_hash_rate, r);
     // and hash
-    char *b = buf;
+    char *b = buf->data;
     while(r > 0) {
       int w = MIN(r, blocksize-block_len);
       tth_update(&tth, b, w);
@@ -583,13 +2447,21 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
         tth_init(&tth);
         block_cur++;
         block_len = 0;
+        // save a checkpoint
+        guint64 off = block_cur*blocksize;
+        if(mtime && block_cur < blocks_num && off - rd_check >= fl_hash_resume_interval) {
+          db_fl_setresume(real, args->filesize, mtime, blocksize, blocks, 24*block_cur);
+          rd_check = off;
+        }
       }
     }
-    if((nr = fl_hash_burst(args->lastreset)) <= 0)
-      goto finish;
+    g_async_queue_push(rdr->empty, buf);
   }
-  if(r < 0) {
-    g_set_error(&args->err, 1, 0, "Error reading file: %s", g_strerror(errno));
+  // cancelled
+  if(buf->len < 0 && !buf->err)
+    goto finish;
+  if(buf->len < 0) {
+    g_set_error(&args->err, 1, 0, "Error reading file: %s", g_strerror(buf->err));
     goto finish;
   }
   if(rd != args->filesize) {
@@ -601,7 +2473,11 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
     tth_final(&tth, blocks+(block_cur*24));
     block_cur++;
   }
-  g_return_if_fail(block_cur == blocks_num);
+  if(block_cur != blocks_num) {
+    g_critical("Number of hashed blocks (%d) does not match the expected number (%d).", block_cur, blocks_num);
+    g_set_error_literal(&args->err, 1, 0, "Internal error.");
+    goto finish;
+  }
   // Calculate root hash
   tth_root(blocks, blocks_num, args->root);
 
@@ -609,13 +2485,14 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
   args->id = db_fl_addhash(real, args->filesize, args->lastmod, args->root, blocks, 24*blocks_num);
   if(!args->id)
     g_set_error_literal(&args->err, 1, 0, "Error saving hash data to the database.");
+  else if(mtime)
+    db_fl_rmresume(real);
 
 finish:
-  if(f > 0) {
-    fadv_close(&adv);
+  if(rdr)
+    fl_hash_rd_close(rdr);
+  if(f > 0)
     close(f);
-  }
-  g_free(buf);
   g_free(real);
   g_free(blocks);
   args->time = g_timer_elapsed(tm, NULL);
@@ -624,33 +2501,55 @@ finish:
 }
 
 
+// Starts hashing files from the queue until hash_threads files are being
+// hashed simultaneously. Files are preferably taken from devices with the
+// least number of active hash operations.
 static void fl_hash_process() {
   if(!g_hash_table_size(fl_hash_queue)) {
     ratecalc_unregister(&fl_hash_rate);
     ratecalc_reset(&fl_hash_rate);
+    // Flush the journal before setting fl_done, so that fl_done always
+    // implies that the saved list is complete.
+    fl_flush(NULL);
     var_set_bool(0, VAR_fl_done, TRUE);
+    fl_compact();
+    g_hash_table_remove_all(fl_hash_rootdevs);
     return;
   }
   var_set_bool(0, VAR_fl_done, FALSE);
   ratecalc_register(&fl_hash_rate, RCC_HASH);
 
-  // get one item from fl_hash_queue
-  GHashTableIter iter;
-  fl_list_t *file;
-  g_hash_table_iter_init(&iter, fl_hash_queue);
-  g_hash_table_iter_next(&iter, (gpointer *)&file, NULL);
-  fl_hash_cur = file;
-
-  // pass stuff to the hash thread
-  fl_hash_t *args = g_new0(fl_hash_t, 1);
-  args->file = file;
-  char *tmp = fl_local_path(file);
-  args->path = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
-  g_free(tmp);
-  args->filesize = file->size;
-  args->lastreset = fl_hash_reset;
-  g_message("Start hashing %s", args->path);
-  g_thread_pool_push(fl_hash_pool, args, NULL);
+  int max = var_get_int(0, VAR_hash_threads);
+  while(g_hash_table_size(fl_hash_active) < max) {
+    // get the least busy device that still has files to hash
+    GHashTableIter iter;
+    fl_hash_dev_t *d, *dev = NULL;
+    g_hash_table_iter_init(&iter, fl_hash_devs);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&d))
+      if(g_hash_table_size(d->files) && (!dev || d->active < dev->active))
+        dev = d;
+    if(!dev)
+      break;
+
+    // get one item from that device
+    fl_list_t *file;
+    g_hash_table_iter_init(&iter, dev->files);
+    g_hash_table_iter_next(&iter, (gpointer *)&file, NULL);
+    g_hash_table_iter_remove(&iter);
+    dev->active++;
+
+    // pass stuff to the hash thread
+    fl_hash_t *args = g_new0(fl_hash_t, 1);
+    args->file = file;
+    args->dev = dev;
+    char *tmp = fl_local_path(file);
+    args->path = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
+    g_free(tmp);
+    args->filesize = file->size;
+    g_hash_table_insert(fl_hash_active, file, args);
+    g_message("Start hashing %s", args->path);
+    g_thread_pool_push(fl_hash_pool, args, NULL);
+  }
 }
 
 
@@ -658,9 +2557,13 @@ static gboolean fl_hash_done(gpointer dat) {
   fl_hash_t *args = dat;
   fl_list_t *fl = args->file;
 
+  args->dev->active--;
+  if(g_hash_table_lookup(fl_hash_active, fl) == args)
+    g_hash_table_remove(fl_hash_active, fl);
+
   // remove file from queue, ignore this hash if the file was already removed
   // by some other process.
-  if(!g_hash_table_remove(fl_hash_queue, fl))
+  if(args->cancel || !g_hash_table_remove(fl_hash_queue, fl))
     goto fl_hash_done_f;
 
   fl_hash_queue_size -= fl->size;
@@ -670,6 +2573,10 @@ static gboolean fl_hash_done(gpointer dat) {
     goto fl_hash_done_f;
   }
   g_message("Completed hashing %s in %.2fs", args->path, args->time);
+  stats_inc(STATC_HASH_FILES);
+  stats_add(STATC_HASH_KIB, args->filesize/1024);
+  if(args->time > 0)
+    stats_record(STATH_HASH_RATE, args->filesize/1024/args->time);
 
   // update file and hash info
   memcpy(fl->tth, args->root, 24);
@@ -677,9 +2584,11 @@ static gboolean fl_hash_done(gpointer dat) {
   fl_list_getlocal(fl).lastmod = args->lastmod;
   fl_list_getlocal(fl).id = args->id;
   fl_hashindex_insert(fl);
-  fl_needflush = TRUE;
+  fl_listcache_invalidate(fl);
+  fl_journal_add(fl);
 
 fl_hash_done_f:
+  fl_hash_dev_gc(args->dev);
   if(args->err)
     g_error_free(args->err);
   g_free(args->path);
@@ -690,6 +2599,14 @@ fl_hash_done_f:
 }
 
 
+// Called when the hash_threads setting has changed.
+void fl_hash_set_threads(int n) {
+  g_thread_pool_set_max_threads(fl_hash_pool, n, NULL);
+  if(g_hash_table_size(fl_hash_queue))
+    fl_hash_process();
+}
+
+
 
 
 
@@ -710,12 +2627,16 @@ static fl_list_t *fl_refresh_getroot(const char *name) {
     cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
     fl_list_add(fl_local_list, cur, -1);
     fl_list_sort(fl_local_list);
+    fl_searchindex_insert(cur);
+    fl_listcache_invalidate(cur);
+    fl_journal_add(cur);
   }
   return cur;
 }
 
 
-// Recursively adds the files to either the hash index or the hash queue.
+// Recursively adds the files to either the hash index or the hash queue, and
+// directories to the search index.
 static void fl_refresh_addhash(fl_list_t *cur) {
   if(cur->isfile) {
     if(cur->hastth)
@@ -724,20 +2645,23 @@ static void fl_refresh_addhash(fl_list_t *cur) {
       fl_hash_queue_append(cur);
   } else {
     int i;
+    fl_searchindex_insert(cur);
     for(i=0; i<cur->sub->len; i++)
       fl_refresh_addhash(g_ptr_array_index(cur->sub, i));
   }
 }
 
 
-// Recursively removes the files from the hash index. Unlike _addhash(), this
-// doesn't touch the hash queue. The files should have been removed from the
-// hash queue before doing the refresh.
+// Recursively removes the files from the hash index and directories from the
+// search index. Unlike _addhash(), this doesn't touch the hash queue. The
+// files should have been removed from the hash queue before doing the
+// refresh.
 static void fl_refresh_delhash(fl_list_t *cur) {
   if(cur->isfile && cur->hastth)
     fl_hashindex_del(cur);
   else if(!cur->isfile) {
     int i;
+    fl_searchindex_del(cur);
     for(i=0; i<cur->sub->len; i++)
       fl_refresh_delhash(g_ptr_array_index(cur->sub, i));
   }
@@ -770,6 +2694,9 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
     if(check) {
       // File, update information
       if(oldl->isfile) {
+        gboolean changed = !oldl->hastth != !newl->hastth || oldl->size != newl->size
+          || (newl->hastth && memcmp(oldl->tth, newl->tth, 24) != 0);
+        fl_listcache_invalidate(oldl);
         // Remove old file from the hash index if it was in there
         if(oldl->hastth)
           fl_hashindex_del(oldl);
@@ -781,8 +2708,10 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
         fl_list_getlocal(oldl).lastmod = fl_list_getlocal(newl).lastmod;
         // Add updated file to either the hash queue or index
         fl_refresh_addhash(oldl);
-      // Directory, recurse into it
-      } else
+        if(changed)
+          fl_journal_add(oldl);
+      // Directory, recurse into it (if it has been scanned)
+      } else if(newl->sub)
         fl_refresh_compare(oldl, newl);
       oldi++;
       newi++;
@@ -790,7 +2719,9 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
 
     // remove
     if(remove) {
+      fl_listcache_invalidate(oldl);
       fl_refresh_delhash(oldl);
+      fl_journal_del(oldl);
       fl_list_remove(oldl);
       // don't modify oldi, after deletion it will automatically point to the next item in the list
     }
@@ -799,7 +2730,9 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
     if(insert) {
       fl_list_t *tmp = fl_list_copy(newl);
       fl_list_add(old, tmp, oldi);
+      fl_listcache_invalidate(tmp);
       fl_refresh_addhash(tmp);
+      fl_journal_add(tmp);
       oldi++; // after fl_list_add(), oldi points to the new item. But we don't have to check that one again, so increase.
       newi++;
     }
@@ -827,7 +2760,8 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
 static gboolean fl_refresh_scanned(gpointer dat);
 
 static void fl_refresh_process() {
-  if(!fl_refresh_queue->head)
+  // Processed when loading is done, see fl_init_loaded()
+  if(!fl_refresh_queue->head || fl_loading)
     return;
 
   // construct the list of to-be-scanned directories
@@ -845,10 +2779,29 @@ static void fl_refresh_process() {
   // Don't allow files in the scanned directory to be hashed while refreshing.
   // Since the refresh thread will create a completely new fl_list structure,
   // any changes to the old one will be lost.
-  fl_hash_queue_delrec(dir);
+  if(dir)
+    fl_hash_queue_delrec(dir);
+
+  // changed directories from fl_watch_dirty
+  if(!dir) {
+    args->shallow = TRUE;
+    GPtrArray *dirs = fl_watch_dirs();
+    int i;
+    args->file = g_new0(fl_list_t *, dirs->len+1);
+    args->res = g_new0(fl_list_t *, dirs->len+1);
+    args->path = g_new0(char *, dirs->len+1);
+    for(i=0; i<dirs->len; i++) {
+      fl_list_t *d = g_ptr_array_index(dirs, i);
+      int j;
+      for(j=0; j<d->sub->len; j++)
+        fl_hash_queue_del(g_ptr_array_index(d->sub, j));
+      args->file[i] = d;
+      args->path[i] = fl_local_path(d);
+    }
+    g_ptr_array_unref(dirs);
 
   // one dir, the simple case
-  if(dir != fl_local_list) {
+  } else if(dir != fl_local_list) {
     args->file = g_new0(fl_list_t *, 2);
     args->res = g_new0(fl_list_t *, 2);
     args->path = g_new0(char *, 2);
@@ -872,10 +2825,12 @@ static void fl_refresh_process() {
   }
 
   // scan the requested directories in the background
-  g_thread_pool_push(fl_scan_pool, args, NULL);
+  fl_scan(args);
 }
 
 
+static void fl_gc_next();
+
 static gboolean fl_refresh_scanned(gpointer dat) {
   fl_scan_t *args = dat;
 
@@ -884,40 +2839,46 @@ static gboolean fl_refresh_scanned(gpointer dat) {
     fl_refresh_compare(args->file[i], args->res[i]);
     fl_list_free(args->res[i]);
   }
+  fl_refresh_gen++;
+  fl_tthlcache_clear();
 
   // If the hash queue is empty after calling fl_refresh_compare() then it
   // means the file list is completely hashed.
   if(!g_hash_table_size(fl_hash_queue))
     var_set_bool(0, VAR_fl_done, TRUE);
 
-  fl_needflush = TRUE;
   g_strfreev(args->path);
   if(args->excl_regex)
     g_regex_unref(args->excl_regex);
   g_free(args->file);
   g_free(args->res);
+  g_mutex_free(args->lock);
   g_slice_free(fl_scan_t, args);
 
   g_queue_pop_head(fl_refresh_queue);
   if(fl_refresh_queue->head)
     fl_refresh_process();
-  else // force a flush when all queued refreshes have been processed
+  else { // force a flush when all queued refreshes have been processed
     fl_flush(NULL);
+    fl_compact();
+    fl_gc_next();
+  }
   return FALSE;
 }
 
 
 void fl_refresh(fl_list_t *dir) {
-  if(!dir)
+  // Anything queued while loading turns into a full refresh
+  if(!dir || fl_loading)
     dir = fl_local_list;
   GList *n;
   for(n=fl_refresh_queue->head; n; n=n->next) {
     fl_list_t *c = n->data;
     // if current dir is part of listed dir then it's already queued
-    if(dir == c || fl_list_is_child(c, dir))
+    if(c && (dir == c || fl_list_is_child(c, dir)))
       return;
     // if listed dir is part of current dir, then we can remove that item (provided it's not being refreshed currently)
-    if(n->prev && (dir == fl_local_list || fl_list_is_child(c, dir))) {
+    if(n->prev && (dir == fl_local_list || (c && fl_list_is_child(c, dir)))) {
       n = n->prev;
       g_queue_delete_link(fl_refresh_queue, n->next);
     }
@@ -933,7 +2894,12 @@ void fl_refresh(fl_list_t *dir) {
 // Adds a directory to the file list and initiates a refresh on it (Assumes the
 // directory has already been added to the config file).
 void fl_share(const char *dir) {
-  fl_refresh(fl_refresh_getroot(dir));
+  // fl_local_list is only a placeholder while loading, the queued refresh
+  // turns into a full refresh (which includes the new directory) afterwards.
+  if(fl_loading)
+    fl_refresh(NULL);
+  else
+    fl_refresh(fl_refresh_getroot(dir));
 }
 
 
@@ -943,11 +2909,18 @@ void fl_share(const char *dir) {
 // when a currently-being-hashed file is removed due to the directory not being
 // present in the config file anymore).
 void fl_unshare(const char *dir) {
+  // The interim index doesn't know which files are in which share
+  fl_interim_free();
+  // While loading, fl_local_list is only a placeholder. The directories that
+  // are not shared anymore are removed by fl_init_loaded().
+  if(fl_loading)
+    return;
   if(dir) {
     fl_list_t *fl = fl_list_file(fl_local_list, dir);
     g_return_if_fail(fl);
     fl_hash_queue_delrec(fl);
     fl_refresh_delhash(fl);
+    fl_journal_del(fl);
     fl_list_remove(fl);
   } else if(fl_local_list) {
     fl_hash_queue_delrec(fl_local_list);
@@ -955,9 +2928,10 @@ void fl_unshare(const char *dir) {
     fl_list_free(fl_local_list);
     fl_local_list = fl_list_create("", FALSE);
     fl_local_list->sub = g_ptr_array_new_with_free_func(fl_list_free);
+    fl_journal_write('R', "/", NULL);
   }
-  // force a refresh, people may be in a hurry with removing stuff
-  fl_needflush = TRUE;
+  fl_listcache_invalidate(NULL);
+  // force a flush, people may be in a hurry with removing stuff
   fl_flush(NULL);
 }
 
@@ -969,19 +2943,94 @@ void fl_unshare(const char *dir) {
 // Initialize local filelist
 
 
-// Walks through the file list and inserts everything into the fl_hashindex.
+// Counts the hashed files in a list, used to size the hash index in advance.
+static guint32 fl_init_count(fl_list_t *fl) {
+  guint32 n = 0;
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *c = g_ptr_array_index(fl->sub, i);
+    n += c->isfile ? c->hastth : fl_init_count(c);
+  }
+  return n;
+}
+
+
+// Walks through the file list and inserts everything into the fl_hashindex
+// and the search index.
 static void fl_init_list(fl_list_t *fl) {
   int i;
   for(i=0; i<fl->sub->len; i++) {
     fl_list_t *c = g_ptr_array_index(fl->sub, i);
     if(c->isfile && c->hastth)
       fl_hashindex_insert(c);
-    else if(!c->isfile)
+    else if(!c->isfile) {
+      fl_searchindex_insert(c);
       fl_init_list(c);
+    }
   }
 }
 
 
+static void fl_gc_resume();
+
+
+// Called when files.xml.bz2 and the journal have been loaded in the
+// background. Replaces the (empty) fl_local_list with the loaded list and
+// brings the indexes online.
+// Refreshes and saving the list are held back while loading, since they
+// would otherwise operate on the empty list.
+static void fl_init_loaded(fl_list_t *fl, GError *err, void *dat) {
+  gboolean dorefresh = fl_refresh_queue->head ? TRUE : FALSE;
+  g_queue_clear(fl_refresh_queue);
+
+  if(!fl) {
+    ui_mf(uit_main_tab, UIP_MED, "Error loading local filelist: %s. Re-building list.", err->message);
+    g_error_free(err);
+    // The journal is useless without the snapshot, start over.
+    unlink(fl_local_list_file);
+    fl_journal_truncate(G_MAXINT64);
+    dorefresh = TRUE;
+  } else {
+    fl_journal_open();
+    // Directories that are not shared anymore
+    int i;
+    for(i=0; i<fl->sub->len; i++) {
+      fl_list_t *c = g_ptr_array_index(fl->sub, i);
+      if(!db_share_path(c->name)) {
+        fl_journal_del(c);
+        fl_list_remove(c);
+        i--;
+      }
+    }
+    fl_list_free(fl_local_list);
+    fl_local_list = fl;
+  }
+  fl_loading = FALSE;
+  fl_interim_free();
+
+  // If ncdc was previously closed while hashing, make sure to force a refresh
+  // this time to continue the hash progress.
+  if(!var_get_bool(0, VAR_fl_done)) {
+    dorefresh = TRUE;
+    ui_m(uit_main_tab, UIM_NOTIFY, "File list incomplete, refreshing...");
+  }
+
+  // Initialize the fl_hash_index. The share size is recalculated from the
+  // index, rather than using the value remembered from the previous run.
+  fl_local_list_size = fl_local_list_length = 0;
+  fl_hashindex_resize(fl_init_count(fl_local_list));
+  fl_init_list(fl_local_list);
+  fl_listcache_invalidate(NULL);
+  hub_global_nfochange();
+
+  // reset loading indicator
+  if(!dorefresh)
+    ui_m(NULL, UIM_NOLOG, NULL);
+
+  if(dorefresh || var_get_int(0, VAR_autorefresh) || var_get_bool(0, VAR_share_watch))
+    fl_refresh(NULL);
+}
+
 static gboolean fl_init_autorefresh(gpointer dat) {
   int r = var_get_int(0, VAR_autorefresh);
   time_t t = time(NULL);
@@ -992,94 +3041,127 @@ static gboolean fl_init_autorefresh(gpointer dat) {
 
 
 void fl_init() {
-  GError *err = NULL;
-  gboolean dorefresh = FALSE;
-
   // init stuff
   fl_local_list = NULL;
   fl_local_list_file = g_build_filename(db_dir, "files.xml.bz2", NULL);
+  fl_journal_file = g_build_filename(db_dir, "files.journal", NULL);
   fl_refresh_queue = g_queue_new();
-  fl_scan_pool = g_thread_pool_new(fl_scan_thread, NULL, 1, FALSE, NULL);
-  fl_hash_pool = g_thread_pool_new(fl_hash_thread, NULL, 1, FALSE, NULL);
+  fl_watch_dirty = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+#ifdef HAVE_INOTIFY_INIT1
+  fl_watch_paths = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+#endif
+  fl_scan_utf8 = g_get_filename_charsets(NULL);
+  fl_scan_pool = g_thread_pool_new(fl_scan_dir, NULL, var_get_int(0, VAR_share_scan_threads), FALSE, NULL);
+  fl_hash_pool = g_thread_pool_new(fl_hash_thread, NULL, var_get_int(0, VAR_hash_threads), FALSE, NULL);
   fl_hash_resetlock = g_mutex_new();
   fl_hash_resetcond = g_cond_new();
   fl_hash_queue = g_hash_table_new(g_direct_hash, g_direct_equal);
-  // Even though the keys are the tth roots, we can just use g_int_hash. The
-  // first four bytes provide enough unique data anyway.
-  fl_hash_index = g_hash_table_new(g_int_hash, tiger_hash_equal);
+  fl_hash_active = g_hash_table_new(g_direct_hash, g_direct_equal);
+  fl_hash_devs = g_hash_table_new(g_int64_hash, g_int64_equal);
+  fl_hash_rootdevs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  fl_hashindex_resize(0);
+  fl_search_tokens = g_hash_table_new(g_str_hash, g_str_equal);
+  fl_search_trigrams = g_hash_table_new(g_direct_hash, g_direct_equal);
+  fl_search_exts = g_hash_table_new(g_str_hash, g_str_equal);
   ratecalc_init(&fl_hash_rate);
 
-  // flush unsaved data to disk every 60 seconds
-  g_timeout_add_seconds_full(G_PRIORITY_LOW, 60, fl_flush, NULL, NULL);
+  // flush the journal to disk every 60 seconds
+  g_timeout_add_seconds_full(G_PRIORITY_LOW, FL_FLUSH_INTERVAL, fl_flush, NULL, NULL);
   // Check every 60 seconds whether we need to refresh. This automatically
   // adapts itself to changes to the autorefresh config variable. Unlike using
   // the configured interval as a timeout, in which case we need to manually
   // adjust the timer on every change.
   g_timeout_add_seconds_full(G_PRIORITY_LOW, 60, fl_init_autorefresh, NULL, NULL);
 
-  // The following code may take a while on large shares, so indicate to the UI
-  // that we're busy.
-  ui_m(NULL, UIM_NOLOG|UIM_DIRECT, "Loading file list...");
-  ui_draw();
-
   // check whether something is shared
   gboolean sharing = db_share_list()->name ? TRUE : FALSE;
 
-  // load our files.xml.bz2
-  fl_local_list = sharing ? fl_load(fl_local_list_file, &err, TRUE) : NULL;
-  if(sharing && !fl_local_list) {
-    ui_mf(uit_main_tab, UIP_MED, "Error loading local filelist: %s. Re-building list.", err->message);
-    g_error_free(err);
-    dorefresh = TRUE;
-  } else if(!sharing)
+  // Always make sure we at least have an fl_local_list
+  fl_local_list = fl_list_create("", FALSE);
+  fl_local_list->sub = g_ptr_array_new_with_free_func(fl_list_free);
+
+  fl_watch_reset(FALSE);
+  fl_gc_resume();
+
+  // Load files.xml.bz2 and the journal in the background. Until it is done,
+  // hubs get the share size from the previous run and TTH lookups use the
+  // interim index.
+  if(sharing) {
+    ui_m(NULL, UIM_NOLOG|UIM_DIRECT, "Loading file list...");
+    char *v = var_get(0, VAR_fl_size);
+    if(!v || sscanf(v, "%"G_GUINT64_FORMAT" %d", &fl_local_list_size, &fl_local_list_length) != 2)
+      fl_local_list_size = fl_local_list_length = 0;
+    fl_loading = TRUE;
+    fl_compact_t *c = g_slice_new0(fl_compact_t);
+    c->end = -1;
+    GPtrArray *shares = g_ptr_array_new();
+    db_share_item_t *l = db_share_list();
+    for(; l->name; l++) {
+      g_ptr_array_add(shares, g_strdup(l->name));
+      g_ptr_array_add(shares, g_strdup(l->path));
+    }
+    g_ptr_array_add(shares, NULL);
+    c->shares = (char **)g_ptr_array_free(shares, FALSE);
+    g_thread_create(fl_compact_thread, c, FALSE, NULL);
+  } else {
+    // Anything left in the snapshot or journal is not shared anymore.
+    fl_journal_open();
+    fl_journal_write('R', "/", NULL);
     // Force a refresh when we're not sharing anything. This makes sure that we
     // at least have a files.xml.bz2
-    dorefresh = TRUE;
-  ui_m(NULL, UIM_NOLOG, NULL);
-
-  // Always make sure we at least have an fl_local_list
-  if(!fl_local_list) {
-    fl_local_list = fl_list_create("", FALSE);
-    fl_local_list->sub = g_ptr_array_new_with_free_func(fl_list_free);
-  }
-
-  // If ncdc was previously closed while hashing, make sure to force a refresh
-  // this time to continue the hash progress.
-  if(sharing && !var_get_bool(0, VAR_fl_done)) {
-    dorefresh = TRUE;
-    ui_m(uit_main_tab, UIM_NOTIFY, "File list incomplete, refreshing...");
-  }
-
-  // Initialize the fl_hash_index
-  if(fl_local_list)
-    fl_init_list(fl_local_list);
-
-  // reset loading indicator
-  if(!fl_local_list || !dorefresh)
-    ui_m(NULL, UIM_NOLOG|UIM_DIRECT, NULL);
-
-  if(dorefresh || var_get_int(0, VAR_autorefresh))
     fl_refresh(NULL);
+  }
 }
 
 
 
 
-// Garbage-collect. This will remove unused entries from the hashfiles table.
-// The algorithm works as follows:
-// - Create array of `active' ids.
-//   (`active' = there is an fl_list entry in memory with that id)
-// - Sort the array.
-// - Walk through all ids from the hashfiles table in ascending order
-//   - If an id is present in the hashfiles table but not in the sorted array
-//     created earlier, add the id to a delete-these-ids array.
-// - Delete all rows indicated with the delete-these-ids array
-// This algorithm is intended to have low memory requirements, while still
-// being quite fast and efficient.
+// Garbage-collect. This will remove unused entries from the hashfiles and
+// hashdata tables and reclaim the unused space in the database file. This
+// runs in the background in small slices, so that it doesn't block the UI or
+// the database thread for long. The database queries of each slice are done
+// in a worker thread, the main thread only decides what to do with the result
+// and schedules the next slice. The progress is kept in the fl_gc variable,
+// so that an interrupted /gc continues after a restart. The phases are:
+// - FL_GC_FILES: Walk through the ids in the hashfiles table in ascending
+//   order, in slices of FL_GC_SLICE ids, and remove the ids that are not in a
+//   sorted array of `active' ids. (`active' = there is an fl_list entry in
+//   memory with that id). This phase waits until a full refresh has been done
+//   and while a refresh is in progress, and is continued when the refresh has
+//   finished. The array is rebuilt after each refresh, since a refresh can
+//   pick up existing ids from the database; the result of a slice that was
+//   checked against an older array is discarded. Ids added after the /gc was
+//   started are never removed.
+// - FL_GC_DATA: Remove the rows in hashdata that are not referenced from
+//   hashfiles, again FL_GC_SLICE rows at a time.
+// - FL_GC_VACUUM: Run incremental vacuum steps until no unused pages are
+//   left.
+
+#define FL_GC_FILES  1
+#define FL_GC_DATA   2
+#define FL_GC_VACUUM 3
+
+#define FL_GC_SLICE 2000
+#define FL_GC_INTERVAL 200 // ms
+
+typedef struct fl_gc_slice_t {
+  int phase;
+  gint64 pos;
+  gint64 max;    // FL_GC_FILES: -1 if it still has to be determined
+  GArray *rm;    // FL_GC_FILES: ids to remove
+  gint64 last;   // FL_GC_FILES: last checked id, FL_GC_DATA: last checked rowid
+  int left;      // FL_GC_VACUUM: unused pages left
+} fl_gc_slice_t;
 
 static GArray *fl_gc_active = NULL;
-static int fl_gc_last = 0;
-static GArray *fl_gc_remove = NULL;
+static int fl_gc_active_gen = 0;
+static int fl_gc_phase = 0;
+static gint64 fl_gc_pos = 0;
+static gint64 fl_gc_max = 0;
+static int fl_gc_removed = 0;
+static guint fl_gc_timer = 0;
+static gboolean fl_gc_busy = FALSE; // whether a slice is being processed
+static GThreadPool *fl_gc_pool = NULL;
 
 
 static gint fl_gc_idcmp(gconstpointer a, gconstpointer b) {
@@ -1089,45 +3171,176 @@ static gint fl_gc_idcmp(gconstpointer a, gconstpointer b) {
 }
 
 
-// Called from db_fl_getids() with a new id. It is assumed that this id is
-// larger than or equal to the given id in any previous calls.
-static void fl_gc_id(gint64 id) {
-  while(fl_gc_last < fl_gc_active->len && g_array_index(fl_gc_active, gint64, fl_gc_last) < id)
-    fl_gc_last++;
-  if(fl_gc_last >= fl_gc_active->len || g_array_index(fl_gc_active, gint64, fl_gc_last) > id)
-    g_array_append_val(fl_gc_remove, id);
+static void fl_gc_save() {
+  char *tmp = fl_gc_phase ? g_strdup_printf("%d %"G_GINT64_FORMAT" %"G_GINT64_FORMAT, fl_gc_phase, fl_gc_pos, fl_gc_max) : NULL;
+  var_set(0, VAR_fl_gc, tmp, NULL);
+  g_free(tmp);
 }
 
 
-// Returns TRUE when it has done garbage collection, FALSE if it's not possible
-// to create a list of `active' ids because no full file refresh has been
-// performed yet.
-gboolean fl_gc() {
-  if(!fl_refresh_last || fl_refresh_queue->head)
+// Fill the fl_gc_active array. It is possible that two identical ids are
+// added to the array, but this isn't a problem.
+static void fl_gc_getactive() {
+  if(fl_gc_active)
+    g_array_unref(fl_gc_active);
+  fl_gc_active = g_array_sized_new(FALSE, FALSE, 8, fl_hash_index.count);
+  fl_gc_active_gen = fl_refresh_gen;
+  guint32 i;
+  fl_list_t *l;
+  for(i=0; i<=fl_hash_index.mask; i++)
+    for(l=fl_hash_index.slots[i].fl; l; l=fl_local_tthnext(l))
+      g_array_append_val(fl_gc_active, fl_list_getlocal(l).id);
+  g_array_sort(fl_gc_active, fl_gc_idcmp);
+}
+
+
+// Whether the FL_GC_FILES phase can continue
+#define fl_gc_files_ready() (fl_refresh_last && !fl_refresh_queue->head && !fl_loading)
+
+
+static gboolean fl_gc_done(gpointer dat);
+
+// Runs the queries of a slice, in the worker thread. fl_gc_active is not
+// modified while a slice is being processed.
+static void fl_gc_thread(gpointer dat, gpointer udat) {
+  fl_gc_slice_t *c = dat;
+  switch(c->phase) {
+  case FL_GC_FILES:
+    if(c->max < 0)
+      c->max = db_fl_maxid();
+    GArray *ids = g_array_sized_new(FALSE, FALSE, 8, FL_GC_SLICE);
+    db_fl_getids(c->pos, c->max, FL_GC_SLICE, ids);
+    c->rm = g_array_new(FALSE, FALSE, 8);
+    int i;
+    for(i=0; i<ids->len; i++) {
+      gint64 *id = &g_array_index(ids, gint64, i);
+      if(!bsearch(id, fl_gc_active->data, fl_gc_active->len, 8, fl_gc_idcmp))
+        g_array_append_val(c->rm, *id);
+    }
+    c->last = ids->len ? g_array_index(ids, gint64, ids->len-1) : 0;
+    g_array_unref(ids);
+    break;
+  case FL_GC_DATA:
+    c->last = db_fl_purgedata(c->pos, FL_GC_SLICE);
+    break;
+  case FL_GC_VACUUM:
+    c->left = db_vacuum();
+    break;
+  }
+  g_idle_add(fl_gc_done, c);
+}
+
+
+static gboolean fl_gc_step(gpointer dat) {
+  fl_gc_timer = 0;
+  if(!fl_gc_phase || (fl_gc_phase == FL_GC_FILES && !fl_gc_files_ready()))
     return FALSE;
+  if(fl_gc_phase == FL_GC_FILES && (!fl_gc_active || fl_gc_active_gen != fl_refresh_gen))
+    fl_gc_getactive();
+
+  fl_gc_slice_t *c = g_slice_new0(fl_gc_slice_t);
+  c->phase = fl_gc_phase;
+  c->pos = fl_gc_pos;
+  c->max = fl_gc_max;
+  if(!fl_gc_pool)
+    fl_gc_pool = g_thread_pool_new(fl_gc_thread, NULL, 1, FALSE, NULL);
+  fl_gc_busy = TRUE;
+  g_thread_pool_push(fl_gc_pool, c, NULL);
+  return FALSE;
+}
 
-  // Init data
-  fl_gc_active = g_array_sized_new(FALSE, FALSE, 8, g_hash_table_size(fl_hash_index));
-  fl_gc_remove = g_array_new(FALSE, FALSE, 8);
-  fl_gc_last = 0;
 
-  // Fill fl_active array.  It is possible that two identical ids are added to
-  // the array, but this isn't a problem.
-  GSList *l;
-  GHashTableIter iter;
-  g_hash_table_iter_init(&iter, fl_hash_index);
-  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&l))
-    for(; l; l=l->next)
-      g_array_append_val(fl_gc_active, fl_list_getlocal((fl_list_t *)l->data).id);
-  g_array_sort(fl_gc_active, fl_gc_idcmp);
+// Schedules the next slice, if there is anything to do. The FL_GC_FILES phase
+// is continued from fl_refresh_scanned() when it has to wait for a refresh.
+static void fl_gc_next() {
+  if(fl_gc_phase && !fl_gc_busy && !fl_gc_timer && (fl_gc_phase != FL_GC_FILES || fl_gc_files_ready()))
+    fl_gc_timer = g_timeout_add_full(G_PRIORITY_LOW, FL_GC_INTERVAL, fl_gc_step, NULL, NULL);
+}
 
-  // walk through hashfiles table and fill fl_gc_remove
-  db_fl_getids(fl_gc_id);
 
-  // Delete rows and clean up
-  g_debug("fl-gc: Removing %d entries from hashrows.", fl_gc_remove->len);
-  db_fl_rmfiles((gint64 *)fl_gc_remove->data, fl_gc_remove->len);
-  g_array_unref(fl_gc_active);
-  g_array_unref(fl_gc_remove);
-  return TRUE;
+static gboolean fl_gc_done(gpointer dat) {
+  fl_gc_slice_t *c = dat;
+  fl_gc_busy = FALSE;
+  int oldphase = fl_gc_phase;
+  gint64 oldpos = fl_gc_pos, oldmax = fl_gc_max;
+
+  // A new /gc may have been started in the meantime
+  switch(c->phase != fl_gc_phase || c->pos != fl_gc_pos ? 0 : c->phase) {
+  case FL_GC_FILES:
+    fl_gc_max = c->max;
+    // Discard the result if a refresh may have picked up any of these ids in
+    // the meantime, the slice is checked again against the new array.
+    if(fl_gc_active_gen != fl_refresh_gen || !fl_gc_files_ready())
+      break;
+    db_fl_rmfiles((gint64 *)c->rm->data, c->rm->len);
+    fl_gc_removed += c->rm->len;
+    if(c->last)
+      fl_gc_pos = c->last;
+    else {
+      g_debug("fl-gc: Removed %d entries from hashfiles.", fl_gc_removed);
+      // Any remaining hash checkpoints are of files that are no longer being
+      // hashed.
+      if(!g_hash_table_size(fl_hash_queue) && !g_hash_table_size(fl_hash_active))
+        db_fl_rmresume(NULL);
+      g_array_unref(fl_gc_active);
+      fl_gc_active = NULL;
+      fl_gc_phase = FL_GC_DATA;
+      fl_gc_pos = 0;
+      db_fl_gcindex(TRUE);
+    }
+    break;
+  case FL_GC_DATA:
+    if(!(fl_gc_pos = c->last)) {
+      db_fl_gcindex(FALSE);
+      fl_gc_phase = FL_GC_VACUUM;
+    }
+    break;
+  case FL_GC_VACUUM:
+    if(!c->left) {
+      fl_gc_phase = 0;
+      ui_m(uit_main_tab, 0, "Garbage-collection done.");
+    }
+    break;
+  }
+
+  if(c->rm)
+    g_array_unref(c->rm);
+  g_slice_free(fl_gc_slice_t, c);
+  if(fl_gc_phase != oldphase || fl_gc_pos != oldpos || fl_gc_max != oldmax)
+    fl_gc_save();
+  fl_gc_next();
+  return FALSE;
+}
+
+
+// Starts a garbage collection in the background. Returns FALSE if the
+// hashfiles table can't be checked because no full file list refresh has been
+// performed yet, in which case only the hashdata table is cleaned up.
+gboolean fl_gc() {
+  gboolean files = fl_refresh_last ? TRUE : FALSE;
+  if(fl_gc_phase != FL_GC_FILES) {
+    fl_gc_phase = files ? FL_GC_FILES : FL_GC_DATA;
+    fl_gc_pos = 0;
+    fl_gc_max = files ? -1 : 0;
+    fl_gc_removed = 0;
+    if(!files)
+      db_fl_gcindex(TRUE);
+    fl_gc_save();
+  }
+  fl_gc_next();
+  return files;
+}
+
+
+// Continues an interrupted garbage collection. The FL_GC_FILES phase only
+// continues after the first refresh.
+static void fl_gc_resume() {
+  char *v = var_get(0, VAR_fl_gc);
+  if(!v || sscanf(v, "%d %"G_GINT64_FORMAT" %"G_GINT64_FORMAT, &fl_gc_phase, &fl_gc_pos, &fl_gc_max) != 3
+      || fl_gc_phase < FL_GC_FILES || fl_gc_phase > FL_GC_VACUUM) {
+    fl_gc_phase = 0;
+    return;
+  }
+  g_debug("fl-gc: Resuming garbage collection at phase %d.", fl_gc_phase);
+  fl_gc_next();
 }
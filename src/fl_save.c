@@ -71,6 +71,13 @@
 // Minimum output buffer size to give to zlib's deflate() function.
 #define ZLIBBUFSIZE (16*1024)
 
+// Amount of uncompressed data in FO_FB mode that is compressed as a single
+// bzip2 block. The block size at compression level 7 is 700k, but the initial
+// run-length encoding step may expand the input by up to 25%, so this leaves
+// enough room to ensure that a chunk never spans more than one block.
+#define BZCHUNKSIZE (448*1024)
+#define BZLEVEL 7
+
 // Some estimate stats for determining what to include in a file list.
 #define AVGFILELEN 105 // Average size of a <File /> entry
 #define AVGENTRYLEN 80 // Average size of any entry in a directory. (Excluding recursive dirs)
@@ -83,13 +90,50 @@
 #define FO_MZ 3 // Write to memory (zlib)
 
 
+/* Parallel bzip2 compression:
+ *
+ * In FO_FB mode, the serialized XML is split into chunks of BZCHUNKSIZE bytes,
+ * and each chunk is compressed into a separate bzip2 stream in a thread pool.
+ * The streams are then spliced back together, in order, into a single stream
+ * by the main thread. A bzip2 stream consists of a 4-byte header, a bitstream
+ * of blocks, and an 80-bit trailer with a CRC that is a combination of the
+ * CRCs of all blocks, padded to a byte boundary. Blocks are not byte-aligned,
+ * so the splicing has to happen at the bit level. Since each chunk fits in a
+ * single block, the stream CRC of a chunk is the CRC of its only block.
+ *
+ * Writing a single stream rather than concatenating multiple streams (as
+ * pbzip2 does) ensures that the file can be read by clients that stop
+ * decompressing at the end of the first stream.
+ */
+
+typedef struct bzjob_t {
+  GString *in;
+  char *out;
+  unsigned int outlen;
+  int bzerr;
+  gboolean done;
+  struct ctx_t *x;
+} bzjob_t;
+
+static GThreadPool *bz_pool = NULL;
+
+// Maximum number of chunks being compressed or waiting to be written.
+static int bz_maxjobs;
+
+
 typedef struct ctx_t {
   int conf;         // FO_*
   int size;
   GString *buf;     // Write buffer (final in F0_MU, temporary otherwise)
   GString *dest;    // F0_MZ - Destination buffer
   z_stream *zlib;   // F0_MZ
-  BZFILE *fh_bz;    // F0_FB
+  GQueue *bz_jobs;  // F0_FB - bzjob_t items, in order
+  GMutex *bz_lock;  // F0_FB - protects bzjob_t.done
+  GCond *bz_cond;   // F0_FB - signalled when a job is done
+  GString *bz_out;  // F0_FB - compressed data waiting to be written to fh_f
+  guint32 bz_acc;   // F0_FB - bits that have not been written to bz_out yet
+  int bz_nacc;      // F0_FB - number of bits in bz_acc, always < 8
+  guint32 bz_crc;   // F0_FB - combined CRC of all blocks written so far
   FILE *fh_f;       // F0_F*
   const char *file; // F0_F* - Filename (ownership is of the caller)
   char *tmpfile;    // F0_F* - Temp filename (ownership is ours)
@@ -97,19 +141,128 @@ typedef struct ctx_t {
 } ctx_t;
 
 
+static void bz_thread(gpointer dat, gpointer udat) {
+  bzjob_t *j = dat;
+  j->outlen = j->in->len + j->in->len/100 + 600;
+  j->out = g_malloc(j->outlen);
+  j->bzerr = BZ2_bzBuffToBuffCompress(j->out, &j->outlen, j->in->str, j->in->len, BZLEVEL, 0, 0);
+
+  g_mutex_lock(j->x->bz_lock);
+  j->done = TRUE;
+  g_cond_broadcast(j->x->bz_cond);
+  g_mutex_unlock(j->x->bz_lock);
+}
+
+
+// Append the n (<= 24) least significant bits of v to the output stream.
+static void bz_putbits(ctx_t *x, guint32 v, int n) {
+  x->bz_acc = (x->bz_acc << n) | (v & ((1<<n)-1));
+  x->bz_nacc += n;
+  while(x->bz_nacc >= 8) {
+    x->bz_nacc -= 8;
+    g_string_append_c(x->bz_out, (x->bz_acc >> x->bz_nacc) & 0xff);
+  }
+}
+
+
+static int bz_getbit(const guchar *buf, guint64 pos) {
+  return (buf[pos>>3] >> (7-(pos&7))) & 1;
+}
+
+
+static int bz_write(ctx_t *x, gboolean force) {
+  if(!force && x->bz_out->len < BUFSIZE)
+    return 0;
+  if(fwrite(x->bz_out->str, 1, x->bz_out->len, x->fh_f) != x->bz_out->len) {
+    g_set_error(&x->err, 1, 0, "Write error: %s", g_strerror(errno));
+    return -1;
+  }
+  g_string_truncate(x->bz_out, 0);
+  return 0;
+}
+
+
+// Splice the block of a compressed chunk into the output stream.
+static int bz_splice(ctx_t *x, bzjob_t *j) {
+  const guchar *c = (const guchar *)j->out;
+  if(j->bzerr != BZ_OK || j->outlen < 14+10) {
+    g_set_error(&x->err, 1, 0, "bzip2 compression error (%d)", j->bzerr);
+    return -1;
+  }
+  guint32 crc = (c[10]<<24) | (c[11]<<16) | (c[12]<<8) | c[13];
+
+  // Find the trailer, which is followed by 0 to 7 bits of padding.
+  static const guchar trailer[6] = { 0x17, 0x72, 0x45, 0x38, 0x50, 0x90 };
+  guint64 end = 0;
+  int pad, i;
+  for(pad=0; !end && pad<8; pad++) {
+    guint64 start = (guint64)j->outlen*8 - pad - 80;
+    for(i=0; i<80; i++) {
+      int bit = i < 48 ? (trailer[i>>3] >> (7-(i&7))) & 1 : (crc >> (79-i)) & 1;
+      if(bz_getbit(c, start+i) != bit)
+        break;
+    }
+    if(i == 80)
+      end = start;
+  }
+  if(!end) {
+    g_set_error_literal(&x->err, 1, 0, "bzip2 compression error (unexpected stream layout)");
+    return -1;
+  }
+
+  // Copy everything between the stream header and the trailer.
+  guint64 n = 32;
+  for(; n+8 <= end; n+=8)
+    bz_putbits(x, c[n>>3], 8);
+  for(; n<end; n++)
+    bz_putbits(x, bz_getbit(c, n), 1);
+  x->bz_crc = ((x->bz_crc << 1) | (x->bz_crc >> 31)) ^ crc;
+  return bz_write(x, FALSE);
+}
+
+
+// Wait for the oldest job to finish and write it to the output.
+static int bz_pop(ctx_t *x) {
+  bzjob_t *j = g_queue_pop_head(x->bz_jobs);
+  g_mutex_lock(x->bz_lock);
+  while(!j->done)
+    g_cond_wait(x->bz_cond, x->bz_lock);
+  g_mutex_unlock(x->bz_lock);
+
+  int r = x->err ? -1 : bz_splice(x, j);
+  g_string_free(j->in, TRUE);
+  g_free(j->out);
+  g_slice_free(bzjob_t, j);
+  return r;
+}
+
+
 // Flushes the write buffer to the underlying bzip2/zlib/file object (if any).
 static int doflush(ctx_t *x, gboolean force) {
   switch(x->conf) {
-  case FO_FB: {
-    int bzerr;
-    BZ2_bzWrite(&bzerr, x->fh_bz, x->buf->str, x->buf->len);
-    if(bzerr != BZ_OK) {
-      g_set_error(&x->err, 1, 0, "Write error: %s", g_strerror(errno));
-      return -1;
+  case FO_FB:
+    if(x->buf->len >= BZCHUNKSIZE || (force && x->buf->len > 0)) {
+      bzjob_t *j = g_slice_new0(bzjob_t);
+      j->in = x->buf;
+      j->x = x;
+      x->buf = g_string_sized_new(BZCHUNKSIZE + BUFSIZE);
+      g_queue_push_tail(x->bz_jobs, j);
+      g_thread_pool_push(bz_pool, j, NULL);
+    }
+    while(x->bz_jobs->length > (force ? 0 : bz_maxjobs))
+      if(bz_pop(x))
+        return -1;
+    if(force) {
+      // Stream trailer
+      bz_putbits(x, 0x177245, 24);
+      bz_putbits(x, 0x385090, 24);
+      bz_putbits(x, x->bz_crc >> 16, 16);
+      bz_putbits(x, x->bz_crc, 16);
+      if(x->bz_nacc)
+        bz_putbits(x, 0, 8-x->bz_nacc);
+      return bz_write(x, TRUE);
     }
-    x->buf->len = 0;
     break;
-  }
 
   case FO_FU: {
     int r = fwrite(x->buf->str, 1, x->buf->len, x->fh_f);
@@ -319,12 +472,17 @@ static int ctx_open(ctx_t *x, int conf, const char *file, GString *buf) {
 
   // bzip2 compressor
   if(x->conf == FO_FB) {
-    int bzerr;
-    x->fh_bz = BZ2_bzWriteOpen(&bzerr, x->fh_f, 7, 0, 0);
-    if(bzerr != BZ_OK) {
-      g_set_error(&x->err, 1, 0, "Unable to create bzip2 file (%d): %s", bzerr, g_strerror(errno));
-      return -1;
+    if(!bz_pool) {
+      int n = sysconf(_SC_NPROCESSORS_ONLN);
+      n = MAX(n, 1);
+      bz_maxjobs = 2*n;
+      bz_pool = g_thread_pool_new(bz_thread, NULL, n, FALSE, NULL);
     }
+    x->bz_jobs = g_queue_new();
+    x->bz_lock = g_mutex_new();
+    x->bz_cond = g_cond_new();
+    x->bz_out = g_string_sized_new(BUFSIZE*2);
+    g_string_append_printf(x->bz_out, "BZh%d", BZLEVEL);
   }
 
   return 0;
@@ -345,11 +503,14 @@ static void ctx_close(ctx_t *x) {
     g_slice_free(z_stream, x->zlib);
   }
 
-  if(x->conf == FO_FB && x->fh_bz) {
-    int bzerr;
-    BZ2_bzWriteClose(&bzerr, x->fh_bz, 0, NULL, NULL);
-    if(bzerr != BZ_OK && !x->err)
-      g_set_error(&x->err, 1, 0, "Error closing bzip2 stream (%d): %s", bzerr, g_strerror(errno));
+  if(x->conf == FO_FB && x->bz_jobs) {
+    // Only non-empty on error, but we still have to wait for the threads.
+    while(x->bz_jobs->length)
+      bz_pop(x);
+    g_queue_free(x->bz_jobs);
+    g_mutex_free(x->bz_lock);
+    g_cond_free(x->bz_cond);
+    g_string_free(x->bz_out, TRUE);
   }
 
   if(x->conf == FO_FB || x->conf == FO_FU) {
@@ -375,12 +536,14 @@ static void ctx_close(ctx_t *x) {
 int fl_save(fl_list_t *fl, const char *cid, int targetsize, gboolean zlib, GString *buf, const char *file, GError **err) {
   g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
 
+  gint64 start = stats_now();
   ctx_t x;
   int conf = buf && zlib ? FO_MZ : buf ? FO_MU :
     strlen(file) > 4 && strcmp(file+(strlen(file)-4), ".bz2") == 0 ? FO_FB : FO_FU;
   if(ctx_open(&x, conf, file, buf) == 0)
     at(&x, fl, cid, targetsize);
   ctx_close(&x);
+  stats_record(STATH_FL_SAVE, stats_now()-start);
   if(x.err)
     g_propagate_error(err, x.err);
 
@@ -40,6 +40,8 @@ struct fl_list_t {
   gboolean isfile : 1;
   gboolean hastth : 1;  // only if isfile==TRUE
   gboolean islocal : 1; // only if isfile==TRUE
+  gboolean inarena : 1; // allocated from the arena of the root
+  gboolean isarena : 1; // root of a list that owns an arena
   char name[1];
 };
 
@@ -51,6 +53,7 @@ struct fl_list_t {
 struct fl_list_local_t {
   time_t lastmod;
   gint64 id;
+  fl_list_t *hashnext; // next file with the same TTH, see fl_local_from_tth()
 };
 
 #endif
@@ -83,6 +86,52 @@ struct fl_list_local_t {
 #endif
 
 
+// Arena allocation. Large lists (as created by fl_load() and the local file
+// scanner) are built at once and mostly freed at once, so rather than
+// allocating every item separately, the items (including their names) are
+// allocated from large memory slabs owned by the root of the list. The arena
+// itself is stored in the first slab, right before the root item.
+// fl_list_free() on an item inside an arena doesn't release its memory, this
+// only happens when the root is freed. Items added to such a list later on
+// (e.g. with fl_list_copy()) are allocated separately, as usual. Because freed
+// items are never reused, lists that keep changing for a long time (i.e. our
+// own file list) should not use an arena.
+
+typedef struct fl_arena_t {
+  GSList *slabs; // excluding the first one
+  char *ptr;
+  gsize left;
+} fl_arena_t;
+
+#define FL_ARENA_SLAB (256*1024)
+#define FL_ARENA_OFFSET ((sizeof(fl_arena_t) + 7) & ~7)
+#define fl_arena(root) ((fl_arena_t *)((char *)(root) - FL_ARENA_OFFSET))
+
+
+static void *fl_arena_alloc(fl_arena_t *a, gsize size) {
+  size = (size + 7) & ~7;
+  if(size > a->left) {
+    a->left = MAX(FL_ARENA_SLAB, size);
+    a->ptr = g_malloc(a->left);
+    a->slabs = g_slist_prepend(a->slabs, a->ptr);
+  }
+  void *r = a->ptr;
+  a->ptr += size;
+  a->left -= size;
+  memset(r, 0, size);
+  return r;
+}
+
+
+static void fl_arena_free(fl_arena_t *a) {
+  GSList *l;
+  for(l=a->slabs; l; l=l->next)
+    g_free(l->data);
+  g_slist_free(a->slabs);
+  g_free(a);
+}
+
+
 // only frees the given item and its childs. leaves the parent(s) untouched
 void fl_list_free(gpointer dat) {
   fl_list_t *fl = dat;
@@ -90,7 +139,10 @@ void fl_list_free(gpointer dat) {
     return;
   if(fl->sub)
     g_ptr_array_unref(fl->sub);
-  g_slice_free1(fl_list_size(fl->name, fl->islocal), fl);
+  if(fl->isarena)
+    fl_arena_free(fl_arena(fl));
+  else if(!fl->inarena)
+    g_slice_free1(fl_list_size(fl->name, fl->islocal), fl);
 }
 
 
@@ -104,6 +156,36 @@ fl_list_t *fl_list_create(const char *name, gboolean local) {
 }
 
 
+// Create an empty root directory that has its own arena. Items for this list
+// can then be allocated with fl_list_create_in().
+fl_list_t *fl_list_create_root() {
+  char *slab = g_malloc(FL_ARENA_SLAB);
+  fl_arena_t *a = (fl_arena_t *)slab;
+  fl_list_t *fl = (fl_list_t *)(slab + FL_ARENA_OFFSET);
+  gsize size = (fl_list_size("", FALSE) + 7) & ~7;
+  memset(fl, 0, size);
+  a->slabs = NULL;
+  a->ptr = slab + FL_ARENA_OFFSET + size;
+  a->left = FL_ARENA_SLAB - FL_ARENA_OFFSET - size;
+  fl->isarena = TRUE;
+  fl->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  return fl;
+}
+
+
+// Like fl_list_create(), but allocates the item from the arena of the given
+// root (as created with fl_list_create_root()). Not thread-safe for the same
+// root.
+fl_list_t *fl_list_create_in(fl_list_t *root, const char *name, gboolean local) {
+  g_return_val_if_fail(root->isarena, fl_list_create(name, local));
+  fl_list_t *fl = fl_arena_alloc(fl_arena(root), fl_list_size(name, local));
+  strcpy(fl->name, name);
+  fl->islocal = local;
+  fl->inarena = TRUE;
+  return fl;
+}
+
+
 // Used for sorting and determining whether two files in the same directory are
 // equivalent (that is, have the same name). File names are case-insensitive,
 // as required by the ADC protocol.
@@ -180,6 +262,9 @@ fl_list_t *fl_list_copy(const fl_list_t *fl) {
   fl_list_t *cur = g_slice_alloc(size);
   memcpy(cur, fl, size);
   cur->parent = NULL;
+  cur->inarena = cur->isarena = FALSE;
+  if(cur->islocal)
+    fl_list_getlocal(cur).hashnext = NULL;
   if(fl->sub) {
     cur->sub = g_ptr_array_sized_new(fl->sub->len);
     g_ptr_array_set_free_func(cur->sub, fl_list_free);
@@ -318,8 +403,9 @@ struct fl_search_t {
   char filedir; // 1 = file, 2 = dir, 3 = any
   guint64 size;
   char **ext;   // extension list
-  GRegex **and; // keywords that must all be present {/\Qstring\E/i, .., NULL}
-  GRegex *not;  // keywords that may not be present /\Qstring1\E|\Qstring2\E|../i
+  str_matcher_t *match; // matcher for all AND and NOT keywords (NULL if there are none)
+  guint64 and;  // bits in `match' of the keywords that must all be present
+  guint64 not;  // bits in `match' of the keywords that may not be present
 };
 
 
@@ -333,71 +419,48 @@ struct fl_search_t {
 #endif
 
 
-// Create fl_search.and from a NULL-terminated string array.
-// Free with fl_search_free_and().
-GRegex **fl_search_create_and(char **a) {
-  if(!a || !*a)
-    return NULL;
-  int len = g_strv_length(a);
-  GRegex **res = g_new(GRegex *, len+1);
-  int i;
-  for(i=0; *a; a++) {
-    char *tmp = g_regex_escape_string(*a, -1);
-    res[i++] = g_regex_new(tmp, G_REGEX_CASELESS|G_REGEX_OPTIMIZE, 0, NULL);
-    g_free(tmp);
-  }
-  res[i] = NULL;
-  return res;
-}
-
-
-// Create a fl_search.not regex from a NULL-terminated string array.
-// Free with g_regex_unref().
-GRegex *fl_search_create_not(char **a) {
-  if(!a || !*a)
-    return NULL;
-  GString *reg = g_string_new("(?:");
-  int first = 0;
-  for(; *a; a++) {
-    if(first++)
-      g_string_append_c(reg, '|');
-    char *tmp = g_regex_escape_string(*a, -1);
-    g_string_append(reg, tmp);
-    g_free(tmp);
-  }
-  g_string_append_c(reg, ')');
-  GRegex *res = g_regex_new(reg->str, G_REGEX_CASELESS|G_REGEX_OPTIMIZE, 0, NULL);
-  g_string_free(reg, TRUE);
-  return res;
+// Set the AND and NOT keywords (both NULL-terminated string arrays, may be
+// NULL) of a search. Free with fl_search_free_keywords(). Returns FALSE if
+// there are more than 64 keywords, which str_matcher_t doesn't support.
+// Dropping the extra ones would widen the search, so the query should be
+// ignored instead.
+gboolean fl_search_keywords(fl_search_t *s, char **and, char **not) {
+  int nand = and ? g_strv_length(and) : 0;
+  int nnot = not ? g_strv_length(not) : 0;
+  s->and = s->not = 0;
+  s->match = NULL;
+  if(nand + nnot > 64)
+    return FALSE;
+  if(!nand && !nnot)
+    return TRUE;
+  char *pats[nand+nnot+1];
+  memcpy(pats, and, nand*sizeof(char *));
+  memcpy(pats+nand, not, nnot*sizeof(char *));
+  pats[nand+nnot] = NULL;
+  s->match = str_matcher_new(pats);
+  s->and = nand ? G_MAXUINT64 >> (64-nand) : 0;
+  s->not = nnot ? (G_MAXUINT64 >> (64-nnot)) << nand : 0;
+  return TRUE;
 }
 
 
-void fl_search_free_and(GRegex **l) {
-  GRegex **i = l;
-  for(; i&&*i; i++)
-    g_regex_unref(*i);
-  g_free(l);
+void fl_search_free_keywords(fl_search_t *s) {
+  str_matcher_free(s->match);
+  s->match = NULL;
 }
 
 
-static int fl_search_and_len(GRegex **l) {
-  int i = 0;
-  for(; l&&*l; l++)
-    i++;
-  return i;
-}
+#define fl_search_match_str(s, str) ((s)->match ? str_matcher_match((s)->match, str) : 0)
 
 
 // Only matches against fl->name itself, not the path to it (AND keywords
 // matched in the path are assumed to be removed already)
 gboolean fl_search_match_name(fl_list_t *fl, fl_search_t *s) {
-  GRegex **tmpr;
-  for(tmpr=s->and; tmpr&&*tmpr; tmpr++)
-    if(G_LIKELY(!g_regex_match(*tmpr, fl->name, 0, NULL)))
+  if(s->match) {
+    guint64 m = str_matcher_match(s->match, fl->name);
+    if(G_LIKELY((m & s->and) != s->and) || (m & s->not))
       return FALSE;
-
-  if(s->not && g_regex_match(s->not, fl->name, 0, NULL))
-    return FALSE;
+  }
 
   char **tmp;
   tmp = s->ext;
@@ -422,17 +485,11 @@ int fl_search_rec(fl_list_t *parent, fl_search_t *s, fl_list_t **res, int max) {
     return 0;
   // weed out stuff from 'and' if it's already matched in parent (I'm assuming
   // that stuff matching the parent of parent has already been removed)
-  GRegex **o = s->and;
-  GRegex *nand[fl_search_and_len(o)+1];
-  int i = 0;
-  for(; o&&*o; o++)
-    if(G_LIKELY(!parent->parent || !g_regex_match(*o, parent->name, 0, NULL)))
-      nand[i++] = *o;
-  nand[i] = NULL;
-  o = s->and;
-  s->and = nand;
+  guint64 oand = s->and;
+  if(parent->parent && s->and)
+    s->and &= ~fl_search_match_str(s, parent->name);
   // loop through the directory
-  int n = 0;
+  int i, n = 0;
   for(i=0; n<max && i<parent->sub->len; i++) {
     fl_list_t *f = g_ptr_array_index(parent->sub, i);
     if(fl_search_match(f, s))
@@ -440,34 +497,40 @@ int fl_search_rec(fl_list_t *parent, fl_search_t *s, fl_list_t **res, int max) {
     if(!f->isfile && n < max)
       n += fl_search_rec(f, s, res+n, max-n);
   }
-  s->and = o;
+  s->and = oand;
   return n;
 }
 
 
+// Returns the AND keywords of s that are not matched in any of the parents of
+// fl (excluding the root).
+static guint64 fl_search_and_parents(fl_list_t *fl, fl_search_t *s) {
+  guint64 and = s->and;
+  fl_list_t *p = fl->parent;
+  for(; and && p && p->parent; p=p->parent)
+    and &= ~fl_search_match_str(s, p->name);
+  return and;
+}
+
+
 // Similar to fl_search_match(), but also matches the name of the parents.
 gboolean fl_search_match_full(fl_list_t *fl, fl_search_t *s) {
   // weed out stuff from 'and' if it's already matched in any of its parents.
-  GRegex **oand = s->and;
-  int len = fl_search_and_len(s->and);
-  GRegex *nand[len];
-  fl_list_t *p = fl->parent;
-  int i;
-  memcpy(nand, s->and, len*sizeof(GRegex *));
-  for(; p && p->parent; p=p->parent)
-    for(i=0; i<len; i++)
-      if(G_UNLIKELY(nand[i] && g_regex_match(nand[i], p->name, 0, NULL)))
-        nand[i] = NULL;
-  GRegex *and[len];
-  int j=0;
-  for(i=0; i<len; i++)
-    if(nand[i])
-      and[j++] = nand[i];
-  and[j] = NULL;
-  s->and = and;
+  guint64 oand = s->and;
+  s->and = fl_search_and_parents(fl, s);
   // and now match
   gboolean r = fl_search_match(fl, s);
   s->and = oand;
   return r;
 }
 
+
+// Similar to fl_search_rec(), but also matches the names of the parents of
+// the given directory. Can be used to search within any subdirectory.
+int fl_search_rec_full(fl_list_t *parent, fl_search_t *s, fl_list_t **res, int max) {
+  guint64 oand = s->and;
+  s->and = fl_search_and_parents(parent, s);
+  int r = fl_search_rec(parent, s, res, max);
+  s->and = oand;
+  return r;
+}
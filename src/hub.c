@@ -58,6 +58,7 @@ struct hub_user_t {
   char *client;
   guint64 uid;
   guint64 sharesize;
+  guint64 nfo_hash; // hash of the last $MyINFO / BINF, to detect updates that don't change anything
   char *kp;      // ADC with KEYP, 32 bytes slice-alloc'ed
   GSequenceIter *iter; // used by ui_userlist_*
 }
@@ -69,6 +70,8 @@ struct hub_t {
   int state;               // (ADC) ADC_S_*
   ui_tab_t *tab;
   net_t *net;
+  ratecalc_t *rate_up;     // Rate limiting buckets for the transfers with users on this hub.
+  ratecalc_t *rate_down;   // (Limited by the hub-local upload_rate and download_rate)
 
   // Hub info / config
   guint64 id;              // "hubid" number
@@ -168,6 +171,67 @@ guint64 hub_user_nmdc_id(guint64 hubid, const char *name) {
 }
 
 
+// Interned strings for the desc, client, conn and mail fields of hub_user_t.
+// These are often identical for many users, and the same users tend to be on
+// several hubs. The strings are reference counted, main thread only.
+
+typedef struct user_str_t {
+  int ref;
+  char str[1];
+} user_str_t;
+
+static GHashTable *user_strs = NULL;
+
+
+static char *user_str_get(const char *str) {
+  if(!str || !str[0])
+    return NULL;
+  if(!user_strs)
+    user_strs = g_hash_table_new(g_str_hash, g_str_equal);
+  user_str_t *s = g_hash_table_lookup(user_strs, str);
+  if(!s) {
+    int len = strlen(str);
+    s = g_malloc(G_STRUCT_OFFSET(user_str_t, str) + len + 1);
+    s->ref = 0;
+    memcpy(s->str, str, len+1);
+    g_hash_table_insert(user_strs, s->str, s);
+  }
+  s->ref++;
+  return s->str;
+}
+
+
+// Same as user_str_get(), but frees the given string.
+static char *user_str_take(char *str) {
+  char *r = user_str_get(str);
+  g_free(str);
+  return r;
+}
+
+
+static void user_str_unref(char *str) {
+  if(!str)
+    return;
+  user_str_t *s = (user_str_t *)(str - G_STRUCT_OFFSET(user_str_t, str));
+  if(!--s->ref) {
+    g_hash_table_remove(user_strs, s->str);
+    g_free(s);
+  }
+}
+
+
+// 64-bit FNV-1a, used for hub_user_t->nfo_hash.
+static guint64 user_nfo_hash(guint64 h, const char *str) {
+  if(!h)
+    h = G_GUINT64_CONSTANT(14695981039346656037);
+  for(; *str; str++) {
+    h ^= (unsigned char)*str;
+    h *= G_GUINT64_CONSTANT(1099511628211);
+  }
+  return h;
+}
+
+
 // cid is required for ADC. expected to be base32-encoded.
 static hub_user_t *user_add(hub_t *hub, const char *name, const char *cid) {
   hub_user_t *u = g_hash_table_lookup(hub->users, name);
@@ -211,11 +275,11 @@ static void user_free(gpointer dat) {
     g_slice_free1(32, u->kp);
   g_free(u->name_hub);
   g_free(u->name);
-  g_free(u->desc);
+  user_str_unref(u->desc);
   if(!u->hub->adc)
-    g_free(u->conn);
-  g_free(u->mail);
-  g_free(u->client);
+    user_str_unref(u->conn);
+  user_str_unref(u->mail);
+  user_str_unref(u->client);
   g_slice_free(hub_user_t, u);
 }
 
@@ -292,6 +356,11 @@ static void user_nmdc_nfo(hub_t *hub, hub_user_t *u, char *str) {
   unsigned int as = 0;
   guint64 share = 0;
 
+  // Many $MyINFO updates don't change anything, nothing to do in that case.
+  guint64 hash = user_nfo_hash(0, str);
+  if(u->hasinfo && u->nfo_hash == hash)
+    return;
+
   if(!(next = strchr(str, '$')) || strlen(next) < 3 || next[2] != '$')
     return;
   if(next[1] == 'A')
@@ -360,15 +429,16 @@ static void user_nmdc_nfo(hub_t *hub, hub_user_t *u, char *str) {
   share = g_ascii_strtoull(str, NULL, 10);
 
   // If we still haven't 'return'ed yet, that means we have a correct $MyINFO. Now we can update the struct.
-  g_free(u->desc);
-  g_free(u->client);
-  g_free(u->conn);
-  g_free(u->mail);
+  user_str_unref(u->desc);
+  user_str_unref(u->client);
+  user_str_unref(u->conn);
+  user_str_unref(u->mail);
+  u->nfo_hash = hash;
   u->sharesize = share;
-  u->desc = desc[0] ? nmdc_unescape_and_decode(hub, desc) : NULL;
-  u->client = client && client[0] ? g_strdup(client) : NULL;
-  u->conn = conn[0] ? nmdc_unescape_and_decode(hub, conn) : NULL;
-  u->mail = mail[0] ? nmdc_unescape_and_decode(hub, mail) : NULL;
+  u->desc = desc[0] ? user_str_take(nmdc_unescape_and_decode(hub, desc)) : NULL;
+  u->client = user_str_get(client);
+  u->conn = conn[0] ? user_str_take(nmdc_unescape_and_decode(hub, conn)) : NULL;
+  u->mail = mail[0] ? user_str_take(nmdc_unescape_and_decode(hub, mail)) : NULL;
   u->h_norm = h_norm;
   u->h_reg = h_reg;
   u->h_op = h_op;
@@ -386,6 +456,16 @@ static void user_nmdc_nfo(hub_t *hub, hub_user_t *u, char *str) {
 #define P(a,b) (((a)<<8) + (b))
 
 static void user_adc_nfo(hub_t *hub, hub_user_t *u, adc_cmd_t *cmd) {
+  // Applying the same INF twice has no effect, so skip it if it's identical
+  // to the previous one.
+  char **n;
+  guint64 hash = 0;
+  for(n=cmd->argv; n&&*n; n++)
+    hash = user_nfo_hash(user_nfo_hash(hash, *n), " ");
+  if(u->hasinfo && u->nfo_hash == hash)
+    return;
+  u->nfo_hash = hash;
+
   u->hasinfo = TRUE;
   // sid
   if(!u->sid) {
@@ -394,7 +474,6 @@ static void user_adc_nfo(hub_t *hub, hub_user_t *u, adc_cmd_t *cmd) {
   }
 
   // This is faster than calling adc_getparam() each time
-  char **n;
   for(n=cmd->argv; n&&*n; n++) {
     if(strlen(*n) < 2)
       continue;
@@ -407,17 +486,17 @@ static void user_adc_nfo(hub_t *hub, hub_user_t *u, adc_cmd_t *cmd) {
       g_hash_table_insert(hub->users, u->name, u);
       break;
     case P('D','E'): // description
-      g_free(u->desc);
-      u->desc = p[0] ? g_strdup(p) : NULL;
+      user_str_unref(u->desc);
+      u->desc = user_str_get(p);
       break;
     case P('V','E'): // client name (+ version)
-      g_free(u->client);
+      user_str_unref(u->client);
       char *ap = adc_getparam(cmd->argv, "AP", NULL);
-      u->client = !p[0] ? NULL : !ap || strncmp(p, ap, strlen(ap)) == 0 ? g_strdup(p) : g_strdup_printf("%s %s", ap, p);
+      u->client = !p[0] ? NULL : !ap || strncmp(p, ap, strlen(ap)) == 0 ? user_str_get(p) : user_str_take(g_strdup_printf("%s %s", ap, p));
       break;
     case P('E','M'): // mail
-      g_free(u->mail);
-      u->mail = p[0] ? g_strdup(p) : NULL;
+      user_str_unref(u->mail);
+      u->mail = user_str_get(p);
       break;
     case P('S','S'): // share size
       u->sharesize = g_ascii_strtoull(p, NULL, 10);
@@ -493,14 +572,27 @@ hub_t *hub_global_byid(guint64 id) {
 }
 
 
+// The fields of our INF / $MyINFO that are the same for every hub.
+typedef struct hub_nfo_global_t {
+  unsigned char slots, free_slots, h_norm, h_reg, h_op;
+  int upload_rate;
+  guint64 share;
+} hub_nfo_global_t;
+
+static void hub_nfo_global(hub_nfo_global_t *g);
+static void hub_send_nfo_g(hub_t *hub, const hub_nfo_global_t *g);
+
+
 // Should be called when something changes that may affect our INF or $MyINFO.
 void hub_global_nfochange() {
+  hub_nfo_global_t g;
+  hub_nfo_global(&g);
   GHashTableIter i;
   g_hash_table_iter_init(&i, hubs);
   hub_t *h;
   while(g_hash_table_iter_next(&i, NULL, (gpointer *)&h)) {
     if(h->nick_valid)
-      hub_send_nfo(h);
+      hub_send_nfo_g(h, &g);
   }
 }
 
@@ -673,76 +765,94 @@ static unsigned char num_free_slots(unsigned char hub_slots) {
   return rv > 0 ? rv : 0;
 }
 
-static GString* format_desc(hub_t *hub, unsigned char free_slots) {
-  GString *desc;
+static void format_desc(GString *desc, hub_t *hub, unsigned char free_slots) {
   const char *static_desc = var_get(hub->id, VAR_description);
   if(var_get_bool(hub->id, VAR_show_free_slots)) {
-    desc = g_string_sized_new(128);
     if(static_desc)
       g_string_printf(desc, "[%d sl] %s", free_slots, static_desc);
     else
       g_string_printf(desc, "[%d sl]", free_slots);
   } else
-    desc = g_string_new(static_desc);
-  return desc;
+    g_string_assign(desc, static_desc ? static_desc : "");
 }
 
+
+static void hub_nfo_global(hub_nfo_global_t *g) {
+  g->slots = var_get_int(0, VAR_slots);
+  g->free_slots = num_free_slots(g->slots);
+  g->upload_rate = var_get_int(0, VAR_upload_rate);
+  g->share = fl_local_list_size;
+
+  g->h_norm = g->h_reg = g->h_op = 0;
+  GHashTableIter iter;
+  hub_t *oh = NULL;
+  g_hash_table_iter_init(&iter, hubs);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&oh)) {
+    if(!oh->nick_valid)
+      continue;
+    if(oh->isop)
+      g->h_op++;
+    else if(oh->isreg)
+      g->h_reg++;
+    else
+      g->h_norm++;
+  }
+}
+
+
 void hub_send_nfo(hub_t *hub) {
+  if(!net_is_connected(hub->net))
+    return;
+  hub_nfo_global_t g;
+  hub_nfo_global(&g);
+  hub_send_nfo_g(hub, &g);
+}
+
+
+static void hub_send_nfo_g(hub_t *hub, const hub_nfo_global_t *g) {
   if(!net_is_connected(hub->net))
     return;
 
+  // Scratch buffers, so that the common case of nothing having changed
+  // doesn't allocate anything and an update doesn't need a fresh string for
+  // every hub.
+  static GString *fmt_desc = NULL, *cmd = NULL;
+  if(!fmt_desc) {
+    fmt_desc = g_string_sized_new(128);
+    cmd = g_string_sized_new(512);
+  }
+
   // get info, to be compared with hub->nfo_
   char *desc, *conn = NULL, *mail, *ip;
-  unsigned char slots, free_slots, h_norm, h_reg, h_op;
-  guint64 share;
+  unsigned char slots = g->slots, free_slots = g->free_slots, h_norm = g->h_norm, h_reg = g->h_reg, h_op = g->h_op;
+  guint64 share = g->share;
   guint16 udp_port;
   gboolean sup_tls, sup_sudp;
-  GString *fmt_desc;
 
   mail = var_get(hub->id, VAR_email);
-  slots = var_get_int(0, VAR_slots);
-  free_slots = num_free_slots(slots);
-  fmt_desc = format_desc(hub, free_slots);
+  format_desc(fmt_desc, hub, free_slots);
   desc = fmt_desc->str;
 
   char buf[50] = {};
-  if(var_get_int(0, VAR_upload_rate)) {
-    g_snprintf(buf, sizeof(buf), "%d KiB/s", var_get_int(0, VAR_upload_rate)/1024);
+  if(g->upload_rate) {
+    g_snprintf(buf, sizeof(buf), "%d KiB/s", g->upload_rate/1024);
     conn = buf;
   } else
     conn = var_get(hub->id, VAR_connection);
 
-  h_norm = h_reg = h_op = 0;
-  GHashTableIter iter;
-  hub_t *oh = NULL;
-  g_hash_table_iter_init(&iter, hubs);
-  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&oh)) {
-    if(!oh->nick_valid)
-      continue;
-    if(oh->isop)
-      h_op++;
-    else if(oh->isreg)
-      h_reg++;
-    else
-      h_norm++;
-  }
   ip = listen_hub_active(hub->id) ? hub_ip(hub) : NULL;
   udp_port = listen_hub_udp(hub->id);
-  share = fl_local_list_size;
   sup_tls = var_get_int(hub->id, VAR_tls_policy) > VAR_TLSP_DISABLE ? TRUE : FALSE;
   sup_sudp = hub->tls && var_get_int(0, VAR_sudp_policy) != VAR_SUDPP_DISABLE ? TRUE : FALSE;
 
   // check whether we need to make any further effort
   if(hub->nick_valid && streq(desc) && streq(conn) && streq(mail) && eq(slots) && eq(free_slots) && streq(ip)
-      && eq(h_norm) && eq(h_reg) && eq(h_op) && eq(share) && eq(udp_port) && beq(sup_tls) && beq(sup_sudp)) {
-    g_string_free(fmt_desc, TRUE);
+      && eq(h_norm) && eq(h_reg) && eq(h_op) && eq(share) && eq(udp_port) && beq(sup_tls) && beq(sup_sudp))
     return;
-  }
 
-  char *nfo;
   // ADC
   if(hub->adc) { // TODO: DS and SF?
-    GString *cmd = adc_generate('B', ADCC_INF, hub->sid, 0);
+    adc_generate_buf(cmd, 'B', ADCC_INF, hub->sid, 0);
     // send non-changing stuff in the IDENTIFY state
     gboolean f = hub->state == ADC_S_IDENTIFY;
     if(f) {
@@ -792,14 +902,13 @@ void hub_send_nfo(hub_t *hub) {
     if((f || !streq(conn)) && str_connection_to_speed(conn))
       g_string_append_printf(cmd, " US%"G_GUINT64_FORMAT, str_connection_to_speed(conn));
     g_string_append_c(cmd, '\n');
-    nfo = g_string_free(cmd, FALSE);
 
   // NMDC
   } else {
     char *ndesc = nmdc_encode_and_escape(hub, desc?desc:"");
     char *nconn = nmdc_encode_and_escape(hub, conn?conn:"0.005");
     char *nmail = nmdc_encode_and_escape(hub, mail?mail:"");
-    nfo = g_strdup_printf("$MyINFO $ALL %s %s<ncdc V:%s,M:%c,H:%d/%d/%d,S:%d>$ $%s%c$%s$%"G_GUINT64_FORMAT"$|",
+    g_string_printf(cmd, "$MyINFO $ALL %s %s<ncdc V:%s,M:%c,H:%d/%d/%d,S:%d>$ $%s%c$%s$%"G_GUINT64_FORMAT"$|",
       hub->nick_hub, ndesc, main_version, ip ? 'A' : 'P', h_norm, h_reg, h_op,
       slots, nconn, 1 | (sup_tls ? 0x10 : 0), nmail, share);
     g_free(ndesc);
@@ -808,11 +917,10 @@ void hub_send_nfo(hub_t *hub) {
   }
 
   // send
-  net_writestr(hub->net, nfo);
-  g_free(nfo);
+  net_writestr(hub->net, cmd->str);
 
   // update
-  g_free(hub->nfo_desc); hub->nfo_desc = g_string_free(fmt_desc, FALSE);
+  g_free(hub->nfo_desc); hub->nfo_desc = g_strdup(desc);
   g_free(hub->nfo_conn); hub->nfo_conn = g_strdup(conn);
   g_free(hub->nfo_mail); hub->nfo_mail = g_strdup(mail);
   g_free(hub->nfo_ip);   hub->nfo_ip   = g_strdup(ip);
@@ -952,13 +1060,18 @@ static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t *
     );
   }
 
+  // The part of the message that is the same for each result
+  GString *head = udp ? adc_generate('U', ADCC_RES, 0, 0) : adc_generate('D', ADCC_RES, hub->sid, cmd->source);
+  if(udp)
+    g_string_append_printf(head, " %s", cid);
+  if(to)
+    adc_append(head, "TO", to);
+  GString *r = g_string_sized_new(512);
+
   int i;
   for(i=0; i<len; i++) {
-    GString *r = udp ? adc_generate('U', ADCC_RES, 0, 0) : adc_generate('D', ADCC_RES, hub->sid, cmd->source);
-    if(udp)
-      g_string_append_printf(r, " %s", cid);
-    if(to)
-      adc_append(r, "TO", to);
+    g_string_truncate(r, 0);
+    g_string_append_len(r, head->str, head->len);
     g_string_append_printf(r, " SL%d SI%"G_GUINT64_FORMAT, slots_free, res[i]->size);
     char *path = fl_list_path(res[i]);
     adc_append(r, "FN", path);
@@ -971,8 +1084,9 @@ static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t *
     g_string_append_c(r, '\n');
 
     adc_sch_reply_send(hub, udp, r, ky ? sudpkey : NULL);
-    g_string_free(r, TRUE);
   }
+  g_string_free(r, TRUE);
+  g_string_free(head, TRUE);
 
   if(udp)
     net_udp_destroy(udp);
@@ -1018,12 +1132,13 @@ static void adc_sch(hub_t *hub, adc_cmd_t *cmd) {
   s.sizem = eq ? 0 : le ? -1 : ge ? 1 : -2;
   s.size = s.sizem == -2 ? 0 : g_ascii_strtoull(eq ? eq : le ? le : ge, NULL, 10);
   s.filedir = !ty ? 3 : ty[0] == '1' ? 1 : 2;
-  char **tmp = adc_getparams(cmd->argv, "AN");
-  s.and = fl_search_create_and(tmp);
-  g_free(tmp);
-  tmp = adc_getparams(cmd->argv, "NO");
-  s.not = fl_search_create_not(tmp);
-  g_free(tmp);
+  char **and = adc_getparams(cmd->argv, "AN");
+  char **not = adc_getparams(cmd->argv, "NO");
+  if(!fl_search_keywords(&s, and, not)) {
+    g_free(and);
+    g_free(not);
+    return;
+  }
   s.ext = adc_getparams(cmd->argv, "EX");
 
   int i = 0;
@@ -1034,24 +1149,25 @@ static void adc_sch(hub_t *hub, adc_cmd_t *cmd) {
   if(tr) {
     char root[24];
     base32_decode(tr, root);
-    GSList *l = fl_local_from_tth(root);
+    fl_list_t *c = fl_local_from_tth(root);
     // it still has to match the other requirements...
-    for(; i<max && l; l=l->next) {
-      fl_list_t *c = l->data;
+    for(; i<max && c; c=fl_local_tthnext(c)) {
       if(fl_search_match_full(c, &s))
         res[i++] = c;
     }
 
-  // Advanced lookup (Noo! This is slooow!)
+  // Advanced lookup
   } else
-    i = fl_search_rec(fl_local_list, &s, res, max);
+    i = fl_local_search(&s, and, not, res, max);
 
-  if(i)
+  if(i) {
+    stats_add(STATC_SEARCH_RES, i);
     adc_sch_reply(hub, cmd, u, res, i);
+  }
 
-  fl_search_free_and(s.and);
-  if(s.not)
-    g_regex_unref(s.not);
+  g_free(and);
+  g_free(not);
+  fl_search_free_keywords(&s);
   g_free(s.ext);
 }
 
@@ -1289,8 +1405,12 @@ static void adc_handle(net_t *net, char *msg, int _len) {
   case ADCC_SCH:
     if(cmd.type != 'B' && cmd.type != 'D' && cmd.type != 'E' && cmd.type != 'F')
       g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
-    else if(cmd.source != hub->sid)
+    else if(cmd.source != hub->sid) {
+      gint64 start = stats_now();
       adc_sch(hub, &cmd);
+      stats_inc(STATC_SEARCH_ADC);
+      stats_record(STATH_SEARCH, stats_now()-start);
+    }
     break;
 
   case ADCC_GPA:
@@ -1322,17 +1442,15 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       long m = strtol(cmd.argv[3], NULL, 10);
       long k = bk ? strtol(bk, NULL, 10) : 0;
       long h = bh ? strtol(bh, NULL, 10) : 0;
-      bloom_t b;
-      if(bloom_init(&b, m, k, h) < 0)
+      bloom_t *b = fl_local_bloom(m, k, h);
+      if(!b)
         g_message("Invalid bloom filter parameters from %s: %s", net_remoteaddr(hub->net), msg);
       else {
-        fl_local_bloom(&b);
         GString *r = adc_generate('H', ADCC_SND, 0, 0);
-        g_string_append_printf(r, " blom / 0 %d\n", b.m);
+        g_string_append_printf(r, " blom / 0 %d\n", b->m);
         net_writestr(hub->net, r->str);
         g_string_free(r, TRUE);
-        net_write(hub->net, (char *)b.d, b.m);
-        bloom_free(&b);
+        net_write(hub->net, (char *)b->d, b->m);
       }
     }
     break;
@@ -1368,15 +1486,14 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
     }
     char root[24];
     base32_decode(query+4, root);
-    GSList *l = fl_local_from_tth(root);
+    fl_list_t *c = fl_local_from_tth(root);
     // it still has to match the other requirements...
-    for(; i<max && l; l=l->next) {
-      fl_list_t *c = l->data;
+    for(; i<max && c; c=fl_local_tthnext(c)) {
       if(fl_search_match_full(c, &s))
         res[i++] = c;
     }
 
-  // Advanced lookup (Noo! This is slooow!)
+  // Advanced lookup
   } else {
     char *tmp = query;
     for(; *tmp; tmp++)
@@ -1385,15 +1502,17 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
     tmp = nmdc_unescape_and_decode(hub, query);
     char **args = g_strsplit(tmp, " ", 0);
     g_free(tmp);
-    s.and = fl_search_create_and(args);
+    if(fl_search_keywords(&s, args, NULL)) {
+      i = fl_local_search(&s, args, NULL, res, max);
+      fl_search_free_keywords(&s);
+    }
     g_strfreev(args);
-    i = fl_search_rec(fl_local_list, &s, res, max);
-    fl_search_free_and(s.and);
   }
 
   // reply
   if(!i)
     return;
+  stats_add(STATC_SEARCH_RES, i);
 
   const char *hubaddr = net_remoteaddr(hub->net);
   int slots = var_get_int(0, VAR_slots);
@@ -1406,6 +1525,7 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
   net_udp_t udp;
   if(port)
     net_udp_init(&udp, from, port, var_get(hub->id, VAR_local_address));
+  GString *msg = g_string_sized_new(512);
 
   while(--i>=0) {
     char *fl = fl_list_path(res[i]);
@@ -1420,17 +1540,19 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
       base32_encode(res[i]->tth, tth+4);
       size = g_strdup_printf("\05%"G_GUINT64_FORMAT, res[i]->size);
     }
-    char *msg = g_strdup_printf("$SR %s %s%s %d/%d\05%s (%s)",
+    g_string_printf(msg, "$SR %s %s%s %d/%d\05%s (%s)",
       hub->nick_hub, tmp, size ? size : "", slots_free, slots, res[i]->isfile ? tth : hub->hubname_hub, hubaddr);
     if(!port)
-      net_writef(hub->net, "%s\05%s|", msg, from);
-    else
-      net_udp_sendf(&udp, "%s|", msg);
+      net_writef(hub->net, "%s\05%s|", msg->str, from);
+    else {
+      g_string_append_c(msg, '|');
+      net_udp_send(&udp, msg->str);
+    }
     g_free(fl);
-    g_free(msg);
     g_free(size);
     g_free(tmp);
   }
+  g_string_free(msg, TRUE);
 
   if(port)
     net_udp_destroy(&udp);
@@ -1744,8 +1866,12 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
         port = uri.port;
       }
     }
-    if(nfrom)
+    if(nfrom) {
+      gint64 start = stats_now();
       nmdc_search(hub, nfrom, port, sizerestrict[0] == 'F' ? -2 : ismax[0] == 'T' ? -1 : 1, g_ascii_strtoull(size, NULL, 10), type[0]-'0', query);
+      stats_inc(STATC_SEARCH_NMDC);
+      stats_record(STATH_SEARCH, stats_now()-start);
+    }
     g_free(from);
     g_free(sizerestrict);
     g_free(ismax);
@@ -1844,6 +1970,8 @@ hub_t *hub_create(ui_tab_t *tab) {
   }
 
   hub->net = net_new(hub, handle_error);
+  hub->rate_up = ratecalc_bucket_new(RCC_UP, VAR_upload_rate, hub->id);
+  hub->rate_down = ratecalc_bucket_new(RCC_DOWN, VAR_download_rate, hub->id);
   hub->tab = tab;
   hub->users = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, user_free);
   hub->sessions = g_hash_table_new(g_direct_hash, g_direct_equal);
@@ -2018,6 +2146,8 @@ void hub_free(hub_t *hub) {
   listen_refresh();
 
   net_unref(hub->net);
+  ratecalc_bucket_free(hub->rate_up);
+  ratecalc_bucket_free(hub->rate_down);
   g_free(hub->nfo_desc);
   g_free(hub->nfo_conn);
   g_free(hub->nfo_mail);
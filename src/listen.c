@@ -199,8 +199,8 @@ static gboolean listen_udp_handle(gpointer dat) {
   // Since all incoming messages must be search results, just pass the messages to search.c
   buf[r] = 0;
   if(!search_handle_udp(addr_str, buf, r)) {
-    // The message may habe been encrypted with SUDP, so this error reporting
-    // may not be too useful.
+    // A decrypted SUDP message is logged without its IV and padding. One that
+    // couldn't be decrypted is logged as received, and won't be too useful.
     g_message("UDP:%s: Invalid message: %s", addr_str, buf);
   }
   return TRUE;
@@ -172,6 +172,9 @@ static gboolean one_second_timer(gpointer dat) {
   // Disconnect offline users
   cc_global_onlinecheck();
 
+  // Write statistics to the log, if enabled
+  stats_log_tick();
+
   // And draw the UI
   ui_draw();
   return TRUE;
@@ -436,6 +439,7 @@ int main(int argc, char **argv) {
   // Init database & variables
   db_init();
   vars_init();
+  db_tune();
 
   // open log file
   char *errlog = g_build_filename(db_dir, "stderr.log", NULL);
@@ -40,8 +40,11 @@
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -53,6 +56,12 @@
 # include <sys/socket.h>
 # include <sys/uio.h>
 #endif
+#ifdef HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_INOTIFY_INIT1
+# include <sys/inotify.h>
+#endif
 
 #include <yuri.h>
 #include <zlib.h>
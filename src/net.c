@@ -24,6 +24,9 @@
 */
 
 
+// For sendmmsg()
+#define _GNU_SOURCE
+
 #include "ncdc.h"
 #include "net.h"
 
@@ -35,6 +38,12 @@ ratecalc_t net_in, net_out;
 #define NET_MAX_RBUF  (1024*1024)
 #define NET_TRANS_BUF (  32*1024)
 
+// zlib settings for compressed (ZL1) uploads. Every SYN_ZLIB_WINDOW bytes of
+// input the compression ratio of that window is checked, and compression is
+// switched off for the rest of the transfer if it saved less than 5%.
+#define SYN_ZLIB_LEVEL  1
+#define SYN_ZLIB_WINDOW (1024*1024)
+
 
 #if INTERFACE
 
@@ -70,6 +79,9 @@ struct net_t {
 
   ratecalc_t rate_in;
   ratecalc_t rate_out;
+  // Parents of rate_in/rate_out for file transfers, see net_setbuckets()
+  ratecalc_t *bucket_in;
+  ratecalc_t *bucket_out;
 
   dnscon_t *dnscon; // state DNS,CON. Setting ->net to NULL 'cancels' DNS resolving.
   int sock; // state CON,ASY,SYN,DIS
@@ -86,10 +98,16 @@ struct net_t {
   gboolean shutdown_closed : 4; // state DIS, whether shutdown() has been called on the socket.
   gboolean writing : 4; // state ASY. Whether 'socksrc' is write poll event.
   gboolean wantwrite : 4; // state ASY. Whether we want a write on sock.
+  gboolean tls_fd : 4; // state ASY,SYN,DIS. Whether GnuTLS uses sock directly rather than tls_push/tls_pull.
+  gboolean ktls_send : 4; // state ASY,SYN. Whether the kernel handles encryption of outgoing data (kTLS).
 
   GString *tlsrbuf; // state ASY. Temporary buffer for data read before switching to TLS. (To be fed to GnuTLS)
   GString *rbuf; // state ASY. Read buffer.
+  gsize rbuf_off; // state ASY. Read cursor, anything in rbuf before this offset has been consumed.
+  int rbuf_max; // state ASY. Largest amount of unconsumed data in rbuf so far.
+  int rsize; // state ASY. Preferred size of the next read, adapts to the incoming data rate.
   GString *wbuf; // state ASY. Write buffer.
+  int flushsrc; // state ASY,DIS. Idle source that flushes wbuf, see asy_flush().
 
   // Called when an error has occured. Second argument is NETERR_*, third a
   // string representing the error.
@@ -183,7 +201,8 @@ static int low_recv(net_t *n, char *buf, int len, const char **err) {
     return -1;
   }
 
-  if(!n->tls) {
+  // With tls_fd, GnuTLS bypasses tls_pull(), so count the plaintext.
+  if(!n->tls || n->tls_fd) {
     ratecalc_add(&net_in, r);
     ratecalc_add(&n->rate_in, r);
   }
@@ -223,7 +242,7 @@ static int low_send(net_t *n, const char *buf, int len, const char **err) {
     return -1;
   }
 
-  if(!n->tls) {
+  if(!n->tls || n->tls_fd) {
     ratecalc_add(&net_out, r);
     ratecalc_add(&n->rate_out, r);
   }
@@ -236,18 +255,58 @@ static int low_send(net_t *n, const char *buf, int len, const char **err) {
 
 
 // Synchronous file transfers
+//
+// These are handled by a small, fixed set of reactor threads, each
+// multiplexing any number of transfers over a single epoll instance (or
+// poll() where epoll is not available). A transfer is only ever touched by the
+// reactor it has been assigned to. Every time a socket becomes ready, at most a
+// single chunk is transferred, so all connections of a reactor get their turn.
+// Transfers that have run out of burst in their ratecalc are taken out of the
+// poll set until ratecalc_calc() has allocated some new bandwidth to them.
+//
+// Disk I/O happens on the reactor as well: uploads read the file with
+// sendfile() or pread(), and downloads pass the data to cb_downdata(), which
+// writes it to the incoming file. A disk that is slow to respond therefore
+// also delays the other transfers on the same reactor. To bound that, every
+// event reads or writes at most NET_TRANS_BUF bytes of file data (sendfile()
+// is bounded by the free space in the socket buffer instead), and
+// dlfile_recv() hands its larger write buffers to a separate worker thread.
 
 static void asy_setuppoll(net_t *n);
 
+typedef struct syn_reactor_t syn_reactor_t;
+
 struct synfer_t {
   GStaticMutex lock; // protects n->left, any data used within the low_* functions and, in the case of a disconnect, net->sock and net->tls.
   net_t *net;
-  guint64 left; // The transfer thread itself does not need the lock to read this value, only to write. (It is the only writer)
+  syn_reactor_t *reactor; // set when the transfer has been started
+  guint64 left; // The reactor itself does not need the lock to read this value, only to write. (It is the only writer)
+  int sock;   // copy of net->sock, made when the reactor picks up the transfer
   int fd;     // for uploads
+  off_t off;  // for uploads, current offset in fd
+  int retry;  // for uploads, length of a send that would have blocked and has to be retried with the same data
+  char *hdr;  // for uploads, message to send before the data, see net_sendfile()
+  char *hdr_zlib; // for uploads, replaces hdr if the data is sent compressed
+  int hdroff, hdrlen; // for uploads, the part of hdr that has been sent and its length
   int cancel; // set to 1 to cancel transfer
-  int can[2]; // close() this pipe (can[1]) to cancel the transfer
   gboolean upl : 1; // whether this is an upload or download
   gboolean flush : 1; // for uploads
+  gboolean sendfile : 1; // for uploads, whether to (still) use sendfile()
+  gboolean added : 1; // whether sock has been added to the poll set of the reactor
+  gboolean armed : 1; // whether the reactor is waiting for sock to become ready
+  gboolean pending : 1; // for downloads, whether GnuTLS may have buffered data (s is in reactor->pending)
+  gboolean zend : 1; // for ZL1, whether the end of the zlib stream has been generated or received
+  gboolean zstored : 1; // for ZL1 uploads, whether compression has been switched off
+  fadv_t adv; // for uploads with flush
+  // ZL1 compressed transfers. left is always in uncompressed bytes.
+  z_stream *zs;    // NULL if the transfer is not compressed, must be set with the lock held
+  char *zin;       // for uploads, NET_TRANS_BUF bytes of input for deflate()
+  char *zbuf;      // NET_TRANS_BUF bytes, (de)compressed data
+  int zoff, zlen;  // for uploads, the part of zbuf that has yet to be sent
+  guint64 zwin_in, zwin_out; // for uploads, bytes in and out of the current SYN_ZLIB_WINDOW
+  guint64 zconsumed, zproduced; // for uploads, total bytes consumed and generated by deflate()
+  guint64 zleft;   // for uploads, estimate of the uncompressed bytes that have yet to be sent, see syn_upload_zlib()
+  GString *zrest;  // for downloads, data received after the end of the zlib stream
   char *err;
   void *ctx; // for downloads
   void (*cb_downdone)(net_t *, void *);
@@ -255,7 +314,27 @@ struct synfer_t {
   void (*cb_upldone)(net_t *);
 };
 
-static GThreadPool *syn_pool = NULL;
+struct syn_reactor_t {
+  int wake[2]; // a byte is written to wake[1] when a transfer is queued or cancelled
+#ifdef HAVE_EPOLL_CREATE1
+  int epfd;
+#else
+  GArray *fds;      // GPollFD array passed to g_poll()
+  GPtrArray *polled; // synfer_t's corresponding to fds[1..]
+#endif
+  int num;           // number of transfers assigned to this reactor (atomic)
+  GAsyncQueue *queue; // transfers that have yet to be picked up
+  // The following are only accessed from the reactor thread
+  GPtrArray *list;   // transfers being handled
+  GSList *waiting;   // transfers without burst, not armed
+  GSList *pending;   // downloads that may have data buffered within GnuTLS
+  char *buf;         // NET_TRANS_BUF bytes, shared by all transfers
+};
+
+#define SYN_MAX_REACTORS 4
+
+static syn_reactor_t syn_reactors[SYN_MAX_REACTORS];
+static int syn_nreactors = 0;
 
 
 static void syn_new(net_t *n, gboolean upl, guint64 len) {
@@ -265,19 +344,43 @@ static void syn_new(net_t *n, gboolean upl, guint64 len) {
   n->syn->upl = upl;
 
   g_static_mutex_init(&n->syn->lock);
-  if(pipe(n->syn->can) < 0) {
-    g_critical("pipe() failed: %s", g_strerror(errno));
-    g_return_if_reached();
-  }
   net_ref(n);
+  if(upl)
+    ratecalc_setparent(&n->rate_out, n->bucket_out);
+  else
+    ratecalc_setparent(&n->rate_in, n->bucket_in);
+}
+
+
+static void syn_new_zlib(synfer_t *s) {
+  s->zs = g_slice_new0(z_stream);
+  s->zbuf = g_malloc(NET_TRANS_BUF);
+  if(s->upl) {
+    s->zin = g_malloc(NET_TRANS_BUF);
+    deflateInit(s->zs, SYN_ZLIB_LEVEL);
+    s->zleft = s->left;
+  } else
+    inflateInit(s->zs);
 }
 
 
 static void syn_free(synfer_t *s) {
   net_unref(s->net);
-  close(s->can[0]);
+  if(s->zs) {
+    if(s->upl)
+      deflateEnd(s->zs);
+    else
+      inflateEnd(s->zs);
+    g_slice_free(z_stream, s->zs);
+    g_free(s->zin);
+    g_free(s->zbuf);
+    if(s->zrest)
+      g_string_free(s->zrest, TRUE);
+  }
   if(s->fd)
     close(s->fd);
+  g_free(s->hdr);
+  g_free(s->hdr_zlib);
   if(s->cb_downdone)
     s->cb_downdone(NULL, s->ctx);
   g_free(s->err);
@@ -285,14 +388,25 @@ static void syn_free(synfer_t *s) {
 }
 
 
+static void syn_reactor_wake(syn_reactor_t *r) {
+  char c = 0;
+  // If the pipe is full the reactor has yet to wake up anyway.
+  if(write(r->wake[1], &c, 1) < 0 && errno != EAGAIN && errno != EINTR)
+    g_warning("Unable to wake up transfer thread: %s", g_strerror(errno));
+}
+
+
 static void syn_cancel(net_t *n) {
   n->syn->cancel = 1;
-  close(n->syn->can[1]);
+  if(n->syn->reactor)
+    syn_reactor_wake(n->syn->reactor);
   n->syn = NULL;
+  ratecalc_setparent(&n->rate_in, NULL);
+  ratecalc_setparent(&n->rate_out, NULL);
 }
 
 
-// Called as an idle function from syn_thread
+// Called as an idle function from the reactor
 static gboolean syn_done(gpointer dat) {
   synfer_t *s = dat;
   net_t *n = s->net;
@@ -315,6 +429,9 @@ static gboolean syn_done(gpointer dat) {
   syn_cancel(n);
   n->state = NETST_ASY;
   n->wantwrite = FALSE;
+  // Whatever came after the compressed data belongs to the ASY state
+  if(s->zrest)
+    g_string_append_len(n->rbuf, s->zrest->str, s->zrest->len);
   asy_setuppoll(n);
   if(s->cb_upldone)
     s->cb_upldone(n);
@@ -327,222 +444,555 @@ static gboolean syn_done(gpointer dat) {
 }
 
 
-// Does two things: Waits some time to ensure that we are allowed to burst with
-// the rate limiting thing, and then waits for the socket to become
-// readable/writable. Returns the number of bytes that may be read/written on
-// success, 0 if the operation has been cancelled.
-static int syn_wait(synfer_t *s, int sock, gboolean write) {
-  // Lock to get the socket fd
+#ifdef HAVE_EPOLL_CREATE1
+# define SYN_IO_ADD EPOLL_CTL_ADD
+# define SYN_IO_MOD EPOLL_CTL_MOD
+# define SYN_IO_DEL EPOLL_CTL_DEL
+#else
+# define SYN_IO_ADD 0
+# define SYN_IO_MOD 1
+# define SYN_IO_DEL 2
+#endif
+
+// Updates the registration of s->sock in the poll set according to s->armed.
+// Must be called with s->lock held, and only while s->sock is still open
+// (s->net->sock == s->sock), since the fd number may have been reused for a
+// different connection otherwise.
+static void syn_io_ctl(syn_reactor_t *r, synfer_t *s, int op) {
+#ifdef HAVE_EPOLL_CREATE1
+  struct epoll_event ev = {};
+  ev.events = !s->armed ? 0 : s->upl ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = s;
+  if(epoll_ctl(r->epfd, op, s->sock, &ev) < 0 && op != EPOLL_CTL_DEL && !s->err)
+    s->err = g_strdup(g_strerror(errno));
+#endif
+  // With poll(), the poll set is simply rebuilt from s->armed on every wait.
+}
+
+
+// Removes the transfer from the reactor and hands it back to the main thread.
+static void syn_finish(syn_reactor_t *r, synfer_t *s) {
+  // If the socket has been closed already, the kernel has taken care of
+  // removing it from the epoll set.
   g_static_mutex_lock(&s->lock);
-  GPollFD fds[2] = {};
-  fds[0].fd = s->can[0];
-  fds[0].events = G_IO_IN;
-  fds[1].fd = sock;
-  fds[1].events = write ? G_IO_OUT : G_IO_IN;
+  if(s->added && s->net->sock == s->sock)
+    syn_io_ctl(r, s, SYN_IO_DEL);
   g_static_mutex_unlock(&s->lock);
 
-  // Poll for burst
-  int b = 0;
-  int r = 0;
-  while(r <= 0 && (b = ratecalc_burst(write ? &s->net->rate_out : &s->net->rate_in)) <= 0) {
-    // Wake up 4 times per second. If the resource is CPU or HDD I/O
-    // constrained, then this means that at most 1/4th of the possible usage
-    // time is "thrown away". I don't expect this to be much of an issue,
-    // however.
-    r = g_poll(fds, 1, 250); // only poll for the cancel fd here.
-    g_return_val_if_fail(r >= 0 || errno == EINTR, 0);
-  }
-  if(r)
-    return 0;
+  g_ptr_array_remove_fast(r->list, s);
+  r->waiting = g_slist_remove(r->waiting, s);
+  r->pending = g_slist_remove(r->pending, s);
+  if(s->upl && s->flush)
+    fadv_close(&s->adv);
+  g_atomic_int_add(&r->num, -1);
+  g_idle_add(syn_done, s);
+}
 
-  // Now poll for read/writability of the socket.
-  do
-    r = g_poll(fds, 2, -1);
-  while(r < 0 && errno == EINTR);
 
-  if(fds[0].revents)
-    return 0;
-  return b;
+// Whether all data has been transferred. For uploads that includes the
+// header, for compressed uploads flushing the end of the zlib stream, and for
+// compressed downloads it means having received the end of the stream.
+#define syn_complete(s) ((s)->hdroff == (s)->hdrlen && ((s)->zs ? (s)->zend && (s)->zoff == (s)->zlen : !(s)->left))
+
+
+// Compresses a sample of the data that is about to be uploaded, to see whether
+// it's worth sending it with ZL1. Most large files are already compressed
+// (video, audio, archives), and those are better served with sendfile().
+// Since this reads from the file it is done on the reactor when it picks up
+// the transfer, rather than in the main thread.
+static gboolean syn_zlib_probe(synfer_t *s) {
+  char in[16*1024];
+  int rd = pread(s->fd, in, MIN(s->left, sizeof(in)), s->off);
+  if(rd < 1024) // too small to bother
+    return FALSE;
+  uLongf len = compressBound(rd);
+  Bytef *out = g_malloc(len);
+  gboolean r = compress2(out, &len, (Bytef *)in, rd, 1) == Z_OK && len < rd - rd/10;
+  g_free(out);
+  return r;
 }
 
 
+static void syn_pickup(syn_reactor_t *r, synfer_t *s) {
+  g_ptr_array_add(r->list, s);
+
+  gboolean zlib = s->hdr_zlib && syn_zlib_probe(s);
+  if(s->upl && s->flush)
+    fadv_init(&s->adv, s->fd, s->off, VAR_FFC_UPLOAD);
+
+  g_static_mutex_lock(&s->lock);
+  if(zlib) {
+    syn_new_zlib(s);
+    g_free(s->hdr);
+    s->hdr = s->hdr_zlib;
+    s->hdr_zlib = NULL;
+  }
+  if(s->hdr) {
+    s->hdrlen = strlen(s->hdr);
+    g_debug("%s> %.*s", s->net->addr, s->hdrlen && s->hdr[s->hdrlen-1] == '\n' ? s->hdrlen-1 : s->hdrlen, s->hdr);
+  }
+  s->sock = s->net->sock;
 #ifdef HAVE_SENDFILE
+  // With kTLS the kernel encrypts whatever is written to the socket, so
+  // sendfile() can be used just like on a plain connection.
+  s->sendfile = s->upl && !s->zs && (!s->net->tls || s->net->ktls_send) && var_get_bool(0, VAR_sendfile);
+#endif
+  if(!s->err && !s->cancel && s->sock && !syn_complete(s)) {
+    s->added = s->armed = TRUE;
+    syn_io_ctl(r, s, SYN_IO_ADD);
+  }
+  g_static_mutex_unlock(&s->lock);
 
-static void syn_upload_sendfile(synfer_t *s, int sock, fadv_t *adv) {
-  off_t off = lseek(s->fd, 0, SEEK_CUR);
-  if(off == (off_t)-1) {
-    s->err = g_strdup(g_strerror(errno));
+  if(!s->added || s->err)
+    syn_finish(r, s);
+}
+
+
+// Take the transfer out of the poll set until it has some burst again.
+static void syn_throttle(syn_reactor_t *r, synfer_t *s) {
+  if(!s->armed)
     return;
+  g_static_mutex_lock(&s->lock);
+  if(!s->cancel && s->net->sock == s->sock) {
+    s->armed = FALSE;
+    syn_io_ctl(r, s, SYN_IO_MOD);
   }
+  g_static_mutex_unlock(&s->lock);
+  if(!s->armed)
+    r->waiting = g_slist_prepend(r->waiting, s);
+}
+
+
+static void syn_rearm(syn_reactor_t *r) {
+  GSList *l, *next;
+  for(l=r->waiting; l; l=next) {
+    next = l->next;
+    synfer_t *s = l->data;
+    if(ratecalc_burst(s->upl ? &s->net->rate_out : &s->net->rate_in) <= 0)
+      continue;
+    r->waiting = g_slist_delete_link(r->waiting, l);
+
+    g_static_mutex_lock(&s->lock);
+    gboolean tls = FALSE;
+    if(!s->cancel && s->net->sock == s->sock) {
+      s->armed = TRUE;
+      syn_io_ctl(r, s, SYN_IO_MOD);
+      tls = !!s->net->tls;
+    }
+    g_static_mutex_unlock(&s->lock);
+
+    // GnuTLS may still have data from before we were throttled, and that
+    // won't wake up the poll.
+    if(tls && !s->upl && !s->pending) {
+      s->pending = TRUE;
+      r->pending = g_slist_prepend(r->pending, s);
+    }
+  }
+}
 
-  while(s->left > 0 && !s->err && !s->cancel) {
-    off_t oldoff = off;
-    int b = syn_wait(s, sock, TRUE);
-    if(b <= 0)
-      return;
 
-    // No need for a lock here, we're not using the TLS session and socket fd's
-    // are thread-safe. To some extent at least.
+#ifdef HAVE_SENDFILE
+
+static void syn_upload_sendfile(synfer_t *s, int b) {
+  size_t len = MIN((guint64)b, s->left);
+
+  // No need for a lock here, we're not using the TLS session and socket fd's
+  // are thread-safe. To some extent at least.
 #ifdef HAVE_LINUX_SENDFILE
-    // XXX: On 32bit Linux with musl, sendfile() may fail with EOVERFLOW when
-    // an offset argument is given and is larger than UINT32_MAX, so we're
-    // passing NULL instead to use the fd's internal file offset.
-    ssize_t r = sendfile(sock, s->fd, NULL, MIN(b, s->left));
+  // The file description may be shared with other uploads, so always pass
+  // an explicit offset. On 32bit Linux with musl, sendfile() may fail with
+  // EOVERFLOW when the offset is larger than UINT32_MAX, in which case the
+  // pread() fallback below is used.
+  off_t off = s->off;
+  ssize_t r = sendfile(s->sock, s->fd, &off, len);
+  if(r == 0) {
+    s->err = g_strdup("Unexpected end of file");
+    return;
+  }
 #elif HAVE_BSD_SENDFILE
-    off_t len = 0;
-    gint64 r = sendfile(s->fd, sock, off, (size_t)MIN(b, s->left), NULL, &len, 0);
-    // a partial write results in an EAGAIN error on BSD, even though this isn't
-    // really an error condition at all.
-    if(r != -1 || (r == -1 && errno == EAGAIN))
-      r = len;
+  off_t sent = 0;
+  gint64 r = sendfile(s->fd, s->sock, s->off, len, NULL, &sent, 0);
+  // a partial write results in an EAGAIN error on BSD, even though this isn't
+  // really an error condition at all.
+  if(r != -1 || (r == -1 && errno == EAGAIN))
+    r = sent;
 #endif
 
-    if(r >= 0) {
-      if(s->flush)
-        fadv_purge(adv, r);
-      off = oldoff + r;
-      // This bypasses the low_send() function, so manually add it to the
-      // ratecalc thing and update timeout_last.
-      ratecalc_add(&net_out, r);
-      ratecalc_add(&s->net->rate_out, r);
+  if(r >= 0) {
+    if(s->flush)
+      fadv_purge(&s->adv, r);
+    s->off += r;
+    // This bypasses the low_send() function, so manually add it to the
+    // ratecalc thing and update timeout_last.
+    ratecalc_add(&net_out, r);
+    ratecalc_add(&s->net->rate_out, r);
+    g_static_mutex_lock(&s->lock);
+    time(&s->net->timeout_last);
+    s->left -= r;
+    g_static_mutex_unlock(&s->lock);
+  } else if(errno == EAGAIN || errno == EINTR) {
+    return;
+  } else if(errno == ENOTSUP || errno == ENOSYS || errno == EINVAL || errno == EOVERFLOW) {
+    // Don't set s->err here, let the fallback handle the rest. It continues
+    // from s->off.
+    g_message("sendfile() failed with `%s', using fallback.", g_strerror(errno));
+    s->sendfile = FALSE;
+  } else {
+    if(errno != EPIPE && errno != ECONNRESET)
+      g_message("sendfile() returned an unknown error: %d (%s)", errno, g_strerror(errno));
+    s->err = g_strdup(g_strerror(errno));
+  }
+}
+
+#endif
+
+
+// Fills s->zbuf with more compressed data, if it has been fully sent.
+static void syn_deflate(synfer_t *s) {
+  z_stream *z = s->zs;
+  gboolean read = FALSE;
+  while(s->zoff == s->zlen && !s->zend) {
+    if(!z->avail_in && s->left) {
+      // Well-compressible data may need several reads before deflate() has
+      // any output. Do at most one per event and pick up where we left off on
+      // the next one, the socket is still writable.
+      if(read)
+        return;
+      read = TRUE;
+      int rd = pread(s->fd, s->zin, MIN(NET_TRANS_BUF, s->left), s->off);
+      if(rd <= 0) {
+        s->err = g_strdup(rd < 0 ? g_strerror(errno) : "Unexpected end of file");
+        return;
+      }
+      s->off += rd;
       g_static_mutex_lock(&s->lock);
-      time(&s->net->timeout_last);
-      s->left -= r;
+      s->left -= rd;
       g_static_mutex_unlock(&s->lock);
-      continue;
-    } else if(errno == EAGAIN || errno == EINTR) {
-      continue;
-    } else if(errno == ENOTSUP || errno == ENOSYS || errno == EINVAL || errno == EOVERFLOW) {
-      // Don't set s->err here, let the fallback handle the rest
-      g_message("sendfile() failed with `%s', using fallback.", g_strerror(errno));
-      // The fallback code continues from the fd position, so make sure to
-      // update it in case (FreeBSD's) sendfile() didn't do so.
-      if(lseek(s->fd, off, SEEK_SET) == (off_t)-1) {
-        g_message("Can't switch to fallback, seek failed: %d (%s)", errno, g_strerror(errno));
-        s->err = g_strdup(g_strerror(errno));
-      }
-      return;
-    } else {
-      if(errno != EPIPE && errno != ECONNRESET)
-        g_message("sendfile() returned an unknown error: %d (%s)", errno, g_strerror(errno));
-      s->err = g_strdup(g_strerror(errno));
+      if(s->flush)
+        fadv_purge(&s->adv, rd);
+      z->next_in = (Bytef *)s->zin;
+      z->avail_in = rd;
+      s->zwin_in += rd;
+    }
+
+    z->next_out = (Bytef *)s->zbuf;
+    z->avail_out = NET_TRANS_BUF;
+
+    // Not worth it, fall back to stored blocks. This still has to go through
+    // zlib, since the remote expects a single zlib stream.
+    if(!s->zstored && s->zwin_in >= SYN_ZLIB_WINDOW) {
+      if(s->zwin_out > s->zwin_in - s->zwin_in/20 && deflateParams(z, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY) == Z_OK)
+        s->zstored = TRUE;
+      s->zwin_in = s->zwin_out = 0;
+    }
+
+    int avail = z->avail_in;
+    int r = deflate(z, s->left ? Z_NO_FLUSH : Z_FINISH);
+    s->zconsumed += avail - z->avail_in;
+    if(r == Z_STREAM_END)
+      s->zend = TRUE;
+    else if(r != Z_OK && r != Z_BUF_ERROR) {
+      s->err = g_strdup_printf("zlib error: %s", z->msg ? z->msg : "unknown");
       return;
     }
+    s->zoff = 0;
+    s->zlen = NET_TRANS_BUF - z->avail_out;
+    s->zwin_out += s->zlen;
+    s->zproduced += s->zlen;
   }
 }
 
-#endif
 
+// s->left counts the bytes that have been read into deflate(), which may run
+// ahead of what has been sent by up to a few buffers. zleft is what net_left()
+// reports instead: the bytes that haven't been read or consumed yet, plus the
+// compressed bytes waiting in zbuf, scaled back by the overall compression
+// ratio. Data buffered within zlib itself isn't accounted for.
+static void syn_upload_zlib(synfer_t *s, int b) {
+  syn_deflate(s);
+  if(s->err || s->zoff == s->zlen)
+    return;
 
-static void syn_upload_buf(synfer_t *s, int sock, fadv_t *adv) {
-  char *buf = g_malloc(NET_TRANS_BUF);
+  int len = s->retry ? s->retry : MIN(b, s->zlen - s->zoff);
+  g_static_mutex_lock(&s->lock);
+  const char *err = NULL;
+  int wr = s->cancel || s->net->sock != s->sock ? 0 : low_send(s->net, s->zbuf + s->zoff, len, &err);
+  if(wr > 0) {
+    s->zoff += wr;
+    s->zleft = s->left + s->zs->avail_in + (s->zproduced ? s->zconsumed * (s->zlen - s->zoff) / s->zproduced : 0);
+  }
+  g_static_mutex_unlock(&s->lock);
 
-  while(s->left > 0 && !s->err && !s->cancel) {
-    int rd = read(s->fd, buf, MIN(NET_TRANS_BUF, s->left));
-    if(rd <= 0) {
-      s->err = g_strdup(g_strerror(errno));
-      goto done;
-    }
-    if(s->flush)
-      fadv_purge(adv, rd);
+  s->retry = wr < 0 && !err ? len : 0;
+  if(wr < 0 && err)
+    s->err = g_strdup(err);
+}
 
-    char *p = buf;
-    while(rd > 0) {
-      int b = syn_wait(s, sock, TRUE);
-      if(b <= 0)
-        goto done;
 
-      g_static_mutex_lock(&s->lock);
-      const char *err = NULL;
-      int wr = s->cancel || !s->net->sock ? 0 : low_send(s->net, p, MIN(rd, b), &err);
-      // successful write
-      if(wr > 0) {
-        p += wr;
-        s->left -= wr;
-        rd -= wr;
-      }
-      g_static_mutex_unlock(&s->lock);
+// Sends the header that precedes the data of an upload.
+static void syn_upload_hdr(synfer_t *s, int b) {
+  int len = s->retry ? s->retry : MIN(b, s->hdrlen - s->hdroff);
+  g_static_mutex_lock(&s->lock);
+  const char *err = NULL;
+  int wr = s->cancel || s->net->sock != s->sock ? 0 : low_send(s->net, s->hdr + s->hdroff, len, &err);
+  if(wr > 0)
+    s->hdroff += wr;
+  g_static_mutex_unlock(&s->lock);
 
-      if(!wr) // cancelled
-        goto done;
-      if(wr < 0 && !err) // would block
-        continue;
-      if(wr < 0) { // actual error
-        s->err = g_strdup(err);
-        goto done;
-      }
-    }
+  s->retry = wr < 0 && !err ? len : 0;
+  if(wr < 0 && err)
+    s->err = g_strdup(err);
+}
+
+
+static void syn_upload(syn_reactor_t *r, synfer_t *s, int b) {
+  if(s->hdroff < s->hdrlen) {
+    syn_upload_hdr(s, b);
+    return;
   }
 
-done:
-  g_free(buf);
-}
+  if(s->zs) {
+    syn_upload_zlib(s, b);
+    return;
+  }
 
+#ifdef HAVE_SENDFILE
+  if(s->sendfile) {
+    syn_upload_sendfile(s, b);
+    return;
+  }
+#endif
+
+  // Data is read back from the file rather than kept in a per-transfer
+  // buffer. GnuTLS requires an interrupted send to be retried with the same
+  // data, hence s->retry.
+  int len = s->retry ? s->retry : MIN(MIN(NET_TRANS_BUF, b), s->left);
+  int rd = pread(s->fd, r->buf, len, s->off);
+  if(rd <= 0) {
+    s->err = g_strdup(rd < 0 ? g_strerror(errno) : "Unexpected end of file");
+    return;
+  }
 
-static void syn_download(synfer_t *s, int sock) {
-  char *buf = g_malloc(NET_TRANS_BUF);
+  g_static_mutex_lock(&s->lock);
+  const char *err = NULL;
+  int wr = s->cancel || s->net->sock != s->sock ? 0 : low_send(s->net, r->buf, rd, &err);
+  // successful write
+  if(wr > 0) {
+    s->off += wr;
+    s->left -= wr;
+  }
+  g_static_mutex_unlock(&s->lock);
 
-  while(s->left > 0 && !s->err && !s->cancel) {
-    int b = syn_wait(s, sock, FALSE);
-    if(b <= 0)
-      break;
+  s->retry = wr < 0 && !err ? rd : 0;
+  if(wr > 0 && s->flush)
+    fadv_purge(&s->adv, wr);
+  if(wr < 0 && err) // actual error
+    s->err = g_strdup(err);
+}
 
-    g_static_mutex_lock(&s->lock);
-    const char *err = NULL;
-    int r = s->cancel || !s->net->sock ? 0 : low_recv(s->net, buf, MIN(NET_TRANS_BUF, s->left), &err);
-    if(r > 0)
-      s->left -= r;
-    g_static_mutex_unlock(&s->lock);
 
-    if(!r)
+// Inflates compressed data received in a ZL1 transfer and passes it on to
+// cb_downdata(). Returns the number of bytes of buf that have been used, which
+// is less than len if the zlib stream ended within buf. Sets s->err on error.
+static int syn_inflate(synfer_t *s, const char *buf, int len) {
+  z_stream *z = s->zs;
+  z->next_in = (Bytef *)buf;
+  z->avail_in = len;
+  while(!s->err && !s->zend) {
+    z->next_out = (Bytef *)s->zbuf;
+    z->avail_out = NET_TRANS_BUF;
+    int r = inflate(z, Z_NO_FLUSH);
+    int out = NET_TRANS_BUF - z->avail_out;
+    if(r == Z_STREAM_END)
+      s->zend = TRUE;
+    else if(r != Z_OK && r != Z_BUF_ERROR) {
+      s->err = g_strdup_printf("zlib error: %s", z->msg ? z->msg : "unknown");
       break;
-    if(r < 0 && !err)
-      continue;
-    if(r < 0) {
-      s->err = g_strdup(err);
+    }
+    if(out > s->left) {
+      s->err = g_strdup("Compressed data larger than expected");
       break;
     }
-
-    if(!s->cb_downdata(s->ctx, buf, r)) {
+    g_static_mutex_lock(&s->lock);
+    s->left -= out;
+    g_static_mutex_unlock(&s->lock);
+    if(out && !s->cb_downdata(s->ctx, s->zbuf, out))
       s->err = g_strdup("Operation cancelled");
+    // zlib has used all input and has no more output for us
+    if(z->avail_out > 0 && (r == Z_BUF_ERROR || !z->avail_in))
       break;
-    }
   }
-
-  g_free(buf);
+  if(!s->err && s->zend && s->left)
+    s->err = g_strdup("Compressed data smaller than expected");
+  return len - z->avail_in;
 }
 
 
-static void syn_thread(gpointer dat, gpointer udat) {
-  synfer_t *s = dat;
-
-  // Make a copy of sock to make sure it doesn't disappear on us.
-  // (Still need to obtain the lock to make use of it).
+static void syn_download(syn_reactor_t *r, synfer_t *s) {
   g_static_mutex_lock(&s->lock);
-  int sock = s->net->sock;
-  gboolean tls = !!s->net->tls;
+  const char *err = NULL;
+  // When compressed there is no telling how many bytes belong to the stream,
+  // so this may read beyond its end, see zrest.
+  int rd = s->cancel || s->net->sock != s->sock ? 0 : low_recv(s->net, r->buf, s->zs ? NET_TRANS_BUF : MIN(NET_TRANS_BUF, s->left), &err);
+  if(rd > 0 && !s->zs)
+    s->left -= rd;
+  gboolean pending = rd > 0 && s->net->tls && gnutls_record_check_pending(s->net->tls) > 0;
   g_static_mutex_unlock(&s->lock);
 
-  if(sock && !s->cancel && s->upl) {
-    fadv_t adv;
-    if(s->flush)
-      fadv_init(&adv, s->fd, lseek(s->fd, 0, SEEK_CUR), VAR_FFC_UPLOAD);
+  if(rd < 0 && err)
+    s->err = g_strdup(err);
+  else if(rd > 0 && s->zs) {
+    int used = syn_inflate(s, r->buf, rd);
+    if(!s->err && used < rd)
+      s->zrest = g_string_new_len(r->buf+used, rd-used);
+  } else if(rd > 0 && !s->cb_downdata(s->ctx, r->buf, rd))
+    s->err = g_strdup("Operation cancelled");
+  if(!s->err && !syn_complete(s) && pending && !s->pending) {
+    s->pending = TRUE;
+    r->pending = g_slist_prepend(r->pending, s);
+  }
+}
 
-#ifdef HAVE_SENDFILE
-    if(!tls && var_get_bool(0, VAR_sendfile))
-      syn_upload_sendfile(s, sock, &adv);
+
+// Called when s->sock is ready (or when GnuTLS has buffered data). If hup is
+// set, the socket is in an error state and the transfer should be given the
+// chance to notice that, even if the rate limit wouldn't allow it.
+static void syn_event(syn_reactor_t *r, synfer_t *s, gboolean hup) {
+  if(!s->cancel) {
+    int b = ratecalc_burst(s->upl ? &s->net->rate_out : &s->net->rate_in);
+    if(b <= 0 && !hup) {
+      syn_throttle(r, s);
+      return;
+    }
+    if(s->upl)
+      syn_upload(r, s, MAX(b, 1));
+    else
+      syn_download(r, s);
+  }
+  if(s->cancel || s->err || syn_complete(s))
+    syn_finish(r, s);
+}
+
+
+// Waits for socket activity and handles it. Returns whether the reactor has
+// been woken up.
+static gboolean syn_reactor_poll(syn_reactor_t *r, int timeout) {
+  gboolean wake = FALSE;
+  int i, n;
+#ifdef HAVE_EPOLL_CREATE1
+  struct epoll_event ev[64];
+  n = epoll_wait(r->epfd, ev, 64, timeout);
+  if(n < 0 && errno != EINTR)
+    g_warning("epoll_wait() failed: %s", g_strerror(errno));
+  for(i=0; i<n; i++) {
+    if(ev[i].data.ptr == r)
+      wake = TRUE;
+    else
+      syn_event(r, ev[i].data.ptr, !!(ev[i].events & (EPOLLHUP|EPOLLERR)));
+  }
+#else
+  g_array_set_size(r->fds, 1);
+  g_ptr_array_set_size(r->polled, 0);
+  for(i=0; i<r->list->len; i++) {
+    synfer_t *s = g_ptr_array_index(r->list, i);
+    if(s->armed) {
+      GPollFD p = { s->sock, s->upl ? G_IO_OUT : G_IO_IN, 0 };
+      g_array_append_val(r->fds, p);
+      g_ptr_array_add(r->polled, s);
+    }
+  }
+  GPollFD *fds = (GPollFD *)r->fds->data;
+  n = g_poll(fds, r->fds->len, timeout);
+  if(n < 0 && errno != EINTR)
+    g_warning("poll() failed: %s", g_strerror(errno));
+  if(n > 0) {
+    wake = !!fds[0].revents;
+    // syn_event() may remove items from r->list, but not from r->polled.
+    for(i=1; i<r->fds->len; i++)
+      if(fds[i].revents)
+        syn_event(r, g_ptr_array_index(r->polled, i-1), !!(fds[i].revents & (G_IO_HUP|G_IO_ERR|G_IO_NVAL)));
+  }
 #endif
-    if(s->left > 0 && !s->err && !s->cancel)
-      syn_upload_buf(s, sock, &adv);
+  return wake;
+}
 
-    if(s->flush)
-      fadv_close(&adv);
+
+static gpointer syn_reactor_thread(gpointer dat) {
+  syn_reactor_t *r = dat;
+  int i;
+
+  while(1) {
+    synfer_t *s;
+    while((s = g_async_queue_try_pop(r->queue)))
+      syn_pickup(r, s);
+
+    syn_rearm(r);
+
+    // Wake up 4 times per second while there are transfers waiting for the
+    // rate limiter. If the resource is CPU or HDD I/O constrained, then this
+    // means that at most 1/4th of the possible usage time is "thrown away".
+    // I don't expect this to be much of an issue, however.
+    gboolean wake = syn_reactor_poll(r, r->pending ? 0 : r->waiting ? 250 : -1);
+
+    GSList *l, *pending = r->pending;
+    r->pending = NULL;
+    for(l=pending; l; l=l->next) {
+      s = l->data;
+      s->pending = FALSE;
+      if(s->armed)
+        syn_event(r, s, FALSE);
+    }
+    g_slist_free(pending);
+
+    // Handle cancelled transfers last, after which nothing may refer to them.
+    if(wake) {
+      char buf[64];
+      while(read(r->wake[0], buf, sizeof(buf)) > 0)
+        ;
+      for(i=0; i<r->list->len; ) {
+        s = g_ptr_array_index(r->list, i);
+        if(s->cancel)
+          syn_finish(r, s);
+        else
+          i++;
+      }
+    }
   }
+  return NULL;
+}
 
-  if(sock && !s->cancel && !s->upl)
-    syn_download(s, sock);
 
-  g_idle_add(syn_done, s);
+static void syn_reactor_init(syn_reactor_t *r) {
+  if(pipe(r->wake) < 0) {
+    g_critical("pipe() failed: %s", g_strerror(errno));
+    g_return_if_reached();
+  }
+  fcntl(r->wake[0], F_SETFL, fcntl(r->wake[0], F_GETFL, 0)|O_NONBLOCK);
+  fcntl(r->wake[1], F_SETFL, fcntl(r->wake[1], F_GETFL, 0)|O_NONBLOCK);
+
+#ifdef HAVE_EPOLL_CREATE1
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(r->epfd < 0) {
+    g_critical("epoll_create1() failed: %s", g_strerror(errno));
+    g_return_if_reached();
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = r;
+  epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake[0], &ev);
+#else
+  r->fds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+  g_array_set_size(r->fds, 1);
+  GPollFD *w = (GPollFD *)r->fds->data;
+  w->fd = r->wake[0];
+  w->events = G_IO_IN;
+  r->polled = g_ptr_array_new();
+#endif
+
+  r->queue = g_async_queue_new();
+  r->list = g_ptr_array_new();
+  r->buf = g_malloc(NET_TRANS_BUF);
+  g_thread_create(syn_reactor_thread, r, FALSE, NULL);
 }
 
 
@@ -553,7 +1003,17 @@ static void syn_start(net_t *n) {
     g_source_remove(n->socksrc);
     n->socksrc = 0;
   }
-  g_thread_pool_push(syn_pool, n->syn, NULL);
+
+  // Assign the transfer to the least busy reactor
+  syn_reactor_t *r = syn_reactors;
+  int i;
+  for(i=1; i<syn_nreactors; i++)
+    if(g_atomic_int_get(&syn_reactors[i].num) < g_atomic_int_get(&r->num))
+      r = syn_reactors+i;
+  g_atomic_int_inc(&r->num);
+  n->syn->reactor = r;
+  g_async_queue_push(r->queue, n->syn);
+  syn_reactor_wake(r);
 }
 
 
@@ -561,7 +1021,7 @@ guint64 net_left(net_t *n) {
   if(!n->syn)
     return 0;
   g_static_mutex_lock(&n->syn->lock);
-  guint64 r = n->syn->left;
+  guint64 r = n->syn->zs && n->syn->upl ? n->syn->zleft : n->syn->left;
   g_static_mutex_unlock(&n->syn->lock);
   return r;
 }
@@ -576,6 +1036,17 @@ guint64 net_left(net_t *n) {
 
 static gboolean handle_timer(gpointer dat);
 
+// Marks the first len bytes after the read cursor as consumed. The buffer is
+// only compacted when it runs out of space in asy_read(), or for free when
+// everything has been consumed.
+static void asy_consume(net_t *n, gsize len) {
+  n->rbuf_off += len;
+  if(n->rbuf_off >= n->rbuf->len) {
+    n->rbuf_off = 0;
+    g_string_truncate(n->rbuf, 0);
+  }
+}
+
 // Checks rbuf against any queued read events and handles those. (Can be called
 // as a glib idle function)
 static gboolean asy_handlerbuf(gpointer dat) {
@@ -586,27 +1057,29 @@ static gboolean asy_handlerbuf(gpointer dat) {
   // otherwise we need to make a copy of rbuf before passing it to the
   // callback.
   net_ref(n);
-  while(n->state == NETST_ASY && n->rbuf->len && n->rd_cb && !n->syn) {
+  while(n->state == NETST_ASY && n->rbuf->len > n->rbuf_off && n->rd_cb && !n->syn) {
     gboolean msg = n->rd_msg;
     gboolean consume = n->rd_consume;
     int dat = n->rd_dat;
     void(*cb)(net_t *, char *, int) = n->rd_cb;
+    char *str = n->rbuf->str + n->rbuf_off;
+    gsize len = n->rbuf->len - n->rbuf_off;
 
     char *end = msg
-      ? memchr(n->rbuf->str, dat, n->rbuf->len)
-      : n->rbuf->len >= dat ? n->rbuf->str + dat : NULL;
+      ? memchr(str, dat, len)
+      : len >= dat ? str + dat : NULL;
     if(!end)
       break;
     n->rd_cb = NULL;
     if(msg) {
       *end = 0;
       if(consume)
-        g_debug("%s< %s%c", net_remoteaddr(n), n->rbuf->str, dat != '\n' ? dat : ' ');
+        g_debug("%s< %s%c", net_remoteaddr(n), str, dat != '\n' ? dat : ' ');
     }
-    cb(n, n->rbuf->str, end - n->rbuf->str);
+    cb(n, str, end - str);
     if(n->state == NETST_ASY || n->state == NETST_SYN || n->state == NETST_DIS) {
       if(consume)
-        g_string_erase(n->rbuf, 0, end - n->rbuf->str + (msg ? 1 : 0));
+        asy_consume(n, end - str + (msg ? 1 : 0));
       else if(msg)
         *end = dat;
     }
@@ -615,13 +1088,20 @@ static gboolean asy_handlerbuf(gpointer dat) {
   // Handle recvfile
   if(n->syn && n->state == NETST_ASY && !n->syn->upl) {
     synfer_t *s = n->syn;
-    if(n->rbuf->len) {
-      int w = MIN(n->rbuf->len, s->left);
+    if(n->rbuf->len > n->rbuf_off && s->zs)
+      asy_consume(n, syn_inflate(s, n->rbuf->str + n->rbuf_off, n->rbuf->len - n->rbuf_off));
+    else if(n->rbuf->len > n->rbuf_off) {
+      int w = MIN(n->rbuf->len - n->rbuf_off, s->left);
       s->left -= w;
-      s->cb_downdata(s->ctx, n->rbuf->str, w);
-      g_string_erase(n->rbuf, 0, w);
+      s->cb_downdata(s->ctx, n->rbuf->str + n->rbuf_off, w);
+      asy_consume(n, w);
     }
-    if(s->left)
+    if(s->err) {
+      g_debug("%s: Syn: %s", net_remoteaddr(n), s->err);
+      syn_cancel(n);
+      n->cb_err(n, NETERR_RECV, s->err);
+      syn_free(s);
+    } else if(!syn_complete(s))
       syn_start(n);
     else {
       s->cb_downdone(n, s->ctx);
@@ -639,13 +1119,27 @@ static gboolean asy_handlerbuf(gpointer dat) {
 // Tries a read. Returns FALSE if there was an error other than "please try
 // again later".
 static gboolean asy_read(net_t *n) {
+  // Drop a large buffer once it's empty again, a burst of data shouldn't
+  // leave every connection with a buffer of NET_MAX_RBUF.
+  if(!n->rbuf->len && n->rbuf->allocated_len > 4*n->rsize) {
+    g_string_free(n->rbuf, TRUE);
+    n->rbuf = g_string_sized_new(n->rsize);
+  }
+
+  // Move the unconsumed data to the front if we need the room. This happens
+  // at most once per read, rather than after every message.
+  if(n->rbuf_off && n->rbuf->allocated_len - n->rbuf->len - 1 < n->rsize) {
+    g_string_erase(n->rbuf, 0, n->rbuf_off);
+    n->rbuf_off = 0;
+  }
+
   // Make sure we have enough buffer space
-  if(n->rbuf->allocated_len < NET_MAX_RBUF && n->rbuf->allocated_len - n->rbuf->len < NET_RECV_SIZE) {
+  if(n->rbuf->allocated_len < NET_MAX_RBUF && n->rbuf->allocated_len - n->rbuf->len - 1 < n->rsize) {
     gsize oldlen = n->rbuf->len;
-    g_string_set_size(n->rbuf, MIN(NET_MAX_RBUF, n->rbuf->len+NET_RECV_SIZE));
+    g_string_set_size(n->rbuf, MIN(NET_MAX_RBUF, n->rbuf->len+n->rsize));
     n->rbuf->len = oldlen;
   }
-  int len = n->rbuf->allocated_len - n->rbuf->len - 1;
+  int len = MIN(n->rsize, n->rbuf->allocated_len - n->rbuf->len - 1);
   if(len <= 10) { // Some arbitrary low number.
     g_debug("%s: Read buffer full", net_remoteaddr(n));
     n->cb_err(n, NETERR_RECV, "Read buffer full");
@@ -664,10 +1158,21 @@ static gboolean asy_read(net_t *n) {
     return FALSE;
   }
 
+  // Read larger chunks while the data keeps coming in faster than we read
+  // it, and fall back to smaller reads when it slows down.
+  if(r == len && n->rsize < NET_MAX_RBUF)
+    n->rsize = MIN(n->rsize*2, NET_MAX_RBUF);
+  else if(r < n->rsize/8 && n->rsize > NET_RECV_SIZE)
+    n->rsize /= 2;
+
   // Otherwise, update buffer info
   g_return_val_if_fail(n->rbuf->len + r < n->rbuf->allocated_len, FALSE);
   n->rbuf->len += r;
   n->rbuf->str[n->rbuf->len] = 0;
+  if((int)(n->rbuf->len - n->rbuf_off) > n->rbuf_max) {
+    n->rbuf_max = n->rbuf->len - n->rbuf_off;
+    stats_max(STATM_RBUF, n->rbuf_max);
+  }
   net_ref(n);
   asy_handlerbuf(n);
   gboolean ret = n->state == NETST_ASY;
@@ -777,6 +1282,13 @@ static gboolean asy_handshake(net_t *n) {
     n->tls_handshake = FALSE;
     gboolean ret = TRUE;
 
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+    if(n->tls_fd) {
+      n->ktls_send = !!(gnutls_transport_is_ktls_enabled(n->tls) & GNUTLS_KTLS_SEND);
+      g_debug("%s: kTLS %s for sending.", net_remoteaddr(n), n->ktls_send ? "enabled" : "not available");
+    }
+#endif
+
     int alpn_selected = ALPN_DEFAULT;
 
 #if GNUTLS_VERSION_NUMBER >= 0x030200
@@ -898,10 +1410,13 @@ void net_peekbytes(net_t *n, int bytes, void(*cb)(net_t *, char *, int)) {
 
 // Similar to net_readbytes(), but will call the data() callback for every read
 // from the network, this callback may be run from another thread. When done,
-// the done() callback will be run in the main thread.
-void net_recvfile(net_t *n, guint64 len, gboolean(*data)(void *, const char *, int), void(*done)(net_t *, void *), void *ctx) {
+// the done() callback will be run in the main thread. If zlib is set, the
+// data is received as a ZL1 compressed stream that inflates to len bytes.
+void net_recvfile(net_t *n, guint64 len, gboolean zlib, gboolean(*data)(void *, const char *, int), void(*done)(net_t *, void *), void *ctx) {
   g_return_if_fail(n->state == NETST_ASY);
   syn_new(n, FALSE, len);
+  if(zlib)
+    syn_new_zlib(n->syn);
   n->syn->cb_downdata = data;
   n->syn->cb_downdone = done;
   n->syn->ctx = ctx;
@@ -910,7 +1425,19 @@ void net_recvfile(net_t *n, guint64 len, gboolean(*data)(void *, const char *, i
 }
 
 
-#define flush if(n->tls_handshake || asy_write(n)) asy_setuppoll(n)
+// Writes are not sent right away, but collected in wbuf until the main loop
+// gets around to this. That way a burst of small messages (search results,
+// INF updates, a chat line followed by a command) goes out in a single send()
+// and TLS record.
+static gboolean asy_flush(gpointer dat) {
+  net_t *n = dat;
+  n->flushsrc = 0;
+  if((n->state == NETST_ASY || n->state == NETST_DIS) && (n->tls_handshake || asy_write(n)))
+    asy_setuppoll(n);
+  return FALSE;
+}
+
+#define flush if(!n->flushsrc) n->flushsrc = g_idle_add_full(G_PRIORITY_DEFAULT, asy_flush, n, NULL)
 
 // This is often used to write a raw byte strings, so is not logged for debugging.
 void net_write(net_t *n, const char *buf, int len) {
@@ -963,14 +1490,22 @@ void net_writef(net_t *n, const char *fmt, ...) {
 #undef flush
 
 
-// Switches to the SYN state when the write buffer has been flushed. fd will be
-// close()'d when done. cb() will be called in the main thread.
-void net_sendfile(net_t *n, int fd, guint64 len, gboolean flush, void (*cb)(net_t *)) {
+// Switches to the SYN state when the write buffer has been flushed and sends
+// hdr followed by len bytes from fd, starting at offset off. The file offset
+// of fd itself is not used, so it may be shared with other uploads. fd will be
+// close()'d when done. cb() will be called in the main thread. If hdr_zlib is
+// set and a sample of the data compresses well, hdr_zlib is sent instead of
+// hdr and the data is sent as a ZL1 compressed stream, which rules out the use
+// of sendfile().
+void net_sendfile(net_t *n, int fd, guint64 off, guint64 len, gboolean flush, const char *hdr, const char *hdr_zlib, void (*cb)(net_t *)) {
   g_return_if_fail(n->state == NETST_ASY && !n->syn);
   syn_new(n, TRUE, len);
+  n->syn->hdr = g_strdup(hdr);
+  n->syn->hdr_zlib = g_strdup(hdr_zlib);
   n->syn->flush = flush;
   n->syn->cb_upldone = cb;
   n->syn->fd = fd;
+  n->syn->off = off;
   if(!n->wbuf->len)
     syn_start(n);
 }
@@ -1007,18 +1542,32 @@ void net_settls(net_t *n, gboolean serv, gboolean negotiate, void (*cb)(net_t *,
   g_return_if_fail(n->state == NETST_ASY);
   g_return_if_fail(!n->wbuf->len);
   g_return_if_fail(!n->tls);
-  if(n->rbuf->len) {
+  if(n->rbuf->len > n->rbuf_off) {
+    g_string_erase(n->rbuf, 0, n->rbuf_off);
     n->tlsrbuf = n->rbuf;
     n->rbuf = g_string_sized_new(1024);
-  }
+  } else
+    g_string_truncate(n->rbuf, 0);
+  n->rbuf_off = 0;
   gnutls_init(&n->tls, serv ? GNUTLS_SERVER : GNUTLS_CLIENT);
   gnutls_credentials_set(n->tls, GNUTLS_CRD_CERTIFICATE, db_certificate);
   const char *pos;
   gnutls_priority_set_direct(n->tls, var_get(0, VAR_tls_priority), &pos);
 
-  gnutls_transport_set_ptr(n->tls, n);
-  gnutls_transport_set_push_function(n->tls, tls_push);
-  gnutls_transport_set_pull_function(n->tls, tls_pull);
+  // GnuTLS can only offload the session to the kernel when it has direct
+  // access to the socket. That's not possible when there is still buffered
+  // data to feed to it through tls_pull().
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+  if(!n->tlsrbuf && var_get_bool(0, VAR_tls_ktls)) {
+    gnutls_transport_set_int(n->tls, n->sock);
+    n->tls_fd = TRUE;
+  } else
+#endif
+  {
+    gnutls_transport_set_ptr(n->tls, n);
+    gnutls_transport_set_push_function(n->tls, tls_push);
+    gnutls_transport_set_pull_function(n->tls, tls_pull);
+  }
 
 #if GNUTLS_VERSION_NUMBER >= 0x030200
   if(negotiate) {
@@ -1042,6 +1591,9 @@ void net_connected(net_t *n, int sock, const char *addr, gboolean v6) {
   n->v6 = v6;
   n->wbuf = g_string_sized_new(1024);
   n->rbuf = g_string_sized_new(1024);
+  n->rbuf_off = 0;
+  n->rbuf_max = 0;
+  n->rsize = NET_RECV_SIZE;
 
   if(v6) {
     struct sockaddr_in6 a;
@@ -1256,8 +1808,22 @@ void net_set_keepalive(net_t *n, const char *msg) {
 
 const char *net_remoteaddr(net_t *n) { return n->addr; }
 const char *net_localaddr(net_t *n)  { return n->laddr; }
+int         net_rbuf_max(net_t *n)   { return n->rbuf_max; }
 ratecalc_t *net_rate_in(net_t *n)    { return &n->rate_in; }
 ratecalc_t *net_rate_out(net_t *n)   { return &n->rate_out; }
+
+
+// Sets the buckets that file transfers over this connection take their bytes
+// from, NULL for just the global class buckets. They are only attached while
+// a transfer is in progress (from net_recvfile() or net_sendfile() until it's
+// done or cancelled), so other traffic and idle connections don't count
+// towards them.
+void net_setbuckets(net_t *n, ratecalc_t *in, ratecalc_t *out) {
+  n->bucket_in = in;
+  n->bucket_out = out;
+  if(n->syn)
+    ratecalc_setparent(n->syn->upl ? &n->rate_out : &n->rate_in, n->syn->upl ? out : in);
+}
 void       *net_handle(net_t *n)     { return n->handle; }
 
 gboolean net_is_asy(net_t *n)           { return n->state == NETST_ASY; }
@@ -1352,6 +1918,13 @@ void net_disconnect(net_t *n) {
 
   case NETST_ASY:
   case NETST_DIS:
+    // Writes are normally sent from asy_flush(). Make a best-effort attempt
+    // at still sending them here, as this may be an error message written
+    // just before disconnecting.
+    if(n->flushsrc && !n->tls_handshake && n->wbuf->len) {
+      const char *err;
+      low_send(n, n->wbuf->str, n->wbuf->len, &err);
+    }
     n->rd_cb = NULL;
     s = n->syn;
     if(s) {
@@ -1402,6 +1975,10 @@ void net_disconnect(net_t *n) {
     g_source_remove(n->timeout_src);
     n->timeout_src = 0;
   }
+  if(n->flushsrc) {
+    g_source_remove(n->flushsrc);
+    n->flushsrc = 0;
+  }
 
   ratecalc_unregister(&n->rate_in);
   ratecalc_unregister(&n->rate_out);
@@ -1409,7 +1986,7 @@ void net_disconnect(net_t *n) {
   if(n->state == NETST_ASY || n->state == NETST_SYN || n->state == NETST_DIS)
     g_debug("%s: Disconnected.", net_remoteaddr(n));
   n->addr[0] = 0;
-  n->wantwrite = n->writing = n->tls_handshake = n->shutdown_closed = FALSE;
+  n->wantwrite = n->writing = n->tls_handshake = n->shutdown_closed = n->tls_fd = n->ktls_send = FALSE;
   n->state = NETST_IDL;
 }
 
@@ -1431,66 +2008,174 @@ void net_unref(net_t *n) {
 
 
 // Simple API for sending UDP packets
+//
+// All outgoing UDP messages are sent from a small set of long-lived,
+// unconnected sockets, one for each combination of address family and local
+// address. Messages are not sent immediately, but copied into a shared queue
+// that is flushed from an idle callback (or when it's full), so that a burst
+// of search results can be sent with a few sendmmsg() calls.
 
 #if INTERFACE
 
 struct net_udp_t {
   char addr[62];
   int sock;
+  struct sockaddr_storage sa;
+  socklen_t salen;
 };
 
 #endif
 
+typedef struct net_udp_msg_t {
+  int sock;
+  int off, len; // in net_udp_buf
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char addr[62];
+} net_udp_msg_t;
 
-// Creates a new UDP socket for sending messages to the given destination.
-// host is assumed to be a valid IPv4 or IPv6 address.
-void net_udp_init(net_udp_t *udp, const char *host, unsigned short port, char *laddr) {
-  int af = ip4_isvalid(host) ? AF_INET : AF_INET6;
-  snprintf(udp->addr, sizeof(udp->addr), af == AF_INET ? "%s:%d" : "[%s]:%d", host, (int)port);
+#define NET_UDP_QUEUE 256 // maximum number of queued messages
+#define NET_UDP_BATCH 64  // maximum number of messages in one sendmmsg() call
 
-  udp->sock = socket(af, SOCK_DGRAM, 0);
-  fcntl(udp->sock, F_SETFL, fcntl(udp->sock, F_GETFL, 0)|O_NONBLOCK);
+static GHashTable *net_udp_socks = NULL; // key = "af:laddr", value = socket + 1
+static GString *net_udp_buf = NULL;
+static GArray *net_udp_queue = NULL;
+static guint net_udp_idle = 0;
 
-  if(net_sock_bind(af, udp->sock, laddr) < 0) {
-    g_message("Can't bind UDP socket for '%s' to local address '%s': %s", udp->addr, laddr, g_strerror(errno));
-    close(udp->sock);
-    return;
+
+// Returns the shared socket for the given address family and local address,
+// creating it if necessary. Returns -1 on error.
+static int net_udp_sock(int af, char *laddr) {
+  char *key = g_strdup_printf("%d:%s", af, laddr ? laddr : "");
+  int sock = GPOINTER_TO_INT(g_hash_table_lookup(net_udp_socks, key)) - 1;
+  if(sock >= 0) {
+    g_free(key);
+    return sock;
   }
 
-  int n;
+  sock = socket(af, SOCK_DGRAM, 0);
+  if(sock < 0) {
+    g_message("Can't create UDP socket: %s", g_strerror(errno));
+    g_free(key);
+    return -1;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0)|O_NONBLOCK);
+  if(net_sock_bind(af, sock, laddr) < 0) {
+    g_message("Can't bind UDP socket to local address '%s': %s", laddr, g_strerror(errno));
+    close(sock);
+    g_free(key);
+    return -1;
+  }
+  g_hash_table_insert(net_udp_socks, key, GINT_TO_POINTER(sock+1));
+  return sock;
+}
+
+
+// Prepares for sending messages to the given destination. host is assumed to
+// be a valid IPv4 or IPv6 address. This is cheap, no socket is created.
+void net_udp_init(net_udp_t *udp, const char *host, unsigned short port, char *laddr) {
+  int af = ip4_isvalid(host) ? AF_INET : AF_INET6;
+  snprintf(udp->addr, sizeof(udp->addr), af == AF_INET ? "%s:%d" : "[%s]:%d", host, (int)port);
+
   if(af == AF_INET) {
     struct in_addr a = ip4_pack(host);
-    n = connect(udp->sock, ip4_sockaddr(a, port), sizeof(struct sockaddr_in));
+    udp->salen = sizeof(struct sockaddr_in);
+    memcpy(&udp->sa, ip4_sockaddr(a, port), udp->salen);
   } else {
     struct in6_addr a = ip6_pack(host);
-    n = connect(udp->sock, ip6_sockaddr(a, port), sizeof(struct sockaddr_in6));
-  }
-  if(n < 0) {
-    g_message("Can't associate UDP socket with '%s': %s", udp->addr, g_strerror(errno));
-    close(udp->sock);
-    return;
+    udp->salen = sizeof(struct sockaddr_in6);
+    memcpy(&udp->sa, ip6_sockaddr(a, port), udp->salen);
   }
+  udp->sock = net_udp_sock(af, laddr);
 }
 
 
+// Doesn't do anything at the moment, the socket is shared and any queued
+// messages are still sent.
 void net_udp_destroy(net_udp_t *udp) {
-  if(udp->sock >= 0)
-    close(udp->sock);
+  udp->sock = -1;
+}
+
+
+static void net_udp_senderr(net_udp_msg_t *m) {
+  g_message("Error sending UDP message to '%s': %s", m->addr, g_strerror(errno));
+}
+
+
+// Sends all messages in the queue. Messages for the same socket are batched
+// into a single sendmmsg() call where available.
+static void net_udp_flush() {
+  net_udp_msg_t *q = (net_udp_msg_t *)net_udp_queue->data;
+  int i = 0;
+  while(i < net_udp_queue->len) {
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr h[NET_UDP_BATCH];
+    struct iovec v[NET_UDP_BATCH];
+    int n = 0;
+    memset(h, 0, sizeof(h));
+    for(; n < NET_UDP_BATCH && i+n < net_udp_queue->len && q[i+n].sock == q[i].sock; n++) {
+      v[n].iov_base = net_udp_buf->str + q[i+n].off;
+      v[n].iov_len = q[i+n].len;
+      h[n].msg_hdr.msg_name = &q[i+n].sa;
+      h[n].msg_hdr.msg_namelen = q[i+n].salen;
+      h[n].msg_hdr.msg_iov = v+n;
+      h[n].msg_hdr.msg_iovlen = 1;
+    }
+    int r = sendmmsg(q[i].sock, h, n, 0);
+    // On error, the first message wasn't sent. Log and skip it, and try the
+    // rest in the next round.
+    if(r <= 0) {
+      net_udp_senderr(q+i);
+      r = 1;
+    } else {
+      int j;
+      for(j=0; j<r; j++)
+        ratecalc_add(&net_out, h[j].msg_len);
+    }
+    i += r;
+#else
+    if(sendto(q[i].sock, net_udp_buf->str + q[i].off, q[i].len, 0, (struct sockaddr *)&q[i].sa, q[i].salen) != q[i].len)
+      net_udp_senderr(q+i);
+    else
+      ratecalc_add(&net_out, q[i].len);
+    i++;
+#endif
+  }
+  g_array_set_size(net_udp_queue, 0);
+  g_string_truncate(net_udp_buf, 0);
 }
 
 
-// Send a message to a UDP socket, logs but otherwise ignores errors. Note that
-// the socket is created as non-blocking and this function does not attempt to
-// retry the send() on EWOULDBLOCK or EAGAIN. It is assumed that the kernel
-// buffers are large enough that we can burst-queue several messages, and that,
-// if the kernel buffers are full, we might be better off dropping some
-// messages than queueing them until infinity.
+static gboolean net_udp_flush_idle(gpointer dat) {
+  net_udp_idle = 0;
+  net_udp_flush();
+  return FALSE;
+}
+
+
+// Queue a message for sending, logs but otherwise ignores errors. Note that
+// the sockets are non-blocking and the send is not retried on EWOULDBLOCK or
+// EAGAIN. It is assumed that the kernel buffers are large enough that we can
+// burst-queue several messages, and that, if the kernel buffers are full, we
+// might be better off dropping some messages than queueing them until
+// infinity.
 void net_udp_send_raw(net_udp_t *udp, const char *msg, int len) {
-  int r = send(udp->sock, msg, len, 0);
-  if(r != len)
-    g_message("Error sending UDP message to '%s': %s", udp->addr, g_strerror(errno));
-  else
-    ratecalc_add(&net_out, len);
+  if(udp->sock < 0)
+    return;
+  net_udp_msg_t m;
+  m.sock = udp->sock;
+  m.off = net_udp_buf->len;
+  m.len = len;
+  m.sa = udp->sa;
+  m.salen = udp->salen;
+  strcpy(m.addr, udp->addr);
+  g_string_append_len(net_udp_buf, msg, len);
+  g_array_append_val(net_udp_queue, m);
+
+  if(net_udp_queue->len >= NET_UDP_QUEUE)
+    net_udp_flush();
+  else if(!net_udp_idle)
+    net_udp_idle = g_idle_add(net_udp_flush_idle, NULL);
 }
 
 
@@ -1526,6 +2211,14 @@ void net_init_global() {
   ratecalc_register(&net_out, RCC_NONE);
 
   dns_pool = g_thread_pool_new(dnscon_thread, NULL, -1, FALSE, NULL);
-  syn_pool = g_thread_pool_new(syn_thread, NULL, -1, FALSE, NULL);
+
+  int i;
+  syn_nreactors = CLAMP(sysconf(_SC_NPROCESSORS_ONLN), 1, SYN_MAX_REACTORS);
+  for(i=0; i<syn_nreactors; i++)
+    syn_reactor_init(syn_reactors+i);
+
+  net_udp_socks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  net_udp_buf = g_string_sized_new(NET_UDP_QUEUE*256);
+  net_udp_queue = g_array_sized_new(FALSE, FALSE, sizeof(net_udp_msg_t), NET_UDP_QUEUE);
 }
 
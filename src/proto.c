@@ -139,9 +139,9 @@ char *adc_unescape(const char *str, gboolean nmdc) {
 }
 
 
-// ADC parameter escaping
-char *adc_escape(const char *str, gboolean nmdc) {
-  GString *dest = g_string_sized_new(strlen(str)+50);
+// ADC parameter escaping. adc_escape_append() appends to an existing string
+// rather than allocating a new one.
+void adc_escape_append(GString *dest, const char *str, gboolean nmdc) {
   while(*str) {
     switch(*str) {
     case ' ':  g_string_append(dest, nmdc ? "\\ " : "\\s"); break;
@@ -151,6 +151,12 @@ char *adc_escape(const char *str, gboolean nmdc) {
     }
     str++;
   }
+}
+
+
+char *adc_escape(const char *str, gboolean nmdc) {
+  GString *dest = g_string_sized_new(strlen(str)+50);
+  adc_escape_append(dest, str, nmdc);
   return g_string_free(dest, FALSE);
 }
 
@@ -365,8 +371,11 @@ char **adc_getparams(char **a, char *name) {
 }
 
 
-GString *adc_generate(char type, int cmd, int source, int dest) {
-  GString *c = g_string_sized_new(100);
+// Writes the header of a command to c, overwriting whatever was in there.
+// Useful for re-using a scratch buffer instead of allocating a new string for
+// every message. Returns c.
+GString *adc_generate_buf(GString *c, char type, int cmd, int source, int dest) {
+  g_string_truncate(c, 0);
   g_string_append_c(c, type);
   char r[5] = {};
   ADC_EFCC(cmd, r);
@@ -388,12 +397,15 @@ GString *adc_generate(char type, int cmd, int source, int dest) {
 }
 
 
+GString *adc_generate(char type, int cmd, int source, int dest) {
+  return adc_generate_buf(g_string_sized_new(100), type, cmd, source, dest);
+}
+
+
 void adc_append(GString *c, const char *name, const char *arg) {
   g_string_append_c(c, ' ');
   if(name)
     g_string_append(c, name);
-  char *enc = adc_escape(arg, FALSE);
-  g_string_append(c, enc);
-  g_free(enc);
+  adc_escape_append(c, arg, FALSE);
 }
 
@@ -39,8 +39,11 @@ struct search_q_t {
   gboolean ge;  // TRUE -> match >= size; FALSE -> match <= size
   guint64 size; // 0 = disabled.
   char **query; // list of patterns to include
+  str_matcher_t *match; // matcher for query, created in search_add()
   char tth[24]; // only used when type = 9
   char key[16]; // SUDP key that we sent along with the SCH
+  guint32 gram; // trigram used to find this query in dispatch(), 0 if none
+  guint seen;   // used by dispatch() to avoid matching a query twice
 
   search_cb cb;
   void *cb_dat;
@@ -66,6 +69,18 @@ struct search_type_t {
 // A set of search_q pointers, listing the searches we're currently interested in.
 static GHashTable *search_list = NULL;
 
+// Indices on search_list, to quickly find the queries that an incoming result
+// may match. TTH queries are indexed on their TTH (value = GSList of queries).
+// Keyword queries are indexed on the first three bytes (lowercased) of their
+// longest keyword, as any result that matches the query must include that
+// trigram in its file name. Queries that have no keyword of at least three
+// bytes are kept in search_unindexed.
+static GHashTable *search_tths = NULL;
+static GHashTable *search_grams = NULL;
+static GSList *search_unindexed = NULL;
+
+#define search_gram(s) ((((guint32)(guchar)(s)[0])<<16) | (((guint32)(guchar)(s)[1])<<8) | (guchar)(s)[2])
+
 
 
 // NMDC search types and the relevant ADC SEGA extensions.
@@ -87,6 +102,7 @@ void search_q_free(search_q_t *q) {
     return;
   if(q->query)
     g_strfreev(q->query);
+  str_matcher_free(q->match);
   g_slice_free(search_q_t, q);
 }
 
@@ -153,6 +169,60 @@ char *search_command(search_q_t *q, gboolean onhub) {
 }
 
 
+static void search_index_add(search_q_t *q) {
+  if(q->type == 9) {
+    GSList *l = g_hash_table_lookup(search_tths, q->tth);
+    if(l)
+      l->next = g_slist_prepend(l->next, q); // keep the first item, it owns the key
+    else
+      g_hash_table_insert(search_tths, q->tth, g_slist_prepend(NULL, q));
+    return;
+  }
+
+  // Find the longest keyword (only the first 64 are used by the matcher). The
+  // lowercased form may differ in length, so that's what we compare.
+  char **p, *best = NULL;
+  int bestlen = 0, n;
+  for(p=q->query, n=0; p && *p && n<64; p++, n++) {
+    char *low = str_matcher_lowercase(*p);
+    int len = strlen(low);
+    if(len > bestlen) {
+      g_free(best);
+      best = low;
+      bestlen = len;
+    } else
+      g_free(low);
+  }
+  q->gram = bestlen >= 3 ? search_gram(best) : 0;
+  g_free(best);
+
+  if(q->gram)
+    g_hash_table_insert(search_grams, GUINT_TO_POINTER(q->gram),
+      g_slist_prepend(g_hash_table_lookup(search_grams, GUINT_TO_POINTER(q->gram)), q));
+  else
+    search_unindexed = g_slist_prepend(search_unindexed, q);
+}
+
+
+static void search_index_remove(search_q_t *q) {
+  if(q->type == 9) {
+    GSList *l = g_hash_table_lookup(search_tths, q->tth);
+    l = g_slist_remove(l, q);
+    if(!l)
+      g_hash_table_remove(search_tths, q->tth);
+    else
+      g_hash_table_replace(search_tths, ((search_q_t *)l->data)->tth, l);
+  } else if(q->gram) {
+    GSList *l = g_slist_remove(g_hash_table_lookup(search_grams, GUINT_TO_POINTER(q->gram)), q);
+    if(l)
+      g_hash_table_insert(search_grams, GUINT_TO_POINTER(q->gram), l);
+    else
+      g_hash_table_remove(search_grams, GUINT_TO_POINTER(q->gram));
+  } else
+    search_unindexed = g_slist_remove(search_unindexed, q);
+}
+
+
 // Performs the search query on the given hub, or on all hubs if hub=NULL.
 // Returns FALSE on error and sets *err. *err may also be set when TRUE is
 // returned and there's a non-fatal warning.
@@ -203,17 +273,25 @@ gboolean search_add(hub_t *hub, search_q_t *q, GError **err) {
   }
 
   // Add to the active searches list
-  if(!search_list)
+  if(q->type != 9)
+    q->match = str_matcher_new(q->query);
+  if(!search_list) {
     search_list = g_hash_table_new(g_direct_hash, g_direct_equal);
+    search_tths = g_hash_table_new(g_int_hash, tiger_hash_equal);
+    search_grams = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
   g_hash_table_insert(search_list, q, q);
+  search_index_add(q);
   return TRUE;
 }
 
 
 // Remove a query from the active searches.
 void search_remove(search_q_t *q) {
-  if(search_list && g_hash_table_remove(search_list, q))
+  if(search_list && g_hash_table_remove(search_list, q)) {
+    search_index_remove(q);
     search_q_free(q);
+  }
 }
 
 
@@ -231,10 +309,8 @@ static gboolean match(search_q_t *q, search_r_t *r) {
   if(q->size && !(q->ge ? r->size >= q->size : r->size <= q->size))
     return FALSE;
   // Match query
-  char **str = q->query;
-  for(; str&&*str; str++)
-    if(G_LIKELY(!str_casestr(r->file, *str)))
-      return FALSE;
+  if(q->match && G_LIKELY(str_matcher_match(q->match, r->file) != q->match->all))
+    return FALSE;
   // Match extension
   char **ext = search_types[(int)q->type].exts;
   if(ext && *ext) {
@@ -253,17 +329,51 @@ static gboolean match(search_q_t *q, search_r_t *r) {
 }
 
 
+// Adds q to the list of matched queries if it hasn't been checked before.
+#define dispatch_check(q) do {\
+    if((q)->seen != seen && (q)->cb) {\
+      (q)->seen = seen;\
+      if(match(q, r))\
+        g_ptr_array_add(matched, q);\
+    }\
+  } while(0)
+
+
 // Match the search result against any active searches and runs the q->cb
-// callbacks.
+// callbacks. Only the queries found through the indices are matched.
 static void dispatch(search_r_t *r) {
-  if(!search_list)
+  if(!search_list || !g_hash_table_size(search_list))
     return;
-  GHashTableIter i;
-  g_hash_table_iter_init(&i, search_list);
+  static guint seen = 0;
+  seen++;
+  GPtrArray *matched = g_ptr_array_new();
+  GSList *l;
   search_q_t *q;
-  while(g_hash_table_iter_next(&i, (gpointer *)&q, NULL))
-    if(q->cb && match(q, r))
-      q->cb(r, q->cb_dat);
+
+  if(r->size != G_MAXUINT64)
+    for(l=g_hash_table_lookup(search_tths, r->tth); l; l=l->next)
+      dispatch_check((search_q_t *)l->data);
+
+  for(l=search_unindexed; l; l=l->next)
+    dispatch_check((search_q_t *)l->data);
+
+  if(g_hash_table_size(search_grams)) {
+    char *low = str_matcher_lowercase(r->file);
+    int i, len = strlen(low);
+    for(i=0; i+3<=len; i++)
+      for(l=g_hash_table_lookup(search_grams, GUINT_TO_POINTER(search_gram(low+i))); l; l=l->next)
+        dispatch_check((search_q_t *)l->data);
+    g_free(low);
+  }
+
+  // Callbacks are run after matching, so that they don't run while we're
+  // walking through the indices.
+  guint i;
+  for(i=0; i<matched->len; i++) {
+    q = g_ptr_array_index(matched, i);
+    q->cb(r, q->cb_dat);
+  }
+  g_ptr_array_free(matched, TRUE);
 }
 
 
@@ -471,38 +581,104 @@ gboolean search_handle_nmdc(hub_t *hub, char *msg) {
 }
 
 
-// length(out) >= inlen.
-static char *try_decrypt(const char *key, const char *in, int inlen, char *out) {
-  if(inlen < 32 || inlen & 15)
-    return NULL;
+// SUDP decryption. The key that was used to encrypt a packet isn't known in
+// advance, so it has to be found by trying the keys of all active searches.
+// Only the first two blocks (the random prefix and the start of the message)
+// need to be decrypted to see whether a key is correct. Peers tend to send
+// many results in a row, so the last key that worked for each source address
+// is remembered and tried first.
 
-  // Decrypt
-  memcpy(out, in, inlen);
-  crypt_aes128cbc(FALSE, key, 16, out, inlen);
+#define SUDP_CACHE 16
 
-  // Validate padding and replace with 0-bytes.
-  int padlen = out[inlen-1];
-  if(padlen < 1 || padlen > 16)
-    return NULL;
-  int r;
-  for(r=0; r<padlen; r++) {
-    if(out[inlen-padlen+r] != padlen)
-      return NULL;
-    else
-      out[inlen-padlen+r] = 0;
+static struct {
+  char addr[64];
+  char key[16];
+} sudp_cache[SUDP_CACHE];
+static int sudp_cache_len = 0;
+
+
+static gboolean sudp_try(const char *key, const char *pack) {
+  char buf[32];
+  memcpy(buf, pack, 32);
+  crypt_aes128cbc(FALSE, key, 16, buf, 32);
+  return strncmp(buf+16, "$SR ", 4) == 0 || strncmp(buf+16, "URES ", 5) == 0;
+}
+
+
+// Moves cache entry i to the front, or adds a new entry if i < 0.
+static void sudp_cache_use(int i, const char *addr, const char *key) {
+  if(i < 0) {
+    i = MIN(sudp_cache_len, SUDP_CACHE-1);
+    if(sudp_cache_len < SUDP_CACHE)
+      sudp_cache_len++;
+    g_strlcpy(sudp_cache[i].addr, addr, sizeof(sudp_cache[i].addr));
+    memcpy(sudp_cache[i].key, key, 16);
   }
+  if(i > 0) {
+    char tmp[sizeof(sudp_cache[0])];
+    memcpy(tmp, sudp_cache+i, sizeof(tmp));
+    memmove(sudp_cache+1, sudp_cache, i*sizeof(sudp_cache[0]));
+    memcpy(sudp_cache, tmp, sizeof(tmp));
+  }
+}
+
+
+// Returns the key to decrypt the packet with, or NULL if none of our keys
+// match. The returned pointer is only valid until the next call.
+static const char *sudp_findkey(const char *addr, const char *pack) {
+  static const char zero[16] = {};
+  int i;
+  for(i=0; i<sudp_cache_len; i++)
+    if(strncmp(sudp_cache[i].addr, addr, sizeof(sudp_cache[i].addr)-1) == 0) {
+      if(sudp_try(sudp_cache[i].key, pack)) {
+        sudp_cache_use(i, addr, NULL);
+        return sudp_cache[0].key;
+      }
+      break;
+    }
 
-  return out+16;
+  GHashTableIter iter;
+  search_q_t *q;
+  g_hash_table_iter_init(&iter, search_list);
+  while(g_hash_table_iter_next(&iter, (gpointer *)&q, NULL))
+    if(memcmp(q->key, zero, 16) != 0 && sudp_try(q->key, pack)) {
+      // Replace the existing entry for this address, if any
+      if(i < sudp_cache_len)
+        memcpy(sudp_cache[i].key, q->key, 16);
+      sudp_cache_use(i < sudp_cache_len ? i : -1, addr, q->key);
+      return sudp_cache[0].key;
+    }
+  return NULL;
+}
+
+
+// Decrypts the packet into a scratch buffer and validates the padding. Only
+// if that succeeds, the message (without IV and padding) is copied to the
+// start of pack and 0-terminated, so that an invalid packet is left as it was
+// received. Returns FALSE if the padding is invalid.
+static gboolean sudp_decrypt(const char *key, char *pack, int len) {
+  char *buf = g_memdup(pack, len);
+  crypt_aes128cbc(FALSE, key, 16, buf, len);
+  int r, padlen = buf[len-1];
+  gboolean ok = padlen >= 1 && padlen <= 16;
+  for(r=0; ok && r<padlen; r++)
+    if(buf[len-padlen+r] != padlen)
+      ok = FALSE;
+  if(ok) {
+    memcpy(pack, buf+16, len-16-padlen);
+    pack[len-16-padlen] = 0;
+  }
+  g_free(buf);
+  return ok;
 }
 
 
+// pack must be 0-terminated (at pack[len]) and is modified in-place.
 gboolean search_handle_udp(const char *addr, char *pack, int len) {
   if(len < 10 || !search_list)
     return TRUE;
 
-  pack = g_memdup(pack, len+1);
   char *msg = pack;
-  msg[len] = 0;
 
   // Check for protocol and encryption
   gboolean adc = FALSE;
@@ -511,30 +687,14 @@ gboolean search_handle_udp(const char *addr, char *pack, int len) {
     adc = FALSE;
   else if(strncmp(msg, "URES ", 5) == 0)
     adc = TRUE;
-  else if(!(len & 15) && var_get_int(0, VAR_sudp_policy) != VAR_SUDPP_DISABLE) {
-    char *buf = g_malloc(len);
-    GHashTableIter i;
-    g_hash_table_iter_init(&i, search_list);
-    search_q_t *q;
-    while(g_hash_table_iter_next(&i, (gpointer *)&q, NULL)) {
-      char *new = try_decrypt(q->key, pack, len, buf);
-      if(new && (strncmp(new, "$SR ", 4) == 0 || strncmp(new, "URES ", 5) == 0)) {
-        g_free(pack);
-        pack = buf;
-        msg = new;
-        sudp = TRUE;
-        adc = msg[0] == 'U';
-      }
-    }
-    if(!sudp) {
-      g_free(pack);
-      g_free(buf);
+  else if(len >= 32 && !(len & 15) && var_get_int(0, VAR_sudp_policy) != VAR_SUDPP_DISABLE) {
+    const char *key = sudp_findkey(addr, pack);
+    if(!key || !sudp_decrypt(key, pack, len))
       return FALSE;
-    }
-  } else {
-    g_free(pack);
+    sudp = TRUE;
+    adc = msg[0] == 'U';
+  } else
     return FALSE;
-  }
 
   // handle message
   char *next;
@@ -544,26 +704,19 @@ gboolean search_handle_udp(const char *addr, char *pack, int len) {
 
     if(adc) {
       adc_cmd_t cmd;
-      if(!adc_parse(msg, &cmd, NULL, NULL)) {
-        g_free(pack);
+      if(!adc_parse(msg, &cmd, NULL, NULL))
         return FALSE;
-      }
       gboolean r = search_handle_adc(NULL, &cmd);
       g_strfreev(cmd.argv);
-      if(!r) {
-        g_free(pack);
+      if(!r)
         return FALSE;
-      }
 
-    } else if(!search_handle_nmdc(NULL, msg)) {
-      g_free(pack);
+    } else if(!search_handle_nmdc(NULL, msg))
       return FALSE;
-    }
 
     msg = next;
   }
 
-  g_free(pack);
   return TRUE;
 }
 
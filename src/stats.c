@@ -0,0 +1,231 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2019 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#include "ncdc.h"
+#include "stats.h"
+
+
+// Runtime statistics of a few hot paths, displayed with /stats and
+// periodically written to the log file if log_stats is set.
+//
+// All counters are plain ints that are updated atomically, so they can be
+// used from any thread without locking. Counters wrap around after 4G events
+// (they are displayed as unsigned), which takes long enough in practice.
+// Histograms have power-of-two buckets, so percentiles are only accurate up
+// to a factor of two, but recording a value is just a few atomic increments.
+
+#if INTERFACE
+
+// Counters
+#define STATC_SEARCH_ADC   0 // ADC SCH requests handled
+#define STATC_SEARCH_NMDC  1 // NMDC $Search requests handled
+#define STATC_SEARCH_RES   2 // Search results sent
+#define STATC_HASH_FILES   3 // Files hashed
+#define STATC_HASH_KIB     4 // KiB hashed
+#define STATC_DL_VERIFIED  5 // Downloaded blocks verified against the TTHL data
+#define STATC_DL_HASHFAIL  6 // ...of which did not match
+#define STATC_NUM          7
+
+// High-water marks
+#define STATM_RBUF         0 // Largest amount of unconsumed data in a net_t read buffer
+#define STATM_NUM          1
+
+// Histograms
+#define STATH_SEARCH       0 // Time to handle an incoming search, in us
+#define STATH_DB_COMMIT    1 // Time to commit a database transaction, in us
+#define STATH_FL_SAVE      2 // Duration of fl_save(), in us
+#define STATH_HASH_RATE    3 // Hashing throughput of each file, in KiB/s
+#define STATH_NUM          4
+
+#define STATS_BUCKETS 32
+
+#endif
+
+
+typedef struct stats_hist_t {
+  int count;
+  int max;
+  int buckets[STATS_BUCKETS]; // bucket n > 0 holds values in [2^(n-1), 2^n), bucket 0 anything <= 0
+} stats_hist_t;
+
+static int stats_counters[STATC_NUM];
+static int stats_maxima[STATM_NUM];
+static stats_hist_t stats_hists[STATH_NUM];
+
+
+void stats_add(int c, int n) {
+  g_atomic_int_add(&stats_counters[c], n);
+}
+
+
+void stats_inc(int c) {
+  g_atomic_int_inc(&stats_counters[c]);
+}
+
+
+guint stats_get(int c) {
+  return (guint)g_atomic_int_get(&stats_counters[c]);
+}
+
+
+static void stats_setmax(int *var, int v) {
+  int old;
+  do
+    old = g_atomic_int_get(var);
+  while(v > old && !g_atomic_int_compare_and_exchange(var, old, v));
+}
+
+
+void stats_max(int m, int v) {
+  stats_setmax(&stats_maxima[m], v);
+}
+
+
+void stats_record(int h, gint64 v) {
+  stats_hist_t *s = stats_hists+h;
+  v = MIN(v, G_MAXINT);
+  int b = v <= 0 ? 0 : g_bit_storage(v);
+  g_atomic_int_add(&s->buckets[b], 1);
+  g_atomic_int_inc(&s->count);
+  stats_setmax(&s->max, v);
+}
+
+
+// Monotonic clock in microseconds, for use with stats_record().
+gint64 stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (gint64)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+// Returns an upper bound of the p-th percentile (0-100) of a histogram.
+static int stats_percentile(stats_hist_t *s, int p) {
+  guint count = g_atomic_int_get(&s->count);
+  guint want = MAX(1, ((guint64)count*p + 99) / 100);
+  guint n = 0;
+  int i;
+  for(i=0; i<STATS_BUCKETS; i++) {
+    n += g_atomic_int_get(&s->buckets[i]);
+    if(n >= want)
+      return i == 0 ? 0 : i >= 31 ? g_atomic_int_get(&s->max) : MIN((1<<i)-1, g_atomic_int_get(&s->max));
+  }
+  return g_atomic_int_get(&s->max);
+}
+
+
+static void stats_fmt_time(GString *str, int us) {
+  if(us < 1000)
+    g_string_append_printf(str, "%dus", us);
+  else if(us < 1000000)
+    g_string_append_printf(str, "%.1fms", us/1000.0);
+  else
+    g_string_append_printf(str, "%.2fs", us/1000000.0);
+}
+
+
+static void stats_fmt_rate(GString *str, int kib) {
+  g_string_append_printf(str, "%s/s", str_formatsize((guint64)kib*1024));
+}
+
+
+static void stats_fmt_hist(GString *str, const char *title, int h, void (*fmt)(GString *, int)) {
+  stats_hist_t *s = stats_hists+h;
+  guint count = g_atomic_int_get(&s->count);
+  g_string_append_printf(str, "\n  %-16s", title);
+  if(!count) {
+    g_string_append(str, "-");
+    return;
+  }
+  g_string_append_printf(str, "n=%u  p50<=", count);
+  fmt(str, stats_percentile(s, 50));
+  g_string_append(str, "  p90<=");
+  fmt(str, stats_percentile(s, 90));
+  g_string_append(str, "  p99<=");
+  fmt(str, stats_percentile(s, 99));
+  g_string_append(str, "  max=");
+  fmt(str, g_atomic_int_get(&s->max));
+}
+
+
+// Returns a human-readable summary of the statistics. Should be called from
+// the main thread, as it also reads some main-thread-only state.
+char *stats_report() {
+  GString *str = g_string_new("Runtime statistics:");
+
+  g_string_append_printf(str,
+    "\n  %-16sADC %u, NMDC %u, results sent %u, cache hits %"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT,
+    "Searches:", stats_get(STATC_SEARCH_ADC), stats_get(STATC_SEARCH_NMDC), stats_get(STATC_SEARCH_RES),
+    fl_search_cache_hits, fl_search_cache_lookups);
+  stats_fmt_hist(str, "Search time:", STATH_SEARCH, stats_fmt_time);
+
+  db_stats_t db;
+  db_stats(&db);
+  g_string_append_printf(str,
+    "\n  %-16squeued %d, %"G_GUINT64_FORMAT" transactions, %"G_GUINT64_FORMAT" statements, last %d",
+    "Database:", db.queued, db.transactions, db.queries, db.lastsize);
+  stats_fmt_hist(str, "Commit time:", STATH_DB_COMMIT, stats_fmt_time);
+  stats_fmt_hist(str, "fl_save() time:", STATH_FL_SAVE, stats_fmt_time);
+
+  // str_formatsize() uses a static buffer, so can't be used twice in one call
+  g_string_append_printf(str, "\n  %-16s%u files, %s", "Hashing:",
+    stats_get(STATC_HASH_FILES), str_formatsize((guint64)stats_get(STATC_HASH_KIB)*1024));
+  g_string_append_printf(str, ", currently %s/s", str_formatsize(ratecalc_rate(&fl_hash_rate)));
+  stats_fmt_hist(str, "Per-file rate:", STATH_HASH_RATE, stats_fmt_rate);
+
+  g_string_append_printf(str, "\n  %-16s%u blocks verified, %u failed",
+    "Downloads:", stats_get(STATC_DL_VERIFIED), stats_get(STATC_DL_HASHFAIL));
+
+  g_string_append_printf(str, "\n  %-16s%s max",
+    "Read buffers:", str_formatsize(g_atomic_int_get(&stats_maxima[STATM_RBUF])));
+  GList *n;
+  for(n=ui_tabs; n; n=n->next) {
+    ui_tab_t *t = n->data;
+    if(t->type == uit_hub && t->hub->net)
+      g_string_append_printf(str, ", %s %s", t->name, str_formatsize(net_rbuf_max(t->hub->net)));
+  }
+
+  return g_string_free(str, FALSE);
+}
+
+
+// Called from the one-second timer, writes the report to the log file every
+// log_stats seconds.
+void stats_log_tick() {
+  static time_t last = 0;
+  int interval = var_get_int(0, VAR_log_stats);
+  time_t now = time(NULL);
+  if(!interval || !last || now < last) {
+    last = now;
+    return;
+  }
+  if(now - last < interval)
+    return;
+  last = now;
+  char *r = stats_report();
+  g_message("%s", r);
+  g_free(r);
+}
@@ -232,8 +232,7 @@ int str_casecmp(const char *a, const char *b) {
 // This should be somewhat equivalent to
 //   strstr(g_utf8_casefold(haystack), g_utf8_casefold(needle))
 // If the same needle is used to match against many haystacks, it will be far
-// more efficient to use regular expressions instead. Those tend to be around 4
-// times faster.
+// more efficient to use a str_matcher_t instead.
 char *str_casestr(const char *haystack, const char *needle) {
   gsize hlen = g_utf8_strlen(haystack, -1);
   gsize nlen = g_utf8_strlen(needle, -1);
@@ -260,6 +259,168 @@ char *str_casestr(const char *haystack, const char *needle) {
 }
 
 
+
+// Case-insensitive matching of multiple substrings in a single pass. This is
+// an Aho-Corasick automaton on the UTF-8 bytes of the lowercased patterns,
+// the haystack is lowercased on the fly. Lowercasing is done the same way as
+// in str_casestr(). To keep the transition table small, the bytes are first
+// mapped into classes, where all bytes that don't occur in any pattern share
+// class 0.
+// Up to 64 patterns are supported, any further patterns are ignored.
+
+#if INTERFACE
+
+struct str_matcher_t {
+  guint64 all;   // bit mask of all patterns
+  guint64 empty; // bit mask of empty patterns, these always match
+  int ncls;
+  guchar cls[256];
+  int *delta;    // state transitions, index = state*ncls + class
+  guint64 *out;  // patterns matched when entering a state
+};
+
+#endif
+
+
+// Writes the lowercased UTF-8 representation of the character at *str to buf,
+// returns the number of bytes written and advances *str. Invalid UTF-8 is
+// passed through byte by byte.
+static int str_matcher_lower(const char **str, char *buf) {
+  if(!(**str & 0x80)) {
+    *buf = g_ascii_tolower(**str);
+    (*str)++;
+    return 1;
+  }
+  gunichar c = g_utf8_get_char_validated(*str, -1);
+  if(c == (gunichar)-1 || c == (gunichar)-2) {
+    *buf = **str;
+    (*str)++;
+    return 1;
+  }
+  *str = g_utf8_next_char(*str);
+  return g_unichar_to_utf8(g_unichar_tolower(c), buf);
+}
+
+
+// Creates a matcher from a NULL-terminated list of patterns. Bit n in the
+// result of str_matcher_match() corresponds to the n'th pattern.
+str_matcher_t *str_matcher_new(char **pats) {
+  str_matcher_t *m = g_slice_new0(str_matcher_t);
+  GString *low = g_string_new("");
+  GArray *offs = g_array_new(FALSE, FALSE, sizeof(int));
+  int i, j, num;
+
+  // Lowercase the patterns and assign the byte classes
+  m->ncls = 1;
+  for(num=0; pats && pats[num] && num<64; num++) {
+    const char *p = pats[num];
+    char buf[8];
+    g_array_append_val(offs, low->len);
+    while(*p) {
+      int l = str_matcher_lower(&p, buf);
+      for(i=0; i<l; i++)
+        if(!m->cls[(guchar)buf[i]])
+          m->cls[(guchar)buf[i]] = m->ncls++;
+      g_string_append_len(low, buf, l);
+    }
+    g_string_append_c(low, 0);
+    m->all |= ((guint64)1)<<num;
+    if(!*pats[num])
+      m->empty |= ((guint64)1)<<num;
+  }
+
+  // Build the trie, with -1 for missing transitions
+  int nstates = low->len - num + 1;
+  m->delta = g_new(int, nstates*m->ncls);
+  m->out = g_new0(guint64, nstates);
+  memset(m->delta, -1, nstates*m->ncls*sizeof(int));
+  nstates = 1;
+  for(i=0; i<num; i++) {
+    int st = 0;
+    guchar *p = (guchar *)low->str + g_array_index(offs, int, i);
+    for(; *p; p++) {
+      int *t = m->delta + st*m->ncls + m->cls[*p];
+      if(*t < 0)
+        *t = nstates++;
+      st = *t;
+    }
+    if(st)
+      m->out[st] |= ((guint64)1)<<i;
+  }
+
+  // Add the failure transitions in breadth-first order, which turns the trie
+  // into a DFA.
+  int *fail = g_new0(int, nstates);
+  int *queue = g_new(int, nstates);
+  int qhead = 0, qtail = 0;
+  for(j=0; j<m->ncls; j++) {
+    int *t = m->delta + j;
+    if(*t < 0)
+      *t = 0;
+    else
+      queue[qtail++] = *t;
+  }
+  while(qhead < qtail) {
+    int st = queue[qhead++];
+    m->out[st] |= m->out[fail[st]];
+    for(j=0; j<m->ncls; j++) {
+      int *t = m->delta + st*m->ncls + j;
+      int f = m->delta[fail[st]*m->ncls + j];
+      if(*t < 0)
+        *t = f;
+      else {
+        fail[*t] = f;
+        queue[qtail++] = *t;
+      }
+    }
+  }
+
+  g_free(fail);
+  g_free(queue);
+  g_array_unref(offs);
+  g_string_free(low, TRUE);
+  return m;
+}
+
+
+// Returns a newly allocated copy of str, lowercased in the same way as the
+// patterns and strings given to the matcher.
+char *str_matcher_lowercase(const char *str) {
+  GString *r = g_string_sized_new(strlen(str));
+  char buf[8];
+  while(*str) {
+    int l = str_matcher_lower(&str, buf);
+    g_string_append_len(r, buf, l);
+  }
+  return g_string_free(r, FALSE);
+}
+
+
+void str_matcher_free(str_matcher_t *m) {
+  if(!m)
+    return;
+  g_free(m->delta);
+  g_free(m->out);
+  g_slice_free(str_matcher_t, m);
+}
+
+
+// Returns the bit mask of the patterns found in str.
+guint64 str_matcher_match(const str_matcher_t *m, const char *str) {
+  guint64 r = m->empty;
+  int st = 0;
+  char buf[8];
+  while(*str && r != m->all) {
+    int i, l = str_matcher_lower(&str, buf);
+    for(i=0; i<l; i++) {
+      st = m->delta[st*m->ncls + m->cls[(guchar)buf[i]]];
+      r |= m->out[st];
+    }
+  }
+  return r;
+}
+
+
 // Parses a size string. ('<num>[GMK](iB)?'). Returns G_MAXUINT64 on error.
 guint64 str_parsesize(const char *str) {
   char *e = NULL;
@@ -258,6 +258,131 @@ void tiger_final(tiger_ctx_t *ctx, char result[24]) {
 
 
 
+/* Multi-lane leaf hashing. The leaves of a TTH tree can be hashed
+ * independently, so instead of running one block after the other through
+ * tiger_process_block(), we interleave the rounds of several leaves. Each
+ * round is bound by the latency of its S-box lookups, and running the lookups
+ * of independent lanes side by side lets the CPU keep more of them in flight.
+ * (SIMD gathers have been considered, but are not faster than plain scalar
+ * loads for 64-bit wide tables on current CPUs)
+ *
+ * Every leaf is tiger(0x00 | data[1024]), which is 17 blocks: 16 blocks of
+ * data shifted by one byte, and a final block with the last data byte, the
+ * padding and the message length. */
+
+#define TIGER_LANES 8
+
+#define tiger_lane_round(a,b,c,x,mul) \
+  for(l=0; l<TIGER_LANES; l++) { round(a[l],b[l],c[l],x[l],mul) }
+
+#define tiger_lane_pass(a,b,c,mul) \
+  tiger_lane_round(a,b,c,x0,mul) \
+  tiger_lane_round(b,c,a,x1,mul) \
+  tiger_lane_round(c,a,b,x2,mul) \
+  tiger_lane_round(a,b,c,x3,mul) \
+  tiger_lane_round(b,c,a,x4,mul) \
+  tiger_lane_round(c,a,b,x5,mul) \
+  tiger_lane_round(a,b,c,x6,mul) \
+  tiger_lane_round(b,c,a,x7,mul)
+
+#define tiger_lane_key_schedule for(l=0; l<TIGER_LANES; l++) { \
+  x0[l] -= x7[l] ^ G_GUINT64_CONSTANT(0xA5A5A5A5A5A5A5A5); \
+  x1[l] ^= x0[l]; \
+  x2[l] += x1[l]; \
+  x3[l] -= x2[l] ^ ((~x1[l])<<19); \
+  x4[l] ^= x3[l]; \
+  x5[l] += x4[l]; \
+  x6[l] -= x5[l] ^ ((~x4[l])>>23); \
+  x7[l] ^= x6[l]; \
+  x0[l] += x7[l]; \
+  x1[l] -= x0[l] ^ ((~x7[l])<<19); \
+  x2[l] ^= x1[l]; \
+  x3[l] += x2[l]; \
+  x4[l] -= x3[l] ^ ((~x2[l])>>23); \
+  x5[l] ^= x4[l]; \
+  x6[l] += x5[l]; \
+  x7[l] -= x6[l] ^ G_GUINT64_CONSTANT(0x0123456789ABCDEF); \
+}
+
+
+static void tiger_process_lanes(guint64 state[3][TIGER_LANES], guint64 block[TIGER_LANES][8]) {
+  guint64 a[TIGER_LANES], b[TIGER_LANES], c[TIGER_LANES];
+  guint64 x0[TIGER_LANES], x1[TIGER_LANES], x2[TIGER_LANES], x3[TIGER_LANES];
+  guint64 x4[TIGER_LANES], x5[TIGER_LANES], x6[TIGER_LANES], x7[TIGER_LANES];
+  int l;
+
+  for(l=0; l<TIGER_LANES; l++) {
+    x0[l] = GUINT64_FROM_LE(block[l][0]); x1[l] = GUINT64_FROM_LE(block[l][1]);
+    x2[l] = GUINT64_FROM_LE(block[l][2]); x3[l] = GUINT64_FROM_LE(block[l][3]);
+    x4[l] = GUINT64_FROM_LE(block[l][4]); x5[l] = GUINT64_FROM_LE(block[l][5]);
+    x6[l] = GUINT64_FROM_LE(block[l][6]); x7[l] = GUINT64_FROM_LE(block[l][7]);
+    a[l] = state[0][l];
+    b[l] = state[1][l];
+    c[l] = state[2][l];
+  }
+
+  tiger_lane_pass(a, b, c, 5);
+  tiger_lane_key_schedule;
+  tiger_lane_pass(c, a, b, 7);
+  tiger_lane_key_schedule;
+  tiger_lane_pass(b, c, a, 9);
+
+  for(l=0; l<TIGER_LANES; l++) {
+    state[0][l] = a[l] ^ state[0][l];
+    state[1][l] = b[l] - state[1][l];
+    state[2][l] = c[l] + state[2][l];
+  }
+}
+
+
+// Hashes TIGER_LANES consecutive leaves of tth_base_block bytes from msg
+// and writes the TIGER_LANES*24 bytes of leaf hashes to res.
+static void tiger_leaf_lanes(const char *msg, char *res) {
+  guint64 state[3][TIGER_LANES];
+  guint64 block[TIGER_LANES][8];
+  int i, l;
+
+  for(l=0; l<TIGER_LANES; l++) {
+    state[0][l] = G_GUINT64_CONSTANT(0x0123456789ABCDEF);
+    state[1][l] = G_GUINT64_CONSTANT(0xFEDCBA9876543210);
+    state[2][l] = G_GUINT64_CONSTANT(0xF096A5B4C3B2E187);
+  }
+
+  for(i=0; i<=1024/tiger_block_size; i++) {
+    for(l=0; l<TIGER_LANES; l++) {
+      const char *leaf = msg + l*1024;
+      char *blk = (char *)block[l];
+      if(i == 0) {
+        blk[0] = 0;
+        memcpy(blk+1, leaf, tiger_block_size-1);
+      } else if(i < 1024/tiger_block_size)
+        memcpy(blk, leaf + i*tiger_block_size - 1, tiger_block_size);
+      else {
+        memset(blk, 0, tiger_block_size);
+        blk[0] = leaf[1023];
+        blk[1] = 0x01;
+        block[l][7] = GUINT64_TO_LE((guint64)1025 << 3);
+      }
+    }
+    tiger_process_lanes(state, block);
+  }
+
+  for(l=0; l<TIGER_LANES; l++) {
+    guint64 r[3] = {
+      GUINT64_TO_LE(state[0][l]),
+      GUINT64_TO_LE(state[1][l]),
+      GUINT64_TO_LE(state[2][l])
+    };
+    memcpy(res + l*24, r, 24);
+  }
+}
+
+#undef tiger_lane_round
+#undef tiger_lane_pass
+#undef tiger_lane_key_schedule
+
+
+
 
 
 
@@ -333,12 +458,42 @@ void tth_update_leaf(tth_ctx_t *ctx, const char *leaf) {
 }
 
 
+// Hashes num consecutive leaves of tth_base_block bytes and writes the 24*num
+// bytes of leaf hashes to res.
+void tth_leaves(const char *msg, int num, char *res) {
+  for(; num >= TIGER_LANES; num -= TIGER_LANES) {
+    tiger_leaf_lanes(msg, res);
+    msg += TIGER_LANES*tth_base_block;
+    res += TIGER_LANES*24;
+  }
+  for(; num > 0; num--) {
+    tiger_ctx_t t;
+    tiger_init(&t);
+    tiger_update(&t, "\0", 1);
+    tiger_update(&t, msg, tth_base_block);
+    tiger_final(&t, res);
+    msg += tth_base_block;
+    res += 24;
+  }
+}
+
+
 void tth_update(tth_ctx_t *ctx, const char *msg, size_t len) {
-  char leaf[24];
-  int left;
+  char leaf[24*TIGER_LANES];
+  int left, i;
   if(len > 0)
     ctx->gotfirst = 1;
   while(len > 0) {
+    // We're at a leaf boundary and have enough data to hash several leaves
+    // at once.
+    if(ctx->tiger.length == 1 && len >= TIGER_LANES*tth_base_block) {
+      tth_leaves(msg, TIGER_LANES, leaf);
+      for(i=0; i<TIGER_LANES; i++)
+        tth_update_leaf(ctx, leaf+24*i);
+      len -= TIGER_LANES*tth_base_block;
+      msg += TIGER_LANES*tth_base_block;
+      continue;
+    }
     left = MIN(tth_base_block - (ctx->tiger.length-1), len);
     tiger_update(&ctx->tiger, msg, left);
     len -= left;
@@ -79,6 +79,9 @@ struct ui_cursor_t {
 
 #define UIC(n) (ui_colors[(ui_coltype)UIC_##n].a)
 
+// Index into ui_colors, for when the attribute is looked up at a later time.
+#define UICN(n) ((ui_coltype)UIC_##n)
+
 #endif // INTERFACE
 
 
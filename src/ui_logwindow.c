@@ -38,11 +38,25 @@
 
 #define LOGWIN_BUF 1023 // must be 2^x-1
 
+// A line in the log window. The wrapping points and colors of a line are
+// calculated when it is first drawn, and are kept until the width of the
+// window changes or ui_logwindow_invalidate() is called.
+struct ui_logwindow_line_t {
+  char *str;
+  int *layout; // rows[rmask+2], colors_sep[cmask+2], colors[cmask+1] (ui_coltype)
+  int cols;    // width the layout has been calculated for
+  int gen;     // ui_logwindow_gen at the time the layout was calculated
+  int indent;
+  int ind_row;
+  int rmask;
+  int cmask;
+};
+
 struct ui_logwindow_t {
   int lastlog;
   int lastvis;
   logfile_t *logfile;
-  char *buf[LOGWIN_BUF+1];
+  ui_logwindow_line_t buf[LOGWIN_BUF+1];
   gboolean updated;
   int (*checkchat)(void *, char *, char *);
   void *handle;
@@ -51,6 +65,25 @@ struct ui_logwindow_t {
 #endif
 
 
+// Incremented to invalidate the cached layouts of all lines.
+static int ui_logwindow_gen = 0;
+
+
+static void ui_logwindow_line_free(ui_logwindow_line_t *l) {
+  g_free(l->str);
+  g_free(l->layout);
+  l->str = NULL;
+  l->layout = NULL;
+}
+
+
+// Should be called when the return value of a checkchat() function may have
+// changed, e.g. when our nick has been changed.
+void ui_logwindow_invalidate() {
+  ui_logwindow_gen++;
+}
+
+
 void ui_logwindow_addline(ui_logwindow_t *lw, const char *msg, gboolean raw, gboolean nolog) {
   if(lw->lastlog == lw->lastvis)
     lw->lastvis = lw->lastlog + 1;
@@ -72,7 +105,9 @@ void ui_logwindow_addline(ui_logwindow_t *lw, const char *msg, gboolean raw, gbo
   }
 
   char *ts = localtime_fmt("%H:%M:%S ");
-  lw->buf[lw->lastlog & LOGWIN_BUF] = raw ? g_strdup(msgl) : g_strconcat(ts, msgl, NULL);
+  ui_logwindow_line_t *l = lw->buf + (lw->lastlog & LOGWIN_BUF);
+  ui_logwindow_line_free(l);
+  l->str = raw ? g_strdup(msgl) : g_strconcat(ts, msgl, NULL);
   g_free(ts);
 
   if(msgbuf)
@@ -81,11 +116,7 @@ void ui_logwindow_addline(ui_logwindow_t *lw, const char *msg, gboolean raw, gbo
   if(!nolog && lw->logfile)
     logfile_add(lw->logfile, msg);
 
-  int next = (lw->lastlog + 1) & LOGWIN_BUF;
-  if(lw->buf[next]) {
-    g_free(lw->buf[next]);
-    lw->buf[next] = NULL;
-  }
+  ui_logwindow_line_free(lw->buf + ((lw->lastlog + 1) & LOGWIN_BUF));
 }
 
 
@@ -187,10 +218,8 @@ void ui_logwindow_add(ui_logwindow_t *lw, const char *msg) {
 
 void ui_logwindow_clear(ui_logwindow_t *lw) {
   int i;
-  for(i=0; i<=LOGWIN_BUF; i++) {
-    g_free(lw->buf[i]);
-    lw->buf[i] = NULL;
-  }
+  for(i=0; i<=LOGWIN_BUF; i++)
+    ui_logwindow_line_free(lw->buf+i);
   lw->lastlog = lw->lastvis = 0;
 }
 
@@ -263,8 +292,9 @@ static int ui_logwindow_calc_wrap(char *str, int cols, int indent, int *rows, in
 }
 
 
-// Determines the colors each part of a log line should have. Returns the
-// highest index to the attr array.
+// Determines the colors each part of a log line should have. The colors are
+// stored as ui_coltype, so that the cached layout remains valid when the color
+// settings are changed. Returns the highest index to the attr array.
 static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int *attr) {
   sep[0] = 0;
   int mask = 0;
@@ -274,7 +304,7 @@ static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int
   int t_f = from;\
   if(sep[mask] != t_f) {\
     sep[mask+1] = t_f;\
-    attr[mask] = UIC(log_default);\
+    attr[mask] = UICN(log_default);\
     mask++;\
   }\
   sep[mask] = t_f;\
@@ -287,7 +317,7 @@ static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int
   if(msg && msg-str != 8) // Make sure it's not "Day changed to ..", which doesn't have the time prefix
     msg = NULL;
   if(msg) {
-    addm(0, msg-str, UIC(log_time));
+    addm(0, msg-str, UICN(log_time));
     msg++;
   }
 
@@ -304,28 +334,29 @@ static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int
     int r = lw->checkchat ? lw->checkchat(lw->handle, str+nickstart, str+nickend+1) : 0;
     tmp[0] = old;
     // and use the correct color
-    addm(nickstart, nickend, r == 2 ? UIC(log_ownnick) : r == 1 ? UIC(log_highlight) : UIC(log_nick));
+    addm(nickstart, nickend, r == 2 ? UICN(log_ownnick) : r == 1 ? UICN(log_highlight) : UICN(log_nick));
   }
 
   // join/quits (--> and --<)
   if(msg && msg[0] == '-' && msg[1] == '-' && (msg[2] == '>' || msg[2] == '<')) {
-    addm(msg-str, strlen(str), msg[2] == '>' ? UIC(log_join) : UIC(log_quit));
+    addm(msg-str, strlen(str), msg[2] == '>' ? UICN(log_join) : UICN(log_quit));
   }
 
 #undef addm
   // make sure the last mask is correct and return
   if(sep[mask+1] != strlen(str)) {
     sep[mask+1] = strlen(str);
-    attr[mask] = UIC(log_default);
+    attr[mask] = UICN(log_default);
   }
   return mask;
 }
 
 
-// Draws a line between x and x+cols on row y (continuing on y-1 .. y-(rows+1) for
-// multiple rows). Returns the actual number of rows written to.
-static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, int cols, char *str) {
-  g_return_val_if_fail(nrows > 0, 1);
+// (Re)calculates the layout of a line for the given width, if necessary.
+static void ui_logwindow_layout(ui_logwindow_t *lw, ui_logwindow_line_t *l, int cols) {
+  if(l->layout && l->cols == cols && l->gen == ui_logwindow_gen)
+    return;
+  char *str = l->str;
 
   // Determine the indentation for multi-line rows. This is:
   // - Always after the time part (hh:mm:ss )
@@ -357,9 +388,38 @@ static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, in
 
   // Determine the colors to give each part
   static int colors_sep[10]; // Mask, similar to the rows array
-  static int colors[10];     // Color attribute for each mask
+  static int colors[10];     // Color for each mask
   int cmask = ui_logwindow_calc_color(lw, str, colors_sep, colors);
 
+  g_free(l->layout);
+  l->layout = g_new(int, (rmask+2) + (cmask+2) + (cmask+1));
+  memcpy(l->layout, rows, (rmask+2)*sizeof(int));
+  memcpy(l->layout+rmask+2, colors_sep, (cmask+2)*sizeof(int));
+  memcpy(l->layout+rmask+2+cmask+2, colors, (cmask+1)*sizeof(int));
+  l->cols = cols;
+  l->gen = ui_logwindow_gen;
+  l->indent = indent;
+  l->ind_row = ind_row;
+  l->rmask = rmask;
+  l->cmask = cmask;
+}
+
+
+// Draws a line between x and x+cols on row y (continuing on y-1 .. y-(rows+1) for
+// multiple rows). Returns the actual number of rows written to.
+static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, int cols, ui_logwindow_line_t *l) {
+  g_return_val_if_fail(nrows > 0, 1);
+
+  ui_logwindow_layout(lw, l, cols);
+  char *str = l->str;
+  int indent = l->indent;
+  int ind_row = l->ind_row;
+  int rmask = l->rmask;
+  int cmask = l->cmask;
+  int *rows = l->layout;
+  int *colors_sep = rows+rmask+2;
+  int *colors = colors_sep+cmask+2;
+
   // print the rows
   int r = 0, c = 0, lr = 0;
   if(rmask-r < nrows)
@@ -379,9 +439,9 @@ static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, in
       lr = r;
 
     if(start != end && rmask-r < nrows) {
-      attron(colors[c]);
+      attron(ui_colors[colors[c]].a);
       addnstr(str+start, end-start);
-      attroff(colors[c]);
+      attroff(ui_colors[colors[c]].a);
     }
 
     if(rend <= cend) {
@@ -403,10 +463,10 @@ void ui_logwindow_draw(ui_logwindow_t *lw, int y, int x, int rows, int cols) {
   lw->updated = FALSE;
 
   while(top >= y) {
-    char *str = lw->buf[cur & LOGWIN_BUF];
-    if(!str)
+    ui_logwindow_line_t *l = lw->buf + (cur & LOGWIN_BUF);
+    if(!l->str)
       break;
-    top -= ui_logwindow_drawline(lw, top, x, top-y+1, cols, str);
+    top -= ui_logwindow_drawline(lw, top, x, top-y+1, cols, l);
     cur = (cur-1) & LOGWIN_BUF;
   }
 }
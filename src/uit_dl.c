@@ -227,6 +227,9 @@ static void t_draw(ui_tab_t *tab) {
     mvprintw(bottom, 0, hash);
   } else
     mvaddstr(bottom, 0, "Nothing selected.");
+  int jfiles, jpct;
+  if(dl_queue_fl_progress(&jfiles, &jpct))
+    mvprintw(bottom, 41, "Queueing: %d files (%d%%)", jfiles, jpct);
   mvprintw(bottom, wincols-19, "%5d files - %3d%%", g_hash_table_size(dl_queue), pos);
   attroff(UIC(separator));
 
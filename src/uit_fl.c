@@ -108,9 +108,7 @@ static void matchqueue(tab_t *t, fl_list_t *root) {
     while(root->parent)
       root = root->parent;
   }
-  int a = 0;
-  int n = dl_queue_match_fl(t->uid, root, &a);
-  ui_mf(NULL, 0, "Matched %d files, %d new.", n, a);
+  dl_queue_match_fl(t->uid, root, FALSE, NULL);
   t->needmatch = FALSE;
 }
 
@@ -128,7 +126,7 @@ static void dosel(tab_t *t, fl_list_t *fl, const char *sel) {
 
 
 // Callback function for use in uit_fl_queue() - not associated with any tab.
-// Will just match the list against the queue and free it.
+// Will just pass the list on to the queue for matching.
 static void loadmatch(fl_list_t *fl, GError *err, void *dat) {
   guint64 uid = *(guint64 *)dat;
   g_free(dat);
@@ -140,12 +138,8 @@ static void loadmatch(fl_list_t *fl, GError *err, void *dat) {
   if(err) {
     ui_mf(uit_main_tab, 0, "Error opening file list of %s for matching: %s", user, err->message);
     g_error_free(err);
-  } else {
-    int a = 0;
-    int n = dl_queue_match_fl(uid, fl, &a);
-    ui_mf(NULL, 0, "Matched queue for %s: %d files, %d new.", user, n, a);
-    fl_list_free(fl);
-  }
+  } else
+    dl_queue_match_fl(uid, fl, TRUE, user);
   g_free(user);
 }
 
@@ -212,7 +206,7 @@ void uit_fl_queue(guint64 uid, gboolean force, const char *sel, ui_tab_t *parent
       if(match)
         matchqueue((tab_t *)tab, NULL);
     } else if(match)
-      fl_load_async(fn, loadmatch, g_memdup(&uid, 8));
+      fl_load_async(fn, FALSE, loadmatch, g_memdup(&uid, 8));
   } else {
     g_return_if_fail(u); // the caller should have checked this
     dl_queue_addlist(u, sel, parent, open, match);
@@ -276,7 +270,7 @@ ui_tab_t *uit_fl_create(guint64 uid, const char *sel) {
     struct stat st;
     if(stat(fn, &st) >= 0)
       t->age = st.st_mtime;
-    fl_load_async(fn, loaddone, t);
+    fl_load_async(fn, FALSE, loaddone, t);
     g_free(tmp);
     g_free(fn);
     ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
@@ -458,7 +452,7 @@ static void t_key(ui_tab_t *tab, guint64 key) {
       g_return_if_fail(!sel->isfile || sel->hastth);
       char *excl = var_get(0, VAR_download_exclude);
       GRegex *r = excl ? g_regex_new(excl, 0, 0, NULL) : NULL;
-      dl_queue_add_fl(t->uid, sel, NULL, r);
+      dl_queue_add_fl(t->uid, sel, r);
       if(r)
         g_regex_unref(r);
     }
@@ -223,6 +223,7 @@ void uit_hub_setnick(ui_tab_t *tab) {
   t->highlight = g_regex_new(pattern, G_REGEX_CASELESS|G_REGEX_OPTIMIZE, 0, NULL);
   g_free(name);
   g_free(pattern);
+  ui_logwindow_invalidate();
 }
 
 
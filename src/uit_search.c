@@ -40,9 +40,32 @@ typedef struct tab_t {
   int order;
   gboolean reverse : 1;
   gboolean hide_hub : 1;
+  // Result store, see result()
+  GHashTable *dedup;
+  GSequence *rank;
+  GSequence *pending;
+  guint64 mem;
+  guint64 memmax;
+  int lastid;
 } tab_t;
 
 
+// A search result in a tab. The file name is owned by the result, so that its
+// memory is released when the result is evicted. The result is in either
+// t->pending or t->list->list.
+typedef struct res_t {
+  search_r_t r;
+  GSequenceIter *iter;
+  GSequenceIter *rank;
+  int id;
+  gboolean inlist : 1;
+} res_t;
+
+// Estimated memory usage of a result, including the overhead of the
+// sequences and the hash table.
+#define RES_MEM(r) (sizeof(res_t) + 112 + strlen((r)->file) + 1)
+
+
 // Columns to sort on
 #define SORT_USER  0
 #define SORT_SIZE  1
@@ -113,12 +136,96 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
 }
 
 
+// Results are identified by user, path and size. The same result is often
+// received more than once, e.g. over both TCP and UDP.
+static guint res_hash(gconstpointer dat) {
+  const search_r_t *r = dat;
+  return g_int64_hash(&r->uid) ^ g_str_hash(r->file) ^ (guint)r->size;
+}
+
+
+static gboolean res_equal(gconstpointer da, gconstpointer db) {
+  const search_r_t *a = da;
+  const search_r_t *b = db;
+  return a->uid == b->uid && a->size == b->size && strcmp(a->file, b->file) == 0;
+}
+
+
+// Eviction order: the results with the least free slots go first, ties are
+// broken by removing the most recently received result.
+static gint res_rank_cmp(gconstpointer da, gconstpointer db, gpointer dat) {
+  const res_t *a = da;
+  const res_t *b = db;
+  return a->r.slots != b->r.slots ? (a->r.slots < b->r.slots ? -1 : 1) : b->id - a->id;
+}
+
+
+static void res_free(gpointer dat) {
+  res_t *r = dat;
+  g_free(r->r.file);
+  g_slice_free(res_t, r);
+}
+
+
+static void res_remove(tab_t *t, res_t *r) {
+  g_hash_table_remove(t->dedup, r);
+  g_sequence_remove(r->rank);
+  t->mem -= RES_MEM(&r->r);
+  if(r->inlist)
+    ui_listing_remove(t->list, r->iter);
+  g_sequence_remove(r->iter);
+}
+
+
+// Moves the pending results into the (sorted) list. Called before the list is
+// used, so that the results don't have to be sorted as they come in. If a
+// large number of results is pending, it is faster to sort the entire list
+// in one go.
+static void res_flush(tab_t *t) {
+  int n = g_sequence_get_length(t->pending);
+  if(!n)
+    return;
+  gboolean bulk = n >= 64 && n*4 >= g_sequence_get_length(t->list->list);
+  GSequenceIter *end = g_sequence_get_end_iter(t->list->list);
+  while(n--) {
+    GSequenceIter *i = g_sequence_get_begin_iter(t->pending);
+    res_t *r = g_sequence_get(i);
+    g_sequence_move(i, bulk ? end : g_sequence_search(t->list->list, r, sort_func, t));
+    r->inlist = TRUE;
+  }
+  if(bulk)
+    g_sequence_sort(t->list->list, sort_func, t);
+  ui_listing_inserted(t->list);
+  ui_listing_sorted(t->list);
+}
+
+
 // Callback from search.c when we have a new result.
-static void result(search_r_t *r, void *dat) {
+static void result(search_r_t *in, void *dat) {
   tab_t *t = dat;
-  g_sequence_insert_sorted(t->list->list, search_r_copy(r), sort_func, t);
-  ui_listing_inserted(t->list);
-  ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
+  if(g_hash_table_lookup(t->dedup, in))
+    return;
+
+  res_t *r = g_slice_new0(res_t);
+  r->r = *in;
+  r->r.file = g_strdup(in->file);
+  r->id = ++t->lastid;
+  g_hash_table_insert(t->dedup, r, r);
+  r->rank = g_sequence_insert_sorted(t->rank, r, res_rank_cmp, NULL);
+  r->iter = g_sequence_append(t->pending, r);
+  t->mem += RES_MEM(&r->r);
+
+  // Remove the lowest-ranked results when the memory limit has been reached.
+  // This may well be the result we have just added.
+  gboolean added = TRUE;
+  while(t->memmax && t->mem > t->memmax) {
+    res_t *e = g_sequence_get(g_sequence_get_begin_iter(t->rank));
+    if(e == r)
+      added = FALSE;
+    res_remove(t, e);
+  }
+  if(added)
+    ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
 }
 
 
@@ -128,6 +235,17 @@ static const char *search_r_get_file(GSequenceIter *iter) {
 }
 
 
+static void t_free(tab_t *t) {
+  g_hash_table_unref(t->dedup);
+  g_sequence_free(t->rank);
+  g_sequence_free(t->pending);
+  g_sequence_free(t->list->list);
+  ui_listing_free(t->list);
+  g_free(t->hubname);
+  g_free(t);
+}
+
+
 // Performs a search and opens a new tab for the results.
 // May return NULL on error, behaves similarly to search_add() w.r.t *err.
 // Ownership of q is passed to the tab, and will be freed on error or close.
@@ -140,11 +258,17 @@ ui_tab_t *uit_search_create(hub_t *hub, search_q_t *q, GError **err) {
   t->order = SORT_FILE;
   time(&t->age);
 
+  t->list = ui_listing_create(g_sequence_new(res_free), NULL, t, search_r_get_file);
+  t->dedup = g_hash_table_new(res_hash, res_equal);
+  t->rank = g_sequence_new(NULL);
+  t->pending = g_sequence_new(res_free);
+  t->memmax = var_get_int64(0, VAR_search_memory);
+
   // Do the search
   q->cb_dat = t;
   q->cb = result;
   if(!search_add(hub, q, err)) {
-    g_free(t);
+    t_free(t);
     return NULL;
   }
 
@@ -163,7 +287,6 @@ ui_tab_t *uit_search_create(hub_t *hub, search_q_t *q, GError **err) {
   while(t->tab.name[strlen(t->tab.name)-1] == ' ')
     t->tab.name[strlen(t->tab.name)-1] = 0;
 
-  t->list = ui_listing_create(g_sequence_new(search_r_free), NULL, t, search_r_get_file);
   return (ui_tab_t *)t;
 }
 
@@ -171,12 +294,9 @@ ui_tab_t *uit_search_create(hub_t *hub, search_q_t *q, GError **err) {
 static void t_close(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
   search_remove(t->q);
-  g_sequence_free(t->list->list);
-  ui_listing_free(t->list);
   ui_tab_remove(tab);
-  g_free(t->hubname);
   g_free(t->tab.name);
-  g_free(t);
+  t_free(t);
 }
 
 
@@ -235,6 +355,7 @@ static void draw_row(ui_listing_t *list, GSequenceIter *iter, int row, void *dat
 
 static void t_draw(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
+  res_flush(t);
 
   attron(UIC(list_header));
   mvhline(1, 0, ' ', wincols);
@@ -278,6 +399,7 @@ static void t_draw(ui_tab_t *tab) {
 
 static void t_key(ui_tab_t *tab, guint64 key) {
   tab_t *t = (tab_t *)tab;
+  res_flush(t);
 
   if(ui_listing_key(t->list, key, (winrows-4)/2))
     return;
@@ -44,6 +44,7 @@ typedef struct tab_t {
   gboolean hide_conn : 1;
   gboolean hide_ip : 1;
   int cw_user, cw_country, cw_share, cw_conn, cw_desc, cw_mail, cw_tag, cw_ip;
+  GHashTable *pending; // users that have to be (re-)inserted into the list, see userlist_flush()
 } tab_t;
 
 
@@ -58,10 +59,16 @@ typedef struct tab_t {
 #define SORT_IP     6
 
 
-static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
-  const hub_user_t *a = da;
-  const hub_user_t *b = db;
-  tab_t *t = dat;
+// Collation keys, for sorting a large number of users in one go.
+typedef struct sort_key_t {
+  hub_user_t *u;
+  char *name;
+  char *col;
+} sort_key_t;
+
+
+// ka and kb are optional, g_utf8_collate() is used if they're not given.
+static gint sort_cmp(tab_t *t, const hub_user_t *a, const hub_user_t *b, const sort_key_t *ka, const sort_key_t *kb) {
   int p = t->order;
 
   if(t->opfirst && !a->isop != !b->isop)
@@ -71,14 +78,16 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
   int o = p == SORT_USER ? 0 :
     p == SORT_SHARE  ? a->sharesize > b->sharesize ? 1 : -1:
     p == SORT_CONN   ? (t->tab.hub->adc ? a->conn - b->conn : strcmp(a->conn?a->conn:"", b->conn?b->conn:"")) :
+    p == SORT_DESC && ka ? strcmp(ka->col, kb->col) :
     p == SORT_DESC   ? g_utf8_collate(a->desc?a->desc:"", b->desc?b->desc:"") :
+    p == SORT_MAIL && ka ? strcmp(ka->col, kb->col) :
     p == SORT_MAIL   ? g_utf8_collate(a->mail?a->mail:"", b->mail?b->mail:"") :
     p == SORT_CLIENT ? strcmp(a->client?a->client:"", b->client?b->client:"")
                      : (ip4_cmp(a->ip4, b->ip4) != 0 ? ip4_cmp(a->ip4, b->ip4) : ip6_cmp(a->ip6, b->ip6));
 
   // Username sort
   if(!o)
-    o = g_utf8_collate(a->name, b->name);
+    o = ka ? strcmp(ka->name, kb->name) : g_utf8_collate(a->name, b->name);
   if(!o && a->name_hub && b->name_hub)
     o = strcmp(a->name_hub, b->name_hub);
   if(!o)
@@ -87,6 +96,100 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
 }
 
 
+static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
+  return sort_cmp(dat, da, db, NULL, NULL);
+}
+
+
+static gint sort_key_func(gconstpointer da, gconstpointer db, gpointer dat) {
+  const sort_key_t *a = da;
+  const sort_key_t *b = db;
+  return sort_cmp(dat, a->u, b->u, a, b);
+}
+
+
+// Sorts the entire list. Rather than letting g_sequence_sort() call
+// g_utf8_collate() O(n log n) times, the collation keys are generated once
+// for each user. The items are moved around within the sequence, so any
+// iterators remain valid.
+static void sort_all(tab_t *t) {
+  GSequence *l = t->list->list;
+  int i, n = g_sequence_get_length(l);
+  sort_key_t *k = g_new(sort_key_t, n);
+  GSequenceIter *iter = g_sequence_get_begin_iter(l);
+  for(i=0; i<n; i++) {
+    hub_user_t *u = g_sequence_get(iter);
+    k[i].u = u;
+    k[i].name = g_utf8_collate_key(u->name, -1);
+    k[i].col =
+      t->order == SORT_DESC ? g_utf8_collate_key(u->desc?u->desc:"", -1) :
+      t->order == SORT_MAIL ? g_utf8_collate_key(u->mail?u->mail:"", -1) : NULL;
+    iter = g_sequence_iter_next(iter);
+  }
+
+  g_qsort_with_data(k, n, sizeof(sort_key_t), sort_key_func, t);
+
+  GSequenceIter *end = g_sequence_get_end_iter(l);
+  for(i=0; i<n; i++) {
+    g_sequence_move(k[i].u->iter, end);
+    g_free(k[i].name);
+    g_free(k[i].col);
+  }
+  g_free(k);
+  ui_listing_sorted(t->list);
+}
+
+
+// Joins and info changes are not applied to the list right away, as a hub
+// may send thousands of them in a short time. Instead, the users are queued
+// in t->pending and this function is called before the list is used. Users
+// that have just joined are not in the list yet, and have u->iter = NULL.
+// When a large part of the list has changed, it is cheaper to sort the entire
+// list in one go than to insert the users one by one.
+// Otherwise, the changed users are first moved out of the list, as
+// g_sequence_search() and friends require the rest of the list to be sorted.
+// Moving (rather than removing) keeps their iters valid for the listing.
+static void userlist_flush(tab_t *t) {
+  int n = g_hash_table_size(t->pending);
+  if(!n)
+    return;
+
+  GHashTableIter iter;
+  hub_user_t *u;
+  gboolean bulk = n >= 64 && n*8 >= g_sequence_get_length(t->list->list);
+  GSequence *changed = NULL;
+  if(!bulk) {
+    changed = g_sequence_new(NULL);
+    GSequenceIter *end = g_sequence_get_end_iter(changed);
+    g_hash_table_iter_init(&iter, t->pending);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&u))
+      if(u->iter)
+        g_sequence_move(u->iter, end);
+  }
+
+  g_hash_table_iter_init(&iter, t->pending);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&u)) {
+    if(bulk) {
+      if(!u->iter)
+        u->iter = g_sequence_append(t->list->list, u);
+    } else if(!u->iter) {
+      u->iter = g_sequence_insert_sorted(t->list->list, u, sort_func, t);
+      ui_listing_inserted(t->list);
+    } else
+      g_sequence_move(u->iter, g_sequence_search(t->list->list, u, sort_func, t));
+  }
+  g_hash_table_remove_all(t->pending);
+  if(changed)
+    g_sequence_free(changed);
+
+  if(bulk) {
+    ui_listing_inserted(t->list);
+    sort_all(t);
+  } else
+    ui_listing_sorted(t->list);
+}
+
+
 static const char *get_name(GSequenceIter *iter) {
   hub_user_t *u = g_sequence_get(iter);
   return u->name;
@@ -104,18 +207,16 @@ ui_tab_t *uit_userlist_create(hub_t *hub) {
   t->hide_mail = TRUE;
   t->hide_ip = TRUE;
 
-  GSequence *users = g_sequence_new(NULL);
   // populate the list
-  // g_sequence_sort() uses insertion sort? in that case it is faster to insert
-  // all items using g_sequence_insert_sorted() rather than inserting them in
-  // no particular order and then sorting them in one go. (which is faster for
-  // linked lists, since it uses a faster sorting algorithm)
+  GSequence *users = g_sequence_new(NULL);
   GHashTableIter iter;
   g_hash_table_iter_init(&iter, hub->users);
   hub_user_t *u;
   while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&u))
-    u->iter = g_sequence_insert_sorted(users, u, sort_func, t);
+    u->iter = g_sequence_append(users, u);
   t->list = ui_listing_create(users, NULL, t, get_name);
+  t->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+  sort_all(t);
 
   return (ui_tab_t *)t;
 }
@@ -130,6 +231,7 @@ static void t_close(ui_tab_t *tab) {
   // get reset in a subsequent ui_userlist_create().
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
+  g_hash_table_unref(t->pending);
   g_free(t->tab.name);
   g_free(t);
 }
@@ -251,6 +353,7 @@ static void calc_widths(tab_t *t) {
 static void t_draw(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
 
+  userlist_flush(t);
   calc_widths(t);
 
   // header
@@ -321,6 +424,7 @@ static void t_draw(ui_tab_t *tab) {
 
 static void t_key(ui_tab_t *tab, guint64 key) {
   tab_t *t = (tab_t *)tab;
+  userlist_flush(t);
 
   if(ui_listing_key(t->list, key, winrows/2))
     return;
@@ -418,8 +522,7 @@ static void t_key(ui_tab_t *tab, guint64 key) {
   }
 
   if(sort) {
-    g_sequence_sort(t->list->list, sort_func, tab);
-    ui_listing_sorted(t->list);
+    sort_all(t);
     ui_mf(NULL, 0, "Ordering by %s (%s%s)",
         t->order == SORT_USER  ? "user name" :
         t->order == SORT_SHARE ? "share size" :
@@ -439,25 +542,28 @@ void uit_userlist_disconnect(ui_tab_t *tab) {
 
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
+  g_hash_table_remove_all(t->pending);
   t->list = ui_listing_create(g_sequence_new(NULL), NULL, t, get_name);
 }
 
 
-// Called from the hub tab when something changes to the user list.
+// Called from the hub tab when something changes to the user list. Joins and
+// info changes are queued, see userlist_flush().
 void uit_userlist_userchange(ui_tab_t *tab, int change, hub_user_t *user) {
   tab_t *t = (tab_t *)tab;
 
   if(change == UIHUB_UC_JOIN) {
-    user->iter = g_sequence_insert_sorted(t->list->list, user, sort_func, t);
-    ui_listing_inserted(t->list);
+    user->iter = NULL;
+    g_hash_table_insert(t->pending, user, user);
   } else if(change == UIHUB_UC_QUIT) {
+    g_hash_table_remove(t->pending, user);
+    if(!user->iter)
+      return;
     g_return_if_fail(g_sequence_get(user->iter) == (gpointer)user);
     ui_listing_remove(t->list, user->iter);
     g_sequence_remove(user->iter);
-  } else {
-    g_sequence_sort_changed(user->iter, sort_func, t);
-    ui_listing_sorted(t->list);
-  }
+  } else
+    g_hash_table_insert(t->pending, user, user);
 }
 
 
@@ -482,6 +588,7 @@ gboolean uit_userlist_open(hub_t *hub, guint64 uid, const char *user, gboolean u
 
   if(u) {
     tab_t *t = (tab_t *)ut;
+    userlist_flush(t);
     // u->iter should be valid at this point.
     t->list->sel = u->iter;
     t->details = TRUE;
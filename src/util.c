@@ -317,20 +317,6 @@ path_suggest_f:
 
 
 
-// Reads from fd until EOF and returns the number of lines found. Starts
-// counting after the first '\n' if start is FALSE. Returns -1 on error.
-static int file_count_lines(int fd) {
-  char buf[1024];
-  int n = 0;
-  int r;
-  while((r = read(fd, buf, 1024)) > 0)
-    while(r--)
-      if(buf[r] == '\n')
-        n++;
-  return r == 0 ? MAX(0, n) : r;
-}
-
-
 // Skips 'skip' lines and reads n lines from fd.
 static char **file_read_lines(int fd, int skip, int n) {
   char buf[1024];
@@ -378,8 +364,8 @@ static char **file_read_lines(int fd, int skip, int n) {
 // Read the last n lines from a file and return them in a string array. The
 // file must end with a newline, and only \n is recognized as one.  Returns
 // NULL on error, with errno set. Can return an empty string array (result &&
-// !*result). This isn't the fastest implementation available, but at least it
-// does not have to read the entire file.
+// !*result). The file is scanned backwards from the end, so only the part
+// that is actually returned is read.
 char **file_tail(const char *fn, int n) {
   if(n <= 0)
     return g_new0(char *, 1);
@@ -388,34 +374,35 @@ char **file_tail(const char *fn, int n) {
   int fd = open(fn, O_RDONLY);
   if(fd < 0)
     return NULL;
-  int backbytes = n*128;
-  off_t offset;
-  while((offset = lseek(fd, -backbytes, SEEK_END)) != (off_t)-1) {
-    int lines = file_count_lines(fd);
-    if(lines < 0)
-      goto done;
-    // not enough lines, try seeking back further
-    if(offset > 0 && lines < n)
-      backbytes *= 2;
-    // otherwise, if we have enough lines seek again and fetch them
-    else if(lseek(fd, offset, SEEK_SET) == (off_t)-1)
-      goto done;
-    else {
-      ret = file_read_lines(fd, MAX(0, lines-n), MIN(lines+1, n));
+  off_t pos = lseek(fd, 0, SEEK_END);
+  if(pos == (off_t)-1)
+    goto done;
+
+  // Find the start of the n'th line from the end, i.e. the position after
+  // the (n+1)'th newline.
+  char buf[8192];
+  off_t start = 0;
+  int lines = 0;
+  while(pos > 0) {
+    int len = MIN((off_t)sizeof(buf), pos);
+    pos -= len;
+    int r = pread(fd, buf, len, pos);
+    if(r != len) {
+      if(r >= 0)
+        errno = EIO;
       goto done;
     }
+    while(len--)
+      if(buf[len] == '\n' && ++lines > n) {
+        start = pos+len+1;
+        break;
+      }
+    if(lines > n)
+      break;
   }
 
-  // offset is -1 if we reach this. we may have been seeking to a negative
-  // offset, so let's try from the beginning.
-  if(errno == EINVAL) {
-    if(lseek(fd, 0, SEEK_SET) == (off_t)-1)
-      goto done;
-    int lines = file_count_lines(fd);
-    if(lines < 0 || lseek(fd, 0, SEEK_SET) == (off_t)-1)
-      goto done;
-    ret = file_read_lines(fd, MAX(0, lines-n), MIN(lines+1, n));
-  }
+  if(lseek(fd, start, SEEK_SET) != (off_t)-1)
+    ret = file_read_lines(fd, 0, n);
 
 done:
   close(fd);
@@ -724,6 +711,7 @@ char *darray_get_dat(char *v, int *l) {
  *   ratecalc_register(&thing, class);
  * From any thread (usually some worker thread):
  *   ratecalc_add(&thing, bytes);
+ *   burst = ratecalc_burst(&thing);
  * From any other thread (usually main thread):
  *   rate = ratecalc_rate(&thing);
  * From main thread:
@@ -731,6 +719,19 @@ char *darray_get_dat(char *v, int *l) {
  *   ratecalc_unregister(&thing);
  *
  * ratecalc_calc() should be called with a one-second interval
+ *
+ * Rate limiting is done with token buckets, arranged in a hierarchy: every
+ * ratecalc_t has a parent, which is either explicitely set with
+ * ratecalc_setparent() or the global bucket of the class it has been
+ * registered with. Bytes added to a ratecalc_t are taken from the buckets of
+ * all its ancestors, and the burst available for a ratecalc_t is the minimum
+ * of what is left in those buckets. Buckets are refilled by ratecalc_calc(),
+ * which costs O(1) per bucket, regardless of the number of transfers sharing
+ * it. All counters are accessed with atomic operations, so the transfer
+ * threads never have to take a lock.
+ *
+ * Additional buckets (e.g. one per hub) can be created with
+ * ratecalc_bucket_new(). Their limit is read from a (hub-local) setting.
  */
 
 #if INTERFACE
@@ -743,148 +744,163 @@ char *darray_get_dat(char *v, int *l) {
 #define RCC_MAX  RCC_DOWN
 
 struct ratecalc_t {
-  GStaticMutex lock; // protects total, last, rate and burst
-  gint64 total;
-  gint64 last;
-  int burst;
-  int rate;
+  ratecalc_t *parent; // atomic, NULL to use the class bucket
+  int pending; // atomic, bytes added since the last ratecalc_calc()
+  int burst;   // atomic, bytes left in the bucket, only used if limit > 0
+  int limit;   // atomic, bytes per second, 0 = unlimited
+  int rate;    // atomic
+  gint64 total; // main thread only, excluding pending
   int reg; // 0 = not registered, >1 = registered with class #n
+  // For buckets created with ratecalc_bucket_new()
+  int var;
+  guint64 var_hub;
 };
 
 #define ratecalc_reset(rc) do {\
-    g_static_mutex_lock(&((rc)->lock));\
-    (rc)->total = (rc)->last = (rc)->rate = (rc)->burst = 0;\
-    g_static_mutex_unlock(&((rc)->lock));\
+    g_atomic_int_add(&((rc)->pending), -g_atomic_int_get(&((rc)->pending)));\
+    g_atomic_int_set(&((rc)->rate), 0);\
+    g_atomic_int_set(&((rc)->burst), 0);\
+    (rc)->total = 0;\
   } while(0)
 
 #define ratecalc_init(rc) do {\
-    g_static_mutex_init(&((rc)->lock));\
     ratecalc_unregister(rc);\
     ratecalc_reset(rc);\
+    g_atomic_pointer_set(&((rc)->parent), NULL);\
+    (rc)->limit = (rc)->var = 0;\
+    (rc)->var_hub = 0;\
   } while(0)
 
-// TODO: get some burst allocated upon registering? Otherwise a transfer will
-// block until _calc() has assigned some bandwidth to it...
 #define ratecalc_register(rc, n) do { if(!(rc)->reg) {\
     ratecalc_list = g_slist_prepend(ratecalc_list, rc);\
     (rc)->reg = n;\
   } } while(0)
 
-// TODO: give rc->burst back to the class? (in particular the negative ones)
 #define ratecalc_unregister(rc) do {\
     ratecalc_list = g_slist_remove(ratecalc_list, rc);\
-    (rc)->reg = (rc)->rate = (rc)->burst = 0;\
+    (rc)->reg = 0;\
+    g_atomic_int_set(&((rc)->rate), 0);\
   } while(0)
 
+// Sets the bucket that bytes are taken from, the bucket in turn takes them
+// from its own parent. NULL reverts to the class bucket. May be called while
+// the ratecalc_t is in use by another thread.
+#define ratecalc_setparent(rc, p) g_atomic_pointer_set(&((rc)->parent), p)
+
 #endif
 
 GSList *ratecalc_list = NULL;
 
+// The global bucket of each class, limited by the respective *_rate setting.
+static ratecalc_t ratecalc_classes[RCC_MAX+1];
+
+// Buckets created with ratecalc_bucket_new(), and those that have been
+// released but may still be referenced by a transfer thread.
+static GSList *ratecalc_buckets = NULL;
+static GSList *ratecalc_buckets_gone = NULL;
+
+
+static ratecalc_t *ratecalc_next(ratecalc_t *rc) {
+  ratecalc_t *p = g_atomic_pointer_get(&rc->parent);
+  if(p)
+    return p;
+  return rc->reg >= RCC_HASH && rc->reg <= RCC_MAX ? &ratecalc_classes[rc->reg] : NULL;
+}
+
 
 void ratecalc_add(ratecalc_t *rc, int b) {
-  g_static_mutex_lock(&rc->lock);
-  rc->total += b;
-  rc->burst -= b;
-  g_static_mutex_unlock(&rc->lock);
+  for(; rc; rc=ratecalc_next(rc)) {
+    g_atomic_int_add(&rc->pending, b);
+    if(g_atomic_int_get(&rc->limit))
+      g_atomic_int_add(&rc->burst, -b);
+  }
 }
 
 
 int ratecalc_rate(ratecalc_t *rc) {
-  g_static_mutex_lock(&rc->lock);
-  int r = rc->rate;
-  g_static_mutex_unlock(&rc->lock);
-  return r;
+  return g_atomic_int_get(&rc->rate);
 }
 
 
 int ratecalc_burst(ratecalc_t *rc) {
-  g_static_mutex_lock(&rc->lock);
-  int r = rc->burst;
-  g_static_mutex_unlock(&rc->lock);
+  int r = INT_MAX;
+  for(; rc; rc=ratecalc_next(rc))
+    if(g_atomic_int_get(&rc->limit))
+      r = MIN(r, g_atomic_int_get(&rc->burst));
   return r;
 }
 
 
+// Should only be called from the main thread.
 gint64 ratecalc_total(ratecalc_t *rc) {
-  g_static_mutex_lock(&rc->lock);
-  gint64 r = rc->total;
-  g_static_mutex_unlock(&rc->lock);
-  return r;
+  return rc->total + g_atomic_int_get(&rc->pending);
+}
+
+
+// Creates a bucket of the given class, its limit is taken from the setting
+// var of the given hub (or the global setting if hub = 0). Use
+// ratecalc_setparent() to let a transfer make use of it.
+ratecalc_t *ratecalc_bucket_new(int class, int var, guint64 hub) {
+  ratecalc_t *rc = g_slice_new0(ratecalc_t);
+  rc->reg = class;
+  rc->var = var;
+  rc->var_hub = hub;
+  ratecalc_buckets = g_slist_prepend(ratecalc_buckets, rc);
+  return rc;
+}
+
+
+// The bucket is not freed right away, as a transfer thread may still be
+// walking through the hierarchy. The caller must make sure that no ratecalc_t
+// uses this bucket as parent anymore.
+void ratecalc_bucket_free(ratecalc_t *rc) {
+  ratecalc_buckets = g_slist_remove(ratecalc_buckets, rc);
+  ratecalc_buckets_gone = g_slist_prepend(ratecalc_buckets_gone, rc);
+}
+
+
+// Updates rc->rate and rc->total, and refills the bucket if it's limited.
+static void ratecalc_update(ratecalc_t *rc, int limit) {
+  int diff = g_atomic_int_get(&rc->pending);
+  g_atomic_int_add(&rc->pending, -diff);
+  rc->total += diff;
+  int rate = g_atomic_int_get(&rc->rate);
+  g_atomic_int_set(&rc->rate, diff + ((rate - diff) / 2));
+
+  if(limit != g_atomic_int_get(&rc->limit))
+    g_atomic_int_set(&rc->limit, limit);
+  // Add one second worth of bytes, but don't let the bucket grow beyond
+  // that. Any bytes sent while the bucket was empty are paid back first.
+  if(limit) {
+    int burst = g_atomic_int_get(&rc->burst);
+    g_atomic_int_add(&rc->burst, MIN(limit, burst + limit) - burst);
+  }
 }
 
 
-// Calculates rc->rate and rc->burst.
+// Calculates the rates and refills the buckets.
 void ratecalc_calc() {
   GSList *n;
-  // Bytes allocated to each class
-  int maxburst[RCC_MAX+1] = {};
-  maxburst[RCC_HASH] = var_get_int(0, VAR_hash_rate);
-  maxburst[RCC_UP]   = var_get_int(0, VAR_upload_rate);
-  maxburst[RCC_DOWN] = var_get_int(0, VAR_download_rate);
-  int i;
-  for(i=0; i<=RCC_MAX; i++)
-    if(!maxburst[i])
-      maxburst[i] = INT_MAX;
-
-  int left[RCC_MAX+1]; // Number of bytes left to distribute
-  int nums[RCC_MAX+1] = {}; // Number of rc structs with burst < max
-  memcpy(left, maxburst, (RCC_MAX+1)*sizeof(int));
-
-  // Pass one: calculate rc->rate, substract negative burst values from left[] and calculate nums[].
-  for(n=ratecalc_list; n; n=n->next) {
-    ratecalc_t *rc = n->data;
-    g_static_mutex_lock(&rc->lock);
-    gint64 diff = rc->total - rc->last;
-    rc->rate = diff + ((rc->rate - diff) / 2);
-    rc->last = rc->total;
-    if(rc->burst < 0) {
-      int sub = MIN(left[rc->reg], -rc->burst);
-      left[rc->reg] -= sub;
-      rc->burst += sub;
-    }
-    if(rc->burst < maxburst[rc->reg])
-      nums[rc->reg]++;
-    else
-      rc->burst = maxburst[rc->reg];
-    g_static_mutex_unlock(&rc->lock);
-  }
 
-  //g_debug("Num: %d - %d - %d", nums[2], nums[3], nums[4]);
-
-  // Pass 2..i+1: distribute bandwidth from left[] among the ratecalc structures.
-  // (The i variable is to limit the number of passes, otherwise it easily gets into an infinite loop)
-  i = 3;
-  while(i--) {
-    int bwp[RCC_MAX+1] = {}; // average bandwidth-per-item
-    gboolean c = FALSE;
-    int j;
-    for(j=2; j<=RCC_MAX; j++) {
-      bwp[j] = nums[j] ? left[j]/nums[j] : 0;
-      if(bwp[j] > 0)
-        c = TRUE;
-    }
-    // If there's nothing to distribute, stop.
-    if(!c)
-      break;
-    // Loop through the ratecalc structs and assign it some BW
-    for(n=ratecalc_list; n; n=n->next) {
-      ratecalc_t *rc = n->data;
-      if(bwp[rc->reg] > 0) {
-        g_static_mutex_lock(&rc->lock);
-        int alloc = MIN(maxburst[rc->reg]-rc->burst, bwp[rc->reg]);
-        //g_debug("Allocing class %d(num=%d), %d new bytes to %d", rc->reg, nums[rc->reg], alloc, rc->burst);
-        rc->burst += alloc;
-        left[rc->reg] -= alloc;
-        g_static_mutex_unlock(&rc->lock);
-        if(alloc > 0 && alloc < bwp[rc->reg])
-          nums[rc->reg]--;
-      }
-    }
-    //g_debug("Left after #%d: %d - %d - %d", 3-i, left[2], left[3], left[4]);
+  // Buckets released in the previous round can't be in use anymore.
+  for(n=ratecalc_buckets_gone; n; n=n->next)
+    g_slice_free(ratecalc_t, n->data);
+  g_slist_free(ratecalc_buckets_gone);
+  ratecalc_buckets_gone = NULL;
+
+  ratecalc_update(&ratecalc_classes[RCC_HASH], var_get_int(0, VAR_hash_rate));
+  ratecalc_update(&ratecalc_classes[RCC_UP],   var_get_int(0, VAR_upload_rate));
+  ratecalc_update(&ratecalc_classes[RCC_DOWN], var_get_int(0, VAR_download_rate));
+
+  for(n=ratecalc_buckets; n; n=n->next) {
+    ratecalc_t *rc = n->data;
+    ratecalc_update(rc, var_get_int(rc->var_hub, rc->var));
   }
 
-  //g_debug("Left after distribution: %d - %d - %d", left[2], left[3], left[4]);
-  // TODO: distribute the last remaining BW on a first-find basis?
+  // Only the rates have to be updated for the registered objects, they don't
+  // have a bucket of their own.
+  for(n=ratecalc_list; n; n=n->next)
+    ratecalc_update(n->data, 0);
 }
 
 
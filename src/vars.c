@@ -406,6 +406,13 @@ static char *i_cid_pid() {
 }
 
 
+static gboolean s_cid(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  fl_local_cidchange();
+  return TRUE;
+}
+
+
 // color_*
 
 static char *p_color(const char *val, GError **err) {
@@ -623,6 +630,26 @@ static gboolean s_geoip_cc(guint64 hub, const char *key, const char *val, GError
 }
 
 
+// share_scan_threads
+
+static char *p_share_scan_threads(const char *val, GError **err) {
+  return p_int_range(val, 1, 64, "Number of scan threads must be between 1 and 64.", err);
+}
+
+
+// hash_threads
+
+static char *p_hash_threads(const char *val, GError **err) {
+  return p_int_range(val, 1, 64, "Number of hash threads must be between 1 and 64.", err);
+}
+
+static gboolean s_hash_threads(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  fl_hash_set_threads(var_get_int(0, VAR_hash_threads));
+  return TRUE;
+}
+
+
 // hubname
 
 static char *p_hubname(const char *val, GError **err) {
@@ -713,6 +740,22 @@ static gboolean s_password(guint64 hub, const char *key, const char *val, GError
 }
 
 
+// search_memory
+
+static char *f_search_memory(const char *var) {
+  return g_strdup(strcmp(var, "0") == 0 ? "0 (unlimited)" : str_formatsize(int_raw(var)));
+}
+
+static char *p_search_memory(const char *val, GError **err) {
+  guint64 size = str_parsesize(val);
+  if(size == G_MAXUINT64) {
+    g_set_error_literal(err, 1, 0, "Invalid size.");
+    return NULL;
+  }
+  return g_strdup_printf("%"G_GUINT64_FORMAT, size);
+}
+
+
 // sendfile
 
 static char *f_sendfile(const char *val) {
@@ -736,6 +779,27 @@ static char *p_sendfile(const char *val, GError **err) {
 }
 
 
+// share_watch
+
+static char *p_share_watch(const char *val, GError **err) {
+  char *r = p_bool(val, err);
+#ifndef HAVE_INOTIFY_INIT1
+  if(r && bool_raw(val)) {
+    g_set_error(err, 1, 0, "This option can't be modified: %s.", "inotify not supported");
+    g_free(r);
+    r = NULL;
+  }
+#endif
+  return r;
+}
+
+static gboolean s_share_watch(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  fl_watch_reset(TRUE);
+  return TRUE;
+}
+
+
 // tls_policy
 
 #if INTERFACE
@@ -788,6 +852,144 @@ static gboolean s_tls_policy(guint64 hub, const char *key, const char *val, GErr
 }
 
 
+// db_synchronous
+
+#if INTERFACE
+#define VAR_DBSYNC_OFF    1
+#define VAR_DBSYNC_NORMAL 2
+#define VAR_DBSYNC_FULL   4
+#endif
+
+static flag_option_t var_db_synchronous_ops[] = {
+  { VAR_DBSYNC_OFF,    "off"    },
+  { VAR_DBSYNC_NORMAL, "normal" },
+  { VAR_DBSYNC_FULL,   "full"   },
+  { 0 }
+};
+
+static char *f_db_synchronous(const char *val) {
+  return flags_fmt(var_db_synchronous_ops, int_raw(val));
+}
+
+static char *p_db_synchronous(const char *val, GError **err) {
+  int n = flags_raw(var_db_synchronous_ops, FALSE, val, err);
+  return n ? g_strdup_printf("%d", n) : NULL;
+}
+
+static void su_db_synchronous(const char *old, const char *val, char **sug) {
+  flags_sug(var_db_synchronous_ops, val, sug);
+}
+
+static char *g_db_synchronous(guint64 hub, const char *key) {
+  static char num[2] = {};
+  char *r = db_vars_get(hub, key);
+  if(!r)
+    return NULL;
+  num[0] = '0' + flags_raw(var_db_synchronous_ops, FALSE, r, NULL);
+  return num;
+}
+
+static gboolean s_db_synchronous(guint64 hub, const char *key, const char *val, GError **err) {
+  char *r = flags_fmt(var_db_synchronous_ops, int_raw(val));
+  db_vars_set(hub, key, r[0] ? r : NULL);
+  g_free(r);
+  db_tune();
+  return TRUE;
+}
+
+
+// db_journal_mode
+
+#if INTERFACE
+#define VAR_DBJOURNAL_DELETE   1
+#define VAR_DBJOURNAL_TRUNCATE 2
+#define VAR_DBJOURNAL_WAL      4
+#endif
+
+static flag_option_t var_db_journal_mode_ops[] = {
+  { VAR_DBJOURNAL_DELETE,   "delete"   },
+  { VAR_DBJOURNAL_TRUNCATE, "truncate" },
+  { VAR_DBJOURNAL_WAL,      "wal"      },
+  { 0 }
+};
+
+static char *f_db_journal_mode(const char *val) {
+  return flags_fmt(var_db_journal_mode_ops, int_raw(val));
+}
+
+static char *p_db_journal_mode(const char *val, GError **err) {
+  int n = flags_raw(var_db_journal_mode_ops, FALSE, val, err);
+  return n ? g_strdup_printf("%d", n) : NULL;
+}
+
+static void su_db_journal_mode(const char *old, const char *val, char **sug) {
+  flags_sug(var_db_journal_mode_ops, val, sug);
+}
+
+static char *g_db_journal_mode(guint64 hub, const char *key) {
+  static char num[2] = {};
+  char *r = db_vars_get(hub, key);
+  if(!r)
+    return NULL;
+  num[0] = '0' + flags_raw(var_db_journal_mode_ops, FALSE, r, NULL);
+  return num;
+}
+
+static gboolean s_db_journal_mode(guint64 hub, const char *key, const char *val, GError **err) {
+  char *r = flags_fmt(var_db_journal_mode_ops, int_raw(val));
+  db_vars_set(hub, key, r[0] ? r : NULL);
+  g_free(r);
+  db_tune();
+  return TRUE;
+}
+
+
+// download_prealloc
+
+static char *f_download_prealloc(const char *val) {
+#ifdef HAVE_FALLOCATE
+  return f_bool(val);
+#else
+  return g_strdup("false (not supported)");
+#endif
+}
+
+static char *p_download_prealloc(const char *val, GError **err) {
+  char *r = p_bool(val, err);
+#ifndef HAVE_FALLOCATE
+  if(r && bool_raw(val)) {
+    g_set_error(err, 1, 0, "This option can't be modified: %s.", "fallocate() not supported");
+    g_free(r);
+    r = NULL;
+  }
+#endif
+  return r;
+}
+
+
+// tls_ktls
+
+static char *f_tls_ktls(const char *val) {
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+  return f_bool(val);
+#else
+  return g_strdup("false (not supported)");
+#endif
+}
+
+static char *p_tls_ktls(const char *val, GError **err) {
+  char *r = p_bool(val, err);
+#ifndef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+  if(r && bool_raw(val)) {
+    g_set_error(err, 1, 0, "This option can't be modified: %s.", "GnuTLS has no kTLS support");
+    g_free(r);
+    r = NULL;
+  }
+#endif
+  return r;
+}
+
+
 // tls_priority
 
 static char *p_tls_priority(const char *val, GError **err) {
@@ -952,14 +1154,17 @@ struct var_t {
   V(autorefresh,      1,0, f_autorefresh,  p_autorefresh,   NULL,          NULL,         NULL,            "3600")\
   V(backlog,          1,1, f_backlog,      p_backlog,       NULL,          NULL,         NULL,            "0")\
   V(chat_only,        1,1, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
-  V(cid,              0,0, NULL,           NULL,            NULL,          NULL,         NULL,            i_cid_pid())\
+  V(cid,              0,0, NULL,           NULL,            NULL,          NULL,         s_cid,           i_cid_pid())\
   UI_COLORS \
   V(connection,       1,1, f_id,           p_connection,    su_old,        NULL,         s_hubinfo,       NULL)\
+  V(db_journal_mode,  1,0, f_db_journal_mode,p_db_journal_mode,su_db_journal_mode,g_db_journal_mode,s_db_journal_mode,G_STRINGIFY(VAR_DBJOURNAL_DELETE))\
+  V(db_synchronous,   1,0, f_db_synchronous,p_db_synchronous,su_db_synchronous,g_db_synchronous,s_db_synchronous,G_STRINGIFY(VAR_DBSYNC_FULL))\
   V(description,      1,1, f_id,           p_id,            su_old,        NULL,         s_hubinfo,       NULL)\
   V(disconnect_offline,1,1,f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(download_dir,     1,0, f_id,           p_id,            su_path,       NULL,         s_dl_inc_dir,    i_dl_inc_dir(TRUE))\
   V(download_exclude, 1,0, f_id,           p_regex,         su_old,        NULL,         NULL,            NULL)\
-  V(download_rate,    1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)\
+  V(download_prealloc,1,0, f_download_prealloc,p_download_prealloc,su_bool,NULL,         NULL,            "false")\
+  V(download_rate,    1,1, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)\
   V(download_segment, 1,0, f_download_segment,p_download_segment,NULL,     NULL,         NULL,            g_strdup_printf("%"G_GUINT64_FORMAT, (guint64)DLFILE_CHUNKSIZE))\
   V(download_shared,  1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "true")\
   V(download_slots,   1,0, f_int,          p_int,           NULL,          NULL,         s_download_slots,"3")\
@@ -967,9 +1172,12 @@ struct var_t {
   V(encoding,         1,1, f_id,           p_encoding,      su_encoding,   NULL,         NULL,            "UTF-8")\
   V(filelist_maxage,  1,0, f_interval,     p_interval,      su_old,        NULL,         NULL,            "604800")\
   V(fl_done,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            "false")\
+  V(fl_gc,            0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
+  V(fl_size,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
   V(flush_file_cache, 1,0, f_ffc,          p_ffc,           su_ffc,        g_ffc,        s_ffc,           i_ffc())\
   V(geoip_cc,         1,0, f_id,           p_id,            su_path,       NULL,         s_geoip_cc,      NULL)\
   V(hash_rate,        1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)\
+  V(hash_threads,     1,0, f_int,          p_hash_threads,  NULL,          NULL,         s_hash_threads,  "1")\
   V(hubaddr,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
   V(hubkp,            0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
   V(hubname,          0,1, f_id,           p_hubname,       su_old,        NULL,         s_hubname,       NULL)\
@@ -978,6 +1186,7 @@ struct var_t {
   V(log_debug,        1,0, f_bool,         p_bool,          su_bool,       NULL,         s_log_debug,     i_log_debug())\
   V(log_downloads,    1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "true")\
   V(log_hubchat,      1,1, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "true")\
+  V(log_stats,        1,0, f_autorefresh,  p_interval,      su_old,        NULL,         NULL,            "0")\
   V(log_uploads,      1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "true")\
   V(max_ul_per_user,  1,1, f_int,          p_int_ge1,       NULL,          NULL,         NULL,            "1")\
   V(minislots,        1,0, f_int,          p_int_ge1,       NULL,          NULL,         NULL,            "3")\
@@ -987,19 +1196,24 @@ struct var_t {
   V(password,         0,1, f_password,     p_id,            NULL,          NULL,         s_password,      NULL)\
   V(pid,              0,0, NULL,           NULL,            NULL,          NULL,         NULL,            i_cid_pid())\
   V(reconnect_timeout,1,1, f_interval,     p_interval,      su_old,        NULL,         NULL,            "30")\
+  V(search_memory,    1,0, f_search_memory,p_search_memory, NULL,          NULL,         NULL,            "67108864")\
   V(sendfile,         1,0, f_sendfile,     p_sendfile,      su_bool,       NULL,         NULL,            "true")\
   V(share_emptydirs,  1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(share_exclude,    1,0, f_id,           p_regex,         su_old,        NULL,         NULL,            NULL)\
   V(share_hidden,     1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
+  V(share_scan_threads,1,0,f_int,          p_share_scan_threads,NULL,      NULL,         NULL,            "4")\
   V(share_symlinks,   1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
+  V(share_watch,      1,0, f_bool,         p_share_watch,   su_bool,       NULL,         s_share_watch,   "false")\
   V(show_free_slots,  1,1, f_bool,         p_bool,          su_bool,       NULL,         s_hubinfo,       "false")\
   V(show_joinquit,    1,1, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(slots,            1,0, f_int,          p_int_ge1,       NULL,          NULL,         s_hubinfo,       "10")\
   V(sudp_policy,      1,0, f_sudp_policy,  p_sudp_policy,   su_sudp_policy,g_sudp_policy,s_sudp_policy,   G_STRINGIFY(VAR_SUDPP_PREFER))\
+  V(tls_ktls,         1,0, f_tls_ktls,     p_tls_ktls,      su_bool,       NULL,         NULL,            "false")\
   V(tls_policy,       1,1, f_tls_policy,   p_tls_policy,    su_tls_policy, g_tls_policy, s_tls_policy,    G_STRINGIFY(VAR_TLSP_PREFER))\
   V(tls_priority,     1,0, f_id,           p_tls_priority,  su_old,        NULL,         NULL,            "NORMAL:-ARCFOUR-128")\
+  V(transfer_zlib,    1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "true")\
   V(ui_time_format,   1,0, f_id,           p_id,            su_old,        NULL,         NULL,            "[%H:%M:%S]")\
-  V(upload_rate,      1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)
+  V(upload_rate,      1,1, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)
 
 enum var_type {
 #define V(n, gl, h, f, p, su, g, s, d) VAR_##n,